@@ -9,6 +9,45 @@
  *  - Comprehensive user management with permissions
  *  - Advanced reporting
  *  - Secure authentication
+ *
+ * Compile: gcc -O2 -pthread -o SHOP-MGT SHOP-MGT.c
+ *
+ * Usage:
+ *  SHOP-MGT                    interactive till
+ *  SHOP-MGT --daemon [ADDR]    serve sales, lookups and reports over RPC
+ *  SHOP-MGT --client [ADDR]    thin till talking to a running daemon
+ *  SHOP-MGT --metrics [ADDR]   print a running daemon's metrics in
+ *                              Prometheus text format
+ *  SHOP-MGT --import KIND [FILE]
+ *                              bulk-load products, customers or sales from a
+ *                              CSV or JSONL file (stdin if FILE is - or absent)
+ *  SHOP-MGT --archive DATE     move sales dated before DATE (YYYY-MM-DD) out
+ *                              of sales.csv into the compressed sales archive
+ *  SHOP-MGT --branch N         make this shop branch N (1-20) of a company
+ *  SHOP-MGT --ship ADDR        send this branch's new sales, stock changes
+ *                              and records to the central node's daemon
+ *  SHOP-MGT --bench [SALES [PRODUCTS [CUSTOMERS]]]
+ *                              generate a synthetic shop in bench_data/ and
+ *                              print timings as JSON lines
+ *  SHOP-MGT --selftest         check import rejection, RPC limits and log
+ *                              replay against a scratch shop in selftest_data/
+ *
+ * ADDR is unix:PATH, HOST:PORT or PORT (default unix:shop.sock).
+ *
+ * Environment:
+ *  - SHOP_REPORT_THREADS  worker threads used by parallel reports (default 4)
+ *  - SHOP_WAL_COMMIT_MS   group-commit window for the write-ahead log in
+ *                         milliseconds (default 2, 0 syncs every commit)
+ *  - SHOP_WRITE_BEHIND    sync the log from a background thread in the
+ *                         interactive till (default 1; 0 makes each commit
+ *                         wait for the disk)
+ *  - SHOP_METRICS         record operation counters and latencies when set
+ *                         to anything but 0 (default off)
+ *  - SHOP_PAGE_SIZE       rows per page in the product, customer and sales
+ *                         lists (default 25)
+ *  - SHOP_PASSWORD_ITERATIONS
+ *                         PBKDF2 rounds for new password hashes (default
+ *                         100000); older hashes are upgraded at login
  */
 
 #include <stdio.h>
@@ -16,26 +55,181 @@
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #define MAX_LINE 1024
-#define MAX_FIELD 256
 #define MAX_PASSWORD_LEN 64
+#define PASSWORD_HASH_LEN 128
+#define PASSWORD_SALT_BYTES 16
+#define PASSWORD_ITERATIONS 100000
+#define PASSWORD_MIN_ITERATIONS 1000
+#define PASSWORD_MAX_ITERATIONS 10000000
+#define MAX_BASKET_ITEMS 64
 #define PRODUCTS_FILE "products.csv"
 #define CUSTOMERS_FILE "customers.csv"
 #define SALES_FILE "sales.csv"
 #define USERS_FILE "users.csv"
 #define BACKUP_DIR "backups"
+#define BACKUP_CHUNK_DIR BACKUP_DIR "/chunks"
+#define BACKUP_SNAPSHOT_DIR BACKUP_DIR "/snapshots"
+#define BACKUP_MANIFEST_MAGIC "shop-backup"
+#define BACKUP_MANIFEST_VERSION 1
+#define BACKUP_CHUNK_MAGIC 0x4B484342u   /* "BCHK" */
+#define BACKUP_MIN_CHUNK 2048
+#define BACKUP_MAX_CHUNK 65536
+#define BACKUP_CHUNK_BITS 13             /* ~8 KB average chunk */
+#define BACKUP_MAX_FILES 16
+#define BACKUP_NAME_LEN 32
+#define SHA256_HEX 65
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define STOCK_JOURNAL_FILE "stock.journal"
+#define STOCK_JOURNAL_FOLDED ".stock_journal_folded"
+#define WAL_FILE "shop.wal"
+#define WAL_FOLDED ".wal_folded"
+#define SNAPSHOT_FILE "shop.snap"
+#define SNAPSHOT_TMP_FILE ".shop_snap_tmp"
+#define WAL_MAGIC 0x4C415753u          /* "SWAL" */
+#define WAL_GROUP_MAGIC 0x50524757u    /* "WGRP" */
+#define WAL_VERSION 1
+#define WAL_CHECKPOINT_BYTES (1 << 20)
+#define DEFAULT_WAL_COMMIT_MS 2
+#define WAL_WRITER_SLOTS 256
+#define SHOP_LOCK_FILE "shop.lock"
+#define USERS_TMP_FILE ".users_tmp"
+#define PRODUCTS_TMP_FILE ".products_tmp"
+#define CUSTOMERS_TMP_FILE ".customers_tmp"
+#define SALES_STORE_DIR "sales_store"
+#define SALES_STORE_FORMAT SALES_STORE_DIR "/FORMAT"
+#define SALES_STORE_VERSION 2
+#define SALES_AGG_FILE "sales_aggregates.dat"
+#define SALES_AGG_TMP_FILE ".sales_aggregates_tmp"
+#define SALES_DAY_INDEX_FILE "sales_day.idx"
+#define SALES_PRODUCT_INDEX_FILE "sales_product.idx"
+#define SALES_TMP_FILE ".sales_tmp"
+#define SALES_ARCHIVE_FILE "sales_archive.dat"
+#define SALES_ARCHIVE_INDEX_FILE "sales_archive.idx"
+#define SALES_ARCHIVE_TMP_FILE ".sales_archive_tmp"
+#define ID_SEQUENCE_FILE "id_sequences.csv"
+#define ID_SEQUENCE_TMP_FILE ".id_sequences_tmp"
+#define ID_BLOCK_SIZE 64
+#define MAX_RECORD_ID INT_MAX
+#define BRANCH_FILE "branch.csv"
+#define BRANCH_TMP_FILE ".branch_tmp"
+#define BRANCH_ID_SPAN 100000000       /* ids per branch; branch b numbers from b * span */
+#define MAX_BRANCH 20
+#define SHIP_DIR "ship"
+#define SHIP_SEGMENT_FILE SHIP_DIR "/segment"
+#define SHIP_SEGMENT_TMP_FILE SHIP_DIR "/.segment_tmp"
+#define SHIP_FRAME_BYTES (RPC_MAX_FRAME - 4096)
+#define REPLICATION_FILE "replication.csv"
+#define REPLICATION_TMP_FILE ".replication_tmp"
+#define DEFAULT_REPORT_THREADS 4
+#define MAX_REPORT_THREADS 64
+#define REPORT_CHUNK_BYTES (4u << 20)
+#define REPORT_ARENA_BYTES ((size_t)64 << 20)
+#define ARENA_KEEP_BYTES ((size_t)1 << 20)
+#define TOP_SCAN_ARENA_BYTES ((size_t)1 << 30)
+#define SLAB_RECORDS 256
+#define STRING_POOL_BYTES ((size_t)256 << 20)
+#define STRING_POOL_MIN_SLOTS 256
+#define DEFAULT_SHOP_ADDRESS "unix:shop.sock"
+#define RPC_HEADER_SIZE 8
+#define RPC_MAX_FRAME (1u << 20)
+#define RPC_MAX_EVENTS 64
+#define RPC_MAX_READS 16               /* socket reads per connection per wakeup */
+#define RPC_MAX_REQUESTS 64            /* frames handled per connection per wakeup */
+#define RPC_MAX_BACKLOG (4u << 20)     /* unsent response bytes before a connection stops being read */
+#define RPC_LOGIN_DELAY_NS 1000000000LL
+#define MONEY_SCALE 100                /* minor units (cents) per shilling */
+#define MONEY_TEXT 32
+#define LIST_PAGE_SIZE 25
+#define LIST_MAX_PAGE_SIZE 10000
+#define OUTBUF_INITIAL_BYTES 16384
+#define METRIC_BUCKETS 25              /* 1us .. 2^23us (~8s), then overflow */
+#define METRICS_FILE "metrics.prom"
+#define METRICS_TMP_FILE ".metrics_tmp"
+#define IMPORT_MAX_COLUMNS 9
+#define IMPORT_MAX_LINE 4096
+#define IMPORT_BATCH_ROWS 10000
+#define IMPORT_MAX_CASHIERS 64
+#define BENCH_DIR "bench_data"
+#define SELFTEST_DIR "selftest_data"
+#define BENCH_SEED 0x9E3779B97F4A7C15ull
+#define BENCH_DEFAULT_SALES 100000
+#define BENCH_SALE_OPS 2000
+#define BENCH_QUERY_OPS 2000
+#define BENCH_REPORT_OPS 1000
+#define BENCH_SCAN_OPS 20
 
 /* -------------------- Data Structures -------------------- */
+/*
+ * Prices and totals are fixed-point minor units, so sums are exact and do
+ * not depend on the order partitions are added in.
+ */
+typedef int64_t Money;
+
+/*
+ * Products and customers have two forms. The *Record structs carry their
+ * text inline; they are what the CSV files, the write-ahead log and the
+ * RPC protocol exchange, so their layout is part of the log format. The
+ * resident tables hold compact records instead, with every string interned
+ * once in the string pool. A product's id, prices and stock sit in a dense
+ * record and its text in a separate one, so stock and price scans never
+ * pull names into the cache.
+ */
 typedef struct {
     int id;
     char name[100];
     char category[50];
     char brand[50];
-    float cost_price;
-    float sell_price;
+    char sku[32];              /* barcode or stock-keeping unit, "" if the product has none */
+    Money cost_price;
+    Money sell_price;
+    int stock;
+    int min_stock_level;
+} ProductRecord;
+
+typedef struct {
+    const char *name;
+    const char *category;
+    const char *brand;
+    const char *sku;
+} ProductText;
+
+typedef struct {
+    int id;
     int stock;
     int min_stock_level;
+    Money cost_price;
+    Money sell_price;
+    const ProductText *text;
 } Product;
 
 typedef struct {
@@ -44,28 +238,42 @@ typedef struct {
     char phone[30];
     char email[100];
     char address[200];
+} CustomerRecord;
+
+typedef struct {
+    int id;
+    const char *name;
+    const char *phone;
+    const char *email;
+    const char *address;
 } Customer;
 
+/* A sale as committed; sales.csv spells out the date and the cashier's username. */
 typedef struct {
     int id;
     int product_id;
     int customer_id;
     int quantity;
-    float total_price;
-    char date[64];
-    char cashier[50];
+    int cashier_id;            /* user id */
+    Money total_price;
+    int64_t date;              /* epoch seconds */
 } Sale;
 
+/* Bits of User.permissions; users.csv keeps one 0/1 column for each. */
+enum {
+    USER_PERM_PRODUCTS = 1,
+    USER_PERM_CUSTOMERS = 2,
+    USER_PERM_SALES = 4,
+    USER_PERM_REPORTS = 8,
+    USER_PERM_USERS = 16,
+    USER_ACTIVE = 32
+};
+
 typedef struct {
     int id;
     char username[50];
-    char password_hash[65];
-    int can_manage_products;
-    int can_manage_customers;
-    int can_manage_sales;
-    int can_view_reports;
-    int can_manage_users;
-    int is_active;
+    char password_hash[PASSWORD_HASH_LEN];
+    uint32_t permissions;      /* USER_PERM_* and USER_ACTIVE */
 } User;
 
 /* -------------------- Utility Helpers -------------------- */
@@ -83,6 +291,63 @@ void trim_newline(char *str) {
     str[strcspn(str, "\n")] = 0;
 }
 
+/*
+ * Parses "[-]123[.45]" into minor units; further decimals are rounded half
+ * away from zero. Surrounding blanks are allowed. Returns 0 if malformed.
+ */
+int parse_money(const char *str, size_t len, Money *out) {
+    size_t i = 0;
+    int negative = 0;
+    int digits = 0;
+    Money whole = 0;
+    Money frac = 0;
+    int frac_digits = 0;
+    int round_up = 0;
+    
+    while (i < len && isspace((unsigned char)str[i])) i++;
+    if (i < len && (str[i] == '-' || str[i] == '+')) {
+        negative = str[i] == '-';
+        i++;
+    }
+    for (; i < len && isdigit((unsigned char)str[i]); i++, digits++) {
+        if (whole > INT64_MAX / MONEY_SCALE / 10) return 0;
+        whole = whole * 10 + (str[i] - '0');
+    }
+    if (i < len && str[i] == '.') {
+        for (i++; i < len && isdigit((unsigned char)str[i]); i++, digits++) {
+            if (frac_digits < 2) {
+                frac = frac * 10 + (str[i] - '0');
+                frac_digits++;
+            } else if (frac_digits == 2) {
+                round_up = str[i] >= '5';
+                frac_digits++;
+            }
+        }
+    }
+    while (i < len && isspace((unsigned char)str[i])) i++;
+    if (i != len || digits == 0) return 0;
+    
+    for (; frac_digits < 2; frac_digits++) frac *= 10;
+    Money value = whole * MONEY_SCALE + frac + round_up;
+    *out = negative ? -value : value;
+    return 1;
+}
+
+/* Formats minor units as "-123.45" into buf and returns it. */
+const char *format_money(Money value, char *buf, size_t size) {
+    uint64_t units = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    snprintf(buf, size, "%s%" PRIu64 ".%02u", value < 0 ? "-" : "",
+             units / MONEY_SCALE, (unsigned)(units % MONEY_SCALE));
+    return buf;
+}
+
+/* Rounded mean of a total over count items, or 0 when there are none. */
+Money money_average(Money total, long count) {
+    if (count <= 0) return 0;
+    Money half = total < 0 ? -count / 2 : count / 2;
+    return (total + half) / count;
+}
+
 int get_validated_int(const char *prompt, int min, int max) {
     int value;
     char input[50];
@@ -101,8 +366,8 @@ int get_validated_int(const char *prompt, int min, int max) {
     }
 }
 
-float get_validated_float(const char *prompt, float min) {
-    float value;
+Money get_validated_money(const char *prompt, Money min) {
+    Money value;
     char input[50];
     
     while (1) {
@@ -112,10 +377,13 @@ float get_validated_float(const char *prompt, float min) {
             continue;
         }
         
-        if (sscanf(input, "%f", &value) == 1 && value >= min) {
+        trim_newline(input);
+        if (parse_money(input, strlen(input), &value) && value >= min) {
             return value;
         }
-        printf("Invalid input. Please enter a number greater than or equal to %.2f.\n", min);
+        char text[MONEY_TEXT];
+        printf("Invalid input. Please enter an amount greater than or equal to %s.\n",
+               format_money(min, text, sizeof(text)));
     }
 }
 
@@ -137,1161 +405,13060 @@ void get_validated_string(const char *prompt, char *buffer, size_t size) {
 
 void now_str(char *buffer, size_t size) {
     time_t t = time(NULL);
-    struct tm tm = *localtime(&t);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(buffer, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+/* Parses "YYYY-MM-DD[ HH:MM:SS]" local time into epoch seconds; returns -1 if malformed. */
+int64_t parse_datetime(const char *str) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    int n = sscanf(str, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                   &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+    if (n != 3 && n != 6) return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    return (int64_t)mktime(&tm);
+}
+
+void format_datetime(int64_t epoch, char *buffer, size_t size) {
+    time_t t = (time_t)epoch;
+    struct tm tm;
+    localtime_r(&t, &tm);
     strftime(buffer, size, "%Y-%m-%d %H:%M:%S", &tm);
 }
 
+/* Calendar month of an epoch timestamp as yyyymm. */
+int epoch_month(int64_t epoch) {
+    time_t t = (time_t)epoch;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return (tm.tm_year + 1900) * 100 + tm.tm_mon + 1;
+}
+
+/* Calendar day of an epoch timestamp as yyyymmdd. */
+int epoch_day_key(int64_t epoch) {
+    time_t t = (time_t)epoch;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return ((tm.tm_year + 1900) * 100 + tm.tm_mon + 1) * 100 + tm.tm_mday;
+}
+
+/* Like get_validated_string, but an empty answer is allowed. */
+void get_optional_string(const char *prompt, char *buffer, size_t size) {
+    printf("%s", prompt);
+    if (fgets(buffer, size, stdin) == NULL) {
+        buffer[0] = '\0';
+        return;
+    }
+    trim_newline(buffer);
+}
+
+/* Prompts for YYYY-MM-DD; returns yyyymmdd, or 0 when left blank. */
+int get_optional_date(const char *prompt) {
+    char input[50];
+    while (1) {
+        get_optional_string(prompt, input, sizeof(input));
+        if (input[0] == '\0') return 0;
+        
+        int y, m, d;
+        char tail;
+        if (sscanf(input, "%4d-%2d-%2d%c", &y, &m, &d, &tail) == 3 &&
+            m >= 1 && m <= 12 && d >= 1 && d <= 31) {
+            return (y * 100 + m) * 100 + d;
+        }
+        printf("Invalid date. Please use YYYY-MM-DD or leave blank.\n");
+    }
+}
+
 int file_exists(const char *path) {
-    FILE *f = fopen(path, "r");
-    if (!f) return 0;
-    fclose(f);
+    return access(path, R_OK) == 0;
+}
+
+static int make_dir(const char *path) {
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+static int full_pwrite(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
     return 1;
 }
 
-int create_directory(const char *path) {
-    char command[256];
-    snprintf(command, sizeof(command), "mkdir -p %s", path);
-    return system(command);
+static int full_pread(int fd, void *buf, size_t len, off_t offset) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 1;
 }
 
-/* -------------------- CSV Parsing Helpers -------------------- */
-char* parse_csv_field(char *line, int field_num) {
-    static char field[MAX_FIELD];
-    char *start = line;
-    int current_field = 0;
-    int in_quotes = 0;
-    int field_index = 0;
-    
-    while (*start && current_field <= field_num) {
-        if (*start == '"') {
-            in_quotes = !in_quotes;
-            start++;
-            continue;
+/*
+ * List views render one page at a time into an OutBuf and hand it to the
+ * terminal in a single write, so a slow link sees one burst per page
+ * instead of a write per row. A list that fits on one page prints as it
+ * always has; longer lists stop after each page for a navigation command.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} OutBuf;
+
+__attribute__((format(printf, 2, 3)))
+void outbuf_printf(OutBuf *b, const char *fmt, ...) {
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        size_t room = b->capacity - b->len;
+        int n = vsnprintf(b->data ? b->data + b->len : NULL, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < room) {
+            b->len += (size_t)n;
+            return;
         }
         
-        if (current_field == field_num) {
-            if (field_index < MAX_FIELD - 1) {
-                if (!in_quotes && *start == ',') {
+        size_t capacity = b->capacity ? b->capacity * 2 : OUTBUF_INITIAL_BYTES;
+        while (capacity - b->len <= (size_t)n) capacity *= 2;
+        char *grown = realloc(b->data, capacity);
+        if (!grown) return;
+        b->data = grown;
+        b->capacity = capacity;
+    }
+}
+
+/* Writes the buffered page to stdout after anything stdio still holds. */
+void outbuf_flush(OutBuf *b) {
+    fflush(stdout);
+    size_t off = 0;
+    while (off < b->len) {
+        ssize_t n = write(STDOUT_FILENO, b->data + off, b->len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += (size_t)n;
+    }
+    b->len = 0;
+}
+
+void outbuf_free(OutBuf *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->capacity = 0;
+}
+
+typedef struct {
+    long rows;
+    int page_size;
+    long page;                 /* 0-based */
+    int sort_column;           /* -1 = stored order */
+    int descending;
+    int resorted;              /* sort changed since the rows were ordered */
+} ListView;
+
+void list_view_init(ListView *v, long rows) {
+    const char *env = getenv("SHOP_PAGE_SIZE");
+    int size = env ? atoi(env) : 0;
+    v->rows = rows;
+    v->page_size = size >= 1 && size <= LIST_MAX_PAGE_SIZE ? size : LIST_PAGE_SIZE;
+    v->page = 0;
+    v->sort_column = -1;
+    v->descending = 0;
+    v->resorted = 0;
+}
+
+long list_view_pages(const ListView *v) {
+    return v->rows <= 0 ? 1 : (v->rows + v->page_size - 1) / v->page_size;
+}
+
+/* Reads a navigation command after a page; returns 0 to leave the list. */
+int list_view_prompt(ListView *v, const char *const *columns, int column_count) {
+    long pages = list_view_pages(v);
+    for (;;) {
+        printf("\nPage %ld of %ld. [Enter] next, p previous, g N go to page, s COLUMN[-] sort, z N page size, q quit: ",
+               v->page + 1, pages);
+        char line[64];
+        if (fgets(line, sizeof(line), stdin) == NULL) return 0;
+        trim_newline(line);
+        const char *arg = line + (line[0] ? 1 : 0);
+        while (isspace((unsigned char)*arg)) arg++;
+        
+        switch (tolower((unsigned char)line[0])) {
+            case '\0':
+            case 'n':
+                if (v->page + 1 >= pages) return 0;
+                v->page++;
+                return 1;
+            case 'p':
+                if (v->page > 0) v->page--;
+                return 1;
+            case 'g': {
+                long page = atol(arg);
+                if (page >= 1 && page <= pages) {
+                    v->page = page - 1;
+                    return 1;
+                }
+                printf("Invalid page. Choose 1 to %ld.\n", pages);
+                break;
+            }
+            case 'z': {
+                int size = atoi(arg);
+                if (size >= 1 && size <= LIST_MAX_PAGE_SIZE) {
+                    // Keep the first row of the current page in view
+                    v->page = v->page * v->page_size / size;
+                    v->page_size = size;
+                    return 1;
+                }
+                printf("Invalid page size. Choose 1 to %d.\n", LIST_MAX_PAGE_SIZE);
+                break;
+            }
+            case 's': {
+                char name[32];
+                snprintf(name, sizeof(name), "%s", arg);
+                size_t len = strlen(name);
+                int descending = len > 0 && name[len - 1] == '-';
+                if (descending) name[--len] = '\0';
+                int column = -1;
+                for (int c = 0; len > 0 && c < column_count; c++) {
+                    if (strncasecmp(columns[c], name, len) == 0) {
+                        column = c;
+                        break;
+                    }
+                }
+                if (len > 0 && column < 0) {
+                    printf("Unknown column. Sort by:");
+                    for (int c = 0; c < column_count; c++) printf(" %s", columns[c]);
+                    printf(" (add - for descending, nothing for stored order)\n");
                     break;
                 }
-                field[field_index++] = *start;
+                v->sort_column = column;
+                v->descending = descending;
+                v->page = 0;
+                v->resorted = 1;
+                return 1;
             }
+            case 'q':
+                return 0;
+            default:
+                printf("Unknown command.\n");
+                break;
         }
-        
-        if (!in_quotes && *start == ',') {
-            current_field++;
+    }
+}
+
+/* Orders a comparison result by the view's direction, falling back to the ids. */
+static int list_order(int cmp, int id_a, int id_b, int descending) {
+    if (cmp == 0) cmp = (id_a > id_b) - (id_a < id_b);
+    return descending ? -cmp : cmp;
+}
+
+/* -------------------- Metrics -------------------- */
+/*
+ * Counters and latency histograms for the paths where a till spends its
+ * time: mapping and rewriting files, parsing CSV, waiting for the shop
+ * lock, logging sales and running reports. They are off unless
+ * SHOP_METRICS is set (or switched on from System Maintenance); when off,
+ * each probe is a single branch on metrics_enabled and no clock is read.
+ *
+ * Bucket i of a histogram counts operations that took at most 2^i
+ * microseconds; the last bucket catches everything slower. Updates are
+ * relaxed atomics so parallel report workers may record too.
+ */
+enum {
+    METRIC_FILE_MAP,
+    METRIC_LOAD_PRODUCTS,
+    METRIC_LOAD_CUSTOMERS,
+    METRIC_SAVE_PRODUCTS,
+    METRIC_SAVE_CUSTOMERS,
+    METRIC_LOAD_SNAPSHOT,
+    METRIC_SAVE_SNAPSHOT,
+    METRIC_LOCK_WAIT,
+    METRIC_WAL_COMMIT,
+    METRIC_WAL_SYNC,
+    METRIC_WAL_LAG,
+    METRIC_STOCK_UPDATE,
+    METRIC_SALE,
+    METRIC_SEARCH,
+    METRIC_REPORT_LOW_STOCK,
+    METRIC_REPORT_SUMMARY,
+    METRIC_REPORT_PROFIT,
+    METRIC_REPORT_TOP,
+    METRIC_SALES_QUERY,
+    METRIC_RPC_REQUEST,
+    METRIC_COUNT
+};
+
+static const char *metric_names[METRIC_COUNT] = {
+    "file_map", "load_products", "load_customers", "save_products", "save_customers", "load_snapshot",
+    "save_snapshot", "lock_wait", "wal_commit", "wal_sync", "wal_lag", "stock_update", "sale", "search",
+    "report_low_stock", "report_sales_summary", "report_profit", "report_top", "sales_query", "rpc_request"
+};
+
+enum {
+    COUNTER_MAPPED_BYTES,
+    COUNTER_CSV_RECORDS,
+    COUNTER_WAL_BYTES,
+    COUNTER_SALE_LINES,
+    COUNTER_ARCHIVE_BLOCKS,
+    COUNTER_COUNT
+};
+
+static const char *counter_names[COUNTER_COUNT] = {
+    "file_mapped_bytes_total", "csv_records_total", "wal_written_bytes_total", "sale_lines_total",
+    "archive_blocks_read_total"
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[METRIC_BUCKETS];
+} MetricHistogram;
+
+static int metrics_enabled;
+static MetricHistogram metrics[METRIC_COUNT];
+static uint64_t metric_counters[COUNTER_COUNT];
+
+static int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_init() {
+    const char *env = getenv("SHOP_METRICS");
+    metrics_enabled = env && *env && strcmp(env, "0") != 0;
+}
+
+void metrics_reset() {
+    memset(metrics, 0, sizeof(metrics));
+    memset(metric_counters, 0, sizeof(metric_counters));
+}
+
+/* Returns a start time for metric_stop(), or 0 when metrics are off. */
+static inline int64_t metric_start() {
+    return metrics_enabled ? monotonic_ns() : 0;
+}
+
+static void metric_record(int metric, uint64_t ns) {
+    MetricHistogram *h = &metrics[metric];
+    uint64_t us = (ns + 999) / 1000;
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket >= METRIC_BUCKETS) bucket = METRIC_BUCKETS - 1;
+    
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static inline void metric_stop(int metric, int64_t start) {
+    if (start) metric_record(metric, (uint64_t)(monotonic_ns() - start));
+}
+
+static inline void metric_count(int counter, uint64_t n) {
+    if (metrics_enabled) __atomic_fetch_add(&metric_counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/* Upper bound in microseconds of the bucket holding the q-th fraction of samples, capped at the max. */
+static uint64_t metric_quantile_us(const MetricHistogram *h, double q) {
+    uint64_t rank = (uint64_t)(q * (double)h->count + 0.5), seen = 0;
+    uint64_t max_us = (h->max_ns + 999) / 1000;
+    if (rank == 0) rank = 1;
+    for (int i = 0; i < METRIC_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) return ((uint64_t)1 << i) < max_us ? (uint64_t)1 << i : max_us;
+    }
+    return max_us;
+}
+
+/* Writes every metric in the Prometheus text exposition format. */
+void metrics_write_prometheus(FILE *f) {
+    fprintf(f, "# HELP shop_metrics_enabled Whether the till is recording metrics.\n");
+    fprintf(f, "# TYPE shop_metrics_enabled gauge\n");
+    fprintf(f, "shop_metrics_enabled %d\n", metrics_enabled);
+    
+    fprintf(f, "# HELP shop_op_duration_seconds Time spent in instrumented shop operations.\n");
+    fprintf(f, "# TYPE shop_op_duration_seconds histogram\n");
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        const MetricHistogram *h = &metrics[m];
+        uint64_t cumulative = 0;
+        for (int i = 0; i < METRIC_BUCKETS - 1; i++) {
+            cumulative += h->buckets[i];
+            fprintf(f, "shop_op_duration_seconds_bucket{op=\"%s\",le=\"%.9g\"} %" PRIu64 "\n",
+                    metric_names[m], (double)((uint64_t)1 << i) / 1e6, cumulative);
         }
-        
-        start++;
+        fprintf(f, "shop_op_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", metric_names[m], h->count);
+        fprintf(f, "shop_op_duration_seconds_sum{op=\"%s\"} %.9f\n", metric_names[m], (double)h->sum_ns / 1e9);
+        fprintf(f, "shop_op_duration_seconds_count{op=\"%s\"} %" PRIu64 "\n", metric_names[m], h->count);
     }
     
-    field[field_index] = '\0';
-    
-    // Remove surrounding quotes if present
-    if (field_index > 1 && field[0] == '"' && field[field_index-1] == '"') {
-        memmove(field, field + 1, field_index - 2);
-        field[field_index - 2] = '\0';
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        fprintf(f, "# TYPE shop_%s counter\n", counter_names[c]);
+        fprintf(f, "shop_%s %" PRIu64 "\n", counter_names[c], metric_counters[c]);
     }
-    
-    return (field_index > 0) ? field : NULL;
 }
 
-/* -------------------- Backup System -------------------- */
-void create_backup() {
-    create_directory(BACKUP_DIR);
-    
-    time_t t = time(NULL);
-    struct tm tm = *localtime(&t);
-    char backup_name[100];
-    strftime(backup_name, sizeof(backup_name), "%Y%m%d_%H%M%S", &tm);
-    
-    char command[512];
-    snprintf(command, sizeof(command), "cp *.csv %s/backup_%s 2>/dev/null", BACKUP_DIR, backup_name);
+/* Prints a table of the operations seen so far; quantiles are bucket upper bounds. */
+void metrics_print() {
+    printf("\n%-22s %10s %12s %10s %10s %12s\n", "Operation", "Count", "Avg (us)", "p50 (us)", "p99 (us)", "Max (us)");
+    printf("------------------------------------------------------------------------------\n");
+    int shown = 0;
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        const MetricHistogram *h = &metrics[m];
+        if (h->count == 0) continue;
+        printf("%-22s %10" PRIu64 " %12.1f %10" PRIu64 " %10" PRIu64 " %12.1f\n",
+               metric_names[m], h->count, (double)h->sum_ns / (double)h->count / 1000.0,
+               metric_quantile_us(h, 0.5), metric_quantile_us(h, 0.99), (double)h->max_ns / 1000.0);
+        shown++;
+    }
+    if (!shown) printf("No operations recorded yet.\n");
     
-    if (system(command) == 0) {
-        printf("Backup created successfully: %s\n", backup_name);
-    } else {
-        printf("Backup creation failed.\n");
+    printf("\n");
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        printf("%-26s %" PRIu64 "\n", counter_names[c], metric_counters[c]);
     }
 }
 
-/* -------------------- Security Functions -------------------- */
-void simple_hash(const char *input, char *output) {
-    const unsigned char *str = (const unsigned char*)input;
-    unsigned long hash = 5381;
-    int c;
-    
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+/* -------------------- Memory Pools -------------------- */
+/*
+ * Working memory comes from three kinds of pool so that its size is known
+ * up front and the report paths never call malloc:
+ *
+ *  - Arena: a bump allocator over one fixed reservation. Scratch data for
+ *    a report or a daemon request is taken from report_arena and dropped
+ *    all at once by releasing back to a mark. Pages are only committed as
+ *    they are touched, so the reservation costs address space, not memory.
+ *  - SlabPool: fixed-size records in slabs of SLAB_RECORDS. Records never
+ *    move once allocated, so pointers into a table stay valid as it grows.
+ *  - StringPool: interned strings for values repeated across many records
+ *    (cashiers, categories, brands). Equal strings share one pointer, so
+ *    matching an interned value is a pointer comparison.
+ *
+ * None of these are thread-safe; a parallel scan worker only allocates
+ * from an arena of its own.
+ */
+typedef struct {
+    char *base;
+    size_t used;
+    size_t capacity;
+    size_t peak;
+} Arena;
+
+static Arena report_arena = { NULL, 0, REPORT_ARENA_BYTES, 0 };
+
+/* Returns size bytes aligned to 16, or NULL once the reservation is spent. */
+void *arena_alloc(Arena *a, size_t size) {
+    if (!a->base) {
+        void *base = mmap(NULL, a->capacity, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) return NULL;
+        a->base = base;
     }
+    size = (size + 15) & ~(size_t)15;
+    if (size > a->capacity - a->used) return NULL;
     
-    snprintf(output, 65, "%016lx", hash);
+    void *p = a->base + a->used;
+    a->used += size;
+    if (a->used > a->peak) a->peak = a->used;
+    return p;
 }
 
-int verify_password(const char *input_password, const char *stored_hash) {
-    char computed_hash[65];
-    simple_hash(input_password, computed_hash);
-    return strcmp(computed_hash, stored_hash) == 0;
+void *arena_calloc(Arena *a, size_t count, size_t size) {
+    if (size && count > (size_t)-1 / size) return NULL;
+    void *p = arena_alloc(a, count * size);
+    if (p) memset(p, 0, count * size);
+    return p;
 }
 
-/* -------------------- User Management -------------------- */
-int next_id_from_file(const char *file) {
-    if (!file_exists(file)) return 1;
-    
-    FILE *f = fopen(file, "r");
-    if (!f) return 1;
-    
-    char line[MAX_LINE];
-    int maxid = 0;
-    
-    while (fgets(line, sizeof(line), f)) {
-        char *id_str = parse_csv_field(line, 0);
-        if (id_str) {
-            int id = atoi(id_str);
-            if (id > maxid) maxid = id;
+size_t arena_mark(const Arena *a) {
+    return a->used;
+}
+
+/* Frees everything allocated since mark; a full release also returns the pages. */
+void arena_release(Arena *a, size_t mark) {
+    if (mark >= a->used) return;
+    a->used = mark;
+    if (mark == 0 && a->peak > ARENA_KEEP_BYTES) {
+        madvise(a->base + ARENA_KEEP_BYTES, a->peak - ARENA_KEEP_BYTES, MADV_DONTNEED);
+        a->peak = ARENA_KEEP_BYTES;
+    }
+}
+
+void arena_destroy(Arena *a) {
+    if (a->base) munmap(a->base, a->capacity);
+    a->base = NULL;
+    a->used = 0;
+    a->peak = 0;
+}
+
+typedef struct {
+    char **slabs;
+    int slab_count;
+    int slab_capacity;
+    size_t record_size;
+} SlabPool;
+
+/* Address of record row, which must already be backed by a slab. */
+static inline void *slab_at(const SlabPool *pool, int row) {
+    return pool->slabs[row / SLAB_RECORDS] + (size_t)(row % SLAB_RECORDS) * pool->record_size;
+}
+
+/* Backs record row with a slab if needed; returns its address or NULL. */
+void *slab_reserve(SlabPool *pool, int row) {
+    while (row >= pool->slab_count * SLAB_RECORDS) {
+        if (pool->slab_count == pool->slab_capacity) {
+            int capacity = pool->slab_capacity ? pool->slab_capacity * 2 : 16;
+            char **slabs = realloc(pool->slabs, (size_t)capacity * sizeof(char *));
+            if (!slabs) return NULL;
+            pool->slabs = slabs;
+            pool->slab_capacity = capacity;
         }
+        char *slab = malloc(SLAB_RECORDS * pool->record_size);
+        if (!slab) return NULL;
+        pool->slabs[pool->slab_count++] = slab;
     }
-    fclose(f);
-    return maxid + 1;
+    return slab_at(pool, row);
 }
 
-void add_user(User *current_user) {
-    if (!current_user->can_manage_users) {
-        printf("Permission denied: You don't have permission to manage users.\n");
-        return;
+void slab_pool_free(SlabPool *pool) {
+    for (int i = 0; i < pool->slab_count; i++) free(pool->slabs[i]);
+    free(pool->slabs);
+    size_t record_size = pool->record_size;
+    memset(pool, 0, sizeof(*pool));
+    pool->record_size = record_size;
+}
+
+static uint64_t hash_bytes(const char *s, size_t n) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
     }
-    
-    User new_user;
-    new_user.id = next_id_from_file(USERS_FILE);
-    
-    printf("\n=== Add New User (ID: %d) ===\n", new_user.id);
-    
-    get_validated_string("Username: ", new_user.username, sizeof(new_user.username));
-    
-    // Check if username already exists
-    FILE *check = fopen(USERS_FILE, "r");
-    if (check) {
-        char line[MAX_LINE];
-        while (fgets(line, sizeof(line), check)) {
-            char *existing_username = parse_csv_field(line, 1);
-            if (strcmp(existing_username, new_user.username) == 0) {
-                printf("Error: Username already exists.\n");
-                fclose(check);
-                return;
-            }
-        }
-        fclose(check);
+    return h;
+}
+
+/*
+ * Open-addressing set of strings. The characters and the slot array both
+ * live in the pool's own arena; a table that grows leaves its old slots
+ * behind, at most doubling the slot memory.
+ */
+typedef struct {
+    Arena arena;
+    const char **slots;
+    size_t capacity; /* always a power of two */
+    size_t used;
+} StringPool;
+
+static StringPool interned = { { NULL, 0, STRING_POOL_BYTES, 0 }, NULL, 0, 0 };
+
+static const char **string_pool_slot(const StringPool *sp, const char *s, size_t n) {
+    size_t mask = sp->capacity - 1;
+    size_t i = hash_bytes(s, n) & mask;
+    while (sp->slots[i] && (strncmp(sp->slots[i], s, n) != 0 || sp->slots[i][n] != '\0')) {
+        i = (i + 1) & mask;
     }
-    
-    char password[MAX_PASSWORD_LEN];
-    printf("Password: ");
-    if (fgets(password, sizeof(password), stdin) == NULL) return;
-    trim_newline(password);
-    
-    if (strlen(password) < 4) {
-        printf("Error: Password must be at least 4 characters long.\n");
-        return;
+    return &sp->slots[i];
+}
+
+/* The pooled copy of s, or NULL if s has never been interned. */
+const char *string_pool_find(const StringPool *sp, const char *s) {
+    return sp->capacity ? *string_pool_slot(sp, s, strlen(s)) : NULL;
+}
+
+/* The pooled copy of the n bytes at s, adding it if needed; NULL if the pool is full. */
+const char *string_pool_intern(StringPool *sp, const char *s, size_t n) {
+    if ((sp->used + 1) * 10 > sp->capacity * 7) {
+        size_t capacity = sp->capacity ? sp->capacity * 2 : STRING_POOL_MIN_SLOTS;
+        const char **slots = arena_calloc(&sp->arena, capacity, sizeof(char *));
+        if (!slots) return NULL;
+        StringPool grown = { sp->arena, slots, capacity, sp->used };
+        for (size_t i = 0; i < sp->capacity; i++) {
+            if (sp->slots[i]) *string_pool_slot(&grown, sp->slots[i], strlen(sp->slots[i])) = sp->slots[i];
+        }
+        sp->slots = slots;
+        sp->capacity = capacity;
     }
     
-    simple_hash(password, new_user.password_hash);
-    
-    printf("\nSet Permissions (1 for Yes, 0 for No):\n");
-    new_user.can_manage_products = get_validated_int("Can manage products? ", 0, 1);
-    new_user.can_manage_customers = get_validated_int("Can manage customers? ", 0, 1);
-    new_user.can_manage_sales = get_validated_int("Can manage sales? ", 0, 1);
-    new_user.can_view_reports = get_validated_int("Can view reports? ", 0, 1);
-    new_user.can_manage_users = get_validated_int("Can manage users? ", 0, 1);
-    new_user.is_active = 1;
-    
-    FILE *f = fopen(USERS_FILE, "a");
-    if (!f) {
-        printf("Error: Unable to open users file.\n");
-        return;
+    const char **slot = string_pool_slot(sp, s, n);
+    if (!*slot) {
+        char *copy = arena_alloc(&sp->arena, n + 1);
+        if (!copy) return NULL;
+        memcpy(copy, s, n);
+        copy[n] = '\0';
+        *slot = copy;
+        sp->used++;
     }
-    
-    fprintf(f, "%d,%s,%s,%d,%d,%d,%d,%d,%d\n",
-            new_user.id, new_user.username, new_user.password_hash,
-            new_user.can_manage_products, new_user.can_manage_customers,
-            new_user.can_manage_sales, new_user.can_view_reports,
-            new_user.can_manage_users, new_user.is_active);
-    fclose(f);
-    
-    printf("✓ User added successfully.\n");
+    return *slot;
 }
 
-void list_users(User *current_user) {
-    if (!current_user->can_manage_users) {
-        printf("Permission denied: You don't have permission to view users.\n");
-        return;
+void string_pool_destroy(StringPool *sp) {
+    arena_destroy(&sp->arena);
+    sp->slots = NULL;
+    sp->capacity = 0;
+    sp->used = 0;
+}
+
+/* Interns s, falling back to "" so callers always get a usable string. */
+const char *intern(const char *s) {
+    const char *p = string_pool_intern(&interned, s, strlen(s));
+    return p ? p : "";
+}
+
+/* -------------------- Digests & Compression -------------------- */
+/*
+ * SHA-256 names backup chunks by content, so equal blocks are stored once
+ * and a chunk can be verified when it is read back. lz_compress() is a
+ * small LZ77 codec in the spirit of LZ4: a stream of sequences, each a
+ * token byte (literal count in the high nibble, match length - 4 in the
+ * low one, 15 meaning more length bytes follow), the literals, then a
+ * 16-bit little-endian offset back into the output. The last sequence
+ * carries literals only.
+ */
+typedef struct {
+    uint32_t h[8];
+    uint64_t bytes;
+    unsigned char block[64];
+    size_t fill;
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(Sha256 *c, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
     }
-    
-    if (!file_exists(USERS_FILE)) {
-        printf("No users found.\n");
-        return;
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
     }
     
-    FILE *f = fopen(USERS_FILE, "r");
-    if (!f) {
-        printf("Error: Unable to read users file.\n");
-        return;
+    uint32_t a = c->h[0], b = c->h[1], cc = c->h[2], d = c->h[3];
+    uint32_t e = c->h[4], f = c->h[5], g = c->h[6], h = c->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = cc;
+        cc = b;
+        b = a;
+        a = t1 + t2;
     }
-    
-    char line[MAX_LINE];
-    printf("\n%-4s %-15s %-8s %-8s %-8s %-8s %-8s %-8s\n",
-           "ID", "Username", "Products", "Customers", "Sales", "Reports", "Users", "Active");
-    printf("----------------------------------------------------------------\n");
-    
-    while (fgets(line, sizeof(line), f)) {
-        User u;
-        u.id = atoi(parse_csv_field(line, 0));
-        strcpy(u.username, parse_csv_field(line, 1));
-        strcpy(u.password_hash, parse_csv_field(line, 2));
-        u.can_manage_products = atoi(parse_csv_field(line, 3));
-        u.can_manage_customers = atoi(parse_csv_field(line, 4));
-        u.can_manage_sales = atoi(parse_csv_field(line, 5));
-        u.can_view_reports = atoi(parse_csv_field(line, 6));
-        u.can_manage_users = atoi(parse_csv_field(line, 7));
-        u.is_active = atoi(parse_csv_field(line, 8));
-        
-        printf("%-4d %-15s %-8s %-8s %-8s %-8s %-8s %-8s\n",
-               u.id, u.username,
-               u.can_manage_products ? "Yes" : "No",
-               u.can_manage_customers ? "Yes" : "No",
-               u.can_manage_sales ? "Yes" : "No",
-               u.can_view_reports ? "Yes" : "No",
-               u.can_manage_users ? "Yes" : "No",
-               u.is_active ? "Yes" : "No");
+    c->h[0] += a;
+    c->h[1] += b;
+    c->h[2] += cc;
+    c->h[3] += d;
+    c->h[4] += e;
+    c->h[5] += f;
+    c->h[6] += g;
+    c->h[7] += h;
+}
+
+void sha256_init(Sha256 *c) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(c->h, iv, sizeof(iv));
+    c->bytes = 0;
+    c->fill = 0;
+}
+
+void sha256_update(Sha256 *c, const void *data, size_t len) {
+    const unsigned char *p = data;
+    c->bytes += len;
+    if (c->fill) {
+        size_t n = 64 - c->fill < len ? 64 - c->fill : len;
+        memcpy(c->block + c->fill, p, n);
+        c->fill += n;
+        p += n;
+        len -= n;
+        if (c->fill < 64) return;
+        sha256_block(c, c->block);
+        c->fill = 0;
     }
-    fclose(f);
+    for (; len >= 64; p += 64, len -= 64) sha256_block(c, p);
+    memcpy(c->block, p, len);
+    c->fill = len;
 }
 
-void delete_user(User *current_user) {
-    if (!current_user->can_manage_users) {
-        printf("Permission denied: You don't have permission to manage users.\n");
-        return;
+void sha256_final(Sha256 *c, unsigned char out[32]) {
+    uint64_t bits = c->bytes * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t n = (c->fill < 56 ? 56 : 120) - c->fill;
+    for (int i = 0; i < 8; i++) pad[n + i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256_update(c, pad, n + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (unsigned char)(c->h[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(c->h[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(c->h[i] >> 8);
+        out[4 * i + 3] = (unsigned char)c->h[i];
+    }
+}
+
+/* Hashes a buffer and writes the digest as 64 hex digits plus NUL. */
+void sha256_hex(const void *data, size_t len, char hex[SHA256_HEX]) {
+    Sha256 c;
+    unsigned char digest[32];
+    sha256_init(&c);
+    sha256_update(&c, data, len);
+    sha256_final(&c, digest);
+    for (int i = 0; i < 32; i++) snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+}
+
+/* Worst-case compressed size, for sizing the output buffer. */
+size_t lz_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+static inline uint32_t read_u32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned char *lz_put_length(unsigned char *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+static unsigned char *lz_sequence(unsigned char *op, const unsigned char *lit, size_t lit_len,
+                                  size_t offset, size_t match_len) {
+    unsigned char *token = op++;
+    *token = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) op = lz_put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    
+    if (match_len) {
+        *op++ = (unsigned char)offset;
+        *op++ = (unsigned char)(offset >> 8);
+        size_t code = match_len - LZ_MIN_MATCH;
+        *token |= (unsigned char)(code < 15 ? code : 15);
+        if (code >= 15) op = lz_put_length(op, code - 15);
+    }
+    return op;
+}
+
+/* Compresses n bytes into dst (at least lz_bound(n) bytes); returns the compressed size. */
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    unsigned char *op = dst;
+    size_t anchor = 0, i = 0;
+    
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t h = (read_u32(src + i) * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = (uint32_t)(i + 1);
+        
+        // Slots hold position + 1 so zero means empty
+        if (candidate-- == 0 || i - candidate > 0xFFFF || read_u32(src + candidate) != read_u32(src + i)) {
+            i++;
+            continue;
+        }
+        size_t len = LZ_MIN_MATCH;
+        while (i + len < n && src[candidate + len] == src[i + len]) len++;
+        op = lz_sequence(op, src + anchor, i - anchor, i - candidate, len);
+        i += len;
+        anchor = i;
+    }
+    op = lz_sequence(op, src + anchor, n - anchor, 0, 0);
+    return (size_t)(op - dst);
+}
+
+static int lz_get_length(const unsigned char **ip, const unsigned char *end, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= end) return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+/* Decompresses into dst of capacity cap; returns the output size or -1 if the stream is malformed. */
+long lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    const unsigned char *ip = src, *end = src + n;
+    size_t out = 0;
+    
+    while (ip < end) {
+        unsigned char token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !lz_get_length(&ip, end, &lit_len)) return -1;
+        if (lit_len > (size_t)(end - ip) || lit_len > cap - out) return -1;
+        memcpy(dst + out, ip, lit_len);
+        ip += lit_len;
+        out += lit_len;
+        if (ip == end) break;
+        
+        if (end - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !lz_get_length(&ip, end, &match_len)) return -1;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || match_len > cap - out) return -1;
+        // Byte by byte: a match may overlap the bytes it is producing
+        for (size_t k = 0; k < match_len; k++, out++) dst[out] = dst[out - offset];
+    }
+    return (long)out;
+}
+
+/* -------------------- Byte Scanning -------------------- */
+/*
+ * Finds CSV structural bytes (',', '"', '\n', '\r') 16 or 32 bytes at a
+ * time. On x86 the SSE2 path is always available and the AVX2 path is
+ * selected at runtime when the CPU supports it; other targets use the
+ * scalar loop.
+ */
+static inline int is_csv_delim(char c) {
+    return c == ',' || c == '"' || c == '\n' || c == '\r';
+}
+
+static const char *scan_delim_scalar(const char *p, const char *end) {
+    while (p < end && !is_csv_delim(*p)) p++;
+    return p;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static const char *scan_delim_sse2(const char *p, const char *end) {
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, quote)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) return p + __builtin_ctz((unsigned)mask);
+        p += 16;
+    }
+    return scan_delim_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_delim_avx2(const char *p, const char *end) {
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, comma), _mm256_cmpeq_epi8(v, quote)),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scan_delim_sse2(p, end);
+}
+#endif
+
+static const char *(*scan_delim_impl)(const char *, const char *);
+
+/* Returns the first structural byte in [p, end), or end if there is none. */
+const char *scan_delim(const char *p, const char *end) {
+    if (!scan_delim_impl) {
+#ifdef HAVE_X86_SIMD
+        __builtin_cpu_init();
+        scan_delim_impl = __builtin_cpu_supports("avx2") ? scan_delim_avx2 : scan_delim_sse2;
+#else
+        scan_delim_impl = scan_delim_scalar;
+#endif
+    }
+    return scan_delim_impl(p, end);
+}
+
+/* Returns the first '\n' in [p, end), or end; memchr is already vectorized by libc. */
+const char *scan_newline(const char *p, const char *end) {
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    return nl ? nl : end;
+}
+
+/* -------------------- CSV Parsing Helpers -------------------- */
+/*
+ * csv_split() walks a record once and records each field as a slice
+ * (pointer + length) into the caller's buffer. Quoted fields may contain
+ * commas, newlines and doubled quotes (""); the slice excludes the
+ * surrounding quotes and is flagged as escaped when it holds "" pairs,
+ * which csv_field_copy() collapses. Nothing is allocated and the input is
+ * never modified, so the same code serves line buffers and mapped files.
+ */
+#define CSV_MAX_FIELDS 16
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+    int escaped;
+} CsvField;
+
+typedef struct {
+    CsvField fields[CSV_MAX_FIELDS];
+    int count;
+} CsvRecord;
+
+/* Splits the record starting at p; returns the start of the next record. */
+const char *csv_split(const char *p, const char *end, CsvRecord *rec) {
+    CsvField overflow;
+    rec->count = 0;
+    
+    if (p < end && (*p == '\n' || *p == '\r')) {
+        // Blank line: no fields
+        if (*p == '\r') p++;
+        if (p < end && *p == '\n') p++;
+        return p;
+    }
+    
+    for (;;) {
+        CsvField *f = rec->count < CSV_MAX_FIELDS ? &rec->fields[rec->count] : &overflow;
+        f->escaped = 0;
+        
+        if (p < end && *p == '"') {
+            const char *start = ++p;
+            while (p < end) {
+                const char *q = memchr(p, '"', (size_t)(end - p));
+                p = q ? q : end;
+                if (p + 1 < end && p[1] == '"') {
+                    f->escaped = 1;
+                    p += 2;
+                    continue;
+                }
+                break;
+            }
+            f->ptr = start;
+            f->len = (size_t)(p - start);
+            if (p < end) p++;
+            // Tolerate stray bytes between the closing quote and the delimiter
+            while (p < end && *p != ',' && *p != '\n' && *p != '\r') p++;
+        } else {
+            const char *start = p;
+            // A stray quote inside an unquoted field is kept as data
+            do {
+                p = scan_delim(p, end);
+            } while (p < end && *p == '"' && ++p < end);
+            f->ptr = start;
+            f->len = (size_t)(p - start);
+        }
+        
+        if (f != &overflow) rec->count++;
+        if (p < end && *p == ',') {
+            p++;
+            continue;
+        }
+        break;
+    }
+    
+    if (p < end && *p == '\r') p++;
+    if (p < end && *p == '\n') p++;
+    return p;
+}
+
+/* Copies a field into dst as a C string, collapsing "" escapes; truncates to fit. */
+size_t csv_field_copy(const CsvField *f, char *dst, size_t size) {
+    size_t n = 0;
+    if (size == 0) return 0;
+    
+    for (size_t i = 0; i < f->len && n < size - 1; i++) {
+        dst[n++] = f->ptr[i];
+        if (f->escaped && f->ptr[i] == '"' && i + 1 < f->len && f->ptr[i + 1] == '"') i++;
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+long csv_field_long(const CsvField *f) {
+    size_t i = 0;
+    int negative = 0;
+    long value = 0;
+    
+    while (i < f->len && isspace((unsigned char)f->ptr[i])) i++;
+    if (i < f->len && (f->ptr[i] == '-' || f->ptr[i] == '+')) {
+        negative = f->ptr[i] == '-';
+        i++;
+    }
+    for (; i < f->len && isdigit((unsigned char)f->ptr[i]); i++) {
+        value = value * 10 + (f->ptr[i] - '0');
+    }
+    return negative ? -value : value;
+}
+
+/* Parses amounts exactly; anything parse_money rejects goes through atof. */
+Money csv_field_money(const CsvField *f) {
+    Money value;
+    if (!f->escaped && parse_money(f->ptr, f->len, &value)) return value;
+    
+    char buf[64];
+    csv_field_copy(f, buf, sizeof(buf));
+    double units = atof(buf) * MONEY_SCALE;
+    return (Money)(units < 0 ? units - 0.5 : units + 0.5);
+}
+
+int csv_field_equals(const CsvField *f, const char *s) {
+    size_t n = strlen(s);
+    return !f->escaped && f->len == n && memcmp(f->ptr, s, n) == 0;
+}
+
+/* Field accessors that treat missing columns as empty/zero. */
+static const CsvField empty_field = { "", 0, 0 };
+
+const CsvField *csv_get(const CsvRecord *rec, int i) {
+    return i < rec->count ? &rec->fields[i] : &empty_field;
+}
+
+int csv_int(const CsvRecord *rec, int i) {
+    return (int)csv_field_long(csv_get(rec, i));
+}
+
+Money csv_money(const CsvRecord *rec, int i) {
+    return csv_field_money(csv_get(rec, i));
+}
+
+void csv_string(const CsvRecord *rec, int i, char *dst, size_t size) {
+    csv_field_copy(csv_get(rec, i), dst, size);
+}
+
+/* Day key yyyymmdd from a "YYYY-MM-DD..." field; 0 if the field is not a date. */
+int field_day_key(const CsvField *f) {
+    if (f->len < 10 || f->ptr[4] != '-' || f->ptr[7] != '-') return 0;
+    int key = 0;
+    for (int i = 0; i < 10; i++) {
+        if (i == 4 || i == 7) continue;
+        if (!isdigit((unsigned char)f->ptr[i])) return 0;
+        key = key * 10 + (f->ptr[i] - '0');
+    }
+    return key;
+}
+
+/* Splits a NUL-terminated line buffer (as read by fgets). */
+int csv_split_line(const char *line, CsvRecord *rec) {
+    csv_split(line, line + strlen(line), rec);
+    if (rec->count == 0 || rec->fields[0].len == 0) return 0;
+    metric_count(COUNTER_CSV_RECORDS, 1);
+    return 1;
+}
+
+/* Writes s as a quoted CSV field, doubling any embedded quotes. */
+void csv_write_quoted(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"') fputc('"', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/* -------------------- Mapped File Scanning -------------------- */
+/*
+ * Report paths map the data file read-only and tokenize records straight
+ * out of the mapping, so no line is ever copied into a buffer.
+ */
+typedef struct {
+    const char *data;
+    size_t size;
+} MappedFile;
+
+/* Maps path read-only; an empty file maps to a NULL/0 region. */
+int map_file(const char *path, MappedFile *m) {
+    m->data = NULL;
+    m->size = 0;
+    int64_t start = metric_start();
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 1;
+    }
+    
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    m->data = data;
+    m->size = (size_t)st.st_size;
+    metric_stop(METRIC_FILE_MAP, start);
+    metric_count(COUNTER_MAPPED_BYTES, m->size);
+    return 1;
+}
+
+void unmap_file(MappedFile *m) {
+    if (m->data) munmap((void *)m->data, m->size);
+    m->data = NULL;
+    m->size = 0;
+}
+
+typedef struct {
+    MappedFile map;
+    const char *pos;
+    const char *end;
+} CsvCursor;
+
+int csv_cursor_open(CsvCursor *c, const char *path) {
+    if (!map_file(path, &c->map)) return 0;
+    c->pos = c->map.data;
+    c->end = c->map.data + c->map.size;
+    return 1;
+}
+
+/* Yields the next non-blank record; returns 0 at the end of the file. */
+int csv_cursor_next(CsvCursor *c, CsvRecord *rec) {
+    while (c->pos < c->end) {
+        c->pos = csv_split(c->pos, c->end, rec);
+        if (rec->count > 0 && rec->fields[0].len > 0) {
+            metric_count(COUNTER_CSV_RECORDS, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void csv_cursor_close(CsvCursor *c) {
+    unmap_file(&c->map);
+    c->pos = c->end = NULL;
+}
+
+/* -------------------- Parallel Scans -------------------- */
+/*
+ * A mapped file is cut into newline-aligned chunks of about
+ * REPORT_CHUNK_BYTES. Worker threads claim chunks from a shared counter and
+ * fill one partial result per chunk. Callers merge the partials in file
+ * order, so the result does not depend on the thread count or scheduling.
+ * Records never span lines: every writer in this program emits one record
+ * per line.
+ */
+typedef void (*ChunkScanFn)(const char *start, const char *end, void *partial, void *ctx);
+
+typedef struct {
+    const char *data;
+    const size_t *bounds;
+    int chunk_count;
+    char *partials;
+    size_t partial_size;
+    ChunkScanFn fn;
+    void *ctx;
+    atomic_int next_chunk;
+} ParallelScan;
+
+int report_thread_count() {
+    static int threads = 0;
+    if (threads == 0) {
+        const char *env = getenv("SHOP_REPORT_THREADS");
+        int n = env ? atoi(env) : DEFAULT_REPORT_THREADS;
+        if (n < 1) n = 1;
+        if (n > MAX_REPORT_THREADS) n = MAX_REPORT_THREADS;
+        threads = n;
+    }
+    return threads;
+}
+
+static void *parallel_scan_worker(void *arg) {
+    ParallelScan *job = arg;
+    for (;;) {
+        int i = atomic_fetch_add(&job->next_chunk, 1);
+        if (i >= job->chunk_count) break;
+        job->fn(job->data + job->bounds[i], job->data + job->bounds[i + 1],
+                job->partials + (size_t)i * job->partial_size, job->ctx);
+    }
+    return NULL;
+}
+
+/*
+ * Runs fn over every chunk of about chunk_bytes in [data, data + size).
+ * Returns a zeroed-then-filled array of *chunk_count partials in file
+ * order, allocated from report_arena, or NULL if the arena is exhausted.
+ */
+void *parallel_scan_chunks(const char *data, size_t size, size_t chunk_bytes, size_t partial_size,
+                           ChunkScanFn fn, void *ctx, int *chunk_count) {
+    int max_chunks = (int)(size / chunk_bytes) + 1;
+    size_t *bounds = arena_alloc(&report_arena, ((size_t)max_chunks + 1) * sizeof(size_t));
+    if (!bounds) return NULL;
+    
+    int chunks = 0;
+    size_t pos = 0;
+    bounds[0] = 0;
+    while (pos < size) {
+        size_t cut = pos + chunk_bytes;
+        if (cut >= size) {
+            cut = size;
+        } else {
+            cut = (size_t)(scan_newline(data + cut, data + size) - data);
+            if (cut < size) cut++;
+        }
+        bounds[++chunks] = cut;
+        pos = cut;
+    }
+    
+    char *partials = arena_calloc(&report_arena, chunks ? (size_t)chunks : 1, partial_size);
+    if (!partials) return NULL;
+    
+    ParallelScan job;
+    job.data = data;
+    job.bounds = bounds;
+    job.chunk_count = chunks;
+    job.partials = partials;
+    job.partial_size = partial_size;
+    job.fn = fn;
+    job.ctx = ctx;
+    atomic_init(&job.next_chunk, 0);
+    
+    int threads = report_thread_count();
+    if (threads > chunks) threads = chunks;
+    
+    pthread_t workers[MAX_REPORT_THREADS];
+    int started = 0;
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&workers[started], NULL, parallel_scan_worker, &job) != 0) break;
+        started++;
+    }
+    parallel_scan_worker(&job);
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    
+    *chunk_count = chunks;
+    return partials;
+}
+
+void *parallel_scan(const char *data, size_t size, size_t partial_size,
+                    ChunkScanFn fn, void *ctx, int *chunk_count) {
+    return parallel_scan_chunks(data, size, REPORT_CHUNK_BYTES, partial_size, fn, ctx, chunk_count);
+}
+
+/* -------------------- In-Memory Catalog -------------------- */
+/*
+ * Products and customers are loaded once at startup into resident tables.
+ * Each table carries an open-addressing (linear probing) hash index keyed
+ * by id, so lookups no longer reopen and reparse the CSV files. The CSV
+ * files are only touched to persist changes. Products are also indexed by
+ * SKU, so a scanned barcode finds its product without a search.
+ */
+#define INDEX_EMPTY -1
+#define INDEX_MIN_CAPACITY 64
+
+typedef struct {
+    int id;
+    int row;     /* position in the owning table, INDEX_EMPTY if the slot is free */
+} IdSlot;
+
+typedef struct {
+    IdSlot *slots;
+    size_t capacity; /* always a power of two */
+    size_t used;
+} IdIndex;
+
+/*
+ * A slot of the SKU index keeps the SKU's hash with the row, and a lookup
+ * confirms a match against the row's current SKU. A product whose SKU is
+ * changed is just added again: its old slot no longer matches, lookups
+ * step over it, and the next growth drops it.
+ */
+typedef struct {
+    uint32_t hash;
+    int row;     /* INDEX_EMPTY if the slot is free */
+} SkuSlot;
+
+typedef struct {
+    SkuSlot *slots;
+    size_t capacity; /* always a power of two */
+    size_t used;
+} SkuIndex;
+
+typedef struct {
+    SlabPool rows;   /* Product records, see product_row() */
+    SlabPool text;   /* ProductText, one per row */
+    int count;
+    int max_id;
+    IdIndex index;
+    SkuIndex sku_index;
+} ProductTable;
+
+typedef struct {
+    SlabPool rows;   /* Customer records, see customer_row() */
+    int count;
+    int max_id;
+    IdIndex index;
+} CustomerTable;
+
+static ProductTable product_table = { { NULL, 0, 0, sizeof(Product) }, { NULL, 0, 0, sizeof(ProductText) },
+                                      0, 0, { NULL, 0, 0 }, { NULL, 0, 0 } };
+static CustomerTable customer_table = { { NULL, 0, 0, sizeof(Customer) }, 0, 0, { NULL, 0, 0 } };
+
+static inline Product *product_row(int row) {
+    return slab_at(&product_table.rows, row);
+}
+
+static inline Customer *customer_row(int row) {
+    return slab_at(&customer_table.rows, row);
+}
+
+static size_t hash_id(int id) {
+    uint32_t x = (uint32_t)id;
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+static int id_index_alloc(IdIndex *idx, size_t capacity) {
+    idx->slots = malloc(capacity * sizeof(IdSlot));
+    if (!idx->slots) return 0;
+    for (size_t i = 0; i < capacity; i++) {
+        idx->slots[i].row = INDEX_EMPTY;
+    }
+    idx->capacity = capacity;
+    idx->used = 0;
+    return 1;
+}
+
+void id_index_free(IdIndex *idx) {
+    free(idx->slots);
+    idx->slots = NULL;
+    idx->capacity = 0;
+    idx->used = 0;
+}
+
+int id_index_find(const IdIndex *idx, int id) {
+    if (idx->capacity == 0) return INDEX_EMPTY;
+    
+    size_t mask = idx->capacity - 1;
+    size_t i = hash_id(id) & mask;
+    while (idx->slots[i].row != INDEX_EMPTY) {
+        if (idx->slots[i].id == id) return idx->slots[i].row;
+        i = (i + 1) & mask;
+    }
+    return INDEX_EMPTY;
+}
+
+/* Inserts id -> row; the first row seen for an id wins, matching the old file scans. */
+int id_index_put(IdIndex *idx, int id, int row) {
+    if ((idx->used + 1) * 10 > idx->capacity * 7) {
+        IdIndex grown;
+        size_t capacity = idx->capacity ? idx->capacity * 2 : INDEX_MIN_CAPACITY;
+        if (!id_index_alloc(&grown, capacity)) return 0;
+        for (size_t i = 0; i < idx->capacity; i++) {
+            if (idx->slots[i].row != INDEX_EMPTY) {
+                id_index_put(&grown, idx->slots[i].id, idx->slots[i].row);
+            }
+        }
+        free(idx->slots);
+        *idx = grown;
+    }
+    
+    size_t mask = idx->capacity - 1;
+    size_t i = hash_id(id) & mask;
+    while (idx->slots[i].row != INDEX_EMPTY) {
+        if (idx->slots[i].id == id) return 1;
+        i = (i + 1) & mask;
+    }
+    idx->slots[i].id = id;
+    idx->slots[i].row = row;
+    idx->used++;
+    return 1;
+}
+
+static uint32_t hash_sku(const char *sku) {
+    return (uint32_t)hash_bytes(sku, strlen(sku));
+}
+
+static int sku_index_alloc(SkuIndex *idx, size_t capacity) {
+    idx->slots = malloc(capacity * sizeof(SkuSlot));
+    if (!idx->slots) return 0;
+    for (size_t i = 0; i < capacity; i++) {
+        idx->slots[i].row = INDEX_EMPTY;
+    }
+    idx->capacity = capacity;
+    idx->used = 0;
+    return 1;
+}
+
+void sku_index_free(SkuIndex *idx) {
+    free(idx->slots);
+    idx->slots = NULL;
+    idx->capacity = 0;
+    idx->used = 0;
+}
+
+/* The product row with this SKU, or INDEX_EMPTY; "" is nobody's SKU. */
+int sku_index_find(const SkuIndex *idx, const char *sku) {
+    if (idx->capacity == 0 || !sku[0]) return INDEX_EMPTY;
+    
+    uint32_t hash = hash_sku(sku);
+    size_t mask = idx->capacity - 1;
+    for (size_t i = hash & mask; idx->slots[i].row != INDEX_EMPTY; i = (i + 1) & mask) {
+        const SkuSlot *slot = &idx->slots[i];
+        if (slot->hash == hash && strcmp(product_row(slot->row)->text->sku, sku) == 0) return slot->row;
+    }
+    return INDEX_EMPTY;
+}
+
+static void sku_index_insert(SkuIndex *idx, uint32_t hash, int row) {
+    size_t mask = idx->capacity - 1;
+    size_t i = hash & mask;
+    while (idx->slots[i].row != INDEX_EMPTY) i = (i + 1) & mask;
+    idx->slots[i].hash = hash;
+    idx->slots[i].row = row;
+    idx->used++;
+}
+
+/* Indexes a row's SKU, which must already be in its ProductText; as with ids, the first row wins. */
+int sku_index_put(SkuIndex *idx, const char *sku, int row) {
+    if (!sku[0] || sku_index_find(idx, sku) != INDEX_EMPTY) return 1;
+    if ((idx->used + 1) * 10 > idx->capacity * 7) {
+        SkuIndex grown;
+        size_t capacity = idx->capacity ? idx->capacity * 2 : INDEX_MIN_CAPACITY;
+        if (!sku_index_alloc(&grown, capacity)) return 0;
+        for (size_t i = 0; i < idx->capacity; i++) {
+            const SkuSlot *slot = &idx->slots[i];
+            if (slot->row != INDEX_EMPTY && hash_sku(product_row(slot->row)->text->sku) == slot->hash) {
+                sku_index_insert(&grown, slot->hash, slot->row);
+            }
+        }
+        free(idx->slots);
+        *idx = grown;
+    }
+    sku_index_insert(idx, hash_sku(sku), row);
+    return 1;
+}
+
+static int grow_rows(void **rows, int *capacity, size_t row_size) {
+    int new_capacity = *capacity ? *capacity * 2 : 64;
+    void *grown = realloc(*rows, (size_t)new_capacity * row_size);
+    if (!grown) return 0;
+    *rows = grown;
+    *capacity = new_capacity;
+    return 1;
+}
+
+/*
+ * Products ordered by how far their stock sits above its minimum level,
+ * as a binary min-heap of table rows keyed by stock - min_stock_level.
+ * The product closest to (or furthest past) its reorder point is at the
+ * root, so everything below its minimum is found without visiting the
+ * rest: a subtree is skipped as soon as its root is not below. Whatever
+ * changes a product's stock or minimum calls reorder_update(), which moves
+ * it in O(log n) and notes it if it has just dropped below its minimum.
+ */
+#define REORDER_ALERT_MAX 32
+
+typedef struct {
+    int margin;                /* stock - min_stock_level, below its minimum when < 0 */
+    int row;
+} ReorderEntry;
+
+typedef struct {
+    ReorderEntry *heap;
+    int *pos;                  /* row -> index in heap */
+    int count;
+    int capacity;
+    int alerts[REORDER_ALERT_MAX];  /* rows that fell below their minimum since reorder_clear_alerts() */
+    int alert_count;
+} ReorderHeap;
+
+static ReorderHeap reorder_heap;
+
+static void reorder_set(int i, ReorderEntry e) {
+    reorder_heap.heap[i] = e;
+    reorder_heap.pos[e.row] = i;
+}
+
+static void reorder_sift(int i) {
+    ReorderEntry *h = reorder_heap.heap;
+    ReorderEntry e = h[i];
+    while (i > 0 && e.margin < h[(i - 1) / 2].margin) {
+        reorder_set(i, h[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= reorder_heap.count) break;
+        if (child + 1 < reorder_heap.count && h[child + 1].margin < h[child].margin) child++;
+        if (h[child].margin >= e.margin) break;
+        reorder_set(i, h[child]);
+        i = child;
+    }
+    reorder_set(i, e);
+}
+
+/* Adds the product in a new table row; rows are added in order and never removed. */
+static int reorder_push(int row, int margin) {
+    ReorderHeap *r = &reorder_heap;
+    if (r->count == r->capacity) {
+        int capacity = r->capacity ? r->capacity * 2 : 64;
+        ReorderEntry *heap = realloc(r->heap, (size_t)capacity * sizeof(*heap));
+        if (heap) r->heap = heap;
+        int *pos = heap ? realloc(r->pos, (size_t)capacity * sizeof(*pos)) : NULL;
+        if (!pos) return 0;
+        r->pos = pos;
+        r->capacity = capacity;
+    }
+    ReorderEntry e = { margin, row };
+    reorder_set(r->count++, e);
+    reorder_sift(r->count - 1);
+    return 1;
+}
+
+void reorder_heap_free() {
+    free(reorder_heap.heap);
+    free(reorder_heap.pos);
+    memset(&reorder_heap, 0, sizeof(reorder_heap));
+}
+
+void reorder_clear_alerts() {
+    reorder_heap.alert_count = 0;
+}
+
+/* Re-sorts a product after its stock or minimum has changed. */
+void reorder_update(const Product *p) {
+    int row = id_index_find(&product_table.index, p->id);
+    if (row == INDEX_EMPTY || row >= reorder_heap.count) return;
+    
+    int i = reorder_heap.pos[row];
+    int before = reorder_heap.heap[i].margin;
+    reorder_heap.heap[i].margin = p->stock - p->min_stock_level;
+    reorder_sift(i);
+    
+    if (before >= 0 && p->stock < p->min_stock_level && reorder_heap.alert_count < REORDER_ALERT_MAX) {
+        reorder_heap.alerts[reorder_heap.alert_count++] = row;
+    }
+}
+
+static int compare_reorder_rows(const void *a, const void *b) {
+    const Product *x = product_row(*(const int *)a), *y = product_row(*(const int *)b);
+    int mx = x->stock - x->min_stock_level, my = y->stock - y->min_stock_level;
+    if (mx != my) return mx < my ? -1 : 1;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+/*
+ * Fills rows with the products below their minimum, most urgent first,
+ * and returns how many there are. rows must have room for product_table.count.
+ */
+int reorder_below(int *rows) {
+    int n = 0;
+    if (reorder_heap.count == 0 || reorder_heap.heap[0].margin >= 0) return 0;
+    
+    // rows doubles as the walk's queue: every heap index in it is below its minimum
+    int *queue = rows;
+    queue[n++] = 0;
+    for (int next = 0; next < n; next++) {
+        for (int child = 2 * queue[next] + 1; child <= 2 * queue[next] + 2; child++) {
+            if (child < reorder_heap.count && reorder_heap.heap[child].margin < 0) queue[n++] = child;
+        }
+    }
+    for (int i = 0; i < n; i++) rows[i] = reorder_heap.heap[rows[i]].row;
+    qsort(rows, (size_t)n, sizeof(*rows), compare_reorder_rows);
+    return n;
+}
+
+/* Records live in slabs, so pointers returned here survive later adds. */
+Product *product_table_add(const ProductRecord *r) {
+    ProductTable *t = &product_table;
+    Product *row = slab_reserve(&t->rows, t->count);
+    ProductText *text = slab_reserve(&t->text, t->count);
+    if (!row || !text || !id_index_put(&t->index, r->id, t->count)) return NULL;
+    
+    text->name = intern(r->name);
+    text->category = intern(r->category);
+    text->brand = intern(r->brand);
+    text->sku = intern(r->sku);
+    row->id = r->id;
+    row->stock = r->stock;
+    row->min_stock_level = r->min_stock_level;
+    row->cost_price = r->cost_price;
+    row->sell_price = r->sell_price;
+    row->text = text;
+    if (!sku_index_put(&t->sku_index, text->sku, t->count)) return NULL;
+    if (!reorder_push(t->count, r->stock - r->min_stock_level)) return NULL;
+    if (r->id > t->max_id) t->max_id = r->id;
+    t->count++;
+    return row;
+}
+
+Customer *customer_table_add(const CustomerRecord *r) {
+    CustomerTable *t = &customer_table;
+    Customer *row = slab_reserve(&t->rows, t->count);
+    if (!row || !id_index_put(&t->index, r->id, t->count)) return NULL;
+    
+    row->id = r->id;
+    row->name = intern(r->name);
+    row->phone = intern(r->phone);
+    row->email = intern(r->email);
+    row->address = intern(r->address);
+    if (r->id > t->max_id) t->max_id = r->id;
+    t->count++;
+    return row;
+}
+
+Product *product_lookup(int id) {
+    int row = id_index_find(&product_table.index, id);
+    return row == INDEX_EMPTY ? NULL : product_row(row);
+}
+
+Product *product_lookup_sku(const char *sku) {
+    int row = sku_index_find(&product_table.sku_index, sku);
+    return row == INDEX_EMPTY ? NULL : product_row(row);
+}
+
+Customer *customer_lookup(int id) {
+    int row = id_index_find(&customer_table.index, id);
+    return row == INDEX_EMPTY ? NULL : customer_row(row);
+}
+
+void write_product_row(FILE *f, const ProductRecord *p) {
+    fprintf(f, "%d,", p->id);
+    csv_write_quoted(f, p->name);
+    fputc(',', f);
+    csv_write_quoted(f, p->category);
+    fputc(',', f);
+    csv_write_quoted(f, p->brand);
+    char cost[MONEY_TEXT], price[MONEY_TEXT];
+    fprintf(f, ",%s,%s,%d,%d", format_money(p->cost_price, cost, sizeof(cost)),
+            format_money(p->sell_price, price, sizeof(price)), p->stock, p->min_stock_level);
+    // The SKU came later as a ninth column, written only when there is one
+    if (p->sku[0]) {
+        fputc(',', f);
+        csv_write_quoted(f, p->sku);
+    }
+    fputc('\n', f);
+}
+
+/* Expands a resident product back into its full record. */
+void product_record(const Product *p, ProductRecord *out) {
+    memset(out, 0, sizeof(*out));
+    out->id = p->id;
+    snprintf(out->name, sizeof(out->name), "%s", p->text->name);
+    snprintf(out->category, sizeof(out->category), "%s", p->text->category);
+    snprintf(out->brand, sizeof(out->brand), "%s", p->text->brand);
+    snprintf(out->sku, sizeof(out->sku), "%s", p->text->sku);
+    out->cost_price = p->cost_price;
+    out->sell_price = p->sell_price;
+    out->stock = p->stock;
+    out->min_stock_level = p->min_stock_level;
+}
+
+/* Expands a resident customer back into its full record. */
+void customer_record(const Customer *c, CustomerRecord *out) {
+    memset(out, 0, sizeof(*out));
+    out->id = c->id;
+    snprintf(out->name, sizeof(out->name), "%s", c->name);
+    snprintf(out->phone, sizeof(out->phone), "%s", c->phone);
+    snprintf(out->email, sizeof(out->email), "%s", c->email);
+    snprintf(out->address, sizeof(out->address), "%s", c->address);
+}
+
+void write_customer_row(FILE *f, const CustomerRecord *c) {
+    fprintf(f, "%d,", c->id);
+    csv_write_quoted(f, c->name);
+    fputc(',', f);
+    csv_write_quoted(f, c->phone);
+    fputc(',', f);
+    csv_write_quoted(f, c->email);
+    fputc(',', f);
+    csv_write_quoted(f, c->address);
+    fputc('\n', f);
+}
+
+int load_products() {
+    if (!file_exists(PRODUCTS_FILE)) return 1;
+    int64_t start = metric_start();
+    
+    FILE *f = fopen(PRODUCTS_FILE, "r");
+    if (!f) return 0;
+    
+    char line[MAX_LINE];
+    CsvRecord rec;
+    while (fgets(line, sizeof(line), f)) {
+        if (!csv_split_line(line, &rec)) continue;
+        
+        ProductRecord p;
+        p.id = csv_int(&rec, 0);
+        csv_string(&rec, 1, p.name, sizeof(p.name));
+        csv_string(&rec, 2, p.category, sizeof(p.category));
+        csv_string(&rec, 3, p.brand, sizeof(p.brand));
+        p.cost_price = csv_money(&rec, 4);
+        p.sell_price = csv_money(&rec, 5);
+        p.stock = csv_int(&rec, 6);
+        p.min_stock_level = csv_int(&rec, 7);
+        csv_string(&rec, 8, p.sku, sizeof(p.sku));
+        
+        if (!product_table_add(&p)) {
+            fclose(f);
+            return 0;
+        }
+    }
+    fclose(f);
+    metric_stop(METRIC_LOAD_PRODUCTS, start);
+    return 1;
+}
+
+int load_customers() {
+    if (!file_exists(CUSTOMERS_FILE)) return 1;
+    int64_t start = metric_start();
+    
+    FILE *f = fopen(CUSTOMERS_FILE, "r");
+    if (!f) return 0;
+    
+    char line[MAX_LINE];
+    CsvRecord rec;
+    while (fgets(line, sizeof(line), f)) {
+        if (!csv_split_line(line, &rec)) continue;
+        
+        CustomerRecord c;
+        c.id = csv_int(&rec, 0);
+        csv_string(&rec, 1, c.name, sizeof(c.name));
+        csv_string(&rec, 2, c.phone, sizeof(c.phone));
+        csv_string(&rec, 3, c.email, sizeof(c.email));
+        csv_string(&rec, 4, c.address, sizeof(c.address));
+        
+        if (!customer_table_add(&c)) {
+            fclose(f);
+            return 0;
+        }
+    }
+    fclose(f);
+    metric_stop(METRIC_LOAD_CUSTOMERS, start);
+    return 1;
+}
+
+/* Writes the resident product table to the temp file and forces it to disk. */
+int save_products() {
+    int64_t start = metric_start();
+    FILE *tmp = fopen(PRODUCTS_TMP_FILE, "w");
+    if (!tmp) return 0;
+    
+    for (int i = 0; i < product_table.count; i++) {
+        ProductRecord r;
+        product_record(product_row(i), &r);
+        write_product_row(tmp, &r);
+    }
+    
+    if (fflush(tmp) != 0 || fsync(fileno(tmp)) != 0) {
+        fclose(tmp);
+        remove(PRODUCTS_TMP_FILE);
+        return 0;
+    }
+    if (fclose(tmp) != 0) {
+        remove(PRODUCTS_TMP_FILE);
+        return 0;
+    }
+    metric_stop(METRIC_SAVE_PRODUCTS, start);
+    return 1;
+}
+
+/* Rewrites customers.csv from the resident table (temp file, fsync, rename). */
+int save_customers() {
+    int64_t start = metric_start();
+    FILE *tmp = fopen(CUSTOMERS_TMP_FILE, "w");
+    if (!tmp) return 0;
+    
+    for (int i = 0; i < customer_table.count; i++) {
+        CustomerRecord r;
+        customer_record(customer_row(i), &r);
+        write_customer_row(tmp, &r);
+    }
+    
+    if (fflush(tmp) != 0 || fsync(fileno(tmp)) != 0) {
+        fclose(tmp);
+        remove(CUSTOMERS_TMP_FILE);
+        return 0;
+    }
+    if (fclose(tmp) != 0 || rename(CUSTOMERS_TMP_FILE, CUSTOMERS_FILE) != 0) {
+        remove(CUSTOMERS_TMP_FILE);
+        return 0;
+    }
+    metric_stop(METRIC_SAVE_CUSTOMERS, start);
+    return 1;
+}
+
+/* -------------------- Search Index -------------------- */
+/*
+ * Inverted index for product and customer search. Field text is split into
+ * lowercased alphanumeric tokens, and every prefix of each token (up to
+ * SEARCH_MAX_PREFIX bytes) maps to a posting list of table rows. A query
+ * matches rows that contain a token starting with each query word. Rows
+ * are ranked by field weight, and whole-token matches score above prefix
+ * matches.
+ *
+ * Postings carry the row's version. Re-indexing an edited row bumps its
+ * version, which retires its old postings without rewriting any lists.
+ * Versions are 32 bits so an often-edited row cannot wrap back onto a
+ * posting it has already retired.
+ */
+#define SEARCH_MAX_PREFIX 16
+#define SEARCH_MAX_TOKEN 64
+#define SEARCH_MAX_QUERY_TOKENS 8
+#define SEARCH_EXACT_BONUS 3
+
+typedef struct {
+    int32_t row;
+    uint32_t version;
+    uint8_t weight;
+    uint8_t exact;
+} SearchPosting;
+
+typedef struct {
+    char *key;                 /* NULL marks a free slot */
+    uint64_t hash;
+    SearchPosting *postings;
+    int count;
+    int capacity;
+} SearchKey;
+
+typedef struct {
+    SearchKey *slots;
+    size_t capacity;           /* power of two */
+    size_t used;
+    uint32_t *versions;
+    int row_capacity;
+    int *score;                /* query scratch, one entry per row */
+    int *matched;
+    int *best;
+    int *candidates;
+    int *pending;
+    const char *borrowed;      /* keys and postings in [borrowed, + borrowed_size) live in the catalog snapshot */
+    size_t borrowed_size;
+} SearchIndex;
+
+typedef struct {
+    int row;
+    int score;
+} SearchHit;
+
+static SearchIndex product_search;
+static SearchIndex customer_search;
+
+static int is_token_char(unsigned char c) {
+    return isalnum(c) || c >= 0x80;
+}
+
+/* Extracts the next lowercased token from *text; returns its length or 0 at the end. */
+static size_t next_token(const char **text, char *token) {
+    const unsigned char *p = (const unsigned char *)*text;
+    size_t n = 0;
+    
+    while (*p && !is_token_char(*p)) p++;
+    while (*p && is_token_char(*p)) {
+        if (n < SEARCH_MAX_TOKEN - 1) token[n++] = (char)tolower(*p);
+        p++;
+    }
+    token[n] = '\0';
+    *text = (const char *)p;
+    return n;
+}
+
+static int search_owns(const SearchIndex *idx, const void *p) {
+    const char *c = p;
+    return !idx->borrowed || c < idx->borrowed || c >= idx->borrowed + idx->borrowed_size;
+}
+
+void search_index_free(SearchIndex *idx) {
+    for (size_t i = 0; i < idx->capacity; i++) {
+        if (search_owns(idx, idx->slots[i].key)) free(idx->slots[i].key);
+        if (search_owns(idx, idx->slots[i].postings)) free(idx->slots[i].postings);
+    }
+    free(idx->slots);
+    free(idx->versions);
+    free(idx->score);
+    free(idx->matched);
+    free(idx->best);
+    free(idx->candidates);
+    free(idx->pending);
+    memset(idx, 0, sizeof(*idx));
+}
+
+static SearchKey *search_key_find(const SearchIndex *idx, const char *key, size_t n, uint64_t h) {
+    if (idx->capacity == 0) return NULL;
+    size_t mask = idx->capacity - 1;
+    for (size_t i = h & mask; idx->slots[i].key; i = (i + 1) & mask) {
+        SearchKey *k = &idx->slots[i];
+        if (k->hash == h && strncmp(k->key, key, n) == 0 && k->key[n] == '\0') return k;
+    }
+    return NULL;
+}
+
+static int search_grow_keys(SearchIndex *idx) {
+    size_t capacity = idx->capacity ? idx->capacity * 2 : 1024;
+    SearchKey *slots = calloc(capacity, sizeof(SearchKey));
+    if (!slots) return 0;
+    
+    for (size_t i = 0; i < idx->capacity; i++) {
+        if (!idx->slots[i].key) continue;
+        size_t j = idx->slots[i].hash & (capacity - 1);
+        while (slots[j].key) j = (j + 1) & (capacity - 1);
+        slots[j] = idx->slots[i];
+    }
+    free(idx->slots);
+    idx->slots = slots;
+    idx->capacity = capacity;
+    return 1;
+}
+
+static SearchKey *search_key_get(SearchIndex *idx, const char *key, size_t n) {
+    uint64_t h = hash_bytes(key, n);
+    SearchKey *k = search_key_find(idx, key, n, h);
+    if (k) return k;
+    
+    if ((idx->used + 1) * 10 > idx->capacity * 7 && !search_grow_keys(idx)) return NULL;
+    size_t mask = idx->capacity - 1;
+    size_t i = h & mask;
+    while (idx->slots[i].key) i = (i + 1) & mask;
+    
+    k = &idx->slots[i];
+    k->key = malloc(n + 1);
+    if (!k->key) return NULL;
+    memcpy(k->key, key, n);
+    k->key[n] = '\0';
+    k->hash = h;
+    idx->used++;
+    return k;
+}
+
+static int search_ensure_rows(SearchIndex *idx, int row) {
+    if (row < idx->row_capacity) return 1;
+    
+    int capacity = idx->row_capacity ? idx->row_capacity : 256;
+    while (capacity <= row) capacity *= 2;
+    
+    uint32_t *versions = realloc(idx->versions, (size_t)capacity * sizeof(uint32_t));
+    if (versions) idx->versions = versions;
+    int *score = realloc(idx->score, (size_t)capacity * sizeof(int));
+    if (score) idx->score = score;
+    int *matched = realloc(idx->matched, (size_t)capacity * sizeof(int));
+    if (matched) idx->matched = matched;
+    int *best = realloc(idx->best, (size_t)capacity * sizeof(int));
+    if (best) idx->best = best;
+    int *candidates = realloc(idx->candidates, (size_t)capacity * sizeof(int));
+    if (candidates) idx->candidates = candidates;
+    int *pending = realloc(idx->pending, (size_t)capacity * sizeof(int));
+    if (pending) idx->pending = pending;
+    if (!versions || !score || !matched || !best || !candidates || !pending) return 0;
+    
+    for (int i = idx->row_capacity; i < capacity; i++) {
+        versions[i] = 0;
+        score[i] = 0;
+        matched[i] = 0;
+        best[i] = 0;
+    }
+    idx->row_capacity = capacity;
+    return 1;
+}
+
+static int search_add_posting(SearchIndex *idx, const char *key, size_t n, int row, int weight, int exact) {
+    SearchKey *k = search_key_get(idx, key, n);
+    if (!k) return 0;
+    
+    // The same row can reach a key through several tokens; keep the best one
+    if (k->count > 0) {
+        SearchPosting *last = &k->postings[k->count - 1];
+        if (last->row == row && last->version == idx->versions[row]) {
+            if (weight * (exact ? SEARCH_EXACT_BONUS : 1) > last->weight * (last->exact ? SEARCH_EXACT_BONUS : 1)) {
+                last->weight = (uint8_t)weight;
+                last->exact = (uint8_t)exact;
+            }
+            return 1;
+        }
+    }
+    if (k->count == k->capacity && !search_owns(idx, k->postings)) {
+        // A list still in the snapshot is copied out before it grows
+        SearchPosting *copy = malloc((size_t)k->count * 2 * sizeof(SearchPosting));
+        if (!copy) return 0;
+        memcpy(copy, k->postings, (size_t)k->count * sizeof(SearchPosting));
+        k->postings = copy;
+        k->capacity = k->count * 2;
+    } else if (k->count == k->capacity &&
+               !grow_rows((void **)&k->postings, &k->capacity, sizeof(SearchPosting))) {
+        return 0;
+    }
+    SearchPosting *sp = &k->postings[k->count++];
+    sp->row = row;
+    sp->version = idx->versions[row];
+    sp->weight = (uint8_t)weight;
+    sp->exact = (uint8_t)exact;
+    return 1;
+}
+
+/* Indexes (or re-indexes) one row from its searchable fields. */
+int search_index_row(SearchIndex *idx, int row, const char **fields, const int *weights, int nfields) {
+    if (!search_ensure_rows(idx, row)) return 0;
+    
+    for (int f = 0; f < nfields; f++) {
+        const char *text = fields[f];
+        char token[SEARCH_MAX_TOKEN];
+        size_t n;
+        while ((n = next_token(&text, token)) > 0) {
+            size_t max = n < SEARCH_MAX_PREFIX ? n : SEARCH_MAX_PREFIX;
+            for (size_t len = 1; len <= max; len++) {
+                if (!search_add_posting(idx, token, len, row, weights[f], len == n)) return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Retires a row's postings; call search_index_row afterwards to add new ones. */
+void search_index_retire_row(SearchIndex *idx, int row) {
+    if (row < idx->row_capacity) idx->versions[row]++;
+}
+
+/* Case-insensitive substring test used to confirm tokens longer than the indexed prefix. */
+static int contains_token_ci(const char *text, const char *token) {
+    size_t n = strlen(token);
+    for (const char *p = text; *p; p++) {
+        size_t i = 0;
+        while (i < n && p[i] && tolower((unsigned char)p[i]) == token[i]) i++;
+        if (i == n) return 1;
+    }
+    return 0;
+}
+
+static int compare_hits(const void *a, const void *b) {
+    const SearchHit *x = a, *y = b;
+    if (x->score != y->score) return y->score - x->score;
+    return x->row - y->row;
+}
+
+typedef int (*SearchVerifyFn)(int row, const char *token);
+
+/*
+ * Returns rows matching every query token, best first, in an array taken
+ * from report_arena. verify() confirms tokens longer than SEARCH_MAX_PREFIX.
+ */
+SearchHit *search_index_query(SearchIndex *idx, const char *query, SearchVerifyFn verify, int *hit_count) {
+    char tokens[SEARCH_MAX_QUERY_TOKENS][SEARCH_MAX_TOKEN];
+    int ntokens = 0;
+    const char *text = query;
+    *hit_count = 0;
+    
+    while (ntokens < SEARCH_MAX_QUERY_TOKENS && next_token(&text, tokens[ntokens]) > 0) ntokens++;
+    if (ntokens == 0 || idx->capacity == 0) return NULL;
+    
+    const SearchKey *keys[SEARCH_MAX_QUERY_TOKENS];
+    for (int t = 0; t < ntokens; t++) {
+        size_t n = strlen(tokens[t]);
+        if (n > SEARCH_MAX_PREFIX) n = SEARCH_MAX_PREFIX;
+        keys[t] = search_key_find(idx, tokens[t], n, hash_bytes(tokens[t], n));
+        if (!keys[t]) return NULL;
+    }
+    
+    // Start from the rarest token so the candidate set is as small as possible
+    for (int t = 1; t < ntokens; t++) {
+        for (int u = t; u > 0 && keys[u]->count < keys[u - 1]->count; u--) {
+            const SearchKey *k = keys[u];
+            keys[u] = keys[u - 1];
+            keys[u - 1] = k;
+            char tmp[SEARCH_MAX_TOKEN];
+            memcpy(tmp, tokens[u], sizeof(tmp));
+            memcpy(tokens[u], tokens[u - 1], sizeof(tmp));
+            memcpy(tokens[u - 1], tmp, sizeof(tmp));
+        }
+    }
+    
+    // Rows matching the first token are the candidates; later tokens only narrow them
+    int candidates = 0;
+    for (int t = 0; t < ntokens; t++) {
+        int long_token = strlen(tokens[t]) > SEARCH_MAX_PREFIX;
+        int *touched = t == 0 ? idx->candidates : idx->pending;
+        int ntouched = 0;
+        
+        for (int i = 0; i < keys[t]->count; i++) {
+            const SearchPosting *sp = &keys[t]->postings[i];
+            if (sp->version != idx->versions[sp->row]) continue;
+            if (idx->matched[sp->row] != t) continue;
+            if (long_token && !verify(sp->row, tokens[t])) continue;
+            
+            int score = sp->weight * (sp->exact && !long_token ? SEARCH_EXACT_BONUS : 1);
+            if (idx->best[sp->row] == 0) touched[ntouched++] = sp->row;
+            if (score > idx->best[sp->row]) idx->best[sp->row] = score;
+        }
+        
+        if (t == 0) candidates = ntouched;
+        for (int i = 0; i < ntouched; i++) {
+            int row = touched[i];
+            idx->score[row] += idx->best[row];
+            idx->best[row] = 0;
+            idx->matched[row]++;
+        }
+    }
+    
+    SearchHit *hits = candidates ? arena_alloc(&report_arena, (size_t)candidates * sizeof(SearchHit)) : NULL;
+    int n = 0;
+    for (int i = 0; i < candidates; i++) {
+        int row = idx->candidates[i];
+        if (hits && idx->matched[row] == ntokens) {
+            hits[n].row = row;
+            hits[n].score = idx->score[row];
+            n++;
+        }
+        idx->matched[row] = 0;
+        idx->score[row] = 0;
+    }
+    
+    if (n > 1) qsort(hits, (size_t)n, sizeof(SearchHit), compare_hits);
+    *hit_count = n;
+    return hits;
+}
+
+static const int product_search_weights[] = { 4, 2, 2 };
+static const int customer_search_weights[] = { 4, 2, 2 };
+
+int index_product_row(int row) {
+    const ProductText *p = product_row(row)->text;
+    const char *fields[] = { p->name, p->category, p->brand };
+    return search_index_row(&product_search, row, fields, product_search_weights, 3);
+}
+
+int index_customer_row(int row) {
+    const Customer *c = customer_row(row);
+    const char *fields[] = { c->name, c->phone, c->email };
+    return search_index_row(&customer_search, row, fields, customer_search_weights, 3);
+}
+
+static int verify_product_token(int row, const char *token) {
+    const ProductText *p = product_row(row)->text;
+    return contains_token_ci(p->name, token) || contains_token_ci(p->category, token) ||
+           contains_token_ci(p->brand, token);
+}
+
+static int verify_customer_token(int row, const char *token) {
+    const Customer *c = customer_row(row);
+    return contains_token_ci(c->name, token) || contains_token_ci(c->phone, token) ||
+           contains_token_ci(c->email, token);
+}
+
+SearchHit *search_products_index(const char *query, int *hit_count) {
+    int64_t start = metric_start();
+    SearchHit *hits = search_index_query(&product_search, query, verify_product_token, hit_count);
+    metric_stop(METRIC_SEARCH, start);
+    return hits;
+}
+
+SearchHit *search_customers_index(const char *query, int *hit_count) {
+    int64_t start = metric_start();
+    SearchHit *hits = search_index_query(&customer_search, query, verify_customer_token, hit_count);
+    metric_stop(METRIC_SEARCH, start);
+    return hits;
+}
+
+int build_search_indexes() {
+    search_index_free(&product_search);
+    search_index_free(&customer_search);
+    for (int i = 0; i < product_table.count; i++) {
+        if (!index_product_row(i)) return 0;
+    }
+    for (int i = 0; i < customer_table.count; i++) {
+        if (!index_customer_row(i)) return 0;
+    }
+    return 1;
+}
+
+/* -------------------- Branches -------------------- */
+/*
+ * A company can run one shop per branch, each in its own directory, and a
+ * central node whose daemon holds the merged data (see Log Shipping).
+ * branch.csv gives a shop its branch number, 1 to MAX_BRANCH; a shop
+ * without one is standalone or the central node.
+ *
+ * Branch b numbers its new records from b * BRANCH_ID_SPAN, so ids never
+ * collide between branches. Ids it handed out before it became a branch
+ * lie below the span; the central node files them under b * BRANCH_ID_SPAN
+ * + id, and the branch's sequences carry on past that.
+ *
+ * A branch keeps every write-ahead log a checkpoint retires as a numbered
+ * segment in ship/, until the central node has applied all of it.
+ * ship/segment holds the number the live shop.wal will be kept under.
+ */
+static int branch_number = -1;
+
+/* This shop's branch, or 0 when it is standalone or the central node. */
+int shop_branch() {
+    if (branch_number >= 0) return branch_number;
+    branch_number = 0;
+    FILE *f = fopen(BRANCH_FILE, "r");
+    if (!f) return 0;
+    
+    char line[MAX_LINE];
+    CsvRecord rec;
+    if (fgets(line, sizeof(line), f) && csv_split_line(line, &rec)) {
+        int branch = csv_int(&rec, 0);
+        if (branch >= 1 && branch <= MAX_BRANCH) branch_number = branch;
+    }
+    fclose(f);
+    return branch_number;
+}
+
+int set_shop_branch(int branch) {
+    FILE *tmp = fopen(BRANCH_TMP_FILE, "w");
+    if (!tmp) return 0;
+    fprintf(tmp, "%d\n", branch);
+    if (fflush(tmp) != 0 || fsync(fileno(tmp)) != 0) {
+        fclose(tmp);
+        remove(BRANCH_TMP_FILE);
+        return 0;
+    }
+    if (fclose(tmp) != 0 || rename(BRANCH_TMP_FILE, BRANCH_FILE) != 0) {
+        remove(BRANCH_TMP_FILE);
+        return 0;
+    }
+    branch_number = branch;
+    return 1;
+}
+
+/* The branch a record id was numbered by; 0 for the central node's own and older ids. */
+int id_branch(int id) {
+    return id > 0 ? id / BRANCH_ID_SPAN : 0;
+}
+
+/* The id a branch's record has on the central node. */
+int branch_global_id(int branch, int id) {
+    return id > 0 && id < BRANCH_ID_SPAN ? branch * BRANCH_ID_SPAN + id : id;
+}
+
+/* True if id is one this shop numbered rather than one shipped in from a branch. */
+int own_id(int id) {
+    return (int64_t)id < (int64_t)(shop_branch() + 1) * BRANCH_ID_SPAN;
+}
+
+static void ship_segment_path(uint32_t segment, char *path, size_t size) {
+    snprintf(path, size, "%s/%08u.wal", SHIP_DIR, segment);
+}
+
+/* The number the live log will be kept under; a crash may have left ship/segment one behind. */
+uint32_t ship_segment_current() {
+    uint32_t segment = 1;
+    FILE *f = fopen(SHIP_SEGMENT_FILE, "r");
+    if (f) {
+        if (fscanf(f, "%u", &segment) != 1 || segment == 0) segment = 1;
+        fclose(f);
+    }
+    char path[64];
+    for (;;) {
+        ship_segment_path(segment, path, sizeof(path));
+        if (!file_exists(path)) return segment;
+        segment++;
+    }
+}
+
+/*
+ * Disposes of a log that a checkpoint or a restore has finished with. A
+ * branch keeps it as the next segment to ship; any other shop removes it.
+ */
+void retire_log(const char *path) {
+    if (!shop_branch() || !file_exists(path)) {
+        remove(path);
+        return;
+    }
+    uint32_t segment = ship_segment_current();
+    char kept[64];
+    ship_segment_path(segment, kept, sizeof(kept));
+    if (!make_dir(SHIP_DIR) || rename(path, kept) != 0) {
+        printf("Warning: Unable to keep %s for shipping.\n", path);
+        remove(path);
+        return;
+    }
+    
+    FILE *tmp = fopen(SHIP_SEGMENT_TMP_FILE, "w");
+    if (tmp) {
+        fprintf(tmp, "%u\n", segment + 1);
+        if (fclose(tmp) != 0 || rename(SHIP_SEGMENT_TMP_FILE, SHIP_SEGMENT_FILE) != 0) remove(SHIP_SEGMENT_TMP_FILE);
+    }
+}
+
+/*
+ * How far the central node has applied one branch's stream. A frame is
+ * only accepted if it starts here, and it moves the position in the same
+ * log group as its records.
+ */
+enum { SHIP_NONE, SHIP_SNAPSHOT, SHIP_LOG };
+
+typedef struct {
+    int32_t branch;
+    int32_t phase;             /* SHIP_* */
+    uint32_t segment;          /* branch log position the stream goes on from */
+    uint32_t record;           /* records of the group at offset already applied */
+    uint64_t offset;
+    int64_t sales_total;       /* sales in the snapshot */
+    int64_t sales_done;        /* of those, applied so far */
+    int64_t updated;           /* epoch seconds of the last frame */
+} ShipPosition;
+
+static ShipPosition ship_positions[MAX_BRANCH + 1];
+static int ship_positions_dirty;
+
+int ship_position_equal(const ShipPosition *a, const ShipPosition *b) {
+    return a->phase == b->phase && a->segment == b->segment && a->record == b->record &&
+           a->offset == b->offset && a->sales_total == b->sales_total && a->sales_done == b->sales_done;
+}
+
+/* Branches that have shipped here, which makes this shop the central node. */
+int shipping_branches() {
+    int n = 0;
+    for (int b = 1; b <= MAX_BRANCH; b++) {
+        if (ship_positions[b].phase != SHIP_NONE) n++;
+    }
+    return n;
+}
+
+/* Reads the positions as of the last checkpoint; the log replays any frame after it. */
+int load_ship_positions() {
+    memset(ship_positions, 0, sizeof(ship_positions));
+    ship_positions_dirty = 0;
+    FILE *f = fopen(REPLICATION_FILE, "r");
+    if (!f) return errno == ENOENT;
+    
+    char line[MAX_LINE];
+    CsvRecord rec;
+    while (fgets(line, sizeof(line), f)) {
+        if (!csv_split_line(line, &rec)) continue;
+        int b = csv_int(&rec, 0);
+        if (b < 1 || b > MAX_BRANCH) continue;
+        ShipPosition *p = &ship_positions[b];
+        p->branch = b;
+        p->phase = csv_int(&rec, 1);
+        p->segment = (uint32_t)csv_field_long(csv_get(&rec, 2));
+        p->offset = (uint64_t)csv_field_long(csv_get(&rec, 3));
+        p->record = (uint32_t)csv_field_long(csv_get(&rec, 4));
+        p->sales_total = csv_field_long(csv_get(&rec, 5));
+        p->sales_done = csv_field_long(csv_get(&rec, 6));
+        p->updated = csv_field_long(csv_get(&rec, 7));
+    }
+    fclose(f);
+    return 1;
+}
+
+/* Writes replication.csv. Must hold the lock, before a checkpoint retires the log. */
+int save_ship_positions() {
+    if (!ship_positions_dirty) return 1;
+    FILE *tmp = fopen(REPLICATION_TMP_FILE, "w");
+    if (!tmp) return 0;
+    
+    for (int b = 1; b <= MAX_BRANCH; b++) {
+        const ShipPosition *p = &ship_positions[b];
+        if (p->phase == SHIP_NONE) continue;
+        fprintf(tmp, "%d,%d,%u,%" PRIu64 ",%u,%" PRId64 ",%" PRId64 ",%" PRId64 "\n", b, p->phase, p->segment,
+                p->offset, p->record, p->sales_total, p->sales_done, p->updated);
+    }
+    
+    if (fflush(tmp) != 0 || fsync(fileno(tmp)) != 0) {
+        fclose(tmp);
+        remove(REPLICATION_TMP_FILE);
+        return 0;
+    }
+    if (fclose(tmp) != 0 || rename(REPLICATION_TMP_FILE, REPLICATION_FILE) != 0) {
+        remove(REPLICATION_TMP_FILE);
+        return 0;
+    }
+    ship_positions_dirty = 0;
+    return 1;
+}
+
+/* -------------------- Stock Journal -------------------- */
+/*
+ * Older builds appended stock changes to stock.journal as fixed-size delta
+ * records. The write-ahead log has replaced it; a journal left by such a
+ * build is folded into products.csv once at startup:
+ *
+ *   1. the folded table is written to .products_tmp and fsynced
+ *   2. stock.journal is renamed to .stock_journal_folded
+ *   3. .products_tmp is renamed over products.csv
+ *   4. .stock_journal_folded is removed
+ *
+ * recover_checkpoint() finishes an interrupted fold, so a delta is never
+ * applied twice or lost. Records written in one group carry the number of
+ * records still to follow in the reserved field.
+ */
+typedef struct {
+    int32_t product_id;
+    int32_t delta;
+    int32_t sale_id;
+    uint32_t reserved;
+    int64_t timestamp;
+} StockJournalRecord;
+
+static void apply_stock_delta(Product *p, int delta) {
+    p->stock += delta;
+    if (p->stock < 0) p->stock = 0;
+    reorder_update(p);
+}
+
+/* Applies every complete group in the journal; a torn trailing group is ignored. */
+int stock_journal_replay() {
+    FILE *f = fopen(STOCK_JOURNAL_FILE, "rb");
+    if (!f) return 0;
+    
+    StockJournalRecord group[MAX_BASKET_ITEMS];
+    StockJournalRecord rec;
+    int pending = 0, applied = 0;
+    
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (pending == MAX_BASKET_ITEMS) break;
+        group[pending++] = rec;
+        if (rec.reserved != 0) continue;
+        
+        for (int i = 0; i < pending; i++) {
+            Product *p = product_lookup(group[i].product_id);
+            if (p) {
+                apply_stock_delta(p, group[i].delta);
+                applied++;
+            }
+        }
+        pending = 0;
+    }
+    fclose(f);
+    return applied;
+}
+
+/* Completes or discards a fold of the journal or the WAL that was interrupted. */
+void recover_checkpoint() {
+    if (file_exists(STOCK_JOURNAL_FOLDED) || file_exists(WAL_FOLDED)) {
+        // The fold was interrupted after the old log was retired
+        if (file_exists(PRODUCTS_TMP_FILE)) {
+            remove(PRODUCTS_FILE);
+            rename(PRODUCTS_TMP_FILE, PRODUCTS_FILE);
+        }
+        remove(STOCK_JOURNAL_FOLDED);
+        retire_log(WAL_FOLDED);
+    } else if (file_exists(PRODUCTS_TMP_FILE)) {
+        // Partial temp file from a fold that never committed
+        remove(PRODUCTS_TMP_FILE);
+    }
+}
+
+/* Folds a journal left by an older build into products.csv and retires it. */
+int migrate_stock_journal() {
+    if (!file_exists(STOCK_JOURNAL_FILE)) return 1;
+    
+    stock_journal_replay();
+    if (!save_products()) return 0;
+    if (rename(STOCK_JOURNAL_FILE, STOCK_JOURNAL_FOLDED) != 0) {
+        remove(PRODUCTS_TMP_FILE);
+        return 0;
+    }
+    remove(PRODUCTS_FILE);
+    if (rename(PRODUCTS_TMP_FILE, PRODUCTS_FILE) != 0) {
+        // Leave the folded journal in place; recovery completes the swap
+        return 0;
+    }
+    remove(STOCK_JOURNAL_FOLDED);
+    return 1;
+}
+
+/* -------------------- Process Locking -------------------- */
+/*
+ * Several tills may share one data directory. Every mutation runs under an
+ * exclusive flock() on shop.lock; the lock nests within a thread so helpers
+ * can take it without knowing whether their caller already holds it. The
+ * flock is shared by the whole process, so a mutex keeps the till and its
+ * write-behind thread from holding it at the same time.
+ */
+static int shop_lock_fd = -1;
+static __thread int shop_lock_depth;
+static pthread_mutex_t shop_lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int shop_lock() {
+    if (shop_lock_depth > 0) {
+        shop_lock_depth++;
+        return 1;
+    }
+    int64_t start = metric_start();
+    pthread_mutex_lock(&shop_lock_mutex);
+    if (shop_lock_fd < 0) {
+        shop_lock_fd = open(SHOP_LOCK_FILE, O_RDWR | O_CREAT, 0644);
+        if (shop_lock_fd < 0) {
+            pthread_mutex_unlock(&shop_lock_mutex);
+            return 0;
+        }
+    }
+    while (flock(shop_lock_fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            pthread_mutex_unlock(&shop_lock_mutex);
+            return 0;
+        }
+    }
+    metric_stop(METRIC_LOCK_WAIT, start);
+    shop_lock_depth = 1;
+    return 1;
+}
+
+void shop_unlock() {
+    if (shop_lock_depth == 0) return;
+    if (--shop_lock_depth == 0) {
+        flock(shop_lock_fd, LOCK_UN);
+        pthread_mutex_unlock(&shop_lock_mutex);
+    }
+}
+
+/* -------------------- ID Sequences -------------------- */
+/*
+ * Record ids come from per-table sequences held in memory. Startup seeds each
+ * sequence from the data already loaded, so creating a record never rescans
+ * its file. Ids are handed out in blocks of ID_BLOCK_SIZE, and the end of the
+ * current block is persisted to id_sequences.csv before any id in it is used.
+ * The sequence resumes past that high-water mark after a restart or crash,
+ * so an id is never reused, even after the highest record is deleted.
+ *
+ * Marks are read and written under the process lock, so tills sharing the
+ * directory reserve disjoint blocks. A clean exit trims the mark back to the
+ * next free id when no other till has reserved past it; only a crash leaves a
+ * gap. A branch's sequences run inside its range (see Branches).
+ */
+enum { SEQ_USERS, SEQ_PRODUCTS, SEQ_CUSTOMERS, SEQ_SALES, SEQ_COUNT };
+
+static const char *sequence_names[SEQ_COUNT] = { "users", "products", "customers", "sales" };
+
+typedef struct {
+    int next;
+    int reserved;              /* first id beyond the persisted block */
+} IdSequence;
+
+static IdSequence id_sequences[SEQ_COUNT];
+
+static void read_id_marks(int *marks) {
+    for (int t = 0; t < SEQ_COUNT; t++) marks[t] = 0;
+    
+    FILE *f = fopen(ID_SEQUENCE_FILE, "r");
+    if (!f) return;
+    
+    char line[MAX_LINE];
+    CsvRecord rec;
+    while (fgets(line, sizeof(line), f)) {
+        if (!csv_split_line(line, &rec)) continue;
+        for (int t = 0; t < SEQ_COUNT; t++) {
+            if (csv_field_equals(csv_get(&rec, 0), sequence_names[t])) marks[t] = csv_int(&rec, 1);
+        }
+    }
+    fclose(f);
+}
+
+static int write_id_marks(const int *marks) {
+    FILE *tmp = fopen(ID_SEQUENCE_TMP_FILE, "w");
+    if (!tmp) return 0;
+    
+    for (int t = 0; t < SEQ_COUNT; t++) {
+        fprintf(tmp, "%s,%d\n", sequence_names[t], marks[t]);
+    }
+    
+    if (fflush(tmp) != 0 || fsync(fileno(tmp)) != 0) {
+        fclose(tmp);
+        remove(ID_SEQUENCE_TMP_FILE);
+        return 0;
+    }
+    if (fclose(tmp) != 0 || rename(ID_SEQUENCE_TMP_FILE, ID_SEQUENCE_FILE) != 0) {
+        remove(ID_SEQUENCE_TMP_FILE);
+        return 0;
+    }
+    return 1;
+}
+
+/* Seeds every sequence from floors[] (max id in use + 1) and the persisted marks. */
+int id_sequences_load(const int *floors) {
+    if (!shop_lock()) return 0;
+    
+    int marks[SEQ_COUNT];
+    read_id_marks(marks);
+    int base = shop_branch() * BRANCH_ID_SPAN;
+    for (int t = 0; t < SEQ_COUNT; t++) {
+        int next = floors[t] > 0 ? floors[t] : 1;
+        if (marks[t] > next) next = marks[t];
+        // Older ids are filed under base + id centrally, so new ones start past those
+        if (next < base) next += base;
+        id_sequences[t].next = next;
+        id_sequences[t].reserved = next;
+    }
+    shop_unlock();
+    return 1;
+}
+
+/* Releases the unused part of each block on a clean exit so ids stay contiguous. */
+int id_sequences_close() {
+    if (!shop_lock()) return 0;
+    
+    int marks[SEQ_COUNT];
+    read_id_marks(marks);
+    int changed = 0;
+    for (int t = 0; t < SEQ_COUNT; t++) {
+        if (marks[t] == id_sequences[t].reserved && marks[t] != id_sequences[t].next) {
+            marks[t] = id_sequences[t].next;
+            changed = 1;
+        }
+    }
+    int ok = !changed || write_id_marks(marks);
+    shop_unlock();
+    return ok;
+}
+
+/* The id the next call to id_sequence_take() will return. */
+int id_sequence_peek(int table) {
+    return id_sequences[table].next;
+}
+
+/* Takes count consecutive ids and returns the first. */
+int id_sequence_take(int table, int count) {
+    IdSequence *seq = &id_sequences[table];
+    if (seq->next + count > seq->reserved) {
+        int marks[SEQ_COUNT];
+        int locked = shop_lock();
+        read_id_marks(marks);
+        
+        // Another till may have reserved past our block
+        if (marks[table] > seq->next) seq->next = marks[table];
+        seq->reserved = seq->next + count + ID_BLOCK_SIZE;
+        marks[table] = seq->reserved;
+        
+        if (!locked || !write_id_marks(marks)) {
+            printf("Warning: Unable to save id sequences.\n");
+        }
+        if (locked) shop_unlock();
+    }
+    
+    int first = seq->next;
+    seq->next += count;
+    return first;
+}
+
+/* -------------------- Security Functions -------------------- */
+/*
+ * Passwords are stored as "pbkdf2-sha256$ITERATIONS$SALT$KEY": PBKDF2 over
+ * HMAC-SHA256 with a random 16-byte salt and a 32-byte key, both in hex.
+ * The count travels with the hash, so raising SHOP_PASSWORD_ITERATIONS
+ * leaves existing hashes valid until their owner next logs in. Rows still
+ * holding the 16-digit djb2 hash of earlier versions are accepted and
+ * upgraded the same way.
+ */
+#define PASSWORD_SCHEME "pbkdf2-sha256$"
+
+static int password_iterations() {
+    const char *env = getenv("SHOP_PASSWORD_ITERATIONS");
+    if (!env || !*env) return PASSWORD_ITERATIONS;
+    long n = atol(env);
+    if (n < PASSWORD_MIN_ITERATIONS) return PASSWORD_MIN_ITERATIONS;
+    return n > PASSWORD_MAX_ITERATIONS ? PASSWORD_MAX_ITERATIONS : (int)n;
+}
+
+/* Compares without an early exit, so the time taken says nothing about where a mismatch is. */
+static int constant_time_equal(const void *a, const void *b, size_t n) {
+    const unsigned char *x = a, *y = b;
+    volatile unsigned char diff = 0;
+    for (size_t i = 0; i < n; i++) diff |= x[i] ^ y[i];
+    return diff == 0;
+}
+
+static void hex_encode(const unsigned char *p, size_t n, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < n; i++) {
+        out[2 * i] = digits[p[i] >> 4];
+        out[2 * i + 1] = digits[p[i] & 15];
+    }
+    out[2 * n] = '\0';
+}
+
+static int hex_nibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+/* Reads exactly 2 * n lowercase hex digits; returns the end, or NULL. */
+static const char *hex_decode(const char *s, unsigned char *out, size_t n) {
+    for (size_t i = 0; i < n; i++, s += 2) {
+        int hi = hex_nibble(s[0]);
+        int lo = hi < 0 ? -1 : hex_nibble(s[1]);
+        if (lo < 0) return NULL;
+        out[i] = (unsigned char)(hi << 4 | lo);
+    }
+    return s;
+}
+
+static int random_bytes(void *buf, size_t n) {
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    char *p = buf;
+    while (n > 0) {
+        ssize_t got = read(fd, p, n);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        p += got;
+        n -= (size_t)got;
+    }
+    close(fd);
+    return n == 0;
+}
+
+/* Both halves of an HMAC with the key already absorbed. */
+typedef struct {
+    Sha256 inner;
+    Sha256 outer;
+} HmacSha256;
+
+static void hmac_sha256_init(HmacSha256 *h, const void *key, size_t len) {
+    unsigned char block[64] = { 0 };
+    unsigned char pad[64];
+    if (len > sizeof(block)) {
+        Sha256 c;
+        sha256_init(&c);
+        sha256_update(&c, key, len);
+        sha256_final(&c, block);
+    } else {
+        memcpy(block, key, len);
+    }
+    for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x36;
+    sha256_init(&h->inner);
+    sha256_update(&h->inner, pad, sizeof(pad));
+    for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x5c;
+    sha256_init(&h->outer);
+    sha256_update(&h->outer, pad, sizeof(pad));
+}
+
+/* out may alias data. Each call costs two compressions whatever the key. */
+static void hmac_sha256(const HmacSha256 *h, const void *data, size_t len, unsigned char out[32]) {
+    Sha256 c = h->inner;
+    sha256_update(&c, data, len);
+    sha256_final(&c, out);
+    c = h->outer;
+    sha256_update(&c, out, 32);
+    sha256_final(&c, out);
+}
+
+/* PBKDF2-HMAC-SHA256 (RFC 8018), one 32-byte block of output. */
+static void pbkdf2_sha256(const char *password, const unsigned char salt[PASSWORD_SALT_BYTES],
+                          int iterations, unsigned char key[32]) {
+    HmacSha256 h;
+    hmac_sha256_init(&h, password, strlen(password));
+    
+    unsigned char first[PASSWORD_SALT_BYTES + 4];
+    memcpy(first, salt, PASSWORD_SALT_BYTES);
+    memcpy(first + PASSWORD_SALT_BYTES, "\0\0\0\1", 4);
+    
+    unsigned char u[32];
+    hmac_sha256(&h, first, sizeof(first), u);
+    memcpy(key, u, sizeof(u));
+    for (int i = 1; i < iterations; i++) {
+        hmac_sha256(&h, u, sizeof(u), u);
+        for (int j = 0; j < 32; j++) key[j] ^= u[j];
+    }
+}
+
+/* Hashes a new password at the current cost; 0 if no salt could be drawn. */
+int hash_password(const char *password, char out[PASSWORD_HASH_LEN]) {
+    unsigned char salt[PASSWORD_SALT_BYTES], key[32];
+    if (!random_bytes(salt, sizeof(salt))) return 0;
+    
+    int iterations = password_iterations();
+    pbkdf2_sha256(password, salt, iterations, key);
+    
+    char salt_hex[2 * PASSWORD_SALT_BYTES + 1], key_hex[SHA256_HEX];
+    hex_encode(salt, sizeof(salt), salt_hex);
+    hex_encode(key, sizeof(key), key_hex);
+    snprintf(out, PASSWORD_HASH_LEN, "%s%d$%s$%s", PASSWORD_SCHEME, iterations, salt_hex, key_hex);
+    return 1;
+}
+
+/* Splits a stored hash; 0 if it is not in the PBKDF2 format. */
+static int parse_password_hash(const char *stored, int *iterations,
+                               unsigned char salt[PASSWORD_SALT_BYTES], unsigned char key[32]) {
+    size_t scheme = strlen(PASSWORD_SCHEME);
+    if (strncmp(stored, PASSWORD_SCHEME, scheme) != 0) return 0;
+    
+    char *end;
+    long n = strtol(stored + scheme, &end, 10);
+    if (end == stored + scheme || *end != '$' || n < 1 || n > PASSWORD_MAX_ITERATIONS) return 0;
+    const char *p = hex_decode(end + 1, salt, PASSWORD_SALT_BYTES);
+    if (!p || *p != '$') return 0;
+    p = hex_decode(p + 1, key, 32);
+    if (!p || *p != '\0') return 0;
+    *iterations = (int)n;
+    return 1;
+}
+
+/* The 64-bit djb2 digest earlier versions stored, as 16 hex digits. */
+static void legacy_password_hash(const char *input, char output[17]) {
+    const unsigned char *str = (const unsigned char*)input;
+    unsigned long hash = 5381;
+    int c;
+    
+    while ((c = *str++)) {
+        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    }
+    
+    snprintf(output, 17, "%016lx", hash);
+}
+
+/* Spends one hash at the current cost, for attempts that have nothing to check against. */
+void password_dummy_check(const char *password) {
+    static const unsigned char salt[PASSWORD_SALT_BYTES];
+    unsigned char key[32];
+    pbkdf2_sha256(password, salt, password_iterations(), key);
+}
+
+int verify_password(const char *input_password, const char *stored_hash) {
+    int iterations;
+    unsigned char salt[PASSWORD_SALT_BYTES], key[32], computed[32];
+    if (parse_password_hash(stored_hash, &iterations, salt, key)) {
+        pbkdf2_sha256(input_password, salt, iterations, computed);
+        return constant_time_equal(computed, key, sizeof(key));
+    }
+    
+    // A legacy row costs as much as a current one, so timing does not single it out
+    password_dummy_check(input_password);
+    char legacy[17];
+    legacy_password_hash(input_password, legacy);
+    return strlen(stored_hash) == 16 && constant_time_equal(legacy, stored_hash, 16);
+}
+
+/* True for legacy hashes and for ones made with fewer rounds than are now configured. */
+int password_needs_rehash(const char *stored_hash) {
+    int iterations;
+    unsigned char salt[PASSWORD_SALT_BYTES], key[32];
+    return !parse_password_hash(stored_hash, &iterations, salt, key) || iterations < password_iterations();
+}
+
+/* -------------------- User Records -------------------- */
+/* users.csv columns 3 to 8, in order; each holds one of these bits as 0 or 1. */
+static const struct {
+    uint32_t bit;
+    const char *column;        /* heading in the user list */
+    const char *title;         /* label when editing a user */
+    const char *prompt;
+} user_flags[] = {
+    { USER_PERM_PRODUCTS, "Products", "Manage Products", "Can manage products? " },
+    { USER_PERM_CUSTOMERS, "Customers", "Manage Customers", "Can manage customers? " },
+    { USER_PERM_SALES, "Sales", "Manage Sales", "Can manage sales? " },
+    { USER_PERM_REPORTS, "Reports", "View Reports", "Can view reports? " },
+    { USER_PERM_USERS, "Users", "Manage Users", "Can manage users? " },
+    { USER_ACTIVE, "Active", "Active", "Is active? " }
+};
+
+#define USER_FLAG_COUNT ((int)(sizeof(user_flags) / sizeof(user_flags[0])))
+#define USER_ALL_PERMISSIONS (USER_PERM_PRODUCTS | USER_PERM_CUSTOMERS | USER_PERM_SALES | \
+                              USER_PERM_REPORTS | USER_PERM_USERS)
+
+void parse_user_record(const CsvRecord *rec, User *u) {
+    u->id = csv_int(rec, 0);
+    csv_string(rec, 1, u->username, sizeof(u->username));
+    csv_string(rec, 2, u->password_hash, sizeof(u->password_hash));
+    u->permissions = 0;
+    for (int i = 0; i < USER_FLAG_COUNT; i++) {
+        if (csv_int(rec, 3 + i)) u->permissions |= user_flags[i].bit;
+    }
+}
+
+void write_user_row(FILE *f, const User *u) {
+    fprintf(f, "%d,%s,%s", u->id, u->username, u->password_hash);
+    for (int i = 0; i < USER_FLAG_COUNT; i++) {
+        fprintf(f, ",%d", (u->permissions & user_flags[i].bit) ? 1 : 0);
+    }
+    fputc('\n', f);
+}
+
+int next_id_from_file(const char *file) {
+    if (!file_exists(file)) return 1;
+    
+    FILE *f = fopen(file, "r");
+    if (!f) return 1;
+    
+    char line[MAX_LINE];
+    CsvRecord rec;
+    int maxid = 0;
+    
+    while (fgets(line, sizeof(line), f)) {
+        if (csv_split_line(line, &rec)) {
+            int id = csv_int(&rec, 0);
+            if (id > maxid) maxid = id;
+        }
+    }
+    fclose(f);
+    return maxid + 1;
+}
+
+/*
+ * users.csv held in memory in file order, with an open-addressed index
+ * from username to row. It is loaded with the catalog and kept current
+ * by the write-ahead log, so logins and lookups never read the file.
+ */
+typedef struct {
+    User *rows;
+    int count;
+    int capacity;
+    int max_id;
+    int *slots;                /* row + 1, 0 when empty */
+    size_t slot_mask;
+} UserTable;
+
+static UserTable user_table;
+
+static size_t username_slot(const char *username) {
+    return (size_t)hash_bytes(username, strlen(username)) & user_table.slot_mask;
+}
+
+/* Rebuilds the username index; the table is small enough that every change does this. */
+static int user_table_reindex() {
+    size_t slots = 16;
+    while (slots < (size_t)user_table.count * 2) slots *= 2;
+    int *grown = calloc(slots, sizeof(*grown));
+    if (!grown) return 0;
+    free(user_table.slots);
+    user_table.slots = grown;
+    user_table.slot_mask = slots - 1;
+    
+    for (int i = 0; i < user_table.count; i++) {
+        size_t h = username_slot(user_table.rows[i].username);
+        while (user_table.slots[h]) h = (h + 1) & user_table.slot_mask;
+        user_table.slots[h] = i + 1;
+    }
+    return 1;
+}
+
+User *user_lookup(const char *username) {
+    if (!user_table.slots) return NULL;
+    for (size_t h = username_slot(username); user_table.slots[h]; h = (h + 1) & user_table.slot_mask) {
+        User *u = &user_table.rows[user_table.slots[h] - 1];
+        if (strcmp(u->username, username) == 0) return u;
+    }
+    return NULL;
+}
+
+User *user_lookup_id(int id) {
+    for (int i = 0; i < user_table.count; i++) {
+        if (user_table.rows[i].id == id) return &user_table.rows[i];
+    }
+    return NULL;
+}
+
+static int user_table_add(const User *u) {
+    if (user_table.count == user_table.capacity) {
+        int capacity = user_table.capacity ? user_table.capacity * 2 : 16;
+        User *grown = realloc(user_table.rows, (size_t)capacity * sizeof(*grown));
+        if (!grown) return 0;
+        user_table.rows = grown;
+        user_table.capacity = capacity;
+    }
+    user_table.rows[user_table.count++] = *u;
+    if (u->id > user_table.max_id) user_table.max_id = u->id;
+    return user_table_reindex();
+}
+
+void user_table_free() {
+    free(user_table.rows);
+    free(user_table.slots);
+    memset(&user_table, 0, sizeof(user_table));
+}
+
+/* Writes users.csv with the admin/admin account when there is none yet. */
+static int ensure_default_user() {
+    if (file_exists(USERS_FILE)) return 1;
+    
+    User admin;
+    memset(&admin, 0, sizeof(admin));
+    admin.id = 1;
+    strcpy(admin.username, "admin");
+    if (!hash_password("admin", admin.password_hash)) return 0;
+    admin.permissions = USER_ALL_PERMISSIONS | USER_ACTIVE;
+    
+    FILE *f = fopen(USERS_FILE, "w");
+    if (!f) return 0;
+    write_user_row(f, &admin);
+    return fclose(f) == 0;
+}
+
+int load_users() {
+    if (!ensure_default_user()) return 0;
+    FILE *f = fopen(USERS_FILE, "r");
+    if (!f) return 0;
+    
+    char line[MAX_LINE];
+    CsvRecord rec;
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), f)) {
+        User u;
+        if (!csv_split_line(line, &rec)) continue;
+        parse_user_record(&rec, &u);
+        ok = user_table_add(&u);
+    }
+    fclose(f);
+    return ok && user_table_reindex();
+}
+
+/* Looks a user up by id (when id > 0) or else by username. */
+int find_user(int id, const char *username, User *out) {
+    const User *u = id > 0 ? user_lookup_id(id) : user_lookup(username);
+    if (u && out) *out = *u;
+    return u != NULL;
+}
+
+/*
+ * A change to one user row. Changes name only the fields they touch, so two
+ * tills editing the same user (say, permissions and password) do not
+ * overwrite each other, and applying a change twice has no further effect.
+ */
+enum { USER_ADD, USER_DELETE, USER_SET_PERMISSIONS, USER_SET_PASSWORD };
+
+typedef struct {
+    int32_t op;
+    User user;
+} UserChange;
+
+/* Rewrites users.csv with one change applied. */
+int apply_user_change(const UserChange *change) {
+    FILE *f = fopen(USERS_FILE, "r");
+    FILE *tmp = fopen(USERS_TMP_FILE, "w");
+    if (!tmp) {
+        if (f) fclose(f);
+        return 0;
+    }
+    
+    const User *c = &change->user;
+    int found = 0;
+    if (f) {
+        char line[MAX_LINE];
+        CsvRecord rec;
+        while (fgets(line, sizeof(line), f)) {
+            User u;
+            if (!csv_split_line(line, &rec)) continue;
+            parse_user_record(&rec, &u);
+            
+            if (u.id == c->id) {
+                found = 1;
+                if (change->op == USER_DELETE) continue;
+                if (change->op == USER_SET_PASSWORD) strcpy(u.password_hash, c->password_hash);
+                if (change->op == USER_SET_PERMISSIONS) u.permissions = c->permissions;
+            }
+            write_user_row(tmp, &u);
+        }
+        fclose(f);
+    }
+    if (!found && change->op == USER_ADD) write_user_row(tmp, c);
+    
+    if (fflush(tmp) != 0 || fsync(fileno(tmp)) != 0) {
+        fclose(tmp);
+        remove(USERS_TMP_FILE);
+        return 0;
+    }
+    if (fclose(tmp) != 0 || rename(USERS_TMP_FILE, USERS_FILE) != 0) {
+        remove(USERS_TMP_FILE);
+        return 0;
+    }
+    return 1;
+}
+
+/* The same change applied to the user table; 0 if out of memory. */
+int user_table_apply(const UserChange *change) {
+    const User *c = &change->user;
+    User *u = user_lookup_id(c->id);
+    if (change->op == USER_ADD) return u || user_table_add(c);
+    if (!u) return 1;
+    
+    if (change->op == USER_SET_PASSWORD) strcpy(u->password_hash, c->password_hash);
+    if (change->op == USER_SET_PERMISSIONS) u->permissions = c->permissions;
+    if (change->op == USER_DELETE) {
+        int row = (int)(u - user_table.rows);
+        memmove(u, u + 1, (size_t)(user_table.count - row - 1) * sizeof(*u));
+        user_table.count--;
+        return user_table_reindex();
+    }
+    return 1;
+}
+
+/* -------------------- Sales Records -------------------- */
+typedef struct {
+    Money revenue;
+    Money cost;
+    long units;
+    long transactions;
+} SalesTotals;
+
+static void totals_add(SalesTotals *t, const SalesTotals *x) {
+    t->revenue += x->revenue;
+    t->cost += x->cost;
+    t->units += x->units;
+    t->transactions += x->transactions;
+}
+
+/*
+ * Username of a cashier id, or "#id" once the user is gone. Usernames never
+ * change and ids are never reused, so the last answer is kept: a basket
+ * asks for the same cashier on every line.
+ */
+void cashier_name(int user_id, char *out, size_t size) {
+    static int cached_id;
+    static char cached[50];
+    
+    if (user_id <= 0) {
+        snprintf(out, size, "%s", "");
+        return;
+    }
+    if (user_id != cached_id) {
+        User u;
+        if (!find_user(user_id, NULL, &u)) {
+            snprintf(out, size, "#%d", user_id);
+            return;
+        }
+        snprintf(cached, sizeof(cached), "%s", u.username);
+        cached_id = user_id;
+    }
+    snprintf(out, size, "%s", cached);
+}
+
+/*
+ * Reads a sales.csv row. Rows name their cashier rather than carry an id
+ * (older rows hold whatever was typed at the till), so the name is copied
+ * to cashier and s->cashier_id is left 0.
+ */
+void parse_sale_record(const CsvRecord *rec, Sale *s, char *cashier, size_t size) {
+    char date[64];
+    s->id = csv_int(rec, 0);
+    s->product_id = csv_int(rec, 1);
+    s->customer_id = csv_int(rec, 2);
+    s->quantity = csv_int(rec, 3);
+    s->total_price = csv_money(rec, 4);
+    csv_string(rec, 5, date, sizeof(date));
+    s->date = parse_datetime(date);
+    s->cashier_id = 0;
+    csv_string(rec, 6, cashier, size);
+}
+
+/* Writes a sales.csv row with the date and cashier already spelled out. */
+void write_sale_fields(FILE *f, const Sale *s, const char *date, const char *cashier) {
+    char total[MONEY_TEXT];
+    fprintf(f, "%d,%d,%d,%d,%s,", s->id, s->product_id, s->customer_id, s->quantity,
+            format_money(s->total_price, total, sizeof(total)));
+    csv_write_quoted(f, date);
+    fputc(',', f);
+    csv_write_quoted(f, cashier);
+    fputc('\n', f);
+}
+
+void write_sale_row(FILE *f, const Sale *s) {
+    char date[32], cashier[50];
+    format_datetime(s->date, date, sizeof(date));
+    cashier_name(s->cashier_id, cashier, sizeof(cashier));
+    write_sale_fields(f, s, date, cashier);
+}
+
+/* -------------------- Sales Archive -------------------- */
+/*
+ * Cold storage for old sales. Archiving moves the leading rows of
+ * sales.csv dated before a cutoff into sales_archive.dat as LZ-compressed
+ * blocks of about ARCHIVE_BLOCK_BYTES of CSV text, each ending on a row
+ * boundary, and leaves sales.csv with the rest. sales_archive.idx lists
+ * every block with its offset, id range, day range and checksum, so a
+ * report decompresses only the blocks its dates touch and reads their
+ * rows as if they were still at the front of sales.csv.
+ *
+ * The data file is only ever appended to. A run appends its blocks, syncs
+ * them, and commits by renaming a new index into place; bytes past the
+ * size the index records are a run that never committed, and the next run
+ * cuts them off. sales.csv is rewritten after the commit. If that step is
+ * interrupted, the archived rows are still at the front of sales.csv and
+ * sales_archive_recover() drops them. The index names the sales.csv the
+ * run read (device, inode) and the length and hash of the text it moved,
+ * since ids alone do not mark the spot: tills take ids in blocks, and on
+ * the central node branches interleave. Version 1 indexes, without those,
+ * are recovered by id.
+ */
+#define SALES_ARCHIVE_MAGIC 0x43524153u /* "SARC" */
+#define SALES_ARCHIVE_VERSION 2
+#define ARCHIVE_BLOCK_BYTES (256u << 10)
+
+typedef struct {
+    uint64_t offset;           /* in sales_archive.dat */
+    uint32_t stored_len;
+    uint32_t raw_len;
+    uint64_t checksum;         /* hash_bytes of the stored bytes */
+    int32_t first_id;
+    int32_t last_id;
+    int32_t day_from;          /* yyyymmdd range of the block's rows */
+    int32_t day_to;
+    int32_t rows;
+    int32_t reserved;
+} ArchiveBlock;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t data_size;        /* bytes of sales_archive.dat the blocks cover */
+    int32_t block_count;
+    int32_t cutoff;            /* latest day archived before */
+    int32_t last_id;           /* of the last row archived */
+    int32_t max_id;            /* from version 2 */
+    int64_t rows;
+    Money revenue;
+    uint64_t run_dev;          /* sales.csv the last run moved rows out of */
+    uint64_t run_ino;
+    uint64_t run_bytes;        /* the text it moved */
+    uint64_t run_hash;
+} ArchiveHeader;
+
+#define ARCHIVE_HEADER_V1 offsetof(ArchiveHeader, run_dev)
+
+typedef struct {
+    ArchiveHeader h;
+    ArchiveBlock *blocks;
+    int capacity;
+    uint64_t dev;              /* sales_archive.idx as last read; ino 0 = none */
+    uint64_t ino;
+    int64_t mtime_ns;
+    int64_t size;
+} SalesArchive;
+
+static SalesArchive sales_archive;
+
+void sales_archive_clear() {
+    free(sales_archive.blocks);
+    memset(&sales_archive, 0, sizeof(sales_archive));
+}
+
+/* Reads sales_archive.idx again if it has been replaced since the last read. */
+int sales_archive_refresh() {
+    SalesArchive *a = &sales_archive;
+    struct stat st;
+    if (stat(SALES_ARCHIVE_INDEX_FILE, &st) != 0) {
+        if (errno != ENOENT) return 0;
+        sales_archive_clear();
+        return 1;
+    }
+    int64_t mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    if (a->ino == (uint64_t)st.st_ino && a->dev == (uint64_t)st.st_dev && a->mtime_ns == mtime_ns &&
+        a->size == (int64_t)st.st_size) {
+        return 1;
+    }
+    
+    sales_archive_clear();
+    FILE *f = fopen(SALES_ARCHIVE_INDEX_FILE, "rb");
+    if (!f) return 0;
+    ArchiveHeader h;
+    memset(&h, 0, sizeof(h));
+    int ok = fread(&h, ARCHIVE_HEADER_V1, 1, f) == 1 && h.magic == SALES_ARCHIVE_MAGIC && h.block_count >= 0 &&
+             (h.version == 1 || (h.version == SALES_ARCHIVE_VERSION &&
+                                 fread((char *)&h + ARCHIVE_HEADER_V1, sizeof(h) - ARCHIVE_HEADER_V1, 1, f) == 1));
+    if (ok && h.version == 1) h.max_id = h.last_id;
+    if (ok && h.block_count > 0) {
+        a->blocks = malloc((size_t)h.block_count * sizeof(ArchiveBlock));
+        ok = a->blocks && fread(a->blocks, sizeof(ArchiveBlock), (size_t)h.block_count, f) == (size_t)h.block_count;
+    }
+    fclose(f);
+    if (!ok) {
+        sales_archive_clear();
+        return 0;
+    }
+    a->h = h;
+    a->capacity = h.block_count;
+    a->dev = (uint64_t)st.st_dev;
+    a->ino = (uint64_t)st.st_ino;
+    a->mtime_ns = mtime_ns;
+    a->size = (int64_t)st.st_size;
+    return 1;
+}
+
+/*
+ * Calls fn over the CSV text of every block holding a day in
+ * [day_from, day_to] (0 = unbounded), oldest first, with the given partial
+ * and ctx. Each block is checked against its checksum before it is read.
+ */
+int archive_scan(int day_from, int day_to, ChunkScanFn fn, void *partial, void *ctx) {
+    if (!sales_archive_refresh()) return 0;
+    const SalesArchive *a = &sales_archive;
+    if (a->h.block_count == 0) return 1;
+    
+    MappedFile map;
+    if (!map_file(SALES_ARCHIVE_FILE, &map)) return 0;
+    unsigned char *buf = NULL;
+    size_t capacity = 0;
+    int ok = 1;
+    for (int i = 0; ok && i < a->h.block_count; i++) {
+        const ArchiveBlock *b = &a->blocks[i];
+        if ((day_from && b->day_to < day_from) || (day_to && b->day_from > day_to)) continue;
+        if (b->offset > map.size || b->stored_len > map.size - b->offset) {
+            ok = 0;
+            break;
+        }
+        if (b->raw_len > capacity) {
+            unsigned char *grown = realloc(buf, b->raw_len);
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            buf = grown;
+            capacity = b->raw_len;
+        }
+        const char *stored = map.data + b->offset;
+        ok = hash_bytes(stored, b->stored_len) == b->checksum &&
+             lz_decompress((const unsigned char *)stored, b->stored_len, buf, b->raw_len) == (long)b->raw_len;
+        if (ok) fn((const char *)buf, (const char *)buf + b->raw_len, partial, ctx);
+        metric_count(COUNTER_ARCHIVE_BLOCKS, 1);
+    }
+    free(buf);
+    unmap_file(&map);
+    return ok;
+}
+
+/* Replaces sales.csv with the rows in [from, end). */
+static int rewrite_sales_file(const char *from, const char *end) {
+    FILE *tmp = fopen(SALES_TMP_FILE, "w");
+    if (!tmp) return 0;
+    int ok = (from == end || fwrite(from, 1, (size_t)(end - from), tmp) == (size_t)(end - from)) &&
+             fflush(tmp) == 0 && fsync(fileno(tmp)) == 0;
+    if (fclose(tmp) != 0) ok = 0;
+    if (ok && rename(SALES_TMP_FILE, SALES_FILE) != 0) ok = 0;
+    if (!ok) remove(SALES_TMP_FILE);
+    return ok;
+}
+
+/* Finishes a run that committed but did not get to rewrite sales.csv. Must hold the lock. */
+int sales_archive_recover() {
+    if (!sales_archive_refresh()) return 0;
+    const ArchiveHeader *h = &sales_archive.h;
+    struct stat st;
+    if (h->rows == 0 || stat(SALES_FILE, &st) != 0) return 1;
+    // A rewritten sales.csv is a new file; only the one the run read can still hold its rows
+    if (h->version != 1 && ((uint64_t)st.st_dev != h->run_dev || (uint64_t)st.st_ino != h->run_ino ||
+                            (uint64_t)st.st_size < h->run_bytes)) {
+        return 1;
+    }
+    
+    MappedFile map;
+    if (!map_file(SALES_FILE, &map)) return 0;
+    const char *p = map.data, *end = map.data + map.size;
+    if (h->version != 1) {
+        if (hash_bytes(map.data, h->run_bytes) == h->run_hash) p += h->run_bytes;
+    } else {
+        CsvRecord rec;
+        while (p < end) {
+            const char *next = csv_split(p, end, &rec);
+            if (rec.count > 0 && rec.fields[0].len > 0 && csv_int(&rec, 0) > h->last_id) break;
+            p = next;
+        }
+    }
+    int ok = p == map.data || rewrite_sales_file(p, end);
+    unmap_file(&map);
+    return ok;
+}
+
+static int write_archive_index(const ArchiveHeader *h, const ArchiveBlock *blocks) {
+    FILE *tmp = fopen(SALES_ARCHIVE_TMP_FILE, "wb");
+    if (!tmp) return 0;
+    int ok = fwrite(h, sizeof(*h), 1, tmp) == 1 &&
+             fwrite(blocks, sizeof(ArchiveBlock), (size_t)h->block_count, tmp) == (size_t)h->block_count &&
+             fflush(tmp) == 0 && fsync(fileno(tmp)) == 0;
+    if (fclose(tmp) != 0) ok = 0;
+    if (ok && rename(SALES_ARCHIVE_TMP_FILE, SALES_ARCHIVE_INDEX_FILE) != 0) ok = 0;
+    if (!ok) remove(SALES_ARCHIVE_TMP_FILE);
+    return ok;
+}
+
+/*
+ * Compresses the rows in [p, end) dated before cutoff, up to the first row
+ * that is not, onto the data file and adds their blocks to the archive in
+ * memory. A row whose date does not parse also ends the run, and its id
+ * goes to *undated_id. Returns where the rows that stay begin, or NULL on
+ * failure.
+ */
+static const char *archive_write_blocks(int fd, const char *p, const char *end, int cutoff, int *undated_id) {
+    SalesArchive *a = &sales_archive;
+    unsigned char *packed = NULL;
+    size_t packed_capacity = 0;
+    int done = 0, ok = 1;
+    
+    while (ok && !done && p < end) {
+        const char *start = p;
+        ArchiveBlock b;
+        memset(&b, 0, sizeof(b));
+        Money revenue = 0;
+        CsvRecord rec;
+        while (p < end && (size_t)(p - start) < ARCHIVE_BLOCK_BYTES) {
+            const char *next = csv_split(p, end, &rec);
+            if (rec.count > 0 && rec.fields[0].len > 0) {
+                int day = field_day_key(csv_get(&rec, 5));
+                if (day == 0 || day >= cutoff) {
+                    if (day == 0) *undated_id = csv_int(&rec, 0);
+                    done = 1;
+                    break;
+                }
+                int id = csv_int(&rec, 0);
+                if (b.rows++ == 0) {
+                    b.first_id = id;
+                    b.day_from = b.day_to = day;
+                }
+                b.last_id = id;
+                if (id > a->h.max_id) a->h.max_id = id;
+                if (day < b.day_from) b.day_from = day;
+                if (day > b.day_to) b.day_to = day;
+                revenue += csv_money(&rec, 4);
+            }
+            p = next;
+        }
+        if (b.rows == 0) break;
+        
+        size_t raw_len = (size_t)(p - start);
+        if (lz_bound(raw_len) > packed_capacity) {
+            unsigned char *grown = realloc(packed, lz_bound(raw_len));
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            packed = grown;
+            packed_capacity = lz_bound(raw_len);
+        }
+        size_t stored = lz_compress((const unsigned char *)start, raw_len, packed);
+        b.offset = a->h.data_size;
+        b.stored_len = (uint32_t)stored;
+        b.raw_len = (uint32_t)raw_len;
+        b.checksum = hash_bytes((const char *)packed, stored);
+        if (!full_pwrite(fd, packed, stored, (off_t)b.offset) ||
+            (a->h.block_count == a->capacity && !grow_rows((void **)&a->blocks, &a->capacity, sizeof(ArchiveBlock)))) {
+            ok = 0;
+            break;
+        }
+        a->blocks[a->h.block_count++] = b;
+        a->h.data_size += stored;
+        a->h.rows += b.rows;
+        a->h.revenue += revenue;
+        a->h.last_id = b.last_id;
+    }
+    free(packed);
+    return ok ? p : NULL;
+}
+
+/*
+ * Moves the leading rows of sales.csv dated before cutoff (yyyymmdd) into
+ * the archive and rewrites sales.csv without them. Must hold the lock.
+ * Returns the number of rows moved, or -1 on failure. *undated_id is the
+ * sale whose unreadable date stopped the run early, or 0.
+ */
+long sales_archive_append(int cutoff, int *undated_id) {
+    *undated_id = 0;
+    if (!sales_archive_recover()) return -1;
+    MappedFile map = { NULL, 0 };
+    if (file_exists(SALES_FILE) && !map_file(SALES_FILE, &map)) return -1;
+    
+    SalesArchive *a = &sales_archive;
+    a->h.magic = SALES_ARCHIVE_MAGIC;
+    a->h.version = SALES_ARCHIVE_VERSION;
+    int64_t rows_before = a->h.rows;
+    int fd = open(SALES_ARCHIVE_FILE, O_WRONLY | O_CREAT, 0644);
+    // Anything past the committed size is a run that never committed
+    int ok = fd >= 0 && ftruncate(fd, (off_t)a->h.data_size) == 0;
+    const char *rest = ok ? archive_write_blocks(fd, map.data, map.data + map.size, cutoff, undated_id) : NULL;
+    long moved = (long)(a->h.rows - rows_before);
+    ok = rest != NULL && (moved == 0 || fdatasync(fd) == 0);
+    if (fd >= 0 && close(fd) != 0) ok = 0;
+    
+    struct stat st;
+    if (ok && moved > 0 && stat(SALES_FILE, &st) != 0) ok = 0;
+    if (ok && moved > 0) {
+        if (cutoff > a->h.cutoff) a->h.cutoff = cutoff;
+        a->h.run_dev = (uint64_t)st.st_dev;
+        a->h.run_ino = (uint64_t)st.st_ino;
+        a->h.run_bytes = (uint64_t)(rest - map.data);
+        a->h.run_hash = hash_bytes(map.data, a->h.run_bytes);
+        ok = write_archive_index(&a->h, a->blocks) && rewrite_sales_file(rest, map.data + map.size);
+    }
+    unmap_file(&map);
+    // Read back whatever the index now says, committed or not
+    sales_archive_clear();
+    if (!sales_archive_refresh()) ok = 0;
+    return ok ? moved : -1;
+}
+
+/* -------------------- Columnar Sales Store -------------------- */
+/*
+ * Optional binary copy of the sales table under sales_store/, one
+ * directory per calendar month (sales_store/YYYY-MM/). Every column is a
+ * flat array of fixed-width values in its own file, and the cashier
+ * column holds codes into the partition's cashier.dict (one name per
+ * line). Reports map only the columns and months they need.
+ *
+ * The store is enabled once sales_store/FORMAT exists (created by the
+ * import command). make_sale then appends to it as well as to sales.csv,
+ * which stays the interchange format.
+ */
+enum {
+    COL_ID,
+    COL_PRODUCT_ID,
+    COL_CUSTOMER_ID,
+    COL_QUANTITY,
+    COL_TOTAL_PRICE,
+    COL_DATE,
+    COL_CASHIER,
+    COL_COUNT
+};
+
+#define COLMASK(c) (1u << (c))
+#define COLMASK_ALL ((1u << COL_COUNT) - 1)
+#define MAX_CASHIER_CODES 65536
+
+static const char *column_files[COL_COUNT] = {
+    "id.col", "product_id.col", "customer_id.col", "quantity.col",
+    "total_price.col", "date.col", "cashier.col"
+};
+static const size_t column_widths[COL_COUNT] = { 4, 4, 4, 4, 8, 8, 4 };
+
+typedef struct {
+    int month;                 /* yyyymm */
+    size_t rows;
+    const int32_t *id;
+    const int32_t *product_id;
+    const int32_t *customer_id;
+    const int32_t *quantity;
+    const Money *total_price;
+    const int64_t *date;
+    const uint32_t *cashier;
+    const char **cashier_names; /* interned */
+    int cashier_count;
+    MappedFile maps[COL_COUNT];
+} SalesPartition;
+
+typedef void (*PartitionFn)(const SalesPartition *part, void *ctx);
+
+/* Appends rows to one month partition at a time, keeping its files open. */
+typedef struct {
+    int month;
+    FILE *files[COL_COUNT];
+    FILE *dict_file;
+    const char **cashier_names; /* interned, in report_arena */
+    int cashier_count;
+    int cashier_capacity;
+} ColstoreWriter;
+
+int colstore_enabled() {
+    return file_exists(SALES_STORE_FORMAT);
+}
+
+static void partition_path(char *buf, size_t size, int month, const char *file) {
+    snprintf(buf, size, "%s/%04d-%02d/%s", SALES_STORE_DIR, month / 100, month % 100, file);
+}
+
+/*
+ * Reads a partition's cashier dictionary into an array of interned names
+ * taken from report_arena, with room for at least one more entry.
+ */
+static int load_cashier_dict(int month, const char ***names_out, int *count_out, int *capacity_out) {
+    char path[256];
+    partition_path(path, sizeof(path), month, "cashier.dict");
+    *names_out = NULL;
+    *count_out = 0;
+    
+    MappedFile map = { NULL, 0 };
+    if (file_exists(path) && !map_file(path, &map)) return 0;
+    
+    const char *end = map.data + map.size;
+    int lines = 0;
+    for (const char *p = map.data; p < end; p = scan_newline(p, end) + 1) lines++;
+    
+    int capacity = lines < 16 ? 16 : lines + 1;
+    const char **names = arena_alloc(&report_arena, (size_t)capacity * sizeof(char *));
+    if (!names) {
+        unmap_file(&map);
+        return 0;
+    }
+    for (const char *p = map.data; p < end; ) {
+        const char *eol = scan_newline(p, end);
+        size_t n = (size_t)(eol - p);
+        if (n > 0 && p[n - 1] == '\r') n--;
+        names[(*count_out)++] = string_pool_intern(&interned, p, n);
+        if (!names[*count_out - 1]) {
+            unmap_file(&map);
+            return 0;
+        }
+        p = eol + 1;
+    }
+    unmap_file(&map);
+    *names_out = names;
+    if (capacity_out) *capacity_out = capacity;
+    return 1;
+}
+
+void colstore_writer_close(ColstoreWriter *w) {
+    for (int c = 0; c < COL_COUNT; c++) {
+        if (w->files[c]) fclose(w->files[c]);
+        w->files[c] = NULL;
+    }
+    if (w->dict_file) fclose(w->dict_file);
+    w->dict_file = NULL;
+    w->cashier_names = NULL;
+    w->cashier_count = 0;
+    w->cashier_capacity = 0;
+    w->month = 0;
+}
+
+/* Length-aligns the partition's columns after a torn append, then opens them. */
+static int colstore_writer_open(ColstoreWriter *w, int month) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%04d-%02d", SALES_STORE_DIR, month / 100, month % 100);
+    if (!make_dir(SALES_STORE_DIR) || !make_dir(path)) return 0;
+    
+    off_t rows = -1;
+    for (int c = 0; c < COL_COUNT; c++) {
+        struct stat st;
+        partition_path(path, sizeof(path), month, column_files[c]);
+        off_t n = stat(path, &st) == 0 ? st.st_size / (off_t)column_widths[c] : 0;
+        if (rows < 0 || n < rows) rows = n;
+    }
+    for (int c = 0; c < COL_COUNT; c++) {
+        partition_path(path, sizeof(path), month, column_files[c]);
+        if (file_exists(path) && truncate(path, rows * (off_t)column_widths[c]) != 0) return 0;
+        w->files[c] = fopen(path, "ab");
+        if (!w->files[c]) {
+            colstore_writer_close(w);
+            return 0;
+        }
+    }
+    
+    if (!load_cashier_dict(month, &w->cashier_names, &w->cashier_count, &w->cashier_capacity)) {
+        colstore_writer_close(w);
+        return 0;
+    }
+    partition_path(path, sizeof(path), month, "cashier.dict");
+    w->dict_file = fopen(path, "a");
+    if (!w->dict_file) {
+        colstore_writer_close(w);
+        return 0;
+    }
+    w->month = month;
+    return 1;
+}
+
+static int cashier_code(ColstoreWriter *w, const char *name, uint32_t *code) {
+    const char *key = string_pool_intern(&interned, name, strlen(name));
+    if (!key) return 0;
+    for (int i = 0; i < w->cashier_count; i++) {
+        if (w->cashier_names[i] == key) {
+            *code = (uint32_t)i;
+            return 1;
+        }
+    }
+    if (w->cashier_count >= MAX_CASHIER_CODES) return 0;
+    
+    if (w->cashier_count == w->cashier_capacity) {
+        int capacity = w->cashier_capacity * 2;
+        const char **grown = arena_alloc(&report_arena, (size_t)capacity * sizeof(char *));
+        if (!grown) return 0;
+        memcpy(grown, w->cashier_names, (size_t)w->cashier_count * sizeof(char *));
+        w->cashier_names = grown;
+        w->cashier_capacity = capacity;
+    }
+    w->cashier_names[w->cashier_count] = key;
+    fprintf(w->dict_file, "%s\n", name);
+    fflush(w->dict_file);
+    *code = (uint32_t)w->cashier_count++;
+    return 1;
+}
+
+int colstore_writer_add(ColstoreWriter *w, const Sale *s, const char *cashier) {
+    int64_t date = s->date;
+    if (date < 0) return 0;
+    
+    int month = epoch_month(date);
+    if (month != w->month) {
+        colstore_writer_close(w);
+        if (!colstore_writer_open(w, month)) return 0;
+    }
+    
+    uint32_t code;
+    if (!cashier_code(w, cashier, &code)) return 0;
+    
+    int32_t id = s->id, product_id = s->product_id, customer_id = s->customer_id, quantity = s->quantity;
+    Money total = s->total_price;
+    const void *values[COL_COUNT] = { &id, &product_id, &customer_id, &quantity, &total, &date, &code };
+    for (int c = 0; c < COL_COUNT; c++) {
+        if (fwrite(values[c], column_widths[c], 1, w->files[c]) != 1) return 0;
+    }
+    return 1;
+}
+
+int colstore_writer_flush(ColstoreWriter *w) {
+    int ok = 1;
+    for (int c = 0; c < COL_COUNT; c++) {
+        if (w->files[c] && fflush(w->files[c]) != 0) ok = 0;
+    }
+    return ok;
+}
+
+/* Appends committed sales when the store is enabled; a no-op otherwise. */
+int colstore_append(const Sale *sales, int count) {
+    if (!colstore_enabled()) return 1;
+    
+    ColstoreWriter w;
+    memset(&w, 0, sizeof(w));
+    size_t mark = arena_mark(&report_arena);
+    int ok = 1;
+    for (int i = 0; i < count && ok; i++) {
+        char cashier[50];
+        cashier_name(sales[i].cashier_id, cashier, sizeof(cashier));
+        ok = colstore_writer_add(&w, &sales[i], cashier);
+    }
+    ok = ok && colstore_writer_flush(&w);
+    colstore_writer_close(&w);
+    arena_release(&report_arena, mark);
+    return ok;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* Layout of the records getdents64 returns. */
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} DirEntry64;
+
+/* Lists partition months (yyyymm) in ascending order, in report_arena. */
+int colstore_months(int **months_out) {
+    *months_out = NULL;
+    // getdents64 into a stack buffer rather than opendir(), which mallocs its DIR
+    int fd = open(SALES_STORE_DIR, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return 0;
+    
+    int count = 0, capacity = 0;
+    char buf[4096] __attribute__((aligned(8)));
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long off = 0; off < n; off += ((DirEntry64 *)(buf + off))->d_reclen) {
+            const char *name = ((DirEntry64 *)(buf + off))->d_name;
+            int year, month;
+            char tail;
+            if (sscanf(name, "%4d-%2d%c", &year, &month, &tail) != 2 || month < 1 || month > 12) continue;
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                int *grown = arena_alloc(&report_arena, (size_t)capacity * sizeof(int));
+                if (!grown) break;
+                if (count) memcpy(grown, *months_out, (size_t)count * sizeof(int));
+                *months_out = grown;
+            }
+            (*months_out)[count++] = year * 100 + month;
+        }
+    }
+    close(fd);
+    
+    if (count > 1) qsort(*months_out, (size_t)count, sizeof(int), compare_ints);
+    return count;
+}
+
+static void partition_close(SalesPartition *part) {
+    for (int c = 0; c < COL_COUNT; c++) unmap_file(&part->maps[c]);
+}
+
+static int partition_open(SalesPartition *part, int month, unsigned columns) {
+    memset(part, 0, sizeof(*part));
+    part->month = month;
+    part->rows = (size_t)-1;
+    
+    for (int c = 0; c < COL_COUNT; c++) {
+        if (!(columns & COLMASK(c))) continue;
+        char path[256];
+        partition_path(path, sizeof(path), month, column_files[c]);
+        if (!map_file(path, &part->maps[c])) {
+            partition_close(part);
+            return 0;
+        }
+        size_t rows = part->maps[c].size / column_widths[c];
+        if (rows < part->rows) part->rows = rows;
+    }
+    if (part->rows == (size_t)-1) part->rows = 0;
+    
+    part->id = (const int32_t *)part->maps[COL_ID].data;
+    part->product_id = (const int32_t *)part->maps[COL_PRODUCT_ID].data;
+    part->customer_id = (const int32_t *)part->maps[COL_CUSTOMER_ID].data;
+    part->quantity = (const int32_t *)part->maps[COL_QUANTITY].data;
+    part->total_price = (const Money *)part->maps[COL_TOTAL_PRICE].data;
+    part->date = (const int64_t *)part->maps[COL_DATE].data;
+    part->cashier = (const uint32_t *)part->maps[COL_CASHIER].data;
+    
+    if ((columns & COLMASK(COL_CASHIER)) &&
+        !load_cashier_dict(month, &part->cashier_names, &part->cashier_count, NULL)) {
+        partition_close(part);
+        return 0;
+    }
+    return 1;
+}
+
+const char *partition_cashier(const SalesPartition *part, size_t row) {
+    uint32_t code = part->cashier[row];
+    return code < (uint32_t)part->cashier_count ? part->cashier_names[code] : "";
+}
+
+/*
+ * Calls fn for every partition whose month is in [month_from, month_to]
+ * (0 means unbounded), mapping only the requested columns.
+ */
+int colstore_scan(unsigned columns, int month_from, int month_to, PartitionFn fn, void *ctx) {
+    size_t mark = arena_mark(&report_arena);
+    int *months;
+    int count = colstore_months(&months);
+    int ok = 1;
+    
+    for (int i = 0; i < count && ok; i++) {
+        if (month_from && months[i] < month_from) continue;
+        if (month_to && months[i] > month_to) break;
+        
+        size_t part_mark = arena_mark(&report_arena);
+        SalesPartition part;
+        if (!partition_open(&part, months[i], columns)) {
+            ok = 0;
+            break;
+        }
+        fn(&part, ctx);
+        partition_close(&part);
+        arena_release(&report_arena, part_mark);
+    }
+    arena_release(&report_arena, mark);
+    return ok;
+}
+
+static void remove_partition(int month) {
+    char path[256];
+    for (int c = 0; c < COL_COUNT; c++) {
+        partition_path(path, sizeof(path), month, column_files[c]);
+        remove(path);
+    }
+    partition_path(path, sizeof(path), month, "cashier.dict");
+    remove(path);
+    snprintf(path, sizeof(path), "%s/%04d-%02d", SALES_STORE_DIR, month / 100, month % 100);
+    rmdir(path);
+}
+
+typedef struct {
+    ColstoreWriter *w;
+    long rows;
+    int ok;
+} ColstoreImport;
+
+static void import_archive_chunk(const char *start, const char *end, void *partial, void *ctx) {
+    (void)ctx;
+    ColstoreImport *imp = partial;
+    CsvRecord rec;
+    while (start < end && imp->ok) {
+        start = csv_split(start, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        Sale s;
+        char cashier[50];
+        parse_sale_record(&rec, &s, cashier, sizeof(cashier));
+        imp->ok = colstore_writer_add(imp->w, &s, cashier);
+        imp->rows += imp->ok;
+    }
+}
+
+/* Rebuilds the store from the archive and sales.csv and enables it. Returns rows imported or -1. */
+long colstore_import_csv() {
+    size_t mark = arena_mark(&report_arena);
+    int *months;
+    int count = colstore_months(&months);
+    for (int i = 0; i < count; i++) remove_partition(months[i]);
+    remove(SALES_STORE_FORMAT);
+    
+    ColstoreWriter w;
+    memset(&w, 0, sizeof(w));
+    ColstoreImport imp = { &w, 0, make_dir(SALES_STORE_DIR) };
+    int ok = imp.ok && archive_scan(0, 0, import_archive_chunk, &imp, NULL) && imp.ok;
+    long rows = imp.rows;
+    
+    CsvCursor cur;
+    if (ok && file_exists(SALES_FILE) && (ok = csv_cursor_open(&cur, SALES_FILE))) {
+        CsvRecord rec;
+        while (ok && csv_cursor_next(&cur, &rec)) {
+            Sale s;
+            char cashier[50];
+            parse_sale_record(&rec, &s, cashier, sizeof(cashier));
+            ok = colstore_writer_add(&w, &s, cashier);
+            rows += ok;
+        }
+        csv_cursor_close(&cur);
+    }
+    if (!colstore_writer_flush(&w)) ok = 0;
+    colstore_writer_close(&w);
+    arena_release(&report_arena, mark);
+    if (!ok) return -1;
+    
+    FILE *f = fopen(SALES_STORE_FORMAT, "w");
+    if (!f) return -1;
+    fprintf(f, "shop-colstore %d\n", SALES_STORE_VERSION);
+    fclose(f);
+    return rows;
+}
+
+/* Rebuilds a store written in an older format; the archive and sales.csv hold every row. */
+int colstore_upgrade() {
+    if (!colstore_enabled()) return 1;
+    
+    int version = 0;
+    FILE *f = fopen(SALES_STORE_FORMAT, "r");
+    if (f) {
+        if (fscanf(f, "shop-colstore %d", &version) != 1) version = 0;
+        fclose(f);
+    }
+    if (version == SALES_STORE_VERSION) return 1;
+    
+    printf("Rebuilding %s/ in format %d...\n", SALES_STORE_DIR, SALES_STORE_VERSION);
+    return colstore_import_csv() >= 0;
+}
+
+typedef struct {
+    FILE *f;
+    int *archived;             /* ids in the archive, ascending */
+    int archived_count;
+    int archived_capacity;
+    int ok;
+} ColstoreExport;
+
+static void collect_archived_ids(const char *start, const char *end, void *partial, void *ctx) {
+    (void)ctx;
+    ColstoreExport *x = partial;
+    CsvRecord rec;
+    while (start < end && x->ok) {
+        start = csv_split(start, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        if (x->archived_count == x->archived_capacity &&
+            !grow_rows((void **)&x->archived, &x->archived_capacity, sizeof(int))) {
+            x->ok = 0;
+            break;
+        }
+        x->archived[x->archived_count++] = csv_int(&rec, 0);
+    }
+}
+
+static void export_partition(const SalesPartition *part, void *ctx) {
+    ColstoreExport *x = ctx;
+    for (size_t r = 0; r < part->rows; r++) {
+        if (x->archived_count &&
+            bsearch(&part->id[r], x->archived, (size_t)x->archived_count, sizeof(int), compare_ints)) {
+            continue;
+        }
+        Sale s;
+        s.id = part->id[r];
+        s.product_id = part->product_id[r];
+        s.customer_id = part->customer_id[r];
+        s.quantity = part->quantity[r];
+        s.total_price = part->total_price[r];
+        char date[32];
+        format_datetime(part->date[r], date, sizeof(date));
+        write_sale_fields(x->f, &s, date, partition_cashier(part, r));
+    }
+}
+
+/*
+ * Regenerates sales.csv from the store, leaving out the rows already
+ * archived. Those are found by id, as ids do not rise in file order.
+ */
+int colstore_export_csv() {
+    ColstoreExport x = { NULL, NULL, 0, 0, 1 };
+    if (!archive_scan(0, 0, collect_archived_ids, &x, NULL) || !x.ok) {
+        free(x.archived);
+        return 0;
+    }
+    qsort(x.archived, (size_t)x.archived_count, sizeof(int), compare_ints);
+    FILE *tmp = fopen(SALES_TMP_FILE, "w");
+    if (!tmp) {
+        free(x.archived);
+        return 0;
+    }
+    
+    x.f = tmp;
+    int ok = colstore_scan(COLMASK_ALL, 0, 0, export_partition, &x) && !ferror(tmp) &&
+             fflush(tmp) == 0 && fsync(fileno(tmp)) == 0;
+    free(x.archived);
+    if (fclose(tmp) != 0) ok = 0;
+    // rename() replaces the live file in one step, so there is never a moment without a sales.csv
+    if (ok && rename(SALES_TMP_FILE, SALES_FILE) != 0) ok = 0;
+    if (!ok) remove(SALES_TMP_FILE);
+    return ok;
+}
+
+/* -------------------- Sales Aggregates -------------------- */
+/*
+ * Running totals per day, per product and per cashier, plus a grand total,
+ * so the summary and profit reports answer without scanning sales.csv.
+ * make_sale is the only writer of sales.csv, and after each append it
+ * folds the new tail into the aggregates. Costs use the catalog cost price
+ * at the time a row is folded in.
+ *
+ * The aggregates are saved to sales_aggregates.dat together with the
+ * sales.csv length they cover and a hash of the bytes just before that
+ * point. On load, rows appended since then are folded in. A shorter file or
+ * a changed hash (the file was edited externally) triggers a full rebuild,
+ * which is also available from System Maintenance. Archived sales stay in
+ * the totals: a rebuild folds the archive in first.
+ */
+#define SALES_AGG_MAGIC 0x47415053u /* "SPAG" */
+#define SALES_AGG_VERSION 2
+#define SALES_AGG_TAIL_BYTES 64
+
+typedef struct {
+    int day;                   /* yyyymmdd */
+    SalesTotals totals;
+} DayAggregate;
+
+typedef struct {
+    int product_id;
+    SalesTotals totals;
+} ProductAggregate;
+
+typedef struct {
+    char cashier[50];
+    SalesTotals totals;
+} CashierAggregate;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_size;
+    uint64_t tail_hash;
+    SalesTotals all;
+    int32_t day_count;
+    int32_t product_count;
+    int32_t cashier_count;
+    int32_t reserved;
+} SalesAggregateHeader;
+
+typedef struct {
+    int ready;
+    uint64_t source_size;      /* bytes of sales.csv folded in */
+    uint64_t tail_hash;
+    SalesTotals all;
+    DayAggregate *days;        /* sorted by day */
+    int day_count;
+    int day_capacity;
+    ProductAggregate *products;
+    int product_count;
+    int product_capacity;
+    IdIndex product_index;
+    CashierAggregate *cashiers;
+    int cashier_count;
+    int cashier_capacity;
+} SalesAggregates;
+
+static SalesAggregates sales_aggregates;
+
+/* FNV-1a over the bytes of sales.csv just before `end`. */
+static uint64_t tail_hash(const char *data, size_t end) {
+    size_t start = end > SALES_AGG_TAIL_BYTES ? end - SALES_AGG_TAIL_BYTES : 0;
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = start; i < end; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void sales_aggregates_clear() {
+    free(sales_aggregates.days);
+    free(sales_aggregates.products);
+    id_index_free(&sales_aggregates.product_index);
+    free(sales_aggregates.cashiers);
+    memset(&sales_aggregates, 0, sizeof(sales_aggregates));
+}
+
+static DayAggregate *day_aggregate(int day) {
+    SalesAggregates *a = &sales_aggregates;
+    int lo = 0, hi = a->day_count;
+    
+    // Appends are chronological, so the usual hit is the last day
+    if (hi > 0 && a->days[hi - 1].day == day) return &a->days[hi - 1];
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (a->days[mid].day < day) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < a->day_count && a->days[lo].day == day) return &a->days[lo];
+    
+    if (a->day_count == a->day_capacity &&
+        !grow_rows((void **)&a->days, &a->day_capacity, sizeof(DayAggregate))) {
+        return NULL;
+    }
+    memmove(&a->days[lo + 1], &a->days[lo], (size_t)(a->day_count - lo) * sizeof(DayAggregate));
+    memset(&a->days[lo], 0, sizeof(DayAggregate));
+    a->days[lo].day = day;
+    a->day_count++;
+    return &a->days[lo];
+}
+
+static ProductAggregate *product_aggregate(int product_id) {
+    SalesAggregates *a = &sales_aggregates;
+    int row = id_index_find(&a->product_index, product_id);
+    if (row != INDEX_EMPTY) return &a->products[row];
+    
+    if (a->product_count == a->product_capacity &&
+        !grow_rows((void **)&a->products, &a->product_capacity, sizeof(ProductAggregate))) {
+        return NULL;
+    }
+    if (!id_index_put(&a->product_index, product_id, a->product_count)) return NULL;
+    ProductAggregate *pa = &a->products[a->product_count++];
+    memset(pa, 0, sizeof(*pa));
+    pa->product_id = product_id;
+    return pa;
+}
+
+static CashierAggregate *cashier_aggregate(const char *cashier) {
+    SalesAggregates *a = &sales_aggregates;
+    for (int i = 0; i < a->cashier_count; i++) {
+        if (strcmp(a->cashiers[i].cashier, cashier) == 0) return &a->cashiers[i];
+    }
+    
+    if (a->cashier_count == a->cashier_capacity &&
+        !grow_rows((void **)&a->cashiers, &a->cashier_capacity, sizeof(CashierAggregate))) {
+        return NULL;
+    }
+    CashierAggregate *ca = &a->cashiers[a->cashier_count++];
+    memset(ca, 0, sizeof(*ca));
+    snprintf(ca->cashier, sizeof(ca->cashier), "%s", cashier);
+    return ca;
+}
+
+static int fold_sale_record(const CsvRecord *rec) {
+    SalesTotals x;
+    int quantity = csv_int(rec, 3);
+    int product_id = csv_int(rec, 1);
+    const Product *p = product_lookup(product_id);
+    char cashier[50];
+    
+    x.revenue = csv_money(rec, 4);
+    x.cost = p ? p->cost_price * quantity : 0;
+    x.units = quantity;
+    x.transactions = 1;
+    csv_string(rec, 6, cashier, sizeof(cashier));
+    
+    DayAggregate *d = day_aggregate(field_day_key(csv_get(rec, 5)));
+    ProductAggregate *pa = product_aggregate(product_id);
+    CashierAggregate *ca = cashier_aggregate(cashier);
+    if (!d || !pa || !ca) return 0;
+    
+    totals_add(&sales_aggregates.all, &x);
+    totals_add(&d->totals, &x);
+    totals_add(&pa->totals, &x);
+    totals_add(&ca->totals, &x);
+    return 1;
+}
+
+/* Folds every row of [from, map end) into the aggregates. */
+static int fold_sales_range(const MappedFile *map, size_t from) {
+    const char *p = map->data + from;
+    const char *end = map->data + map->size;
+    CsvRecord rec;
+    
+    while (p < end) {
+        p = csv_split(p, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        if (!fold_sale_record(&rec)) return 0;
+    }
+    sales_aggregates.source_size = map->size;
+    sales_aggregates.tail_hash = tail_hash(map->data, map->size);
+    return 1;
+}
+
+static void fold_archive_chunk(const char *start, const char *end, void *partial, void *ctx) {
+    (void)ctx;
+    int *ok = partial;
+    CsvRecord rec;
+    while (start < end && *ok) {
+        start = csv_split(start, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        *ok = fold_sale_record(&rec);
+    }
+}
+
+int rebuild_sales_aggregates() {
+    sales_aggregates_clear();
+    
+    int archived = 1;
+    if (!archive_scan(0, 0, fold_archive_chunk, &archived, NULL) || !archived) {
+        sales_aggregates_clear();
+        return 0;
+    }
+    MappedFile map = { NULL, 0 };
+    if (file_exists(SALES_FILE) && !map_file(SALES_FILE, &map)) return 0;
+    
+    int ok = fold_sales_range(&map, 0);
+    unmap_file(&map);
+    sales_aggregates.ready = ok;
+    return ok;
+}
+
+/*
+ * Brings the aggregates up to the current end of sales.csv, rebuilding
+ * from scratch if the covered prefix no longer matches.
+ */
+int sales_aggregates_catch_up() {
+    if (!sales_aggregates.ready) return rebuild_sales_aggregates();
+    
+    MappedFile map = { NULL, 0 };
+    if (file_exists(SALES_FILE) && !map_file(SALES_FILE, &map)) return 0;
+    
+    int ok;
+    if (map.size < sales_aggregates.source_size ||
+        tail_hash(map.data, sales_aggregates.source_size) != sales_aggregates.tail_hash) {
+        unmap_file(&map);
+        return rebuild_sales_aggregates();
+    }
+    ok = map.size == sales_aggregates.source_size || fold_sales_range(&map, sales_aggregates.source_size);
+    unmap_file(&map);
+    if (!ok) sales_aggregates.ready = 0;
+    return ok;
+}
+
+/* Points the aggregates at a sales.csv rewritten without rows that they still count (archived rows). */
+int sales_aggregates_retarget() {
+    if (!sales_aggregates.ready) return 0;
+    MappedFile map = { NULL, 0 };
+    if (file_exists(SALES_FILE) && !map_file(SALES_FILE, &map)) return 0;
+    sales_aggregates.source_size = map.size;
+    sales_aggregates.tail_hash = tail_hash(map.data, map.size);
+    unmap_file(&map);
+    return 1;
+}
+
+static int read_array(FILE *f, void **rows, int count, int *capacity, size_t row_size) {
+    if (count < 0) return 0;
+    if (count == 0) return 1;
+    *rows = malloc((size_t)count * row_size);
+    if (!*rows) return 0;
+    *capacity = count;
+    return fread(*rows, row_size, (size_t)count, f) == (size_t)count;
+}
+
+int load_sales_aggregates() {
+    sales_aggregates_clear();
+    
+    FILE *f = fopen(SALES_AGG_FILE, "rb");
+    if (f) {
+        SalesAggregateHeader h;
+        SalesAggregates *a = &sales_aggregates;
+        int ok = fread(&h, sizeof(h), 1, f) == 1 &&
+                 h.magic == SALES_AGG_MAGIC && h.version == SALES_AGG_VERSION &&
+                 read_array(f, (void **)&a->days, h.day_count, &a->day_capacity, sizeof(DayAggregate)) &&
+                 read_array(f, (void **)&a->products, h.product_count, &a->product_capacity, sizeof(ProductAggregate)) &&
+                 read_array(f, (void **)&a->cashiers, h.cashier_count, &a->cashier_capacity, sizeof(CashierAggregate));
+        fclose(f);
+        
+        if (ok) {
+            a->day_count = h.day_count;
+            a->product_count = h.product_count;
+            a->cashier_count = h.cashier_count;
+            a->source_size = h.source_size;
+            a->tail_hash = h.tail_hash;
+            a->all = h.all;
+            for (int i = 0; i < a->product_count && ok; i++) {
+                ok = id_index_put(&a->product_index, a->products[i].product_id, i);
+            }
+            a->ready = ok;
+        }
+        if (!ok) sales_aggregates_clear();
+    }
+    return sales_aggregates_catch_up();
+}
+
+int save_sales_aggregates() {
+    SalesAggregates *a = &sales_aggregates;
+    if (!a->ready) return 0;
+    
+    FILE *f = fopen(SALES_AGG_TMP_FILE, "wb");
+    if (!f) return 0;
+    
+    SalesAggregateHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = SALES_AGG_MAGIC;
+    h.version = SALES_AGG_VERSION;
+    h.source_size = a->source_size;
+    h.tail_hash = a->tail_hash;
+    h.all = a->all;
+    h.day_count = a->day_count;
+    h.product_count = a->product_count;
+    h.cashier_count = a->cashier_count;
+    
+    // An empty table may have no array behind it, and fwrite must not be handed NULL
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             (a->day_count == 0 ||
+              fwrite(a->days, sizeof(DayAggregate), (size_t)a->day_count, f) == (size_t)a->day_count) &&
+             (a->product_count == 0 ||
+              fwrite(a->products, sizeof(ProductAggregate), (size_t)a->product_count, f) == (size_t)a->product_count) &&
+             (a->cashier_count == 0 ||
+              fwrite(a->cashiers, sizeof(CashierAggregate), (size_t)a->cashier_count, f) == (size_t)a->cashier_count);
+    if (fclose(f) != 0) ok = 0;
+    if (!ok) {
+        remove(SALES_AGG_TMP_FILE);
+        return 0;
+    }
+    return rename(SALES_AGG_TMP_FILE, SALES_AGG_FILE) == 0;
+}
+
+/* -------------------- Sales Index -------------------- */
+/*
+ * Two append-only indexes over sales.csv, extended after every sale:
+ *
+ *   sales_day.idx      one (day, byte offset) entry where each new day
+ *                      starts, so a date range seeks straight to its rows
+ *   sales_product.idx  one (product, sale id, day, offset) entry per row,
+ *                      loaded into per-product posting lists
+ *
+ * Seeking by day relies on sales.csv being in date order, which holds for
+ * rows written by make_sale. If the day entries are out of order (the file
+ * was edited), date filters fall back to a filtered full scan.
+ */
+typedef struct {
+    int32_t day;
+    int32_t reserved;
+    uint64_t offset;
+} DayIndexEntry;
+
+typedef struct {
+    int32_t product_id;
+    int32_t sale_id;
+    int32_t day;
+    int32_t reserved;
+    uint64_t offset;
+} ProductIndexEntry;
+
+typedef struct {
+    uint64_t offset;
+    int32_t day;
+} SalesPosting;
+
+typedef struct {
+    SalesPosting *items;
+    int count;
+    int capacity;
+} PostingList;
+
+typedef struct {
+    int ready;
+    int ordered;               /* day entries strictly ascending */
+    uint64_t covered;          /* bytes of sales.csv indexed */
+    int last_sale_id;
+    uint64_t last_offset;
+    DayIndexEntry *days;
+    int day_count;
+    int day_capacity;
+    PostingList *lists;
+    int list_count;
+    int list_capacity;
+    IdIndex product_index;     /* product id -> posting list */
+    FILE *day_file;
+    FILE *product_file;
+    off_t day_file_size;       /* index file sizes after our last write */
+    off_t product_file_size;
+} SalesIndex;
+
+static SalesIndex sales_index;
+
+void sales_index_close() {
+    SalesIndex *x = &sales_index;
+    if (x->day_file) fclose(x->day_file);
+    if (x->product_file) fclose(x->product_file);
+    for (int i = 0; i < x->list_count; i++) free(x->lists[i].items);
+    free(x->lists);
+    free(x->days);
+    id_index_free(&x->product_index);
+    memset(x, 0, sizeof(*x));
+}
+
+static int index_add_day(int day, uint64_t offset) {
+    SalesIndex *x = &sales_index;
+    if (x->day_count == x->day_capacity &&
+        !grow_rows((void **)&x->days, &x->day_capacity, sizeof(DayIndexEntry))) {
+        return 0;
+    }
+    if (x->day_count > 0 && day <= x->days[x->day_count - 1].day) x->ordered = 0;
+    DayIndexEntry *e = &x->days[x->day_count++];
+    e->day = day;
+    e->reserved = 0;
+    e->offset = offset;
+    return 1;
+}
+
+static int index_add_posting(int product_id, int day, uint64_t offset) {
+    SalesIndex *x = &sales_index;
+    int row = id_index_find(&x->product_index, product_id);
+    if (row == INDEX_EMPTY) {
+        if (x->list_count == x->list_capacity &&
+            !grow_rows((void **)&x->lists, &x->list_capacity, sizeof(PostingList))) {
+            return 0;
+        }
+        row = x->list_count;
+        if (!id_index_put(&x->product_index, product_id, row)) return 0;
+        memset(&x->lists[row], 0, sizeof(PostingList));
+        x->list_count++;
+    }
+    
+    PostingList *list = &x->lists[row];
+    if (list->count == list->capacity &&
+        !grow_rows((void **)&list->items, &list->capacity, sizeof(SalesPosting))) {
+        return 0;
+    }
+    list->items[list->count].offset = offset;
+    list->items[list->count].day = day;
+    list->count++;
+    return 1;
+}
+
+const PostingList *sales_index_postings(int product_id) {
+    int row = id_index_find(&sales_index.product_index, product_id);
+    return row == INDEX_EMPTY ? NULL : &sales_index.lists[row];
+}
+
+static int note_index_sizes() {
+    struct stat ds, ps;
+    if (fstat(fileno(sales_index.day_file), &ds) != 0 || fstat(fileno(sales_index.product_file), &ps) != 0) return 0;
+    sales_index.day_file_size = ds.st_size;
+    sales_index.product_file_size = ps.st_size;
+    return 1;
+}
+
+/* Indexes and persists every row of sales.csv from the covered offset on. */
+static int index_sales_range(const MappedFile *map) {
+    SalesIndex *x = &sales_index;
+    const char *p = map->data + x->covered;
+    const char *end = map->data + map->size;
+    int last_day = x->day_count > 0 ? x->days[x->day_count - 1].day : -1;
+    CsvRecord rec;
+    
+    while (p < end) {
+        uint64_t offset = (uint64_t)(p - map->data);
+        p = csv_split(p, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        
+        ProductIndexEntry pe;
+        memset(&pe, 0, sizeof(pe));
+        pe.product_id = csv_int(&rec, 1);
+        pe.sale_id = csv_int(&rec, 0);
+        pe.day = field_day_key(csv_get(&rec, 5));
+        pe.offset = offset;
+        
+        if (pe.day != last_day) {
+            DayIndexEntry de = { pe.day, 0, offset };
+            if (!index_add_day(pe.day, offset) || fwrite(&de, sizeof(de), 1, x->day_file) != 1) return 0;
+            last_day = pe.day;
+        }
+        if (!index_add_posting(pe.product_id, pe.day, offset) ||
+            fwrite(&pe, sizeof(pe), 1, x->product_file) != 1) {
+            return 0;
+        }
+        x->last_sale_id = pe.sale_id;
+        x->last_offset = offset;
+    }
+    x->covered = map->size;
+    return fflush(x->day_file) == 0 && fflush(x->product_file) == 0 && note_index_sizes();
+}
+
+static int open_index_files(const char *mode) {
+    sales_index.day_file = fopen(SALES_DAY_INDEX_FILE, mode);
+    sales_index.product_file = fopen(SALES_PRODUCT_INDEX_FILE, mode);
+    return sales_index.day_file && sales_index.product_file && note_index_sizes();
+}
+
+/* True if another till has written the index files since we last did. */
+static int index_files_changed() {
+    struct stat ds, ps;
+    if (fstat(fileno(sales_index.day_file), &ds) != 0 || fstat(fileno(sales_index.product_file), &ps) != 0) return 1;
+    return ds.st_size != sales_index.day_file_size || ps.st_size != sales_index.product_file_size;
+}
+
+int rebuild_sales_index() {
+    sales_index_close();
+    sales_index.ordered = 1;
+    if (!open_index_files("wb")) {
+        sales_index_close();
+        return 0;
+    }
+    
+    MappedFile map = { NULL, 0 };
+    if (file_exists(SALES_FILE) && !map_file(SALES_FILE, &map)) {
+        sales_index_close();
+        return 0;
+    }
+    sales_index.ready = index_sales_range(&map);
+    unmap_file(&map);
+    return sales_index.ready;
+}
+
+/* True if the row at the last indexed offset is still the last indexed sale. */
+static int index_matches_file(const MappedFile *map) {
+    SalesIndex *x = &sales_index;
+    if (x->last_offset >= map->size) return x->day_count == 0 && x->list_count == 0;
+    
+    CsvRecord rec;
+    const char *next = csv_split(map->data + x->last_offset, map->data + map->size, &rec);
+    if (csv_int(&rec, 0) != x->last_sale_id) return 0;
+    x->covered = (uint64_t)(next - map->data);
+    return 1;
+}
+
+/* Loads the index files and checks them against sales.csv, rebuilding on mismatch. */
+static int read_sales_index() {
+    sales_index_close();
+    sales_index.ordered = 1;
+    
+    FILE *df = fopen(SALES_DAY_INDEX_FILE, "rb");
+    FILE *pf = fopen(SALES_PRODUCT_INDEX_FILE, "rb");
+    int ok = df && pf;
+    
+    DayIndexEntry de;
+    while (ok && fread(&de, sizeof(de), 1, df) == 1) {
+        ok = index_add_day(de.day, de.offset);
+    }
+    ProductIndexEntry pe;
+    int have_rows = 0;
+    while (ok && fread(&pe, sizeof(pe), 1, pf) == 1) {
+        ok = index_add_posting(pe.product_id, pe.day, pe.offset);
+        sales_index.last_sale_id = pe.sale_id;
+        sales_index.last_offset = pe.offset;
+        have_rows = 1;
+    }
+    if (df) fclose(df);
+    if (pf) fclose(pf);
+    if (!ok) return rebuild_sales_index();
+    
+    MappedFile map = { NULL, 0 };
+    if (file_exists(SALES_FILE) && !map_file(SALES_FILE, &map)) return 0;
+    int matches = have_rows ? index_matches_file(&map) : sales_index.day_count == 0;
+    unmap_file(&map);
+    if (!matches || !open_index_files("ab")) return rebuild_sales_index();
+    
+    sales_index.ready = 1;
+    return 1;
+}
+
+int sales_index_catch_up() {
+    if (!sales_index.ready) return rebuild_sales_index();
+    if (index_files_changed() && !read_sales_index()) return 0;
+    
+    MappedFile map = { NULL, 0 };
+    if (file_exists(SALES_FILE) && !map_file(SALES_FILE, &map)) return 0;
+    
+    int ok;
+    if (map.size < sales_index.covered) {
+        unmap_file(&map);
+        return rebuild_sales_index();
+    }
+    ok = map.size == sales_index.covered || index_sales_range(&map);
+    unmap_file(&map);
+    if (!ok) sales_index.ready = 0;
+    return ok;
+}
+
+int load_sales_index() {
+    return read_sales_index() && sales_index_catch_up();
+}
+
+/* -------------------- B-Tree Storage -------------------- */
+/*
+ * shop.db holds one B+-tree per catalog table in 4 KiB pages, keyed by id
+ * with the fixed-size record as the value. Pages 0 and 1 are alternate
+ * meta pages, and the valid one with the higher txid names the roots.
+ *
+ * Commits are copy-on-write: the first change a transaction makes to a
+ * page goes to a copy on a free page, and so on up the path to a new root,
+ * so no page the last commit can reach is ever overwritten. Commit writes
+ * the changed pages, syncs, then writes the other meta page and syncs
+ * again; a crash leaves either the old tree or the new one. Pages live in
+ * a small buffer pool, and a dirty frame is always a copy that no commit
+ * refers to yet, so it may be written out early to make room.
+ *
+ * Free pages are worked out on the first allocation, as the pages no tree
+ * reaches. Pages a commit replaces become free once that commit is on
+ * disk. Keys are only ever removed from leaves, which are not merged; the
+ * catalog only deletes users.
+ *
+ * The meta page records each tree's value size, so a file from before
+ * products had a SKU still opens and loads; its next checkpoint writes the
+ * whole catalog to a new file in the current layout and swaps it in.
+ */
+#define BTREE_FILE "shop.db"
+#define BTREE_TMP_FILE ".shop_db_tmp"
+#define BTREE_MAGIC 0x45525442u       /* "BTRE" */
+#define BTREE_VERSION 1
+#define BTREE_PAGE_SIZE 4096
+#define BTREE_POOL_PAGES 256
+#define BTREE_POOL_BUCKETS 1024
+#define BTREE_MAX_DEPTH 16
+
+enum { BTREE_PRODUCTS, BTREE_CUSTOMERS, BTREE_USERS, BTREE_TREES };
+enum { BTREE_LEAF = 1, BTREE_BRANCH };
+
+static const uint32_t btree_value_size[BTREE_TREES] = {
+    sizeof(ProductRecord), sizeof(CustomerRecord), sizeof(User)
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t txid;
+    uint32_t page_size;
+    uint32_t page_count;
+    uint32_t roots[BTREE_TREES];       /* 0 for an empty tree */
+    uint32_t value_size[BTREE_TREES];
+    uint64_t folded_bytes;             /* size and hash of the log this commit folded in */
+    uint64_t folded_hash;
+    uint64_t checksum;                 /* hash_bytes of the fields before it */
+} BtreeMeta;
+
+/*
+ * Page header. A leaf holds count keys and then, after room for a full
+ * page of keys, their values from the next 8-byte boundary. A branch holds count keys and count + 1
+ * children; child i covers keys from keys[i - 1] up to keys[i].
+ */
+typedef struct {
+    uint16_t kind;
+    uint16_t count;
+    uint32_t reserved;
+    uint64_t txid;                     /* transaction that wrote this copy */
+} BtreeNode;
+
+#define BTREE_BRANCH_KEYS ((int)((BTREE_PAGE_SIZE - sizeof(BtreeNode) - 4) / 8))
+
+typedef struct {
+    uint32_t page;                     /* 0 when the frame is empty */
+    int pins;
+    int dirty;
+    int next;                          /* bucket chain, -1 at the end */
+    uint64_t used;
+    unsigned char *data;
+} BtreeFrame;
+
+typedef struct {
+    int fd;
+    BtreeMeta meta;                    /* as last committed */
+    uint64_t tx;                       /* the open transaction, meta.txid + 1 */
+    uint32_t roots[BTREE_TREES];
+    uint32_t page_count;
+    uint32_t *free_pages;
+    int free_count;
+    int free_capacity;
+    int free_known;
+    uint32_t *released;                /* replaced by the open transaction */
+    int released_count;
+    int released_capacity;
+    int failed;                        /* the transaction hit an error and must not commit */
+    uint64_t clock;
+    unsigned char *pool;
+    BtreeFrame frames[BTREE_POOL_PAGES];
+    int buckets[BTREE_POOL_BUCKETS];
+} Btree;
+
+static Btree btree = { .fd = -1 };
+
+static inline BtreeNode *btree_node(int frame) {
+    return (BtreeNode *)btree.frames[frame].data;
+}
+
+static inline uint32_t *btree_keys(int frame) {
+    return (uint32_t *)(btree.frames[frame].data + sizeof(BtreeNode));
+}
+
+static inline uint32_t *btree_children(int frame) {
+    return btree_keys(frame) + BTREE_BRANCH_KEYS;
+}
+
+/* Leaves keep 4 bytes spare so the values can start on an 8-byte boundary. */
+static inline int btree_leaf_capacity(int tree) {
+    return (int)((BTREE_PAGE_SIZE - sizeof(BtreeNode) - 4) / (4 + btree.meta.value_size[tree]));
+}
+
+static inline unsigned char *btree_value(int frame, int tree, int i) {
+    size_t keys = ((size_t)4 * btree_leaf_capacity(tree) + 7) & ~(size_t)7;
+    return btree.frames[frame].data + sizeof(BtreeNode) + keys + (size_t)i * btree.meta.value_size[tree];
+}
+
+static uint64_t btree_meta_checksum(const BtreeMeta *m) {
+    return hash_bytes((const char *)m, offsetof(BtreeMeta, checksum));
+}
+
+static int btree_flush_frame(BtreeFrame *f) {
+    if (!f->dirty) return 1;
+    if (!full_pwrite(btree.fd, f->data, BTREE_PAGE_SIZE, (off_t)f->page * BTREE_PAGE_SIZE)) return 0;
+    f->dirty = 0;
+    return 1;
+}
+
+static void btree_unlink_frame(int frame) {
+    int *link = &btree.buckets[btree.frames[frame].page % BTREE_POOL_BUCKETS];
+    while (*link != frame) link = &btree.frames[*link].next;
+    *link = btree.frames[frame].next;
+}
+
+/*
+ * Pins the frame holding page, reading it in unless fresh (a page about to
+ * be filled from scratch). Returns the frame, or -1 with btree.failed set.
+ */
+static int btree_fetch(uint32_t page, int fresh) {
+    for (int f = btree.buckets[page % BTREE_POOL_BUCKETS]; f >= 0; f = btree.frames[f].next) {
+        if (btree.frames[f].page == page) {
+            if (fresh) memset(btree.frames[f].data, 0, BTREE_PAGE_SIZE);
+            btree.frames[f].pins++;
+            btree.frames[f].used = ++btree.clock;
+            return f;
+        }
+    }
+    
+    int victim = -1;
+    for (int f = 0; f < BTREE_POOL_PAGES; f++) {
+        BtreeFrame *fr = &btree.frames[f];
+        if (fr->pins) continue;
+        if (!fr->page) {
+            victim = f;
+            break;
+        }
+        if (victim < 0 || fr->used < btree.frames[victim].used) victim = f;
+    }
+    if (victim < 0) {
+        btree.failed = 1;
+        return -1;
+    }
+    
+    BtreeFrame *fr = &btree.frames[victim];
+    if (fr->page) {
+        if (!btree_flush_frame(fr)) {
+            btree.failed = 1;
+            return -1;
+        }
+        btree_unlink_frame(victim);
+        fr->page = 0;
+    }
+    if (fresh) {
+        memset(fr->data, 0, BTREE_PAGE_SIZE);
+    } else if (!full_pread(btree.fd, fr->data, BTREE_PAGE_SIZE, (off_t)page * BTREE_PAGE_SIZE)) {
+        btree.failed = 1;
+        return -1;
+    }
+    fr->page = page;
+    fr->pins = 1;
+    fr->dirty = 0;
+    fr->used = ++btree.clock;
+    fr->next = btree.buckets[page % BTREE_POOL_BUCKETS];
+    btree.buckets[page % BTREE_POOL_BUCKETS] = victim;
+    return victim;
+}
+
+static inline void btree_unpin(int frame) {
+    btree.frames[frame].pins--;
+}
+
+static int push_u32(uint32_t **pages, int *count, int *capacity, uint32_t page) {
+    if (*count == *capacity) {
+        int grown_capacity = *capacity ? *capacity * 2 : 64;
+        uint32_t *grown = realloc(*pages, (size_t)grown_capacity * sizeof(*grown));
+        if (!grown) return 0;
+        *pages = grown;
+        *capacity = grown_capacity;
+    }
+    (*pages)[(*count)++] = page;
+    return 1;
+}
+
+/* Marks every page a tree reaches; 0 if the tree is damaged. */
+static int btree_mark(uint32_t page, int depth, unsigned char *reached) {
+    if (page < 2 || page >= btree.page_count || depth > BTREE_MAX_DEPTH || reached[page]) return 0;
+    reached[page] = 1;
+    int f = btree_fetch(page, 0);
+    if (f < 0) return 0;
+    int ok = 1;
+    if (btree_node(f)->kind == BTREE_BRANCH) {
+        for (int i = 0; ok && i <= btree_node(f)->count; i++) {
+            ok = btree_mark(btree_children(f)[i], depth + 1, reached);
+        }
+    }
+    btree_unpin(f);
+    return ok;
+}
+
+static int btree_find_free() {
+    unsigned char *reached = calloc(btree.page_count, 1);
+    if (!reached) return 0;
+    int ok = 1;
+    for (int t = 0; ok && t < BTREE_TREES; t++) {
+        if (btree.meta.roots[t]) ok = btree_mark(btree.meta.roots[t], 0, reached);
+    }
+    for (uint32_t p = btree.page_count; ok && p-- > 2;) {
+        if (!reached[p]) ok = push_u32(&btree.free_pages, &btree.free_count, &btree.free_capacity, p);
+    }
+    free(reached);
+    btree.free_known = ok;
+    return ok;
+}
+
+static uint32_t btree_alloc() {
+    if (!btree.free_known && !btree_find_free()) {
+        btree.failed = 1;
+        return 0;
+    }
+    if (btree.free_count > 0) return btree.free_pages[--btree.free_count];
+    return btree.page_count++;
+}
+
+/* A new, empty node owned by the open transaction; returns its frame, pinned. */
+static int btree_new_node(uint32_t *page, int kind) {
+    *page = btree_alloc();
+    if (!*page) return -1;
+    int f = btree_fetch(*page, 1);
+    if (f < 0) return -1;
+    btree_node(f)->kind = (uint16_t)kind;
+    btree_node(f)->txid = btree.tx;
+    btree.frames[f].dirty = 1;
+    return f;
+}
+
+/*
+ * Returns a pinned frame for *page that the open transaction may change:
+ * the page itself once the transaction owns it, else a fresh copy, whose
+ * number replaces *page.
+ */
+static int btree_writable(uint32_t *page) {
+    int f = btree_fetch(*page, 0);
+    if (f < 0) return -1;
+    if (btree_node(f)->txid == btree.tx) {
+        btree.frames[f].dirty = 1;
+        return f;
+    }
+    
+    uint32_t copy;
+    int c = btree_new_node(&copy, btree_node(f)->kind);
+    if (c < 0 || !push_u32(&btree.released, &btree.released_count, &btree.released_capacity, *page)) {
+        btree_unpin(f);
+        if (c >= 0) btree_unpin(c);
+        btree.failed = 1;
+        return -1;
+    }
+    memcpy(btree.frames[c].data, btree.frames[f].data, BTREE_PAGE_SIZE);
+    btree_node(c)->txid = btree.tx;
+    btree_unpin(f);
+    *page = copy;
+    return c;
+}
+
+/* First position whose key is not below key. */
+static int btree_search(const uint32_t *keys, int count, uint32_t key) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (keys[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Child of a branch that covers key. */
+static int btree_child_slot(int frame, uint32_t key) {
+    const uint32_t *keys = btree_keys(frame);
+    int count = btree_node(frame)->count;
+    int i = btree_search(keys, count, key);
+    return i < count && keys[i] == key ? i + 1 : i;
+}
+
+/* What an insert did to a subtree: its new root page, and a new right sibling after a split. */
+typedef struct {
+    uint32_t page;
+    int split;
+    uint32_t key;              /* first key in right */
+    uint32_t right;
+} BtreeChange;
+
+static int btree_insert_leaf(int tree, uint32_t page, uint32_t key, const void *value, BtreeChange *out) {
+    uint32_t size = btree.meta.value_size[tree];
+    int cap = btree_leaf_capacity(tree);
+    
+    int f = btree_fetch(page, 0);
+    if (f < 0) return 0;
+    int count = btree_node(f)->count;
+    int pos = btree_search(btree_keys(f), count, key);
+    int exists = pos < count && btree_keys(f)[pos] == key;
+    int same = exists && memcmp(btree_value(f, tree, pos), value, size) == 0;
+    btree_unpin(f);
+    
+    out->page = page;
+    out->split = 0;
+    if (same) return 1;
+    if ((f = btree_writable(&out->page)) < 0) return 0;
+    if (exists) {
+        memcpy(btree_value(f, tree, pos), value, size);
+        btree_unpin(f);
+        return 1;
+    }
+    
+    int target = f, r = -1;
+    if (count == cap) {
+        // An append (a new id) leaves the left page full rather than half empty
+        int keep = pos == count ? count : cap / 2;
+        if ((r = btree_new_node(&out->right, BTREE_LEAF)) < 0) {
+            btree_unpin(f);
+            return 0;
+        }
+        int moved = count - keep;
+        memcpy(btree_keys(r), btree_keys(f) + keep, (size_t)moved * 4);
+        memcpy(btree_value(r, tree, 0), btree_value(f, tree, keep), (size_t)moved * size);
+        btree_node(r)->count = (uint16_t)moved;
+        btree_node(f)->count = (uint16_t)keep;
+        if (pos >= keep) {
+            target = r;
+            pos -= keep;
+        }
+    }
+    
+    int n = btree_node(target)->count;
+    uint32_t *keys = btree_keys(target);
+    memmove(keys + pos + 1, keys + pos, (size_t)(n - pos) * 4);
+    memmove(btree_value(target, tree, pos + 1), btree_value(target, tree, pos), (size_t)(n - pos) * size);
+    keys[pos] = key;
+    memcpy(btree_value(target, tree, pos), value, size);
+    btree_node(target)->count = (uint16_t)(n + 1);
+    
+    if (r >= 0) {
+        out->split = 1;
+        out->key = btree_keys(r)[0];
+        btree_unpin(r);
+    }
+    btree_unpin(f);
+    return 1;
+}
+
+/* Puts a child's new page, and its new right sibling after a split, into a branch. */
+static int btree_update_branch(uint32_t page, int slot, const BtreeChange *child, BtreeChange *out) {
+    out->page = page;
+    out->split = 0;
+    int f = btree_writable(&out->page);
+    if (f < 0) return 0;
+    btree_children(f)[slot] = child->page;
+    if (!child->split) {
+        btree_unpin(f);
+        return 1;
+    }
+    
+    int count = btree_node(f)->count;
+    uint32_t *keys = btree_keys(f), *children = btree_children(f);
+    if (count < BTREE_BRANCH_KEYS) {
+        memmove(keys + slot + 1, keys + slot, (size_t)(count - slot) * 4);
+        memmove(children + slot + 2, children + slot + 1, (size_t)(count - slot) * 4);
+        keys[slot] = child->key;
+        children[slot + 1] = child->right;
+        btree_node(f)->count = (uint16_t)(count + 1);
+        btree_unpin(f);
+        return 1;
+    }
+    
+    // Full: lay out all count + 1 keys, then push the middle one up
+    uint32_t all_keys[BTREE_BRANCH_KEYS + 1], all_children[BTREE_BRANCH_KEYS + 2];
+    memcpy(all_keys, keys, (size_t)slot * 4);
+    all_keys[slot] = child->key;
+    memcpy(all_keys + slot + 1, keys + slot, (size_t)(count - slot) * 4);
+    memcpy(all_children, children, (size_t)(slot + 1) * 4);
+    all_children[slot + 1] = child->right;
+    memcpy(all_children + slot + 2, children + slot + 1, (size_t)(count - slot) * 4);
+    
+    int total = count + 1;
+    int mid = slot == count ? count : total / 2;
+    int r = btree_new_node(&out->right, BTREE_BRANCH);
+    if (r < 0) {
+        btree_unpin(f);
+        return 0;
+    }
+    memcpy(keys, all_keys, (size_t)mid * 4);
+    memcpy(children, all_children, (size_t)(mid + 1) * 4);
+    btree_node(f)->count = (uint16_t)mid;
+    memcpy(btree_keys(r), all_keys + mid + 1, (size_t)(total - mid - 1) * 4);
+    memcpy(btree_children(r), all_children + mid + 1, (size_t)(total - mid) * 4);
+    btree_node(r)->count = (uint16_t)(total - mid - 1);
+    out->split = 1;
+    out->key = all_keys[mid];
+    btree_unpin(r);
+    btree_unpin(f);
+    return 1;
+}
+
+static int btree_insert(int tree, uint32_t page, uint32_t key, const void *value, int depth, BtreeChange *out) {
+    int f = btree_fetch(page, 0);
+    if (f < 0) return 0;
+    if (btree_node(f)->kind != BTREE_BRANCH) {
+        btree_unpin(f);
+        return btree_insert_leaf(tree, page, key, value, out);
+    }
+    int slot = btree_child_slot(f, key);
+    uint32_t child_page = btree_children(f)[slot];
+    btree_unpin(f);
+    if (depth >= BTREE_MAX_DEPTH) return 0;
+    
+    BtreeChange child;
+    if (!btree_insert(tree, child_page, key, value, depth + 1, &child)) return 0;
+    if (child.page == child_page && !child.split) {
+        out->page = page;
+        out->split = 0;
+        return 1;
+    }
+    return btree_update_branch(page, slot, &child, out);
+}
+
+/* Inserts or replaces the record under key; an unchanged record touches no page. */
+int btree_put(int tree, uint32_t key, const void *value) {
+    if (btree.failed) return 0;
+    if (!btree.roots[tree]) {
+        int f = btree_new_node(&btree.roots[tree], BTREE_LEAF);
+        if (f < 0) return 0;
+        btree_unpin(f);
+    }
+    
+    BtreeChange c;
+    if (!btree_insert(tree, btree.roots[tree], key, value, 0, &c)) {
+        btree.failed = 1;
+        return 0;
+    }
+    btree.roots[tree] = c.page;
+    if (c.split) {
+        uint32_t root;
+        int f = btree_new_node(&root, BTREE_BRANCH);
+        if (f < 0) return 0;
+        btree_node(f)->count = 1;
+        btree_keys(f)[0] = c.key;
+        btree_children(f)[0] = c.page;
+        btree_children(f)[1] = c.right;
+        btree_unpin(f);
+        btree.roots[tree] = root;
+    }
+    return 1;
+}
+
+static int btree_delete(int tree, uint32_t *page, uint32_t key, int depth) {
+    int f = btree_fetch(*page, 0);
+    if (f < 0) return 0;
+    int count = btree_node(f)->count;
+    
+    if (btree_node(f)->kind == BTREE_BRANCH) {
+        int slot = btree_child_slot(f, key);
+        uint32_t child = btree_children(f)[slot], before = child;
+        btree_unpin(f);
+        if (depth >= BTREE_MAX_DEPTH || !btree_delete(tree, &child, key, depth + 1)) return 0;
+        if (child == before) return 1;
+        if ((f = btree_writable(page)) < 0) return 0;
+        btree_children(f)[slot] = child;
+        btree_unpin(f);
+        return 1;
+    }
+    
+    int pos = btree_search(btree_keys(f), count, key);
+    int exists = pos < count && btree_keys(f)[pos] == key;
+    btree_unpin(f);
+    if (!exists) return 1;
+    if ((f = btree_writable(page)) < 0) return 0;
+    uint32_t size = btree.meta.value_size[tree];
+    memmove(btree_keys(f) + pos, btree_keys(f) + pos + 1, (size_t)(count - pos - 1) * 4);
+    memmove(btree_value(f, tree, pos), btree_value(f, tree, pos + 1), (size_t)(count - pos - 1) * size);
+    btree_node(f)->count = (uint16_t)(count - 1);
+    btree_unpin(f);
+    return 1;
+}
+
+int btree_remove(int tree, uint32_t key) {
+    if (btree.failed) return 0;
+    if (!btree.roots[tree]) return 1;
+    if (!btree_delete(tree, &btree.roots[tree], key, 0)) {
+        btree.failed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/* Calls visit for every record in key order, as the open transaction sees them; 0 stops the walk. */
+typedef int (*BtreeVisitFn)(uint32_t key, const void *value, void *ctx);
+
+static int btree_visit(int tree, uint32_t page, int depth, BtreeVisitFn visit, void *ctx) {
+    if (depth > BTREE_MAX_DEPTH) return 0;
+    int f = btree_fetch(page, 0);
+    if (f < 0) return 0;
+    int ok = 1;
+    int count = btree_node(f)->count;
+    if (btree_node(f)->kind == BTREE_BRANCH) {
+        for (int i = 0; ok && i <= count; i++) ok = btree_visit(tree, btree_children(f)[i], depth + 1, visit, ctx);
+    } else {
+        for (int i = 0; ok && i < count; i++) ok = visit(btree_keys(f)[i], btree_value(f, tree, i), ctx);
+    }
+    btree_unpin(f);
+    return ok;
+}
+
+int btree_scan(int tree, BtreeVisitFn visit, void *ctx) {
+    return !btree.roots[tree] || btree_visit(tree, btree.roots[tree], 0, visit, ctx);
+}
+
+void btree_close() {
+    if (btree.fd >= 0) close(btree.fd);
+    free(btree.pool);
+    free(btree.free_pages);
+    free(btree.released);
+    memset(&btree, 0, sizeof(btree));
+    btree.fd = -1;
+}
+
+static int btree_read_meta(int slot, BtreeMeta *m) {
+    if (!full_pread(btree.fd, m, sizeof(*m), (off_t)slot * BTREE_PAGE_SIZE)) return 0;
+    if (m->magic != BTREE_MAGIC || m->version != BTREE_VERSION || m->page_size != BTREE_PAGE_SIZE ||
+        m->checksum != btree_meta_checksum(m) || m->page_count < 2) {
+        return 0;
+    }
+    for (int t = 0; t < BTREE_TREES; t++) {
+        if (m->value_size[t] != btree_value_size[t] || m->roots[t] >= m->page_count) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Opens a tree file and starts a transaction on its last commit. With
+ * create, the file is truncated to an empty tree that is not yet committed.
+ */
+int btree_open(const char *path, int create) {
+    btree_close();
+    btree.fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0644);
+    btree.pool = malloc((size_t)BTREE_POOL_PAGES * BTREE_PAGE_SIZE);
+    if (btree.fd < 0 || !btree.pool) {
+        btree_close();
+        return 0;
+    }
+    for (int i = 0; i < BTREE_POOL_BUCKETS; i++) btree.buckets[i] = -1;
+    for (int i = 0; i < BTREE_POOL_PAGES; i++) {
+        btree.frames[i].data = btree.pool + (size_t)i * BTREE_PAGE_SIZE;
+        btree.frames[i].next = -1;
+    }
+    
+    if (create) {
+        BtreeMeta *m = &btree.meta;
+        m->magic = BTREE_MAGIC;
+        m->version = BTREE_VERSION;
+        m->page_size = BTREE_PAGE_SIZE;
+        m->page_count = 2;
+        for (int t = 0; t < BTREE_TREES; t++) m->value_size[t] = btree_value_size[t];
+        btree.free_known = 1;
+    } else {
+        BtreeMeta a, b;
+        int has_a = btree_read_meta(0, &a), has_b = btree_read_meta(1, &b);
+        if (!has_a && !has_b) {
+            printf("Error: %s is damaged or was written by another version.\n", path);
+            btree_close();
+            return 0;
+        }
+        btree.meta = has_a && (!has_b || a.txid > b.txid) ? a : b;
+    }
+    btree.tx = btree.meta.txid + 1;
+    btree.page_count = btree.meta.page_count;
+    memcpy(btree.roots, btree.meta.roots, sizeof(btree.roots));
+    return 1;
+}
+
+/*
+ * Makes the open transaction durable and starts the next one. The folded
+ * fields record which log the commit took in; see btree_storage_recover().
+ */
+int btree_commit(uint64_t folded_bytes, uint64_t folded_hash) {
+    if (btree.fd < 0 || btree.failed) return 0;
+    for (int i = 0; i < BTREE_POOL_PAGES; i++) {
+        if (btree.frames[i].page && !btree_flush_frame(&btree.frames[i])) return 0;
+    }
+    if (fdatasync(btree.fd) != 0) return 0;
+    
+    unsigned char page[BTREE_PAGE_SIZE];
+    BtreeMeta m = btree.meta;
+    m.txid = btree.tx;
+    m.page_count = btree.page_count;
+    memcpy(m.roots, btree.roots, sizeof(m.roots));
+    m.folded_bytes = folded_bytes;
+    m.folded_hash = folded_hash;
+    m.checksum = btree_meta_checksum(&m);
+    memset(page, 0, sizeof(page));
+    memcpy(page, &m, sizeof(m));
+    if (!full_pwrite(btree.fd, page, sizeof(page), (off_t)(m.txid % 2) * BTREE_PAGE_SIZE) ||
+        fdatasync(btree.fd) != 0) {
+        return 0;
+    }
+    
+    btree.meta = m;
+    btree.tx = m.txid + 1;
+    // The pages this commit replaced are unreachable now that it is on disk
+    for (int i = 0; btree.free_known && i < btree.released_count; i++) {
+        if (!push_u32(&btree.free_pages, &btree.free_count, &btree.free_capacity, btree.released[i])) {
+            btree.free_known = 0;
+            btree.free_count = 0;
+        }
+    }
+    btree.released_count = 0;
+    return 1;
+}
+
+/* -------------------- Storage Backends -------------------- */
+/*
+ * Where the product, customer and user tables live between runs. The
+ * resident tables and the write-ahead log sit in front of the backend:
+ * lookups never reach it, and load() fills the tables at startup and
+ * whenever another till has checkpointed.
+ *
+ *  - csv: products.csv, customers.csv and users.csv. New products and
+ *    customers are appended, and users.csv rewritten, as each log group
+ *    commits; a checkpoint rewrites products.csv with the current stock.
+ *  - btree: shop.db (see B-Tree Storage). Catalog changes stay in the log
+ *    until a checkpoint, which writes only the rows that differ.
+ *
+ * The B-tree is in use while shop.db exists, the way sales_store/ turns on
+ * the columnar store; System Maintenance moves the catalog between the
+ * two. Sales stay in sales.csv under either backend: the sales index, the
+ * aggregates and the columnar store are built from it and answer the
+ * date-range reads.
+ */
+typedef struct {
+    const char *name;
+    int catalog_in_log;                /* catalog records are not written out at commit */
+    void (*recover)(void);             /* settles a checkpoint that was interrupted */
+    int (*load)(void);                 /* fills the product, customer and user tables */
+    int (*checkpoint)(int customers_edited);  /* folds the log in and retires it */
+    int (*export_csv)(void);           /* brings the catalog CSV files up to date */
+} StorageBackend;
+
+/* Rewrites users.csv from the user table. */
+int save_users() {
+    FILE *tmp = fopen(USERS_TMP_FILE, "w");
+    if (!tmp) return 0;
+    
+    for (int i = 0; i < user_table.count; i++) write_user_row(tmp, &user_table.rows[i]);
+    
+    if (fflush(tmp) != 0 || fsync(fileno(tmp)) != 0) {
+        fclose(tmp);
+        remove(USERS_TMP_FILE);
+        return 0;
+    }
+    if (fclose(tmp) != 0 || rename(USERS_TMP_FILE, USERS_FILE) != 0) {
+        remove(USERS_TMP_FILE);
+        return 0;
+    }
+    return 1;
+}
+
+static int csv_storage_load() {
+    return load_products() && load_customers() && load_users();
+}
+
+/* Rewrites products.csv with the stock the log has changed, in the steps described under Stock Journal. */
+static int csv_storage_checkpoint(int customers_edited) {
+    if (customers_edited && !save_customers()) return 0;
+    if (!save_products()) return 0;
+    
+    if (rename(WAL_FILE, WAL_FOLDED) != 0) {
+        remove(PRODUCTS_TMP_FILE);
+        return 0;
+    }
+    remove(PRODUCTS_FILE);
+    if (rename(PRODUCTS_TMP_FILE, PRODUCTS_FILE) != 0) {
+        // Leave the folded log in place; recovery completes the swap
+        return 0;
+    }
+    retire_log(WAL_FOLDED);
+    return 1;
+}
+
+/* The files are the store, and each commit keeps them current. */
+static int csv_storage_export() {
+    return 1;
+}
+
+static const StorageBackend csv_storage = {
+    "csv", 0, recover_checkpoint, csv_storage_load, csv_storage_checkpoint, csv_storage_export
+};
+
+static int load_product_value(uint32_t key, const void *value, void *ctx) {
+    (void)key;
+    (void)ctx;
+    return product_table_add(value) != NULL;
+}
+
+static int load_customer_value(uint32_t key, const void *value, void *ctx) {
+    (void)key;
+    (void)ctx;
+    return customer_table_add(value) != NULL;
+}
+
+static int load_user_value(uint32_t key, const void *value, void *ctx) {
+    (void)key;
+    (void)ctx;
+    return user_table_add(value);
+}
+
+static int btree_storage_load() {
+    if (!btree_open(BTREE_FILE, 0)) return 0;
+    
+    int64_t start = metric_start();
+    if (!btree_scan(BTREE_PRODUCTS, load_product_value, NULL)) return 0;
+    metric_stop(METRIC_LOAD_PRODUCTS, start);
+    
+    start = metric_start();
+    if (!btree_scan(BTREE_CUSTOMERS, load_customer_value, NULL)) return 0;
+    metric_stop(METRIC_LOAD_CUSTOMERS, start);
+    
+    return btree_scan(BTREE_USERS, load_user_value, NULL);
+}
+
+/* Size and hash of a whole log file, so recovery can tell whether a commit folded it in. */
+static int log_fingerprint(const char *path, uint64_t *bytes, uint64_t *hash) {
+    MappedFile m;
+    if (!map_file(path, &m)) return 0;
+    *bytes = m.size;
+    *hash = hash_bytes(m.data ? m.data : "", m.size);
+    unmap_file(&m);
+    return 1;
+}
+
+typedef struct {
+    uint32_t *ids;
+    int count;
+    int capacity;
+} StaleIds;
+
+static int collect_stale_user(uint32_t key, const void *value, void *ctx) {
+    (void)value;
+    StaleIds *stale = ctx;
+    return user_lookup_id((int)key) || push_u32(&stale->ids, &stale->count, &stale->capacity, key);
+}
+
+/* Puts every resident row into the open transaction; rows that have not changed cost a lookup. */
+static int btree_put_catalog() {
+    for (int i = 0; i < product_table.count; i++) {
+        ProductRecord r;
+        product_record(product_row(i), &r);
+        if (!btree_put(BTREE_PRODUCTS, (uint32_t)r.id, &r)) return 0;
+    }
+    for (int i = 0; i < customer_table.count; i++) {
+        CustomerRecord r;
+        customer_record(customer_row(i), &r);
+        if (!btree_put(BTREE_CUSTOMERS, (uint32_t)r.id, &r)) return 0;
+    }
+    for (int i = 0; i < user_table.count; i++) {
+        // Copied field by field so bytes past each string compare equal
+        const User *u = &user_table.rows[i];
+        User r;
+        memset(&r, 0, sizeof(r));
+        r.id = u->id;
+        snprintf(r.username, sizeof(r.username), "%s", u->username);
+        snprintf(r.password_hash, sizeof(r.password_hash), "%s", u->password_hash);
+        r.permissions = u->permissions;
+        if (!btree_put(BTREE_USERS, (uint32_t)r.id, &r)) return 0;
+    }
+    
+    StaleIds stale = { NULL, 0, 0 };
+    int ok = btree_scan(BTREE_USERS, collect_stale_user, &stale);
+    for (int i = 0; ok && i < stale.count; i++) ok = btree_remove(BTREE_USERS, stale.ids[i]);
+    free(stale.ids);
+    return ok && !btree.failed;
+}
+
+/*
+ * Settles a checkpoint that stopped between retiring the log to
+ * .wal_folded and removing it: the log is spent if the last commit to
+ * shop.db recorded its size and hash, and is otherwise put back.
+ */
+static void btree_storage_recover() {
+    if (!file_exists(WAL_FOLDED)) return;
+    
+    uint64_t bytes, hash;
+    if (!btree_open(BTREE_FILE, 0) || !log_fingerprint(WAL_FOLDED, &bytes, &hash)) return;
+    if (bytes == btree.meta.folded_bytes && hash == btree.meta.folded_hash) {
+        retire_log(WAL_FOLDED);
+    } else if (!file_exists(WAL_FILE)) {
+        rename(WAL_FOLDED, WAL_FILE);
+    }
+}
+
+/* Writes the rows that changed since the last checkpoint in one copy-on-write commit. */
+static int btree_storage_checkpoint(int customers_edited) {
+    (void)customers_edited;
+    if (btree.fd < 0 && !btree_open(BTREE_FILE, 0)) return 0;
+    
+    uint64_t bytes, hash;
+    if (!btree_put_catalog() || !log_fingerprint(WAL_FILE, &bytes, &hash)) {
+        btree_close();
+        return 0;
+    }
+    if (rename(WAL_FILE, WAL_FOLDED) != 0) {
+        btree_close();
+        return 0;
+    }
+    if (!btree_commit(bytes, hash)) {
+        btree_close();
+        btree_storage_recover();
+        return 0;
+    }
+    retire_log(WAL_FOLDED);
+    return 1;
+}
+
+static int btree_storage_export() {
+    if (!save_products()) return 0;
+    if (rename(PRODUCTS_TMP_FILE, PRODUCTS_FILE) != 0) {
+        remove(PRODUCTS_TMP_FILE);
+        return 0;
+    }
+    return save_customers() && save_users();
+}
+
+static const StorageBackend btree_storage = {
+    "btree", 1, btree_storage_recover, btree_storage_load, btree_storage_checkpoint, btree_storage_export
+};
+
+static const StorageBackend *storage = &csv_storage;
+
+static void storage_select() {
+    storage = file_exists(BTREE_FILE) ? &btree_storage : &csv_storage;
+}
+
+/* Writes shop.db from the resident tables. Must hold the lock, just after a checkpoint. */
+int btree_storage_create() {
+    if (!btree_open(BTREE_TMP_FILE, 1)) return 0;
+    int ok = btree_put_catalog() && btree_commit(0, 0);
+    btree_close();
+    if (ok && rename(BTREE_TMP_FILE, BTREE_FILE) != 0) ok = 0;
+    if (!ok) remove(BTREE_TMP_FILE);
+    return ok;
+}
+
+/* -------------------- Catalog Snapshot -------------------- */
+/*
+ * shop.snap is a copy of the resident catalog as it stood at a known point
+ * of the log: the product, customer and user tables with their id
+ * indexes, the SKU index, the reorder heap, both search indexes, the
+ * shipped positions and the string pool. It is written at every checkpoint and when a till
+ * shuts down, and lets the next start skip parsing the catalog and
+ * rebuilding the search indexes. The file is mapped and used in place:
+ * strings, search keys and posting lists point into the mapping, which
+ * stays until stop_shop(). Posting lists are copied out when they grow.
+ *
+ * The header records the size, inode and mtime of each file the catalog
+ * is loaded from, and shop.wal's identity, its length at the snapshot and
+ * a hash of the log records just before that point. The snapshot is only used when
+ * every one of them still matches, the checksum over the whole file
+ * holds, and the string pool is still empty (the first load of a run);
+ * startup then replays the log from that offset. Anything else loads the
+ * catalog from storage as before. The snapshot is a cache, so it is not
+ * synced: a torn one fails its checksum.
+ */
+#define SNAPSHOT_MAGIC 0x50414E53u /* "SNAP" */
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_ALIGN 16
+#define SNAPSHOT_BUFFER (1 << 16)
+#define SNAPSHOT_WAL_TAIL 64
+
+/* Files the catalog is loaded from; a snapshot is stale once any of them changes. */
+static const char *const snapshot_sources[] = {
+    PRODUCTS_FILE, CUSTOMERS_FILE, USERS_FILE, BTREE_FILE, REPLICATION_FILE, STOCK_JOURNAL_FILE
+};
+
+#define SNAPSHOT_SOURCE_COUNT ((int)(sizeof(snapshot_sources) / sizeof(snapshot_sources[0])))
+
+enum {
+    SNAPSHOT_STRINGS,          /* bytes: every pooled string, NUL-terminated */
+    SNAPSHOT_STRING_SLOTS,     /* uint32: string offset + 1 per pool slot, 0 when empty */
+    SNAPSHOT_PRODUCTS,         /* SnapshotProduct */
+    SNAPSHOT_PRODUCT_IDS,      /* IdSlot */
+    SNAPSHOT_PRODUCT_SKUS,     /* SkuSlot */
+    SNAPSHOT_REORDER,          /* ReorderEntry, in heap order */
+    SNAPSHOT_CUSTOMERS,        /* SnapshotCustomer */
+    SNAPSHOT_CUSTOMER_IDS,     /* IdSlot */
+    SNAPSHOT_USERS,            /* User */
+    SNAPSHOT_SHIP_POSITIONS,   /* ShipPosition, MAX_BRANCH + 1 */
+    SNAPSHOT_PRODUCT_SEARCH,   /* SnapshotKey, key text, SearchPosting, uint32 version per row */
+    SNAPSHOT_CUSTOMER_SEARCH = SNAPSHOT_PRODUCT_SEARCH + 4,
+    SNAPSHOT_SECTIONS = SNAPSHOT_CUSTOMER_SEARCH + 4
+};
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;          /* all four 0 when the file does not exist */
+} SnapshotStamp;
+
+typedef struct {
+    uint64_t offset;           /* from the start of the file */
+    uint64_t count;            /* elements, or slots for the hash tables */
+    uint64_t used;             /* occupied slots of a hash table */
+} SnapshotSection;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t file_size;
+    SnapshotStamp sources[SNAPSHOT_SOURCE_COUNT];
+    uint64_t wal_dev;
+    uint64_t wal_ino;
+    uint64_t wal_offset;       /* log bytes the tables include */
+    uint64_t wal_tail_hash;    /* FNV-1a over up to SNAPSHOT_WAL_TAIL record bytes before wal_offset */
+    int32_t ship_positions_dirty;
+    int32_t reserved;
+    SnapshotSection sections[SNAPSHOT_SECTIONS];
+    uint64_t checksum;         /* snapshot_hash over every byte after the header */
+} SnapshotHeader;
+
+typedef struct {
+    int32_t id;
+    int32_t stock;
+    int32_t min_stock_level;
+    uint32_t name;             /* offsets into SNAPSHOT_STRINGS */
+    uint32_t category;
+    uint32_t brand;
+    uint32_t sku;
+    Money cost_price;
+    Money sell_price;
+} SnapshotProduct;
+
+typedef struct {
+    int32_t id;
+    uint32_t name;
+    uint32_t phone;
+    uint32_t email;
+    uint32_t address;
+} SnapshotCustomer;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t postings;         /* first posting in the postings section */
+    uint32_t key;              /* offset + 1 into the key text, 0 for a free slot */
+    int32_t count;
+} SnapshotKey;
+
+static const size_t snapshot_element_size[SNAPSHOT_SECTIONS] = {
+    1, sizeof(uint32_t), sizeof(SnapshotProduct), sizeof(IdSlot), sizeof(SkuSlot), sizeof(ReorderEntry),
+    sizeof(SnapshotCustomer), sizeof(IdSlot), sizeof(User), sizeof(ShipPosition),
+    sizeof(SnapshotKey), 1, sizeof(SearchPosting), sizeof(uint32_t),
+    sizeof(SnapshotKey), 1, sizeof(SearchPosting), sizeof(uint32_t)
+};
+
+static MappedFile catalog_snapshot;
+static SnapshotHeader catalog_snapshot_at;  /* the last snapshot loaded or written; magic 0 if none */
+
+/*
+ * A checksum that keeps up with memory bandwidth: four independent 64-bit
+ * lanes, each taking every fourth word with the xxHash64 round, folded
+ * together with the tail bytes and the length at the end. Input arrives in
+ * runs of whole 32-byte stripes until the last.
+ */
+typedef struct {
+    uint64_t lane[4];
+    uint64_t bytes;
+} SnapshotHash;
+
+#define SNAPSHOT_PRIME1 0x9E3779B185EBCA87ULL
+#define SNAPSHOT_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t rotl64(uint64_t x, int n) {
+    return (x << n) | (x >> (64 - n));
+}
+
+static void snapshot_hash_init(SnapshotHash *h) {
+    h->lane[0] = SNAPSHOT_PRIME1 + SNAPSHOT_PRIME2;
+    h->lane[1] = SNAPSHOT_PRIME2;
+    h->lane[2] = 0;
+    h->lane[3] = 0 - SNAPSHOT_PRIME1;
+    h->bytes = 0;
+}
+
+/* Folds in n bytes, a multiple of 32. */
+static void snapshot_hash_stripes(SnapshotHash *h, const char *p, size_t n) {
+    uint64_t a = h->lane[0], b = h->lane[1], c = h->lane[2], d = h->lane[3];
+    for (size_t i = 0; i < n; i += 32) {
+        uint64_t w[4];
+        memcpy(w, p + i, sizeof(w));
+        a = rotl64(a + w[0] * SNAPSHOT_PRIME2, 31) * SNAPSHOT_PRIME1;
+        b = rotl64(b + w[1] * SNAPSHOT_PRIME2, 31) * SNAPSHOT_PRIME1;
+        c = rotl64(c + w[2] * SNAPSHOT_PRIME2, 31) * SNAPSHOT_PRIME1;
+        d = rotl64(d + w[3] * SNAPSHOT_PRIME2, 31) * SNAPSHOT_PRIME1;
+    }
+    h->lane[0] = a;
+    h->lane[1] = b;
+    h->lane[2] = c;
+    h->lane[3] = d;
+    h->bytes += n;
+}
+
+/* Folds in the last n (< 32) bytes and returns the checksum. */
+static uint64_t snapshot_hash_finish(const SnapshotHash *h, const char *tail, size_t n) {
+    uint64_t x = rotl64(h->lane[0], 1) + rotl64(h->lane[1], 7) + rotl64(h->lane[2], 12) + rotl64(h->lane[3], 18);
+    x ^= hash_bytes(tail, n);
+    x = (x ^ (h->bytes + n)) * SNAPSHOT_PRIME1;
+    x ^= x >> 29;
+    x *= SNAPSHOT_PRIME2;
+    return x ^ (x >> 32);
+}
+
+static void snapshot_stamp(const char *path, SnapshotStamp *s) {
+    struct stat st;
+    memset(s, 0, sizeof(*s));
+    if (stat(path, &st) != 0) return;
+    s->dev = (uint64_t)st.st_dev;
+    s->ino = (uint64_t)st.st_ino;
+    s->size = (int64_t)st.st_size;
+    s->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+/*
+ * Fills in where the catalog stands now: its source files and the log up
+ * to offset. The log's records start at log_start; the header before them
+ * is left out of the hash because its synced mark moves on.
+ */
+static int snapshot_position(SnapshotHeader *h, int wal_fd, off_t log_start, off_t offset) {
+    for (int i = 0; i < SNAPSHOT_SOURCE_COUNT; i++) snapshot_stamp(snapshot_sources[i], &h->sources[i]);
+    
+    struct stat st;
+    if (fstat(wal_fd, &st) != 0 || offset < log_start || offset > st.st_size) return 0;
+    char tail[SNAPSHOT_WAL_TAIL];
+    size_t n = offset - log_start > SNAPSHOT_WAL_TAIL ? SNAPSHOT_WAL_TAIL : (size_t)(offset - log_start);
+    if (!full_pread(wal_fd, tail, n, offset - (off_t)n)) return 0;
+    h->wal_dev = (uint64_t)st.st_dev;
+    h->wal_ino = (uint64_t)st.st_ino;
+    h->wal_offset = (uint64_t)offset;
+    h->wal_tail_hash = hash_bytes(tail, n);
+    return 1;
+}
+
+static int snapshot_same_position(const SnapshotHeader *a, const SnapshotHeader *b) {
+    return memcmp(a->sources, b->sources, sizeof(a->sources)) == 0 && a->wal_dev == b->wal_dev &&
+           a->wal_ino == b->wal_ino && a->wal_offset == b->wal_offset && a->wal_tail_hash == b->wal_tail_hash;
+}
+
+/* Buffers the sections on their way to the file and checksums them as they go. */
+typedef struct {
+    FILE *f;
+    uint64_t offset;           /* file offset of the next byte */
+    SnapshotHash hash;
+    size_t fill;
+    int ok;
+    char buf[SNAPSHOT_BUFFER];
+} SnapshotWriter;
+
+/* Writes out and checksums the whole stripes in the buffer, keeping the rest. */
+static void snapshot_flush(SnapshotWriter *w) {
+    size_t whole = w->fill & ~(size_t)31;
+    if (w->ok && fwrite(w->buf, 1, whole, w->f) != whole) w->ok = 0;
+    snapshot_hash_stripes(&w->hash, w->buf, whole);
+    memmove(w->buf, w->buf + whole, w->fill - whole);
+    w->fill -= whole;
+}
+
+static void snapshot_put(SnapshotWriter *w, const void *data, size_t n) {
+    const char *p = data;
+    w->offset += n;
+    while (n > 0) {
+        size_t room = sizeof(w->buf) - w->fill;
+        size_t take = n < room ? n : room;
+        memcpy(w->buf + w->fill, p, take);
+        w->fill += take;
+        p += take;
+        n -= take;
+        if (w->fill == sizeof(w->buf)) snapshot_flush(w);
+    }
+}
+
+/* Pads to SNAPSHOT_ALIGN and starts section s there. */
+static void snapshot_begin(SnapshotWriter *w, SnapshotHeader *h, int s, uint64_t count, uint64_t used) {
+    static const char zeros[SNAPSHOT_ALIGN];
+    snapshot_put(w, zeros, (size_t)(-w->offset & (SNAPSHOT_ALIGN - 1)));
+    h->sections[s].offset = w->offset;
+    h->sections[s].count = count;
+    h->sections[s].used = used;
+}
+
+/* Offset of a pooled string in SNAPSHOT_STRINGS, found through its pool slot. */
+static uint32_t snapshot_string(SnapshotWriter *w, const uint32_t *slot_offsets, const char *s) {
+    if (interned.capacity == 0) {
+        w->ok = 0;
+        return 0;
+    }
+    const char **slot = string_pool_slot(&interned, s, strlen(s));
+    uint32_t offset = slot_offsets[slot - interned.slots];
+    if (!*slot || *slot != s || offset == 0) {
+        w->ok = 0;
+        return 0;
+    }
+    return offset - 1;
+}
+
+static void snapshot_put_search(SnapshotWriter *w, SnapshotHeader *h, int s, const SearchIndex *idx, int rows) {
+    uint64_t postings = 0;
+    size_t text = 0;
+    snapshot_begin(w, h, s, idx->capacity, idx->used);
+    for (size_t i = 0; i < idx->capacity; i++) {
+        const SearchKey *k = &idx->slots[i];
+        SnapshotKey out;
+        memset(&out, 0, sizeof(out));
+        if (k->key) {
+            if (text >= UINT32_MAX - SEARCH_MAX_PREFIX) w->ok = 0;
+            out.hash = k->hash;
+            out.postings = postings;
+            out.key = (uint32_t)text + 1;
+            out.count = k->count;
+            postings += (uint64_t)k->count;
+            text += strlen(k->key) + 1;
+        }
+        snapshot_put(w, &out, sizeof(out));
+    }
+    
+    snapshot_begin(w, h, s + 1, text, 0);
+    for (size_t i = 0; i < idx->capacity; i++) {
+        if (idx->slots[i].key) snapshot_put(w, idx->slots[i].key, strlen(idx->slots[i].key) + 1);
+    }
+    snapshot_begin(w, h, s + 2, postings, 0);
+    for (size_t i = 0; i < idx->capacity; i++) {
+        const SearchKey *k = &idx->slots[i];
+        if (k->key) snapshot_put(w, k->postings, (size_t)k->count * sizeof(SearchPosting));
+    }
+    snapshot_begin(w, h, s + 3, (uint64_t)rows, 0);
+    for (int row = 0; row < rows; row++) {
+        uint32_t version = row < idx->row_capacity ? idx->versions[row] : 0;
+        snapshot_put(w, &version, sizeof(version));
+    }
+}
+
+static void snapshot_put_catalog(SnapshotWriter *w, SnapshotHeader *h, uint32_t *slot_offsets) {
+    size_t text = 0;
+    snapshot_begin(w, h, SNAPSHOT_STRINGS, 0, 0);
+    for (size_t i = 0; i < interned.capacity; i++) {
+        const char *s = interned.slots[i];
+        slot_offsets[i] = 0;
+        if (!s) continue;
+        size_t n = strlen(s) + 1;
+        if (text + n >= UINT32_MAX) w->ok = 0;
+        slot_offsets[i] = (uint32_t)text + 1;
+        snapshot_put(w, s, n);
+        text += n;
+    }
+    h->sections[SNAPSHOT_STRINGS].count = text;
+    snapshot_begin(w, h, SNAPSHOT_STRING_SLOTS, interned.capacity, interned.used);
+    snapshot_put(w, slot_offsets, interned.capacity * sizeof(uint32_t));
+    
+    snapshot_begin(w, h, SNAPSHOT_PRODUCTS, (uint64_t)product_table.count, 0);
+    for (int i = 0; i < product_table.count; i++) {
+        const Product *p = product_row(i);
+        SnapshotProduct out;
+        memset(&out, 0, sizeof(out));
+        out.id = p->id;
+        out.stock = p->stock;
+        out.min_stock_level = p->min_stock_level;
+        out.name = snapshot_string(w, slot_offsets, p->text->name);
+        out.category = snapshot_string(w, slot_offsets, p->text->category);
+        out.brand = snapshot_string(w, slot_offsets, p->text->brand);
+        out.sku = snapshot_string(w, slot_offsets, p->text->sku);
+        out.cost_price = p->cost_price;
+        out.sell_price = p->sell_price;
+        snapshot_put(w, &out, sizeof(out));
+    }
+    snapshot_begin(w, h, SNAPSHOT_PRODUCT_IDS, product_table.index.capacity, product_table.index.used);
+    snapshot_put(w, product_table.index.slots, product_table.index.capacity * sizeof(IdSlot));
+    SkuIndex *skus = &product_table.sku_index;
+    snapshot_begin(w, h, SNAPSHOT_PRODUCT_SKUS, skus->capacity, skus->used);
+    snapshot_put(w, skus->slots, skus->capacity * sizeof(SkuSlot));
+    snapshot_begin(w, h, SNAPSHOT_REORDER, (uint64_t)reorder_heap.count, 0);
+    snapshot_put(w, reorder_heap.heap, (size_t)reorder_heap.count * sizeof(ReorderEntry));
+    
+    snapshot_begin(w, h, SNAPSHOT_CUSTOMERS, (uint64_t)customer_table.count, 0);
+    for (int i = 0; i < customer_table.count; i++) {
+        const Customer *c = customer_row(i);
+        SnapshotCustomer out;
+        out.id = c->id;
+        out.name = snapshot_string(w, slot_offsets, c->name);
+        out.phone = snapshot_string(w, slot_offsets, c->phone);
+        out.email = snapshot_string(w, slot_offsets, c->email);
+        out.address = snapshot_string(w, slot_offsets, c->address);
+        snapshot_put(w, &out, sizeof(out));
+    }
+    snapshot_begin(w, h, SNAPSHOT_CUSTOMER_IDS, customer_table.index.capacity, customer_table.index.used);
+    snapshot_put(w, customer_table.index.slots, customer_table.index.capacity * sizeof(IdSlot));
+    
+    snapshot_begin(w, h, SNAPSHOT_USERS, (uint64_t)user_table.count, 0);
+    snapshot_put(w, user_table.rows, (size_t)user_table.count * sizeof(User));
+    snapshot_begin(w, h, SNAPSHOT_SHIP_POSITIONS, MAX_BRANCH + 1, 0);
+    snapshot_put(w, ship_positions, sizeof(ship_positions));
+    h->ship_positions_dirty = ship_positions_dirty;
+    
+    snapshot_put_search(w, h, SNAPSHOT_PRODUCT_SEARCH, &product_search, product_table.count);
+    snapshot_put_search(w, h, SNAPSHOT_CUSTOMER_SEARCH, &customer_search, customer_table.count);
+}
+
+/*
+ * Writes shop.snap from the resident catalog, which must include the log
+ * records from log_start up to offset. Must hold the lock. Does nothing if
+ * this run already loaded or wrote a snapshot at the same point.
+ */
+int save_snapshot(int wal_fd, off_t log_start, off_t offset) {
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    if (wal_fd < 0 || !snapshot_position(&h, wal_fd, log_start, offset)) return 0;
+    if (catalog_snapshot_at.magic == SNAPSHOT_MAGIC && snapshot_same_position(&catalog_snapshot_at, &h) &&
+        file_exists(SNAPSHOT_FILE)) {
+        return 1;
+    }
+    
+    SnapshotWriter *w = malloc(sizeof(*w));
+    uint32_t *slot_offsets = malloc((interned.capacity ? interned.capacity : 1) * sizeof(uint32_t));
+    if (!w || !slot_offsets) {
+        free(w);
+        free(slot_offsets);
+        return 0;
+    }
+    w->f = fopen(SNAPSHOT_TMP_FILE, "wb");
+    w->ok = w->f && fwrite(&h, sizeof(h), 1, w->f) == 1;
+    w->offset = sizeof(h);
+    w->fill = 0;
+    snapshot_hash_init(&w->hash);
+    if (w->ok) {
+        int64_t start = metric_start();
+        snapshot_put_catalog(w, &h, slot_offsets);
+        snapshot_flush(w);
+        if (w->ok && fwrite(w->buf, 1, w->fill, w->f) != w->fill) w->ok = 0;
+        h.magic = SNAPSHOT_MAGIC;
+        h.version = SNAPSHOT_VERSION;
+        h.file_size = w->offset;
+        h.checksum = snapshot_hash_finish(&w->hash, w->buf, w->fill);
+        if (w->ok && (fseek(w->f, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, w->f) != 1)) w->ok = 0;
+        metric_stop(METRIC_SAVE_SNAPSHOT, start);
+    }
+    if (w->f && fclose(w->f) != 0) w->ok = 0;
+    
+    int ok = w->ok && rename(SNAPSHOT_TMP_FILE, SNAPSHOT_FILE) == 0;
+    if (ok) catalog_snapshot_at = h;
+    if (!ok) remove(SNAPSHOT_TMP_FILE);
+    free(w);
+    free(slot_offsets);
+    return ok;
+}
+
+/* Section s of the mapped snapshot, or NULL if it does not fit in the file. */
+static const void *snapshot_section(const SnapshotHeader *h, int s) {
+    const SnapshotSection *sec = &h->sections[s];
+    size_t size = snapshot_element_size[s];
+    if (sec->offset % SNAPSHOT_ALIGN != 0 || sec->offset > h->file_size ||
+        sec->count > (h->file_size - sec->offset) / size || sec->used > sec->count) {
+        return NULL;
+    }
+    return catalog_snapshot.data + sec->offset;
+}
+
+static int snapshot_id_index(IdIndex *idx, const SnapshotSection *sec, const IdSlot *slots, int rows) {
+    if (sec->count == 0) return 1;
+    if ((sec->count & (sec->count - 1)) != 0 || !id_index_alloc(idx, sec->count)) return 0;
+    memcpy(idx->slots, slots, sec->count * sizeof(IdSlot));
+    idx->used = sec->used;
+    for (size_t i = 0; i < idx->capacity; i++) {
+        if (idx->slots[i].row != INDEX_EMPTY && (idx->slots[i].row < 0 || idx->slots[i].row >= rows)) return 0;
+    }
+    return 1;
+}
+
+static int snapshot_sku_index(SkuIndex *idx, const SnapshotSection *sec, const SkuSlot *slots, int rows) {
+    if (sec->count == 0) return 1;
+    if ((sec->count & (sec->count - 1)) != 0 || !sku_index_alloc(idx, sec->count)) return 0;
+    memcpy(idx->slots, slots, sec->count * sizeof(SkuSlot));
+    idx->used = sec->used;
+    for (size_t i = 0; i < idx->capacity; i++) {
+        if (idx->slots[i].row != INDEX_EMPTY && (idx->slots[i].row < 0 || idx->slots[i].row >= rows)) return 0;
+    }
+    return 1;
+}
+
+static int snapshot_search(SearchIndex *idx, const SnapshotHeader *h, int s, int rows) {
+    const SnapshotKey *keys = snapshot_section(h, s);
+    const char *text = snapshot_section(h, s + 1);
+    SearchPosting *postings = (SearchPosting *)snapshot_section(h, s + 2);
+    const uint32_t *versions = snapshot_section(h, s + 3);
+    const SnapshotSection *sec = h->sections + s;
+    uint64_t text_size = sec[1].count, posting_count = sec[2].count;
+    if (!keys || !text || !postings || !versions || sec[3].count != (uint64_t)rows ||
+        (text_size > 0 && text[text_size - 1] != '\0') || (sec->count & (sec->count - 1)) != 0) {
+        return 0;
+    }
+    
+    idx->borrowed = catalog_snapshot.data;
+    idx->borrowed_size = catalog_snapshot.size;
+    if (sec->count > 0) {
+        idx->slots = calloc(sec->count, sizeof(SearchKey));
+        if (!idx->slots) return 0;
+        idx->capacity = sec->count;
+        idx->used = sec->used;
+    }
+    for (size_t i = 0; i < idx->capacity; i++) {
+        const SnapshotKey *in = &keys[i];
+        if (in->key == 0) continue;
+        if (in->key > text_size || in->count <= 0 || in->postings > posting_count ||
+            (uint64_t)in->count > posting_count - in->postings) {
+            return 0;
+        }
+        SearchKey *k = &idx->slots[i];
+        k->key = (char *)text + in->key - 1;
+        k->hash = in->hash;
+        k->postings = postings + in->postings;
+        k->count = in->count;
+        k->capacity = in->count;
+    }
+    if (rows > 0 && !search_ensure_rows(idx, rows - 1)) return 0;
+    if (rows > 0) memcpy(idx->versions, versions, (size_t)rows * sizeof(uint32_t));
+    return 1;
+}
+
+/* Fills the empty tables, the search indexes and the string pool from the mapped snapshot. */
+static int snapshot_fill(const SnapshotHeader *h) {
+    const char *strings = snapshot_section(h, SNAPSHOT_STRINGS);
+    const uint32_t *string_slots = snapshot_section(h, SNAPSHOT_STRING_SLOTS);
+    const SnapshotProduct *products = snapshot_section(h, SNAPSHOT_PRODUCTS);
+    const IdSlot *product_ids = snapshot_section(h, SNAPSHOT_PRODUCT_IDS);
+    const SkuSlot *product_skus = snapshot_section(h, SNAPSHOT_PRODUCT_SKUS);
+    const ReorderEntry *reorder = snapshot_section(h, SNAPSHOT_REORDER);
+    const SnapshotCustomer *customers = snapshot_section(h, SNAPSHOT_CUSTOMERS);
+    const IdSlot *customer_ids = snapshot_section(h, SNAPSHOT_CUSTOMER_IDS);
+    const User *users = snapshot_section(h, SNAPSHOT_USERS);
+    const ShipPosition *positions = snapshot_section(h, SNAPSHOT_SHIP_POSITIONS);
+    const SnapshotSection *sec = h->sections;
+    uint64_t text_size = sec[SNAPSHOT_STRINGS].count;
+    uint64_t string_capacity = sec[SNAPSHOT_STRING_SLOTS].count;
+    if (!strings || !string_slots || !products || !product_ids || !product_skus || !reorder || !customers ||
+        !customer_ids || !users || !positions || sec[SNAPSHOT_SHIP_POSITIONS].count != MAX_BRANCH + 1 ||
+        sec[SNAPSHOT_PRODUCTS].count > INT_MAX || sec[SNAPSHOT_CUSTOMERS].count > INT_MAX ||
+        sec[SNAPSHOT_USERS].count > INT_MAX || sec[SNAPSHOT_REORDER].count != sec[SNAPSHOT_PRODUCTS].count ||
+        (string_capacity & (string_capacity - 1)) != 0 || (text_size > 0 && strings[text_size - 1] != '\0')) {
+        return 0;
+    }
+#define SNAPSHOT_TEXT(offset) ((offset) < text_size ? strings + (offset) : NULL)
+    
+    int nproducts = (int)sec[SNAPSHOT_PRODUCTS].count;
+    for (int i = 0; i < nproducts; i++) {
+        const SnapshotProduct *in = &products[i];
+        Product *row = slab_reserve(&product_table.rows, i);
+        ProductText *text = slab_reserve(&product_table.text, i);
+        if (!row || !text) return 0;
+        text->name = SNAPSHOT_TEXT(in->name);
+        text->category = SNAPSHOT_TEXT(in->category);
+        text->brand = SNAPSHOT_TEXT(in->brand);
+        text->sku = SNAPSHOT_TEXT(in->sku);
+        if (!text->name || !text->category || !text->brand || !text->sku) return 0;
+        row->id = in->id;
+        row->stock = in->stock;
+        row->min_stock_level = in->min_stock_level;
+        row->cost_price = in->cost_price;
+        row->sell_price = in->sell_price;
+        row->text = text;
+        if (in->id > product_table.max_id) product_table.max_id = in->id;
+        product_table.count++;
+    }
+    if (!snapshot_id_index(&product_table.index, &sec[SNAPSHOT_PRODUCT_IDS], product_ids, nproducts) ||
+        !snapshot_sku_index(&product_table.sku_index, &sec[SNAPSHOT_PRODUCT_SKUS], product_skus, nproducts)) {
+        return 0;
+    }
+    
+    ReorderHeap *r = &reorder_heap;
+    if (nproducts > 0) {
+        r->heap = malloc((size_t)nproducts * sizeof(*r->heap));
+        r->pos = malloc((size_t)nproducts * sizeof(*r->pos));
+        if (!r->heap || !r->pos) return 0;
+        r->capacity = nproducts;
+    }
+    for (int i = 0; i < nproducts; i++) {
+        if (reorder[i].row < 0 || reorder[i].row >= nproducts) return 0;
+        reorder_set(i, reorder[i]);
+    }
+    r->count = nproducts;
+    
+    int ncustomers = (int)sec[SNAPSHOT_CUSTOMERS].count;
+    for (int i = 0; i < ncustomers; i++) {
+        const SnapshotCustomer *in = &customers[i];
+        Customer *row = slab_reserve(&customer_table.rows, i);
+        if (!row) return 0;
+        row->id = in->id;
+        row->name = SNAPSHOT_TEXT(in->name);
+        row->phone = SNAPSHOT_TEXT(in->phone);
+        row->email = SNAPSHOT_TEXT(in->email);
+        row->address = SNAPSHOT_TEXT(in->address);
+        if (!row->name || !row->phone || !row->email || !row->address) return 0;
+        if (in->id > customer_table.max_id) customer_table.max_id = in->id;
+        customer_table.count++;
+    }
+    if (!snapshot_id_index(&customer_table.index, &sec[SNAPSHOT_CUSTOMER_IDS], customer_ids, ncustomers)) return 0;
+    
+    int nusers = (int)sec[SNAPSHOT_USERS].count;
+    if (nusers > 0) {
+        user_table.rows = malloc((size_t)nusers * sizeof(User));
+        if (!user_table.rows) return 0;
+        memcpy(user_table.rows, users, (size_t)nusers * sizeof(User));
+        user_table.capacity = nusers;
+    }
+    for (int i = 0; i < nusers; i++) {
+        User *u = &user_table.rows[i];
+        u->username[sizeof(u->username) - 1] = '\0';
+        u->password_hash[sizeof(u->password_hash) - 1] = '\0';
+        if (u->id > user_table.max_id) user_table.max_id = u->id;
+        user_table.count++;
+    }
+    if (!user_table_reindex()) return 0;
+    
+    memcpy(ship_positions, positions, sizeof(ship_positions));
+    ship_positions_dirty = h->ship_positions_dirty;
+    
+    if (!snapshot_search(&product_search, h, SNAPSHOT_PRODUCT_SEARCH, nproducts) ||
+        !snapshot_search(&customer_search, h, SNAPSHOT_CUSTOMER_SEARCH, ncustomers)) {
+        return 0;
+    }
+    
+    // Last, so that a snapshot given up on leaves the pool as it was
+    if (string_capacity > 0) {
+        const char **slots = arena_calloc(&interned.arena, string_capacity, sizeof(char *));
+        if (!slots) return 0;
+        for (size_t i = 0; i < string_capacity; i++) {
+            if (string_slots[i] == 0) continue;
+            slots[i] = SNAPSHOT_TEXT(string_slots[i] - 1);
+            if (!slots[i]) return 0;
+        }
+        interned.slots = slots;
+        interned.capacity = string_capacity;
+        interned.used = sec[SNAPSHOT_STRING_SLOTS].used;
+    }
+#undef SNAPSHOT_TEXT
+    return 1;
+}
+
+/*
+ * Loads the catalog from shop.snap into the empty tables if the snapshot
+ * still matches its sources and the log, whose records start at log_start.
+ * Returns the log offset to replay from, or 0 when the catalog has to be
+ * loaded from storage; the tables may then be partly filled and must be
+ * dropped first.
+ */
+off_t load_snapshot(off_t log_start) {
+    if (interned.used > 0 || catalog_snapshot.data || !file_exists(SNAPSHOT_FILE)) return 0;
+    int64_t start = metric_start();
+    
+    int fd = open(SNAPSHOT_FILE, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return 0;
+    }
+    // Private and writable, so nothing written through the tables reaches the file
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+    catalog_snapshot.data = data;
+    catalog_snapshot.size = (size_t)st.st_size;
+    
+    SnapshotHeader h, now;
+    memcpy(&h, data, sizeof(h));
+    memset(&now, 0, sizeof(now));
+    int wal_fd = open(WAL_FILE, O_RDONLY);
+    int ok = h.magic == SNAPSHOT_MAGIC && h.version == SNAPSHOT_VERSION && h.file_size == (uint64_t)st.st_size &&
+             wal_fd >= 0 && snapshot_position(&now, wal_fd, log_start, (off_t)h.wal_offset) &&
+             snapshot_same_position(&h, &now);
+    if (wal_fd >= 0) close(wal_fd);
+    
+    if (ok) {
+        SnapshotHash sum;
+        size_t body = catalog_snapshot.size - sizeof(h);
+        snapshot_hash_init(&sum);
+        snapshot_hash_stripes(&sum, catalog_snapshot.data + sizeof(h), body & ~(size_t)31);
+        ok = snapshot_hash_finish(&sum, catalog_snapshot.data + catalog_snapshot.size - (body & 31), body & 31) ==
+             h.checksum;
+    }
+    if (ok && !snapshot_fill(&h)) {
+        printf("Warning: Unable to load %s; loading the catalog instead.\n", SNAPSHOT_FILE);
+        ok = 0;
+    }
+    if (!ok) {
+        unmap_file(&catalog_snapshot);
+        return 0;
+    }
+    catalog_snapshot_at = h;
+    metric_stop(METRIC_LOAD_SNAPSHOT, start);
+    return (off_t)h.wal_offset;
+}
+
+/* Unmaps the snapshot once nothing points into it any more (after string_pool_destroy). */
+void snapshot_close() {
+    unmap_file(&catalog_snapshot);
+    memset(&catalog_snapshot_at, 0, sizeof(catalog_snapshot_at));
+}
+
+/* -------------------- Write-Ahead Log -------------------- */
+/*
+ * Every mutation is first appended to shop.wal as a group of records, then
+ * applied to the CSV files and the resident tables. The sequence is:
+ *
+ *   1. take the process lock and apply groups other tills have appended
+ *   2. append the new group (one write), apply its file changes, and mark
+ *      the group applied
+ *   3. release the lock, wait out the group-commit window, and fdatasync
+ *      the log unless another till's sync already covered this group
+ *
+ * Stock changes only live in the log until a checkpoint folds them into
+ * products.csv (the same temp/rename sequence as the old stock journal, with
+ * shop.wal renamed to .wal_folded). A till that finds the log replaced
+ * reloads the catalog from the checkpoint.
+ *
+ * A group that is complete but not marked applied was left by a till that
+ * died mid-commit; the next till to take the lock redoes its file changes.
+ * Sales, products and customers are skipped when their id is already at the
+ * end of the file, and user changes are idempotent, so replay never
+ * duplicates a row. A torn trailing group fails its checksum and is cut off.
+ * On a branch a retired log is kept for shipping rather than removed (see
+ * Branches).
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t synced;           /* log bytes known to be on disk */
+} WalFileHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;            /* records in the group */
+    uint32_t bytes;            /* record bytes after this header */
+    uint32_t applied;          /* set once the file changes are done */
+    uint64_t checksum;         /* FNV-1a over the record bytes */
+    int64_t timestamp;
+} WalGroupHeader;
+
+typedef struct {
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t length;
+} WalRecordHeader;
+
+enum { WAL_STOCK = 1, WAL_SALE, WAL_PRODUCT, WAL_CUSTOMER, WAL_USER, WAL_SHIP };
+
+/*
+ * A WAL_SALE shipped in from a branch (see Log Shipping). Its cashier is a
+ * user there rather than here, so the record names them. A WAL_SHIP record
+ * carries the branch's new ShipPosition.
+ */
+typedef struct {
+    Sale sale;
+    char cashier[50];
+} BranchSale;
+
+/* Decodes a WAL_SALE payload. cashier points into a BranchSale's payload, or is NULL for a local sale. */
+static int wal_decode_sale(const char *payload, uint32_t len, Sale *s, const char **cashier) {
+    *cashier = NULL;
+    if (len == sizeof(Sale)) {
+        memcpy(s, payload, sizeof(*s));
+        return 1;
+    }
+    if (len != sizeof(BranchSale)) return 0;
+    const BranchSale *shipped = (const BranchSale *)payload;
+    memcpy(s, &shipped->sale, sizeof(*s));
+    *cashier = shipped->cashier;
+    return 1;
+}
+
+static int wal_decode_user_change(const char *payload, uint32_t len, UserChange *c) {
+    if (len != sizeof(*c)) return 0;
+    memcpy(c, payload, sizeof(*c));
+    return 1;
+}
+
+static int wal_decode_product(const char *payload, uint32_t len, ProductRecord *p) {
+    if (len != sizeof(*p)) return 0;
+    memcpy(p, payload, sizeof(*p));
+    return 1;
+}
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int count;
+} WalGroup;
+
+typedef struct {
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;              /* end of the last group applied here */
+} WalState;
+
+static WalState wal = { -1, 0, 0, 0 };
+
+/* Starting sizes of the files a group appended to, for rollback. */
+typedef struct {
+    const char *path;
+    off_t start;
+} WalAppend;
+
+int wal_add(WalGroup *g, int type, const void *payload, size_t len) {
+    size_t need = g->len + sizeof(WalRecordHeader) + len;
+    if (need > g->capacity) {
+        size_t capacity = g->capacity ? g->capacity : 1024;
+        while (capacity < need) capacity *= 2;
+        char *data = realloc(g->data, capacity);
+        if (!data) return 0;
+        g->data = data;
+        g->capacity = capacity;
+    }
+    
+    WalRecordHeader rh = { (uint16_t)type, 0, (uint32_t)len };
+    memcpy(g->data + g->len, &rh, sizeof(rh));
+    memcpy(g->data + g->len + sizeof(rh), payload, len);
+    g->len = need;
+    g->count++;
+    return 1;
+}
+
+void wal_group_free(WalGroup *g) {
+    free(g->data);
+    memset(g, 0, sizeof(*g));
+}
+
+static int wal_commit_window_ms() {
+    const char *env = getenv("SHOP_WAL_COMMIT_MS");
+    if (!env || !*env) return DEFAULT_WAL_COMMIT_MS;
+    int ms = atoi(env);
+    return ms < 0 ? 0 : ms;
+}
+
+/* Forces a data file to disk before the log records that describe it are folded away. */
+static int fsync_path(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT;
+    int ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+/* True if a row with this id is among the last rows of a CSV file. */
+static int file_tail_has_id(const char *path, int id) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    
+    int seek_back = fseek(f, -65536L, SEEK_END) == 0;
+    if (!seek_back) rewind(f);
+    
+    char line[MAX_LINE];
+    CsvRecord rec;
+    int found = 0;
+    // The first line after the seek is usually partial
+    if (seek_back && !fgets(line, sizeof(line), f)) line[0] = '\0';
+    while (!found && fgets(line, sizeof(line), f)) {
+        if (csv_split_line(line, &rec) && csv_int(&rec, 0) == id) found = 1;
+    }
+    fclose(f);
+    return found;
+}
+
+static FILE *wal_open_append(WalAppend *appends, int *count, const char *path) {
+    FILE *f = fopen(path, "a");
+    if (!f) return NULL;
+    
+    int known = 0;
+    for (int i = 0; i < *count; i++) {
+        if (appends[i].path == path) known = 1;
+    }
+    if (!known) {
+        struct stat st;
+        appends[*count].path = path;
+        appends[*count].start = fstat(fileno(f), &st) == 0 ? st.st_size : -1;
+        (*count)++;
+    }
+    return f;
+}
+
+static void wal_undo_appends(const WalAppend *appends, int count) {
+    for (int i = 0; i < count; i++) {
+        if (appends[i].start >= 0 && truncate(appends[i].path, appends[i].start) != 0) {
+            printf("Warning: Unable to roll back %s.\n", appends[i].path);
+        }
+    }
+}
+
+static const char *wal_next_record(const char *p, const char *end, WalRecordHeader *rh) {
+    if ((size_t)(end - p) < sizeof(*rh)) return NULL;
+    memcpy(rh, p, sizeof(*rh));
+    if (rh->length > (size_t)(end - p) - sizeof(*rh)) return NULL;
+    return p + sizeof(*rh);
+}
+
+/*
+ * Applies a group's changes to the CSV files. When replaying another till's
+ * group, rows already at the end of their file are skipped.
+ */
+static int wal_apply_files(const char *data, size_t len, int replay) {
+    WalAppend appends[3];
+    int append_count = 0;
+    const char *end = data + len;
+    WalRecordHeader rh;
+    const char *payload;
+    int ok = 1;
+    
+    for (const char *p = data; ok && (payload = wal_next_record(p, end, &rh)); p = payload + rh.length) {
+        // The B-tree takes catalog records from the log at checkpoints
+        if (storage->catalog_in_log && rh.type != WAL_SALE) continue;
+        const char *path = NULL;
+        int id = 0;
+        Sale sale;
+        const char *cashier = NULL;
+        ProductRecord prod;
+        UserChange change;
+        if (rh.type == WAL_SALE && wal_decode_sale(payload, rh.length, &sale, &cashier)) {
+            path = SALES_FILE;
+            id = sale.id;
+        } else if (rh.type == WAL_PRODUCT && wal_decode_product(payload, rh.length, &prod)) {
+            path = PRODUCTS_FILE;
+            id = prod.id;
+        } else if (rh.type == WAL_CUSTOMER && rh.length == sizeof(CustomerRecord)) {
+            path = CUSTOMERS_FILE;
+            id = ((const CustomerRecord *)payload)->id;
+        } else if (rh.type == WAL_USER && wal_decode_user_change(payload, rh.length, &change)) {
+            ok = apply_user_change(&change);
+            continue;
+        } else {
+            continue;
+        }
+        if (replay && file_tail_has_id(path, id)) continue;
+        
+        FILE *f = wal_open_append(appends, &append_count, path);
+        if (!f) {
+            ok = 0;
+            break;
+        }
+        if (rh.type == WAL_SALE && cashier) {
+            char when[32];
+            format_datetime(sale.date, when, sizeof(when));
+            write_sale_fields(f, &sale, when, cashier);
+        } else if (rh.type == WAL_SALE) {
+            write_sale_row(f, &sale);
+        } else if (rh.type == WAL_PRODUCT) {
+            write_product_row(f, &prod);
+        } else {
+            write_customer_row(f, (const CustomerRecord *)payload);
+        }
+        if (fclose(f) != 0) ok = 0;
+    }
+    
+    if (!ok) wal_undo_appends(appends, append_count);
+    return ok;
+}
+
+/* Applies a group's changes to the resident tables and search indexes. */
+static void wal_apply_memory(const char *data, size_t len) {
+    const char *end = data + len;
+    WalRecordHeader rh;
+    const char *payload;
+    ProductRecord prod;
+    UserChange change;
+    
+    for (const char *p = data; (payload = wal_next_record(p, end, &rh)); p = payload + rh.length) {
+        if (rh.type == WAL_STOCK && rh.length == sizeof(StockJournalRecord)) {
+            const StockJournalRecord *r = (const StockJournalRecord *)payload;
+            Product *prod = product_lookup(r->product_id);
+            if (prod) apply_stock_delta(prod, r->delta);
+        } else if (rh.type == WAL_PRODUCT && wal_decode_product(payload, rh.length, &prod)) {
+            if (!product_lookup(prod.id) &&
+                (!product_table_add(&prod) || !index_product_row(product_table.count - 1))) {
+                printf("Warning: Out of memory while indexing product.\n");
+            }
+        } else if (rh.type == WAL_CUSTOMER && rh.length == sizeof(CustomerRecord)) {
+            const CustomerRecord *cust = (const CustomerRecord *)payload;
+            if (!customer_lookup(cust->id) &&
+                (!customer_table_add(cust) || !index_customer_row(customer_table.count - 1))) {
+                printf("Warning: Out of memory while indexing customer.\n");
+            }
+        } else if (rh.type == WAL_USER && wal_decode_user_change(payload, rh.length, &change)) {
+            if (!user_table_apply(&change)) printf("Warning: Out of memory while indexing user.\n");
+        } else if (rh.type == WAL_SHIP && rh.length == sizeof(ShipPosition)) {
+            ShipPosition pos;
+            memcpy(&pos, payload, sizeof(pos));
+            if (pos.branch >= 1 && pos.branch <= MAX_BRANCH) {
+                ship_positions[pos.branch] = pos;
+                ship_positions_dirty = 1;
+            }
+        }
+    }
+}
+
+static int wal_mark_applied(off_t group_start) {
+    uint32_t applied = 1;
+    return full_pwrite(wal.fd, &applied, sizeof(applied), group_start + offsetof(WalGroupHeader, applied));
+}
+
+static int wal_open() {
+    if (wal.fd >= 0) close(wal.fd);
+    wal.fd = open(WAL_FILE, O_RDWR | O_CREAT, 0644);
+    if (wal.fd < 0) return 0;
+    
+    struct stat st;
+    if (fstat(wal.fd, &st) != 0) return 0;
+    
+    WalFileHeader h;
+    if ((size_t)st.st_size < sizeof(h)) {
+        h.magic = WAL_MAGIC;
+        h.version = WAL_VERSION;
+        h.synced = sizeof(h);
+        if (ftruncate(wal.fd, 0) != 0 || !full_pwrite(wal.fd, &h, sizeof(h), 0)) return 0;
+    } else if (!full_pread(wal.fd, &h, sizeof(h), 0) || h.magic != WAL_MAGIC || h.version != WAL_VERSION) {
+        printf("Error: %s is not a supported write-ahead log.\n", WAL_FILE);
+        close(wal.fd);
+        wal.fd = -1;
+        return 0;
+    }
+    
+    wal.dev = st.st_dev;
+    wal.ino = st.st_ino;
+    wal.offset = sizeof(h);
+    return 1;
+}
+
+/* Applies every group appended since the last call. Must hold the lock. */
+static int wal_catch_up() {
+    struct stat st;
+    if (fstat(wal.fd, &st) != 0) return 0;
+    
+    char *buf = NULL;
+    size_t buf_size = 0;
+    int ok = 1;
+    while (wal.offset < st.st_size) {
+        WalGroupHeader gh;
+        if ((size_t)(st.st_size - wal.offset) < sizeof(gh) ||
+            !full_pread(wal.fd, &gh, sizeof(gh), wal.offset) ||
+            gh.magic != WAL_GROUP_MAGIC ||
+            gh.bytes > (uint64_t)(st.st_size - wal.offset) - sizeof(gh)) {
+            break;
+        }
+        if (gh.bytes > buf_size) {
+            char *grown = realloc(buf, gh.bytes);
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            buf = grown;
+            buf_size = gh.bytes;
+        }
+        if (!full_pread(wal.fd, buf, gh.bytes, wal.offset + (off_t)sizeof(gh)) ||
+            hash_bytes(buf, gh.bytes) != gh.checksum) {
+            break;
+        }
+        
+        if (!gh.applied) {
+            if (!wal_apply_files(buf, gh.bytes, 1)) {
+                ok = 0;
+                break;
+            }
+            wal_mark_applied(wal.offset);
+        }
+        wal_apply_memory(buf, gh.bytes);
+        wal.offset += (off_t)(sizeof(gh) + gh.bytes);
+    }
+    free(buf);
+    
+    // Whatever is left is a group torn by a till that died while writing it
+    if (ok && wal.offset < st.st_size && ftruncate(wal.fd, wal.offset) != 0) ok = 0;
+    return ok;
+}
+
+static void drop_catalog() {
+    search_index_free(&product_search);
+    search_index_free(&customer_search);
+    slab_pool_free(&product_table.rows);
+    slab_pool_free(&product_table.text);
+    id_index_free(&product_table.index);
+    sku_index_free(&product_table.sku_index);
+    reorder_heap_free();
+    product_table.count = product_table.max_id = 0;
+    slab_pool_free(&customer_table.rows);
+    id_index_free(&customer_table.index);
+    customer_table.count = customer_table.max_id = 0;
+    user_table_free();
+}
+
+/*
+ * Drops the resident catalog and loads it again from the checkpoint and the
+ * log, or at startup from the catalog snapshot and the log after it.
+ */
+static int wal_reload() {
+    storage_select();
+    storage->recover();
+    drop_catalog();
+    
+    off_t resume = load_snapshot(sizeof(WalFileHeader));
+    if (resume == 0) {
+        drop_catalog();
+        if (!storage->load() || !load_ship_positions()) return 0;
+        if (!migrate_stock_journal()) {
+            printf("Warning: Unable to fold the old stock journal.\n");
+        }
+        if (!build_search_indexes()) return 0;
+    }
+    if (!wal_open()) return 0;
+    if (resume > wal.offset) wal.offset = resume;
+    return wal_catch_up();
+}
+
+/* Takes the process lock and brings the resident tables up to date with the log. */
+int wal_lock() {
+    if (!shop_lock()) return 0;
+    if (shop_lock_depth > 1) return 1;
+    
+    struct stat st;
+    int current = wal.fd >= 0 && stat(WAL_FILE, &st) == 0 && st.st_dev == wal.dev && st.st_ino == wal.ino;
+    if (current ? wal_catch_up() : wal_reload()) return 1;
+    
+    shop_unlock();
+    return 0;
+}
+
+void wal_unlock() {
+    shop_unlock();
+}
+
+/* Appends a group and applies it. Must hold the lock; the group is not yet durable. */
+int wal_commit(WalGroup *g) {
+    if (g->count == 0) return 1;
+    
+    WalGroupHeader gh;
+    memset(&gh, 0, sizeof(gh));
+    gh.magic = WAL_GROUP_MAGIC;
+    gh.count = (uint32_t)g->count;
+    gh.bytes = (uint32_t)g->len;
+    gh.checksum = hash_bytes(g->data, g->len);
+    gh.timestamp = (int64_t)time(NULL);
+    
+    int64_t started = metric_start();
+    off_t start = wal.offset;
+    int ok = full_pwrite(wal.fd, &gh, sizeof(gh), start) &&
+             full_pwrite(wal.fd, g->data, g->len, start + (off_t)sizeof(gh));
+    if (ok && !wal_apply_files(g->data, g->len, 0)) ok = 0;
+    
+    if (!ok) {
+        if (ftruncate(wal.fd, start) != 0) printf("Warning: Unable to roll back %s.\n", WAL_FILE);
+        return 0;
+    }
+    // An unmarked group is only redone by replay, which skips rows already written
+    wal_mark_applied(start);
+    wal_apply_memory(g->data, g->len);
+    wal.offset = start + (off_t)(sizeof(gh) + g->len);
+    metric_stop(METRIC_WAL_COMMIT, started);
+    metric_count(COUNTER_WAL_BYTES, sizeof(gh) + g->len);
+    return 1;
+}
+
+/* Makes the log behind fd durable up to target and advances the shared mark. */
+static int wal_sync_log(int fd, off_t target) {
+    WalFileHeader h;
+    if (full_pread(fd, &h, sizeof(h), 0) && h.synced >= (uint64_t)target) return 1;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || fdatasync(fd) != 0) return 0;
+    
+    // Advance the shared mark; a stale value only costs another till a sync
+    if (shop_lock()) {
+        if (full_pread(fd, &h, sizeof(h), 0) && h.synced < (uint64_t)st.st_size) {
+            h.synced = (uint64_t)st.st_size;
+            full_pwrite(fd, &h, sizeof(h), 0);
+        }
+        shop_unlock();
+    }
+    return 1;
+}
+
+/*
+ * Makes every group this till committed durable. Waiting out the commit
+ * window first lets groups from other tills share a single fdatasync.
+ */
+static int wal_sync_groups() {
+    if (wal.fd < 0) return 0;
+    off_t target = wal.offset;
+    
+    int window = wal_commit_window_ms();
+    if (window > 0) usleep((useconds_t)window * 1000);
+    return wal_sync_log(wal.fd, target);
+}
+
+/*
+ * Write-behind. In the interactive till wal_sync() hands the log offset to
+ * a background writer instead of waiting on the disk: the commit itself
+ * (the log append, the CSV appends and the resident tables) still happens
+ * under the lock, since other tills order and read their changes from
+ * those files, but the fdatasync moves off the cashier's path. Requests
+ * pass through a single-producer, single-consumer ring. The writer takes
+ * everything queued, waits out the commit window and covers it all with
+ * one sync, so a sale is on disk within about one window and one sync of
+ * being rung up. wal_barrier() waits for whatever has been handed over.
+ */
+typedef struct {
+    off_t target;              /* log bytes to make durable */
+    dev_t dev;                 /* the log they are in */
+    ino_t ino;
+    int64_t queued;            /* metric_start() at hand-over */
+} WalSyncRequest;
+
+typedef struct {
+    WalSyncRequest ring[WAL_WRITER_SLOTS];
+    atomic_size_t head;        /* next slot to fill; only the till moves it */
+    atomic_size_t tail;        /* next slot to sync; only the writer moves it */
+    atomic_int stop;
+    atomic_int failed;         /* a sync failed since the till last looked */
+    sem_t wake;
+    pthread_mutex_t done_lock;
+    pthread_cond_t done;
+    size_t completed;          /* requests synced, under done_lock */
+    int fd;                    /* the writer's own handle on the log */
+    dev_t dev;
+    ino_t ino;
+    int running;
+    pthread_t thread;
+} WalWriter;
+
+static WalWriter wal_writer = { .fd = -1 };
+
+/* Points the writer's handle at the current log; 0 if there is none. */
+static int wal_writer_reopen(WalWriter *w) {
+    struct stat st;
+    if (stat(WAL_FILE, &st) != 0) return 0;
+    if (w->fd >= 0 && st.st_dev == w->dev && st.st_ino == w->ino) return 1;
+    
+    if (w->fd >= 0) close(w->fd);
+    w->fd = open(WAL_FILE, O_RDWR | O_CLOEXEC);
+    if (w->fd < 0 || fstat(w->fd, &st) != 0) return 0;
+    w->dev = st.st_dev;
+    w->ino = st.st_ino;
+    return 1;
+}
+
+static void *wal_writer_main(void *arg) {
+    WalWriter *w = arg;
+    for (;;) {
+        size_t tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&w->head, memory_order_acquire);
+        if (head == tail) {
+            if (atomic_load(&w->stop)) break;
+            while (sem_wait(&w->wake) != 0 && errno == EINTR) {
+            }
+            continue;
+        }
+        
+        int window = wal_commit_window_ms();
+        if (window > 0 && !atomic_load(&w->stop)) {
+            usleep((useconds_t)window * 1000);
+            head = atomic_load_explicit(&w->head, memory_order_acquire);
+        }
+        
+        // Requests against a log that has since been folded were covered by the checkpoint's syncs
+        int have_log = wal_writer_reopen(w);
+        off_t target = 0;
+        for (size_t i = tail; i != head; i++) {
+            const WalSyncRequest *r = &w->ring[i % WAL_WRITER_SLOTS];
+            if (have_log && r->dev == w->dev && r->ino == w->ino && r->target > target) target = r->target;
+        }
+        if (target > 0) {
+            int64_t start = metric_start();
+            if (!wal_sync_log(w->fd, target)) atomic_store(&w->failed, 1);
+            metric_stop(METRIC_WAL_SYNC, start);
+        }
+        metric_stop(METRIC_WAL_LAG, w->ring[tail % WAL_WRITER_SLOTS].queued);
+        
+        atomic_store_explicit(&w->tail, head, memory_order_release);
+        pthread_mutex_lock(&w->done_lock);
+        w->completed = head;
+        pthread_cond_broadcast(&w->done);
+        pthread_mutex_unlock(&w->done_lock);
+    }
+    return NULL;
+}
+
+static int write_behind_enabled() {
+    const char *env = getenv("SHOP_WRITE_BEHIND");
+    return !env || !*env || strcmp(env, "0") != 0;
+}
+
+/* Starts the writer; without it every wal_sync() waits for the disk. */
+void wal_writer_start() {
+    WalWriter *w = &wal_writer;
+    if (w->running || !write_behind_enabled()) return;
+    if (sem_init(&w->wake, 0, 0) != 0) return;
+    pthread_mutex_init(&w->done_lock, NULL);
+    pthread_cond_init(&w->done, NULL);
+    atomic_store(&w->stop, 0);
+    if (pthread_create(&w->thread, NULL, wal_writer_main, w) != 0) {
+        printf("Warning: Unable to start the write-behind thread; commits will wait for the disk.\n");
+        sem_destroy(&w->wake);
+        pthread_mutex_destroy(&w->done_lock);
+        pthread_cond_destroy(&w->done);
+        return;
+    }
+    w->running = 1;
+}
+
+/* Hands the log up to target to the writer; 0 if the ring is full. */
+static int wal_writer_push(off_t target) {
+    WalWriter *w = &wal_writer;
+    size_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&w->tail, memory_order_acquire) == WAL_WRITER_SLOTS) return 0;
+    
+    WalSyncRequest *r = &w->ring[head % WAL_WRITER_SLOTS];
+    r->target = target;
+    r->dev = wal.dev;
+    r->ino = wal.ino;
+    r->queued = metric_start();
+    atomic_store_explicit(&w->head, head + 1, memory_order_release);
+    sem_post(&w->wake);
+    return 1;
+}
+
+/*
+ * Waits until everything handed to the writer is on disk; 0 if a sync
+ * failed. Must not hold the lock, which the writer takes to advance the
+ * shared mark.
+ */
+int wal_barrier() {
+    WalWriter *w = &wal_writer;
+    if (!w->running) return 1;
+    
+    size_t target = atomic_load_explicit(&w->head, memory_order_relaxed);
+    pthread_mutex_lock(&w->done_lock);
+    while (w->completed < target) pthread_cond_wait(&w->done, &w->done_lock);
+    pthread_mutex_unlock(&w->done_lock);
+    return !atomic_exchange(&w->failed, 0);
+}
+
+/* Drains the ring and stops the writer, for a clean shutdown. */
+void wal_writer_stop() {
+    WalWriter *w = &wal_writer;
+    if (!w->running) return;
+    
+    if (!wal_barrier()) printf("Warning: Unable to flush %s to disk.\n", WAL_FILE);
+    atomic_store(&w->stop, 1);
+    sem_post(&w->wake);
+    pthread_join(w->thread, NULL);
+    w->running = 0;
+    sem_destroy(&w->wake);
+    pthread_mutex_destroy(&w->done_lock);
+    pthread_cond_destroy(&w->done);
+    if (w->fd >= 0) close(w->fd);
+    w->fd = -1;
+}
+
+/* Makes this till's commits durable, or with the writer running, hands them to it. */
+int wal_sync() {
+    if (wal_writer.running && wal.fd >= 0) {
+        // A failure the writer hit since the last call is reported here
+        int failed = atomic_exchange(&wal_writer.failed, 0);
+        if (wal_writer_push(wal.offset)) return !failed;
+    }
+    
+    int64_t start = metric_start();
+    int ok = wal_sync_groups();
+    metric_stop(METRIC_WAL_SYNC, start);
+    return ok;
+}
+
+/* Commits one group from start to finish; returns 0 if it was not recorded. */
+int wal_write(WalGroup *g) {
+    if (!wal_lock()) return 0;
+    int ok = wal_commit(g);
+    wal_unlock();
+    
+    if (ok && !wal_sync()) printf("Warning: Unable to flush %s to disk.\n", WAL_FILE);
+    return ok;
+}
+
+int wal_write_record(int type, const void *payload, size_t len) {
+    WalGroup g = { NULL, 0, 0, 0 };
+    int ok = wal_add(&g, type, payload, len) && wal_write(&g);
+    wal_group_free(&g);
+    return ok;
+}
+
+/* Commits one record while the caller holds the lock; wal_sync() is still needed. */
+int wal_commit_record(int type, const void *payload, size_t len) {
+    WalGroup g = { NULL, 0, 0, 0 };
+    int ok = wal_add(&g, type, payload, len) && wal_commit(&g);
+    wal_group_free(&g);
+    return ok;
+}
+
+/* Picks up changes other tills have logged since the last lock. */
+void wal_refresh() {
+    if (wal_lock()) wal_unlock();
+}
+
+/*
+ * Folds the log into the storage backend, starts a new one and snapshots
+ * the catalog. Must hold the lock. customers_edited says the customer
+ * table was changed in place rather than through the log.
+ */
+int checkpoint_catalog(int customers_edited) {
+    if (!fsync_path(SALES_FILE) || !fsync_path(CUSTOMERS_FILE) || !fsync_path(USERS_FILE)) return 0;
+    // Shipped positions live in the log until now, so they are saved before it goes
+    if (!save_ship_positions()) return 0;
+    if (!storage->checkpoint(customers_edited)) return 0;
+    if (!wal_open()) return 0;
+    if (!save_snapshot(wal.fd, sizeof(WalFileHeader), wal.offset)) {
+        printf("Warning: Unable to write %s.\n", SNAPSHOT_FILE);
+    }
+    return 1;
+}
+
+/*
+ * Moves the catalog to the B-tree or back to the CSV files. Must hold the
+ * lock. The log is checkpointed first so the new store starts complete,
+ * and other tills reload from it once they see the new log.
+ */
+int storage_switch(int to_btree) {
+    if (!checkpoint_catalog(0)) return 0;
+    if (to_btree) {
+        if (!btree_storage_create()) return 0;
+    } else {
+        if (!storage->export_csv()) return 0;
+        btree_close();
+        if (remove(BTREE_FILE) != 0) return 0;
+    }
+    return wal_reload();
+}
+
+int load_catalog() {
+    if (!wal_lock()) return 0;
+    if (!sales_archive_recover()) {
+        printf("Warning: Unable to finish the last sales archive run.\n");
+    }
+    
+    struct stat st;
+    if (fstat(wal.fd, &st) == 0 && st.st_size >= (off_t)WAL_CHECKPOINT_BYTES && !checkpoint_catalog(0)) {
+        printf("Warning: Unable to checkpoint %s.\n", WAL_FILE);
+    }
+    wal_unlock();
+    return 1;
+}
+
+/* Leaves a snapshot of the catalog as it stands for the next start. */
+void snapshot_catalog() {
+    if (wal.fd < 0 || !wal_lock()) return;
+    if (!save_snapshot(wal.fd, sizeof(WalFileHeader), wal.offset)) {
+        printf("Warning: Unable to write %s.\n", SNAPSHOT_FILE);
+    }
+    wal_unlock();
+}
+
+void free_catalog() {
+    if (wal.fd >= 0) {
+        close(wal.fd);
+        wal.fd = -1;
+    }
+    drop_catalog();
+    btree_close();
+}
+
+/* -------------------- User Management -------------------- */
+/* Asks for the first count flags of user_flags in order and packs the answers. */
+static uint32_t prompt_user_flags(int count) {
+    uint32_t bits = 0;
+    for (int i = 0; i < count; i++) {
+        if (get_validated_int(user_flags[i].prompt, 0, 1)) bits |= user_flags[i].bit;
+    }
+    return bits;
+}
+
+void add_user(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_USERS)) {
+        printf("Permission denied: You don't have permission to manage users.\n");
+        return;
+    }
+    
+    User new_user;
+    memset(&new_user, 0, sizeof(new_user));
+    printf("\n=== Add New User (ID: %d) ===\n", id_sequence_peek(SEQ_USERS));
+    
+    get_validated_string("Username: ", new_user.username, sizeof(new_user.username));
+    
+    // Check if username already exists
+    if (find_user(0, new_user.username, NULL)) {
+        printf("Error: Username already exists.\n");
+        return;
+    }
+    
+    char password[MAX_PASSWORD_LEN];
+    printf("Password: ");
+    if (fgets(password, sizeof(password), stdin) == NULL) return;
+    trim_newline(password);
+    
+    if (strlen(password) < 4) {
+        printf("Error: Password must be at least 4 characters long.\n");
+        return;
+    }
+    
+    if (!hash_password(password, new_user.password_hash)) {
+        printf("Error: Unable to read random data for the password salt.\n");
+        return;
+    }
+    
+    printf("\nSet Permissions (1 for Yes, 0 for No):\n");
+    new_user.permissions = prompt_user_flags(USER_FLAG_COUNT - 1) | USER_ACTIVE;
+    
+    if (!wal_lock()) {
+        printf("Error: Unable to open users file.\n");
+        return;
+    }
+    // Another till may have taken the name while this one was prompting
+    int taken = find_user(0, new_user.username, NULL);
+    int ok = 0;
+    if (!taken) {
+        new_user.id = id_sequence_take(SEQ_USERS, 1);
+        UserChange change = { USER_ADD, new_user };
+        ok = wal_commit_record(WAL_USER, &change, sizeof(change));
+    }
+    wal_unlock();
+    
+    if (taken) {
+        printf("Error: Username already exists.\n");
+        return;
+    }
+    if (!ok) {
+        printf("Error: Unable to open users file.\n");
+        return;
+    }
+    if (!wal_sync()) printf("Warning: Unable to flush %s to disk.\n", WAL_FILE);
+    
+    printf("✓ User added successfully.\n");
+}
+
+void list_users(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_USERS)) {
+        printf("Permission denied: You don't have permission to view users.\n");
+        return;
+    }
+    
+    if (user_table.count == 0) {
+        printf("No users found.\n");
+        return;
+    }
+    
+    printf("\n%-4s %-15s", "ID", "Username");
+    for (int i = 0; i < USER_FLAG_COUNT; i++) printf(" %-8s", user_flags[i].column);
+    printf("\n----------------------------------------------------------------\n");
+    
+    for (int r = 0; r < user_table.count; r++) {
+        const User *u = &user_table.rows[r];
+        printf("%-4d %-15s", u->id, u->username);
+        for (int i = 0; i < USER_FLAG_COUNT; i++) {
+            printf(" %-8s", (u->permissions & user_flags[i].bit) ? "Yes" : "No");
+        }
+        printf("\n");
+    }
+}
+
+void delete_user(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_USERS)) {
+        printf("Permission denied: You don't have permission to manage users.\n");
+        return;
+    }
+    
+    int user_id = get_validated_int("Enter user ID to delete: ", 1, MAX_RECORD_ID);
+    
+    // Prevent self-deletion
+    if (user_id == current_user->id) {
+        printf("Error: You cannot delete your own account.\n");
+        return;
+    }
+    
+    UserChange change;
+    memset(&change, 0, sizeof(change));
+    if (!find_user(user_id, NULL, &change.user)) {
+        printf("Error: User ID %d not found.\n", user_id);
+        return;
+    }
+    printf("Found user: %s (ID: %d)\n", change.user.username, change.user.id);
+    
+    char confirm[10];
+    printf("Are you sure you want to delete this user? (yes/no): ");
+    fgets(confirm, sizeof(confirm), stdin);
+    trim_newline(confirm);
+    
+    if (strcasecmp(confirm, "yes") != 0 && strcasecmp(confirm, "y") != 0) {
+        printf("Deletion cancelled.\n");
+        return;
+    }
+    
+    change.op = USER_DELETE;
+    if (!wal_write_record(WAL_USER, &change, sizeof(change))) {
+        printf("Error: Unable to access users file.\n");
+        return;
+    }
+    printf("User deleted successfully.\n");
+}
+
+void edit_user_permissions(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_USERS)) {
+        printf("Permission denied: You don't have permission to manage users.\n");
+        return;
+    }
+    
+    int user_id = get_validated_int("Enter user ID to edit: ", 1, MAX_RECORD_ID);
+    
+    UserChange change;
+    memset(&change, 0, sizeof(change));
+    User *u = &change.user;
+    if (!find_user(user_id, NULL, u)) {
+        printf("Error: User ID %d not found.\n", user_id);
+        return;
+    }
+    
+    printf("\nEditing user: %s (ID: %d)\n", u->username, u->id);
+    printf("Current permissions:\n");
+    for (int i = 0; i < USER_FLAG_COUNT; i++) {
+        printf("  %s: %s\n", user_flags[i].title, (u->permissions & user_flags[i].bit) ? "Yes" : "No");
+    }
+    
+    printf("\nSet new permissions (1 for Yes, 0 for No):\n");
+    u->permissions = prompt_user_flags(USER_FLAG_COUNT);
+    
+    change.op = USER_SET_PERMISSIONS;
+    if (!wal_write_record(WAL_USER, &change, sizeof(change))) {
+        printf("Error: Unable to access users file.\n");
+        return;
+    }
+    printf("✓ User permissions updated successfully.\n");
+}
+
+void user_management_menu(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_USERS)) {
+        printf("Permission denied: You don't have permission to manage users.\n");
+        return;
+    }
+    
+    int running = 1;
+    while (running) {
+        printf("\n=== User Management ===\n");
+        printf("1. Add New User\n");
+        printf("2. List All Users\n");
+        printf("3. Edit User Permissions\n");
+        printf("4. Delete User\n");
+        printf("5. Return to Main Menu\n");
+        
+        int choice = get_validated_int("Select option: ", 1, 5);
+        
+        switch (choice) {
+            case 1: add_user(current_user); break;
+            case 2: list_users(current_user); break;
+            case 3: edit_user_permissions(current_user); break;
+            case 4: delete_user(current_user); break;
+            case 5: running = 0; break;
+        }
+        
+        if (running) pause_and_wait();
+    }
+}
+
+/* -------------------- Product Functions -------------------- */
+void add_product(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_PRODUCTS)) {
+        printf("Permission denied: You don't have permission to manage products.\n");
+        return;
+    }
+    
+    ProductRecord p;
+    memset(&p, 0, sizeof(p));
+    p.id = id_sequence_take(SEQ_PRODUCTS, 1);
+    
+    printf("\n=== Add New Product (ID: %d) ===\n", p.id);
+    
+    get_validated_string("Product Name: ", p.name, sizeof(p.name));
+    while (1) {
+        char sku[100];
+        get_optional_string("SKU / Barcode (blank for none): ", sku, sizeof(sku));
+        const Product *owner = product_lookup_sku(sku);
+        if (strlen(sku) >= sizeof(p.sku)) {
+            printf("Error: A SKU is at most %d characters.\n", (int)sizeof(p.sku) - 1);
+        } else if (owner) {
+            printf("Error: SKU %s already belongs to %s (ID %d).\n", sku, owner->text->name, owner->id);
+        } else {
+            strcpy(p.sku, sku);
+            break;
+        }
+    }
+    get_validated_string("Category: ", p.category, sizeof(p.category));
+    get_validated_string("Brand: ", p.brand, sizeof(p.brand));
+    p.cost_price = get_validated_money("Cost Price: ", 0);
+    p.sell_price = get_validated_money("Sell Price: ", p.cost_price);
+    p.stock = get_validated_int("Stock Quantity: ", 0, 10000);
+    p.min_stock_level = get_validated_int("Minimum Stock Level: ", 0, 10000);
+    
+    if (!wal_write_record(WAL_PRODUCT, &p, sizeof(p))) { 
+        printf("Error: Unable to save product.\n"); 
+        return; 
+    }
+    
+    printf("✓ Product added successfully.\n");
+}
+
+static const char *product_columns[] = { "id", "name", "category", "brand", "cost", "price", "stock", "min" };
+static ListView product_view;
+
+static int compare_product_rows(const void *a, const void *b) {
+    const Product *x = product_row(*(const int *)a), *y = product_row(*(const int *)b);
+    int cmp = 0;
+    switch (product_view.sort_column) {
+        case 1: cmp = strcasecmp(x->text->name, y->text->name); break;
+        case 2: cmp = strcasecmp(x->text->category, y->text->category); break;
+        case 3: cmp = strcasecmp(x->text->brand, y->text->brand); break;
+        case 4: cmp = (x->cost_price > y->cost_price) - (x->cost_price < y->cost_price); break;
+        case 5: cmp = (x->sell_price > y->sell_price) - (x->sell_price < y->sell_price); break;
+        case 6: cmp = (x->stock > y->stock) - (x->stock < y->stock); break;
+        case 7: cmp = (x->min_stock_level > y->min_stock_level) - (x->min_stock_level < y->min_stock_level); break;
+    }
+    return list_order(cmp, x->id, y->id, product_view.descending);
+}
+
+void list_products(User *current_user) {
+    if (product_table.count == 0) { 
+        printf("No products found.\n"); 
+        return; 
+    }
+    
+    int *order = malloc((size_t)product_table.count * sizeof(int));
+    if (!order) {
+        printf("Error: Out of memory.\n");
+        return;
+    }
+    for (int i = 0; i < product_table.count; i++) order[i] = i;
+    list_view_init(&product_view, product_table.count);
+    OutBuf out = { NULL, 0, 0 };
+    
+    for (;;) {
+        if (product_view.resorted) {
+            for (int i = 0; i < product_table.count; i++) order[i] = i;
+            if (product_view.sort_column >= 0) qsort(order, (size_t)product_table.count, sizeof(int), compare_product_rows);
+            product_view.resorted = 0;
+        }
+        
+        outbuf_printf(&out, "\n%-4s %-20s %-15s %-15s %-8s %-8s %-6s %-6s\n", 
+                      "ID", "Name", "Category", "Brand", "Cost", "Price", "Stock", "Min");
+        outbuf_printf(&out, "-------------------------------------------------------------------------------\n");
+        
+        long first = product_view.page * product_view.page_size;
+        for (long i = first; i < product_table.count && i < first + product_view.page_size; i++) {
+            const Product *p = product_row(order[i]);
+            char cost[MONEY_TEXT], price[MONEY_TEXT];
+            outbuf_printf(&out, "%-4d %-20s %-15s %-15s %-8s %-8s %-6d %-6d\n", 
+                          p->id, p->text->name, p->text->category, p->text->brand, format_money(p->cost_price, cost, sizeof(cost)),
+                          format_money(p->sell_price, price, sizeof(price)), p->stock, p->min_stock_level);
+        }
+        outbuf_flush(&out);
+        
+        if (list_view_pages(&product_view) <= 1) break;
+        if (!list_view_prompt(&product_view, product_columns, 8)) break;
+    }
+    outbuf_free(&out);
+    free(order);
+}
+
+void search_products(User *current_user) {
+    if (product_table.count == 0) { 
+        printf("No products found.\n"); 
+        return; 
+    }
+    
+    char search_term[100];
+    get_validated_string("Enter search term (name, category, or brand): ", search_term, sizeof(search_term));
+    
+    size_t mark = arena_mark(&report_arena);
+    int hit_count;
+    SearchHit *hits = search_products_index(search_term, &hit_count);
+    
+    printf("\nSearch Results:\n");
+    printf("%-4s %-20s %-15s %-15s %-8s %-8s %-6s\n", 
+           "ID", "Name", "Category", "Brand", "Cost", "Price", "Stock");
+    printf("----------------------------------------------------------------\n");
+    
+    for (int i = 0; i < hit_count; i++) {
+        const Product *p = product_row(hits[i].row);
+        char cost[MONEY_TEXT], price[MONEY_TEXT];
+        printf("%-4d %-20s %-15s %-15s %-8s %-8s %-6d\n", 
+               p->id, p->text->name, p->text->category, p->text->brand, format_money(p->cost_price, cost, sizeof(cost)),
+               format_money(p->sell_price, price, sizeof(price)), p->stock);
+    }
+    arena_release(&report_arena, mark);
+    
+    if (hit_count == 0) {
+        printf("No products found matching '%s'\n", search_term);
+    }
+}
+
+int find_product_by_id(Product *out, int id) {
+    Product *p = product_lookup(id);
+    if (!p) return 0;
+    if (out) *out = *p;
+    return 1;
+}
+
+/* What was scanned or typed at a product prompt: a SKU if one matches, else a product id. */
+const Product *find_product_by_code(const char *code) {
+    const Product *p = product_lookup_sku(code);
+    int id;
+    char tail;
+    if (!p && sscanf(code, "%d %c", &id, &tail) == 1) p = product_lookup(id);
+    return p;
+}
+
+/* -------------------- Customer Functions -------------------- */
+/* Returns the new customer's id, or 0 if none was added. */
+int add_customer(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_CUSTOMERS)) {
+        printf("Permission denied: You don't have permission to manage customers.\n");
+        return 0;
+    }
+    
+    CustomerRecord c;
+    memset(&c, 0, sizeof(c));
+    c.id = id_sequence_take(SEQ_CUSTOMERS, 1);
+    
+    printf("\n=== Add New Customer (ID: %d) ===\n", c.id);
+    
+    get_validated_string("Full Name: ", c.name, sizeof(c.name));
+    get_validated_string("Phone: ", c.phone, sizeof(c.phone));
+    get_validated_string("Email: ", c.email, sizeof(c.email));
+    get_validated_string("Address: ", c.address, sizeof(c.address));
+    
+    if (!wal_write_record(WAL_CUSTOMER, &c, sizeof(c))) { 
+        printf("Error: Unable to save customer.\n"); 
+        return 0; 
+    }
+    
+    printf("✓ Customer added successfully.\n");
+    return c.id;
+}
+
+static const char *customer_columns[] = { "id", "name", "phone", "email", "address" };
+static ListView customer_view;
+
+static int compare_customer_rows(const void *a, const void *b) {
+    const Customer *x = customer_row(*(const int *)a), *y = customer_row(*(const int *)b);
+    int cmp = 0;
+    switch (customer_view.sort_column) {
+        case 1: cmp = strcasecmp(x->name, y->name); break;
+        case 2: cmp = strcmp(x->phone, y->phone); break;
+        case 3: cmp = strcasecmp(x->email, y->email); break;
+        case 4: cmp = strcasecmp(x->address, y->address); break;
+    }
+    return list_order(cmp, x->id, y->id, customer_view.descending);
+}
+
+void list_customers(User *current_user) {
+    if (customer_table.count == 0) { 
+        printf("No customers found.\n"); 
+        return; 
+    }
+    
+    int *order = malloc((size_t)customer_table.count * sizeof(int));
+    if (!order) {
+        printf("Error: Out of memory.\n");
+        return;
+    }
+    for (int i = 0; i < customer_table.count; i++) order[i] = i;
+    list_view_init(&customer_view, customer_table.count);
+    OutBuf out = { NULL, 0, 0 };
+    
+    for (;;) {
+        if (customer_view.resorted) {
+            for (int i = 0; i < customer_table.count; i++) order[i] = i;
+            if (customer_view.sort_column >= 0) qsort(order, (size_t)customer_table.count, sizeof(int), compare_customer_rows);
+            customer_view.resorted = 0;
+        }
+        
+        outbuf_printf(&out, "\n%-4s %-20s %-15s %-25s %-30s\n", 
+                      "ID", "Name", "Phone", "Email", "Address");
+        outbuf_printf(&out, "----------------------------------------------------------------------------------------\n");
+        
+        long first = customer_view.page * customer_view.page_size;
+        for (long i = first; i < customer_table.count && i < first + customer_view.page_size; i++) {
+            const Customer *c = customer_row(order[i]);
+            outbuf_printf(&out, "%-4d %-20s %-15s %-25s %-30s\n", 
+                          c->id, c->name, c->phone, c->email, c->address);
+        }
+        outbuf_flush(&out);
+        
+        if (list_view_pages(&customer_view) <= 1) break;
+        if (!list_view_prompt(&customer_view, customer_columns, 5)) break;
+    }
+    outbuf_free(&out);
+    free(order);
+}
+
+void search_customers(User *current_user) {
+    if (customer_table.count == 0) { 
+        printf("No customers found.\n"); 
+        return; 
+    }
+    
+    char search_term[100];
+    get_validated_string("Enter search term (name, phone, or email): ", search_term, sizeof(search_term));
+    
+    size_t mark = arena_mark(&report_arena);
+    int hit_count;
+    SearchHit *hits = search_customers_index(search_term, &hit_count);
+    
+    printf("\nSearch Results:\n");
+    printf("%-4s %-20s %-15s %-25s\n", "ID", "Name", "Phone", "Email");
+    printf("----------------------------------------------------\n");
+    
+    for (int i = 0; i < hit_count; i++) {
+        const Customer *c = customer_row(hits[i].row);
+        printf("%-4d %-20s %-15s %-25s\n", c->id, c->name, c->phone, c->email);
+    }
+    arena_release(&report_arena, mark);
+    
+    if (hit_count == 0) {
+        printf("No customers found matching '%s'\n", search_term);
+    }
+}
+
+int find_customer_by_id(Customer *out, int id) {
+    Customer *c = customer_lookup(id);
+    if (!c) return 0;
+    if (out) *out = *c;
+    return 1;
+}
+
+/* -------------------- Sales Queries -------------------- */
+/*
+ * Filtered access to sales rows. A product filter walks that product's
+ * posting list, a date range seeks through the day index, and anything else
+ * scans. Archived rows come first, from the archive blocks the date range
+ * touches. When the columnar store is enabled, months outside the range are
+ * skipped and the remaining rows are filtered. A branch is told apart by
+ * the sale id (see Branches).
+ */
+typedef struct {
+    int day_from;              /* yyyymmdd inclusive, 0 = unbounded */
+    int day_to;
+    int product_id;            /* 0 = any */
+    char cashier[50];          /* "" = any */
+    int branch;                /* 0 = any */
+} SalesFilter;
+
+typedef struct {
+    int id;
+    int product_id;
+    int customer_id;
+    int quantity;
+    Money total_price;
+    int day;
+    const char *cashier;       /* interned */
+} SaleRow;
+
+typedef void (*SaleRowFn)(const SaleRow *row, void *ctx);
+
+int sales_filter_empty(const SalesFilter *f) {
+    return !f->day_from && !f->day_to && !f->product_id && !f->cashier[0] && !f->branch;
+}
+
+/* cashier is the filter's cashier interned, or NULL for any. */
+static int sales_filter_match(const SalesFilter *f, const char *cashier, const SaleRow *row) {
+    if (f->day_from && row->day < f->day_from) return 0;
+    if (f->day_to && row->day > f->day_to) return 0;
+    if (f->product_id && row->product_id != f->product_id) return 0;
+    if (cashier && row->cashier != cashier) return 0;
+    if (f->branch && id_branch(row->id) != f->branch) return 0;
+    return 1;
+}
+
+static void sale_row_from_record(const CsvRecord *rec, SaleRow *row) {
+    row->id = csv_int(rec, 0);
+    row->product_id = csv_int(rec, 1);
+    row->customer_id = csv_int(rec, 2);
+    row->quantity = csv_int(rec, 3);
+    row->total_price = csv_money(rec, 4);
+    row->day = field_day_key(csv_get(rec, 5));
+    char cashier[50];
+    csv_string(rec, 6, cashier, sizeof(cashier));
+    row->cashier = intern(cashier);
+}
+
+typedef struct {
+    const SalesFilter *filter;
+    const char *cashier;
+    SaleRowFn fn;
+    void *ctx;
+} QueryContext;
+
+static void query_partition(const SalesPartition *part, void *arg) {
+    QueryContext *q = arg;
+    for (size_t r = 0; r < part->rows; r++) {
+        SaleRow row;
+        row.id = part->id[r];
+        row.product_id = part->product_id[r];
+        row.customer_id = part->customer_id[r];
+        row.quantity = part->quantity[r];
+        row.total_price = part->total_price[r];
+        row.day = epoch_day_key(part->date[r]);
+        row.cashier = partition_cashier(part, r);
+        if (sales_filter_match(q->filter, q->cashier, &row)) q->fn(&row, q->ctx);
+    }
+}
+
+static void query_archive_chunk(const char *start, const char *end, void *partial, void *ctx) {
+    (void)ctx;
+    QueryContext *q = partial;
+    CsvRecord rec;
+    SaleRow row;
+    while (start < end) {
+        start = csv_split(start, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        sale_row_from_record(&rec, &row);
+        if (sales_filter_match(q->filter, q->cashier, &row)) q->fn(&row, q->ctx);
+    }
+}
+
+/* First posting with day >= day_from (postings are in file order). */
+static int first_posting(const PostingList *list, int day_from) {
+    int lo = 0, hi = list->count;
+    if (!day_from || !sales_index.ordered) return 0;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (list->items[mid].day < day_from) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Byte offset of the first row on or after day_from. */
+static uint64_t day_start_offset(int day_from) {
+    SalesIndex *x = &sales_index;
+    int lo = 0, hi = x->day_count;
+    if (!day_from || !x->ordered) return 0;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (x->days[mid].day < day_from) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < x->day_count ? x->days[lo].offset : x->covered;
+}
+
+/* Calls fn for every sale matching the filter, in file order. */
+static int scan_sales_query(const SalesFilter *f, SaleRowFn fn, void *ctx) {
+    const char *cashier = f->cashier[0] ? intern(f->cashier) : NULL;
+    if (colstore_enabled()) {
+        QueryContext q = { f, cashier, fn, ctx };
+        unsigned columns = COLMASK_ALL;
+        return colstore_scan(columns, f->day_from / 100, f->day_to / 100, query_partition, &q);
+    }
+    
+    QueryContext q = { f, cashier, fn, ctx };
+    if (!archive_scan(f->day_from, f->day_to, query_archive_chunk, &q, NULL)) return 0;
+    if (!file_exists(SALES_FILE)) return 1;
+    if (!sales_index.ready) sales_index_catch_up();
+    
+    MappedFile map;
+    if (!map_file(SALES_FILE, &map)) return 0;
+    const char *end = map.data + map.size;
+    CsvRecord rec;
+    SaleRow row;
+    
+    if (f->product_id && sales_index.ready) {
+        const PostingList *list = sales_index_postings(f->product_id);
+        for (int i = list ? first_posting(list, f->day_from) : 0; list && i < list->count; i++) {
+            if (list->items[i].offset >= map.size) break;
+            if (f->day_to && sales_index.ordered && list->items[i].day > f->day_to) break;
+            csv_split(map.data + list->items[i].offset, end, &rec);
+            sale_row_from_record(&rec, &row);
+            if (sales_filter_match(f, cashier, &row)) fn(&row, ctx);
+        }
+        unmap_file(&map);
+        return 1;
+    }
+    
+    const char *p = map.data;
+    if (sales_index.ready && f->day_from) {
+        uint64_t start = day_start_offset(f->day_from);
+        p = map.data + (start < map.size ? start : map.size);
+    }
+    while (p < end) {
+        p = csv_split(p, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        sale_row_from_record(&rec, &row);
+        if (f->day_to && sales_index.ready && sales_index.ordered && row.day > f->day_to) break;
+        if (sales_filter_match(f, cashier, &row)) fn(&row, ctx);
+    }
+    unmap_file(&map);
+    return 1;
+}
+
+int sales_query(const SalesFilter *f, SaleRowFn fn, void *ctx) {
+    int64_t start = metric_start();
+    int ok = scan_sales_query(f, fn, ctx);
+    metric_stop(METRIC_SALES_QUERY, start);
+    return ok;
+}
+
+static void totals_from_row(const SaleRow *row, void *ctx) {
+    SalesTotals *t = ctx;
+    const Product *p = product_lookup(row->product_id);
+    t->revenue += row->total_price;
+    if (p) t->cost += p->cost_price * row->quantity;
+    t->units += row->quantity;
+    t->transactions++;
+}
+
+/*
+ * Totals for a non-empty filter. A single dimension (date range, product
+ * or cashier) is answered from the aggregates; combinations and branches
+ * use the index.
+ */
+int compute_filtered_totals(const SalesFilter *f, SalesTotals *out) {
+    memset(out, 0, sizeof(*out));
+    SalesAggregates *a = &sales_aggregates;
+    
+    if (a->ready && !f->branch && !f->product_id && !f->cashier[0]) {
+        for (int i = 0; i < a->day_count; i++) {
+            if (f->day_from && a->days[i].day < f->day_from) continue;
+            if (f->day_to && a->days[i].day > f->day_to) continue;
+            totals_add(out, &a->days[i].totals);
+        }
+        return 1;
+    }
+    if (a->ready && !f->branch && !f->day_from && !f->day_to && !f->cashier[0]) {
+        int row = id_index_find(&a->product_index, f->product_id);
+        if (row != INDEX_EMPTY) *out = a->products[row].totals;
+        return 1;
+    }
+    if (a->ready && !f->branch && !f->day_from && !f->day_to && !f->product_id) {
+        for (int i = 0; i < a->cashier_count; i++) {
+            if (strcmp(a->cashiers[i].cashier, f->cashier) == 0) *out = a->cashiers[i].totals;
+        }
+        return 1;
+    }
+    return sales_query(f, totals_from_row, out);
+}
+
+/* Asks which branch to report on, when branches ship their sales here. */
+static int prompt_branch_filter() {
+    if (!shipping_branches()) return 0;
+    char input[50];
+    get_optional_string("Branch: ", input, sizeof(input));
+    int branch = atoi(input);
+    return branch >= 1 && branch <= MAX_BRANCH ? branch : 0;
+}
+
+/* Asks for the optional report filters. */
+void prompt_sales_filter(SalesFilter *f) {
+    memset(f, 0, sizeof(*f));
+    printf("\nFilters (leave blank for all):\n");
+    f->day_from = get_optional_date("From date (YYYY-MM-DD): ");
+    f->day_to = get_optional_date("To date (YYYY-MM-DD): ");
+    
+    char input[50];
+    get_optional_string("Product ID: ", input, sizeof(input));
+    f->product_id = atoi(input);
+    get_optional_string("Cashier: ", f->cashier, sizeof(f->cashier));
+    f->branch = prompt_branch_filter();
+}
+
+void print_sales_filter(const SalesFilter *f) {
+    if (sales_filter_empty(f)) {
+        printf("Period: all time\n");
+        return;
+    }
+    if (f->day_from || f->day_to) {
+        printf("Period: ");
+        if (f->day_from) printf("%04d-%02d-%02d", f->day_from / 10000, f->day_from / 100 % 100, f->day_from % 100);
+        else printf("start");
+        printf(" to ");
+        if (f->day_to) printf("%04d-%02d-%02d\n", f->day_to / 10000, f->day_to / 100 % 100, f->day_to % 100);
+        else printf("now\n");
+    }
+    if (f->product_id) {
+        const Product *p = product_lookup(f->product_id);
+        printf("Product: %d%s%s\n", f->product_id, p ? " - " : "", p ? p->text->name : "");
+    }
+    if (f->cashier[0]) printf("Cashier: %s\n", f->cashier);
+    if (f->branch) printf("Branch: %d\n", f->branch);
+}
+
+/* -------------------- Sales Functions -------------------- */
+/*
+ * Commits a batch of sale lines as one write-ahead log group, so a basket is
+ * recorded completely or not at all. Stock is checked again under the lock,
+ * since another till may have sold the same items since the lines were
+ * entered. The unsynced variant leaves the wal_sync() to the caller so that
+ * the daemon can cover several commits with one sync.
+ */
+/* Checks that every product has stock for all of its lines combined. */
+static int sales_have_stock(const Sale *sales, int count) {
+    size_t mark = arena_mark(&report_arena);
+    int *product_ids = arena_alloc(&report_arena, (size_t)count * sizeof(int));
+    int *wanted = arena_alloc(&report_arena, (size_t)count * sizeof(int));
+    IdIndex seen = { NULL, 0, 0 };
+    int distinct = 0;
+    int ok = product_ids && wanted;
+    
+    for (int i = 0; i < count && ok; i++) {
+        int slot = id_index_find(&seen, sales[i].product_id);
+        if (slot != INDEX_EMPTY) {
+            wanted[slot] += sales[i].quantity;
+        } else if (id_index_put(&seen, sales[i].product_id, distinct)) {
+            product_ids[distinct] = sales[i].product_id;
+            wanted[distinct++] = sales[i].quantity;
+        } else {
+            ok = 0;
+        }
+    }
+    for (int i = 0; i < distinct && ok; i++) {
+        const Product *p = product_lookup(product_ids[i]);
+        if (!p || p->stock < wanted[i]) {
+            printf("Error: Only %d of %s left in stock.\n", p ? p->stock : 0, p ? p->text->name : "this product");
+            ok = 0;
+        }
+    }
+    id_index_free(&seen);
+    arena_release(&report_arena, mark);
+    return ok;
+}
+
+/* Tells the till, or the daemon's log, which products the last commit took below their minimum. */
+static void print_reorder_alerts() {
+    for (int i = 0; i < reorder_heap.alert_count; i++) {
+        const Product *p = product_row(reorder_heap.alerts[i]);
+        printf("Alert: %s (ID %d) is below its reorder point: %d left, minimum %d.\n",
+               p->text->name, p->id, p->stock, p->min_stock_level);
+    }
+    reorder_clear_alerts();
+}
+
+int commit_sales_unsynced(Sale *sales, int count) {
+    int64_t start = metric_start();
+    WalGroup g = { NULL, 0, 0, 0 };
+    int ok = 1;
+    for (int i = 0; i < count && ok; i++) {
+        StockJournalRecord r;
+        memset(&r, 0, sizeof(r));
+        r.product_id = sales[i].product_id;
+        r.delta = -sales[i].quantity;
+        r.sale_id = sales[i].id;
+        r.timestamp = (int64_t)time(NULL);
+        ok = wal_add(&g, WAL_SALE, &sales[i], sizeof(Sale)) && wal_add(&g, WAL_STOCK, &r, sizeof(r));
+    }
+    if (!ok || !wal_lock()) {
+        wal_group_free(&g);
+        return 0;
+    }
+    
+    reorder_clear_alerts();
+    ok = sales_have_stock(sales, count) && wal_commit(&g);
+    wal_group_free(&g);
+    if (ok) {
+        print_reorder_alerts();
+        if (!colstore_append(sales, count)) {
+            printf("Warning: Unable to append sale to the columnar store.\n");
+        }
+        if (!sales_aggregates_catch_up()) {
+            printf("Warning: Unable to update sales aggregates.\n");
+        }
+        if (!sales_index_catch_up()) {
+            printf("Warning: Unable to update sales index.\n");
+        }
+        metric_count(COUNTER_SALE_LINES, (uint64_t)count);
+    }
+    wal_unlock();
+    metric_stop(METRIC_STOCK_UPDATE, start);
+    return ok;
+}
+
+int commit_sales(Sale *sales, int count) {
+    int64_t start = metric_start();
+    int ok = commit_sales_unsynced(sales, count);
+    if (ok && !wal_sync()) printf("Warning: Unable to flush %s to disk.\n", WAL_FILE);
+    metric_stop(METRIC_SALE, start);
+    return ok;
+}
+
+void make_sale(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_SALES)) {
+        printf("Permission denied: You don't have permission to manage sales.\n");
+        return;
+    }
+    
+    if (product_table.count == 0) { 
+        printf("No products available to sell.\n"); 
+        return; 
+    }
+    
+    Sale s;
+    memset(&s, 0, sizeof(s));
+    printf("\n=== Create New Sale (ID: %d) ===\n", id_sequence_peek(SEQ_SALES));
+    
+    // Search Products finds an id by name; the catalog is not listed here
+    char code[100];
+    get_validated_string("Enter product ID or SKU: ", code, sizeof(code));
+    const Product *found = find_product_by_code(code);
+    if (!found) { 
+        printf("Error: Product not found.\n"); 
+        return; 
+    }
+    Product p = *found;
+    int pid = p.id;
+    
+    // Adding a customer or committing may reload the catalog, so keep the names printed after it
+    char product[100], customer[100];
+    snprintf(product, sizeof(product), "%s", p.text->name);
+    
+    char price[MONEY_TEXT];
+    printf("Selected: %s (Stock: %d, Price: %s)\n", product, p.stock,
+           format_money(p.sell_price, price, sizeof(price)));
+    
+    int cid = get_validated_int("Enter customer ID (0 to add new): ", 0, MAX_RECORD_ID);
+    if (cid == 0) { 
+        cid = add_customer(current_user); 
+    }
+    
+    Customer cust;
+    if (!find_customer_by_id(&cust, cid)) { 
+        printf("Error: Customer not found.\n"); 
+        return; 
+    }
+    snprintf(customer, sizeof(customer), "%s", cust.name);
+    
+    int qty = get_validated_int("Quantity: ", 1, p.stock);
+    
+    s.product_id = pid;
+    s.customer_id = cid;
+    s.quantity = qty;
+    s.total_price = p.sell_price * qty;
+    s.cashier_id = current_user->id;
+    s.date = (int64_t)time(NULL);
+    
+    s.id = id_sequence_take(SEQ_SALES, 1);
+    if (!commit_sales(&s, 1)) { 
+        printf("Error: Sale was not recorded.\n"); 
+        return; 
+    }
+    
+    printf("\n✓ Sale recorded successfully!\n");
+    printf("Product: %s\n", product);
+    printf("Customer: %s\n", customer);
+    printf("Quantity: %d\n", qty);
+    char total[MONEY_TEXT];
+    printf("Total Amount: %s\n", format_money(s.total_price, total, sizeof(total)));
+}
+
+/* Prompts for a quantity from 1 to max; a blank answer is 1. */
+static int get_quantity(const char *prompt, int max) {
+    char input[50];
+    while (1) {
+        get_optional_string(prompt, input, sizeof(input));
+        int qty;
+        char tail;
+        if (input[0] == '\0') qty = 1;
+        else if (sscanf(input, "%d %c", &qty, &tail) != 1) qty = 0;
+        if (qty >= 1 && qty <= max) return qty;
+        printf("Invalid input. Please enter a number between 1 and %d.\n", max);
+    }
+}
+
+/*
+ * A till with a scanner: the customer is asked once, then each item is a
+ * scanned SKU (or a typed product id) and a quantity, committed on its own
+ * as soon as it is entered. The product comes from the SKU or id index, so
+ * nothing is listed or searched; a blank scan ends the sale.
+ */
+void make_quick_sale(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_SALES)) {
+        printf("Permission denied: You don't have permission to manage sales.\n");
+        return;
+    }
+    
+    if (product_table.count == 0) { 
+        printf("No products available to sell.\n"); 
+        return; 
+    }
+    
+    printf("\n=== Quick Sale ===\n");
+    
+    int cid = get_validated_int("Enter customer ID (0 to add new): ", 0, MAX_RECORD_ID);
+    if (cid == 0) { 
+        cid = add_customer(current_user); 
+    }
+    
+    Customer cust;
+    if (!find_customer_by_id(&cust, cid)) { 
+        printf("Error: Customer not found.\n"); 
+        return; 
+    }
+    char customer[100];
+    snprintf(customer, sizeof(customer), "%s", cust.name);
+    
+    int items = 0;
+    Money sale_total = 0;
+    char amount[MONEY_TEXT], running_total[MONEY_TEXT];
+    while (1) {
+        char code[100];
+        get_optional_string("Scan SKU or enter product ID (blank to finish): ", code, sizeof(code));
+        if (code[0] == '\0') break;
+        
+        const Product *p = find_product_by_code(code);
+        if (!p) { 
+            printf("Error: Product not found.\n"); 
+            continue; 
+        }
+        if (p->stock <= 0) {
+            printf("Error: No stock left for %s.\n", p->text->name);
+            continue;
+        }
+        
+        // The commit may reload the catalog, so keep what is printed after it
+        char name[100];
+        snprintf(name, sizeof(name), "%s", p->text->name);
+        printf("%s (Stock: %d, Price: %s)\n", name, p->stock, format_money(p->sell_price, amount, sizeof(amount)));
+        
+        Sale s;
+        memset(&s, 0, sizeof(s));
+        s.product_id = p->id;
+        s.customer_id = cid;
+        s.quantity = get_quantity("Quantity [1]: ", p->stock);
+        s.total_price = p->sell_price * s.quantity;
+        s.cashier_id = current_user->id;
+        s.date = (int64_t)time(NULL);
+        s.id = id_sequence_take(SEQ_SALES, 1);
+        if (!commit_sales(&s, 1)) { 
+            printf("Error: Sale was not recorded.\n"); 
+            continue; 
+        }
+        
+        items++;
+        sale_total += s.total_price;
+        printf("✓ Sale %d: %d x %s = %s (total %s)\n", s.id, s.quantity, name,
+               format_money(s.total_price, amount, sizeof(amount)),
+               format_money(sale_total, running_total, sizeof(running_total)));
+    }
+    
+    if (items == 0) {
+        printf("Nothing was sold.\n");
+        return;
+    }
+    printf("\n✓ %d item(s) sold to %s, total %s\n", items, customer,
+           format_money(sale_total, amount, sizeof(amount)));
+}
+
+/* Units of a product already held by earlier lines of the basket. */
+static int basket_reserved(const Sale *lines, int count, int product_id) {
+    int qty = 0;
+    for (int i = 0; i < count; i++) {
+        if (lines[i].product_id == product_id) qty += lines[i].quantity;
+    }
+    return qty;
+}
+
+void make_basket_sale(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_SALES)) {
+        printf("Permission denied: You don't have permission to manage sales.\n");
+        return;
+    }
+    
+    if (product_table.count == 0) { 
+        printf("No products available to sell.\n"); 
+        return; 
+    }
+    
+    printf("\n=== Create Basket Sale ===\n");
+    
+    int cid = get_validated_int("Enter customer ID (0 to add new): ", 0, MAX_RECORD_ID);
+    if (cid == 0) { 
+        cid = add_customer(current_user); 
+    }
+    
+    Customer cust;
+    if (!find_customer_by_id(&cust, cid)) { 
+        printf("Error: Customer not found.\n"); 
+        return; 
+    }
+    // The commit may reload the catalog, so keep the name printed after it
+    char customer[100];
+    snprintf(customer, sizeof(customer), "%s", cust.name);
+    
+    Sale lines[MAX_BASKET_ITEMS];
+    memset(lines, 0, sizeof(lines));
+    int count = 0;
+    Money basket_total = 0;
+    char amount[MONEY_TEXT];
+    
+    while (count < MAX_BASKET_ITEMS) {
+        int pid = get_validated_int("Enter product ID (0 to finish): ", 0, MAX_RECORD_ID);
+        if (pid == 0) break;
+        
+        const Product *p = product_lookup(pid);
+        if (!p) { 
+            printf("Error: Product not found.\n"); 
+            continue; 
+        }
+        
+        int available = p->stock - basket_reserved(lines, count, pid);
+        if (available <= 0) {
+            printf("Error: No stock left for %s.\n", p->text->name);
+            continue;
+        }
+        
+        printf("Selected: %s (Available: %d, Price: %s)\n", p->text->name, available,
+               format_money(p->sell_price, amount, sizeof(amount)));
+        int qty = get_validated_int("Quantity: ", 1, available);
+        
+        Sale *s = &lines[count++];
+        s->product_id = pid;
+        s->customer_id = cid;
+        s->quantity = qty;
+        s->total_price = p->sell_price * qty;
+        basket_total += s->total_price;
+        printf("Basket: %d item(s), total %s\n", count, format_money(basket_total, amount, sizeof(amount)));
+    }
+    
+    if (count == MAX_BASKET_ITEMS) {
+        printf("Basket is full (%d items).\n", MAX_BASKET_ITEMS);
+    }
+    if (count == 0) {
+        printf("Basket is empty; nothing recorded.\n");
+        return;
+    }
+    
+    char confirm[10];
+    get_validated_string("Commit this sale? (y/n): ", confirm, sizeof(confirm));
+    if (tolower((unsigned char)confirm[0]) != 'y') {
+        printf("Basket discarded.\n");
+        return;
+    }
+    
+    int first_id = id_sequence_take(SEQ_SALES, count);
+    int64_t date = (int64_t)time(NULL);
+    for (int i = 0; i < count; i++) {
+        lines[i].id = first_id + i;
+        lines[i].cashier_id = current_user->id;
+        lines[i].date = date;
+    }
+    
+    if (!commit_sales(lines, count)) { 
+        printf("Error: Unable to record basket; no items were sold.\n"); 
+        return; 
+    }
+    
+    printf("\n✓ Basket recorded successfully!\n");
+    printf("Customer: %s\n", customer);
+    printf("%-4s %-20s %-6s %-10s\n", "ID", "Product", "Qty", "Total");
+    printf("------------------------------------------\n");
+    for (int i = 0; i < count; i++) {
+        const Product *p = product_lookup(lines[i].product_id);
+        printf("%-4d %-20s %-6d %-10s\n", 
+               lines[i].id, p ? p->text->name : "?", lines[i].quantity,
+               format_money(lines[i].total_price, amount, sizeof(amount)));
+    }
+    printf("Total Amount: %s\n", format_money(basket_total, amount, sizeof(amount)));
+}
+
+static void print_sale_row(OutBuf *out, const Sale *s, const char *cashier) {
+    char date[32], total[MONEY_TEXT];
+    format_datetime(s->date, date, sizeof(date));
+    outbuf_printf(out, "%-4d %-8d %-8d %-4d %-10s %-20s %-15s\n", 
+                  s->id, s->product_id, s->customer_id, s->quantity,
+                  format_money(s->total_price, total, sizeof(total)), date, cashier);
+}
+
+/*
+ * list_sales pages through sales.csv in place: it keeps the byte offset of
+ * each page it has shown, and a jump to a later page starts from the
+ * nearest known offset or, when the day index and aggregates cover the
+ * whole file, from the first row of the day holding the page (the day
+ * aggregates give the row count before each day, the index its offset).
+ * Only the rows on the page are parsed. Sorting, and the columnar store,
+ * load the rows into memory first. Archived sales are left out of the list;
+ * the reports still count them.
+ */
+typedef struct {
+    Sale s;
+    const char *cashier;       /* interned */
+    long seq;                  /* position in stored order */
+} ListedSale;
+
+typedef struct {
+    MappedFile map;
+    size_t *page_offsets;      /* SIZE_MAX = not yet known */
+    long page_count;
+    int page_size;
+    ListedSale *rows;          /* loaded rows, or NULL while paging the file */
+    int row_count;
+    int row_capacity;
+    int failed;                /* a row could not be loaded */
+} SalesList;
+
+static const char *sale_columns[] = { "id", "product", "customer", "qty", "total", "date", "cashier" };
+static ListView sales_view;
+
+static int compare_listed_sales(const void *a, const void *b) {
+    const ListedSale *x = a, *y = b;
+    int cmp = 0;
+    switch (sales_view.sort_column) {
+        case -1: return (x->seq > y->seq) - (x->seq < y->seq);
+        case 1: cmp = (x->s.product_id > y->s.product_id) - (x->s.product_id < y->s.product_id); break;
+        case 2: cmp = (x->s.customer_id > y->s.customer_id) - (x->s.customer_id < y->s.customer_id); break;
+        case 3: cmp = (x->s.quantity > y->s.quantity) - (x->s.quantity < y->s.quantity); break;
+        case 4: cmp = (x->s.total_price > y->s.total_price) - (x->s.total_price < y->s.total_price); break;
+        case 5: cmp = (x->s.date > y->s.date) - (x->s.date < y->s.date); break;
+        case 6: cmp = strcasecmp(x->cashier, y->cashier); break;
+    }
+    return list_order(cmp, x->s.id, y->s.id, sales_view.descending);
+}
+
+static int sales_list_add(SalesList *l, const Sale *s, const char *cashier) {
+    if (l->row_count == l->row_capacity &&
+        !grow_rows((void **)&l->rows, &l->row_capacity, sizeof(ListedSale))) {
+        l->failed = 1;
+        return 0;
+    }
+    ListedSale *row = &l->rows[l->row_count];
+    row->s = *s;
+    row->cashier = cashier;
+    row->seq = l->row_count++;
+    return 1;
+}
+
+static void load_listed_partition(const SalesPartition *part, void *ctx) {
+    SalesList *l = ctx;
+    for (size_t r = 0; r < part->rows; r++) {
+        Sale s;
+        s.id = part->id[r];
+        s.product_id = part->product_id[r];
+        s.customer_id = part->customer_id[r];
+        s.quantity = part->quantity[r];
+        s.total_price = part->total_price[r];
+        s.date = part->date[r];
+        s.cashier_id = 0;
+        if (!sales_list_add(l, &s, partition_cashier(part, r))) return;
+    }
+}
+
+/* Loads every sale into memory, from the store or the mapped sales.csv. */
+static int load_listed_sales(SalesList *l) {
+    if (colstore_enabled()) {
+        if (!colstore_scan(COLMASK_ALL, 0, 0, load_listed_partition, l)) return 0;
+    } else {
+        const char *p = l->map.data, *end = l->map.data + l->map.size;
+        CsvRecord rec;
+        while (p < end) {
+            p = csv_split(p, end, &rec);
+            if (rec.count == 0 || rec.fields[0].len == 0) continue;
+            Sale s;
+            char cashier[50];
+            parse_sale_record(&rec, &s, cashier, sizeof(cashier));
+            if (!sales_list_add(l, &s, intern(cashier))) return 0;
+        }
+    }
+    return !l->failed;
+}
+
+static const char *skip_sale_records(const char *p, const char *end, long n) {
+    CsvRecord rec;
+    while (n > 0 && p < end) {
+        p = csv_split(p, end, &rec);
+        if (rec.count > 0 && rec.fields[0].len > 0) n--;
+    }
+    return p;
+}
+
+/* Start of the day holding row `row`, as (first row of that day, offset); 0 if the indexes cannot say. */
+static int day_seek(const MappedFile *map, long row, long *day_row, size_t *offset) {
+    const SalesIndex *x = &sales_index;
+    if (!x->ready || !x->ordered || x->covered != map->size ||
+        !sales_aggregates.ready || sales_aggregates.source_size != map->size) {
+        return 0;
+    }
+    // Days before the file's first are archived, and the file holds every row from that day on
+    long before = 0;
+    int d = 0;
+    while (d < sales_aggregates.day_count && x->day_count > 0 && sales_aggregates.days[d].day < x->days[0].day) d++;
+    while (d < sales_aggregates.day_count && before + sales_aggregates.days[d].totals.transactions <= row) {
+        before += sales_aggregates.days[d++].totals.transactions;
+    }
+    if (d == sales_aggregates.day_count) return 0;
+    
+    int day = sales_aggregates.days[d].day, lo = 0, hi = x->day_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (x->days[mid].day < day) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == x->day_count || x->days[lo].day != day) return 0;
+    *day_row = before;
+    *offset = (size_t)x->days[lo].offset;
+    return 1;
+}
+
+/* Byte offset in sales.csv where the view's current page starts. */
+static size_t sales_page_offset(SalesList *l, const ListView *v) {
+    long pages = list_view_pages(v);
+    if (l->page_size != v->page_size || l->page_count != pages) {
+        free(l->page_offsets);
+        l->page_offsets = malloc((size_t)pages * sizeof(size_t));
+        l->page_size = v->page_size;
+        l->page_count = l->page_offsets ? pages : 0;
+        for (long i = 0; i < l->page_count; i++) l->page_offsets[i] = SIZE_MAX;
+        if (l->page_offsets) l->page_offsets[0] = 0;
+    }
+    if (!l->page_offsets) return (size_t)(skip_sale_records(l->map.data, l->map.data + l->map.size,
+                                                            v->page * v->page_size) - l->map.data);
+    if (l->page_offsets[v->page] != SIZE_MAX) return l->page_offsets[v->page];
+    
+    long known = v->page;
+    while (l->page_offsets[known] == SIZE_MAX) known--;
+    long target = v->page * v->page_size, from_row = known * v->page_size;
+    size_t from = l->page_offsets[known];
+    long day_row;
+    size_t day_offset;
+    if (day_seek(&l->map, target, &day_row, &day_offset) && day_row > from_row) {
+        from_row = day_row;
+        from = day_offset;
+    }
+    const char *p = skip_sale_records(l->map.data + from, l->map.data + l->map.size, target - from_row);
+    l->page_offsets[v->page] = (size_t)(p - l->map.data);
+    return l->page_offsets[v->page];
+}
+
+static void print_sales_page(SalesList *l, const ListView *v, OutBuf *out) {
+    long first = v->page * v->page_size;
+    if (l->rows) {
+        for (long i = first; i < l->row_count && i < first + v->page_size; i++) {
+            print_sale_row(out, &l->rows[i].s, l->rows[i].cashier);
+        }
+        return;
+    }
+    
+    const char *p = l->map.data + sales_page_offset(l, v), *end = l->map.data + l->map.size;
+    CsvRecord rec;
+    for (int shown = 0; shown < v->page_size && p < end; ) {
+        p = csv_split(p, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        Sale s;
+        char cashier[50];
+        parse_sale_record(&rec, &s, cashier, sizeof(cashier));
+        print_sale_row(out, &s, cashier);
+        shown++;
+    }
+}
+
+void list_sales(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_SALES)) {
+        printf("Permission denied: You don't have permission to view sales.\n");
+        return;
+    }
+    
+    if (!file_exists(SALES_FILE) && !colstore_enabled()) { 
+        printf("No sales recorded.\n"); 
+        return; 
+    }
+    
+    SalesList list;
+    memset(&list, 0, sizeof(list));
+    long count = 0;
+    Money revenue = 0;
+    if (colstore_enabled()) {
+        if (!load_listed_sales(&list)) {
+            printf("Error: Unable to read sales store.\n");
+            free(list.rows);
+            return;
+        }
+        count = list.row_count;
+        for (int i = 0; i < list.row_count; i++) revenue += list.rows[i].s.total_price;
+    } else {
+        if (!map_file(SALES_FILE, &list.map)) {
+            printf("Error: Unable to read sales file.\n");
+            return;
+        }
+        if (!sales_aggregates.ready || sales_aggregates.source_size != list.map.size) sales_aggregates_catch_up();
+        if (sales_aggregates.ready && sales_aggregates.source_size == list.map.size && sales_archive_refresh()) {
+            count = sales_aggregates.all.transactions - (long)sales_archive.h.rows;
+            revenue = sales_aggregates.all.revenue - sales_archive.h.revenue;
+        } else {
+            const char *p = list.map.data, *end = list.map.data + list.map.size;
+            CsvRecord rec;
+            while (p < end) {
+                p = csv_split(p, end, &rec);
+                if (rec.count == 0 || rec.fields[0].len == 0) continue;
+                count++;
+                revenue += csv_money(&rec, 4);
+            }
+        }
+    }
+    
+    list_view_init(&sales_view, count);
+    OutBuf out = { NULL, 0, 0 };
+    for (;;) {
+        if (sales_view.resorted) {
+            if (!list.rows && !load_listed_sales(&list)) {
+                printf("Error: Not enough memory to sort %ld sales.\n", count);
+                free(list.rows);
+                list.rows = NULL;
+                list.row_count = list.row_capacity = list.failed = 0;
+                sales_view.sort_column = -1;
+            } else {
+                qsort(list.rows, (size_t)list.row_count, sizeof(ListedSale), compare_listed_sales);
+            }
+            sales_view.resorted = 0;
+        }
+        
+        outbuf_printf(&out, "\n%-4s %-8s %-8s %-4s %-10s %-20s %-15s\n", 
+                      "ID", "ProdID", "CustID", "Qty", "Total", "Date", "Cashier");
+        outbuf_printf(&out, "----------------------------------------------------------------\n");
+        print_sales_page(&list, &sales_view, &out);
+        outbuf_flush(&out);
+        
+        if (list_view_pages(&sales_view) <= 1) break;
+        if (!list_view_prompt(&sales_view, sale_columns, 7)) break;
+    }
+    outbuf_free(&out);
+    free(list.rows);
+    free(list.page_offsets);
+    unmap_file(&list.map);
+    
+    char total[MONEY_TEXT];
+    printf("\nSummary: %ld sales, Total Revenue: %s\n", count, format_money(revenue, total, sizeof(total)));
+    if (!colstore_enabled() && sales_archive.h.rows > 0) {
+        int c = sales_archive.h.cutoff;
+        printf("%" PRId64 " sales dated before %04d-%02d-%02d are archived; reports include them.\n",
+               sales_archive.h.rows, c / 10000, c / 100 % 100, c % 100);
+    }
+}
+
+/* -------------------- Reports -------------------- */
+void report_low_stock(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_REPORTS)) {
+        printf("Permission denied: You don't have permission to view reports.\n");
+        return;
+    }
+    
+    if (product_table.count == 0) { 
+        printf("No products found.\n"); 
+        return; 
+    }
+    
+    int threshold = get_validated_int("Low stock threshold: ", 0, 10000);
+    
+    int64_t start = metric_start();
+    int low_stock_count = 0;
+    
+    printf("\nProducts with stock <= %d:\n", threshold);
+    printf("%-4s %-20s %-15s %-6s %-6s\n", "ID", "Name", "Category", "Stock", "Min");
+    printf("-------------------------------------------------\n");
+    
+    for (int i = 0; i < product_table.count; i++) {
+        const Product *p = product_row(i);
+        if (p->stock <= threshold) {
+            printf("%-4d %-20s %-15s %-6d %-6d\n", 
+                   p->id, p->text->name, p->text->category, p->stock, p->min_stock_level);
+            low_stock_count++;
+        }
+    }
+    
+    metric_stop(METRIC_REPORT_LOW_STOCK, start);
+    printf("\nTotal low stock items: %d\n", low_stock_count);
+}
+
+/* Products below their own minimum level, read off the reorder heap with no scan. */
+void report_reorder_point(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_REPORTS)) {
+        printf("Permission denied: You don't have permission to view reports.\n");
+        return;
+    }
+    
+    int64_t start = metric_start();
+    size_t mark = arena_mark(&report_arena);
+    int *rows = arena_alloc(&report_arena, (size_t)(product_table.count + 1) * sizeof(int));
+    if (!rows) {
+        printf("Error: Not enough memory for the report.\n");
+        return;
+    }
+    int n = reorder_below(rows);
+    
+    printf("\nProducts below their reorder point:\n");
+    printf("%-4s %-20s %-15s %-6s %-6s %-6s\n", "ID", "Name", "Category", "Stock", "Min", "Short");
+    printf("--------------------------------------------------------\n");
+    for (int i = 0; i < n; i++) {
+        const Product *p = product_row(rows[i]);
+        printf("%-4d %-20s %-15s %-6d %-6d %-6d\n", p->id, p->text->name, p->text->category,
+               p->stock, p->min_stock_level, p->min_stock_level - p->stock);
+    }
+    arena_release(&report_arena, mark);
+    
+    metric_stop(METRIC_REPORT_LOW_STOCK, start);
+    printf("\nTotal items to reorder: %d\n", n);
+}
+
+static void summary_partition(const SalesPartition *part, void *ctx) {
+    SalesTotals *sum = ctx;
+    long units = 0;
+    Money revenue = 0;
+    for (size_t r = 0; r < part->rows; r++) {
+        units += part->quantity[r];
+        revenue += part->total_price[r];
+    }
+    sum->transactions += (long)part->rows;
+    sum->units += units;
+    sum->revenue += revenue;
+}
+
+static void summary_scan_chunk(const char *start, const char *end, void *partial, void *ctx) {
+    (void)ctx;
+    SalesTotals *sum = partial;
+    CsvRecord rec;
+    while (start < end) {
+        start = csv_split(start, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        sum->transactions++;
+        sum->units += csv_int(&rec, 3);
+        sum->revenue += csv_money(&rec, 4);
+    }
+}
+
+static int sales_summary_totals(const SalesFilter *filter, SalesTotals *sum) {
+    if (!sales_filter_empty(filter)) return compute_filtered_totals(filter, sum);
+    
+    memset(sum, 0, sizeof(*sum));
+    
+    if (sales_aggregates.ready) {
+        *sum = sales_aggregates.all;
+        return 1;
+    }
+    
+    if (colstore_enabled()) {
+        return colstore_scan(COLMASK(COL_QUANTITY) | COLMASK(COL_TOTAL_PRICE), 0, 0, summary_partition, sum);
+    }
+    
+    if (!archive_scan(0, 0, summary_scan_chunk, sum, NULL)) return 0;
+    CsvCursor cur;
+    if (!csv_cursor_open(&cur, SALES_FILE)) return 0;
+    
+    CsvRecord rec;
+    while (csv_cursor_next(&cur, &rec)) {
+        sum->transactions++;
+        sum->units += csv_int(&rec, 3);
+        sum->revenue += csv_money(&rec, 4);
+    }
+    csv_cursor_close(&cur);
+    return 1;
+}
+
+int compute_sales_summary(const SalesFilter *filter, SalesTotals *sum) {
+    int64_t start = metric_start();
+    int ok = sales_summary_totals(filter, sum);
+    metric_stop(METRIC_REPORT_SUMMARY, start);
+    return ok;
+}
+
+void print_sales_summary(const SalesFilter *filter, const SalesTotals *t) {
+    char revenue[MONEY_TEXT], average[MONEY_TEXT];
+    printf("\n=== Sales Summary Report ===\n");
+    print_sales_filter(filter);
+    printf("Total Transactions: %ld\n", t->transactions);
+    printf("Total Units Sold: %ld\n", t->units);
+    printf("Total Revenue: %s\n", format_money(t->revenue, revenue, sizeof(revenue)));
+    printf("Average Sale Value: %s\n",
+           format_money(money_average(t->revenue, t->transactions), average, sizeof(average)));
+}
+
+void print_profit_analysis(const SalesFilter *filter, const SalesTotals *t) {
+    char revenue[MONEY_TEXT], cost[MONEY_TEXT], profit[MONEY_TEXT];
+    Money total_profit = t->revenue - t->cost;
+    double profit_margin = t->revenue > 0 ? (double)total_profit / (double)t->revenue * 100 : 0;
+    
+    printf("\n=== Profit Analysis Report ===\n");
+    print_sales_filter(filter);
+    printf("Total Transactions: %ld\n", t->transactions);
+    printf("Total Revenue: %s\n", format_money(t->revenue, revenue, sizeof(revenue)));
+    printf("Total Cost: %s\n", format_money(t->cost, cost, sizeof(cost)));
+    printf("Total Profit: %s\n", format_money(total_profit, profit, sizeof(profit)));
+    printf("Profit Margin: %.2f%%\n", profit_margin);
+}
+
+void report_sales_summary(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_REPORTS)) {
+        printf("Permission denied: You don't have permission to view reports.\n");
+        return;
+    }
+    
+    if (!file_exists(SALES_FILE) && !colstore_enabled()) { 
+        printf("No sales recorded.\n"); 
+        return; 
+    }
+    
+    SalesFilter filter;
+    prompt_sales_filter(&filter);
+    
+    SalesTotals sum;
+    if (!compute_sales_summary(&filter, &sum)) {
+        printf("Error: Unable to read sales file.\n");
+        return;
+    }
+    
+    print_sales_summary(&filter, &sum);
+}
+
+/* Worker body: accumulates one chunk of sales.csv into its own totals. */
+static void profit_scan_chunk(const char *start, const char *end, void *partial, void *ctx) {
+    (void)ctx;
+    SalesTotals *t = partial;
+    CsvRecord rec;
+    
+    while (start < end) {
+        start = csv_split(start, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        
+        int quantity = csv_int(&rec, 3);
+        const Product *p = product_lookup(csv_int(&rec, 1));
+        
+        t->revenue += csv_money(&rec, 4);
+        if (p) t->cost += p->cost_price * quantity;
+        t->units += quantity;
+        t->transactions++;
+    }
+}
+
+static void profit_partition(const SalesPartition *part, void *ctx) {
+    SalesTotals *t = ctx;
+    SalesTotals local;
+    memset(&local, 0, sizeof(local));
+    
+    for (size_t r = 0; r < part->rows; r++) {
+        const Product *p = product_lookup(part->product_id[r]);
+        local.revenue += part->total_price[r];
+        if (p) local.cost += p->cost_price * part->quantity[r];
+        local.units += part->quantity[r];
+    }
+    local.transactions = (long)part->rows;
+    totals_add(t, &local);
+}
+
+static int profit_totals(const SalesFilter *filter, SalesTotals *out) {
+    if (!sales_filter_empty(filter)) return compute_filtered_totals(filter, out);
+    
+    memset(out, 0, sizeof(*out));
+    
+    if (sales_aggregates.ready) {
+        *out = sales_aggregates.all;
+        return 1;
+    }
+    
+    if (colstore_enabled()) {
+        return colstore_scan(COLMASK(COL_PRODUCT_ID) | COLMASK(COL_QUANTITY) | COLMASK(COL_TOTAL_PRICE),
+                             0, 0, profit_partition, out);
+    }
+    
+    if (!archive_scan(0, 0, profit_scan_chunk, out, NULL)) return 0;
+    MappedFile map;
+    if (!map_file(SALES_FILE, &map)) return 0;
+    
+    size_t mark = arena_mark(&report_arena);
+    int chunks = 0;
+    SalesTotals *partials = parallel_scan(map.data, map.size, sizeof(SalesTotals),
+                                           profit_scan_chunk, NULL, &chunks);
+    for (int i = 0; partials && i < chunks; i++) {
+        totals_add(out, &partials[i]);
+    }
+    
+    arena_release(&report_arena, mark);
+    unmap_file(&map);
+    return partials != NULL;
+}
+
+int compute_profit_totals(const SalesFilter *filter, SalesTotals *out) {
+    int64_t start = metric_start();
+    int ok = profit_totals(filter, out);
+    metric_stop(METRIC_REPORT_PROFIT, start);
+    return ok;
+}
+
+void report_profit_analysis(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_REPORTS)) {
+        printf("Permission denied: You don't have permission to view reports.\n");
+        return;
+    }
+    
+    if ((!file_exists(SALES_FILE) && !colstore_enabled()) || product_table.count == 0) { 
+        printf("Insufficient data for profit analysis.\n"); 
+        return; 
+    }
+    
+    SalesFilter filter;
+    prompt_sales_filter(&filter);
+    
+    SalesTotals totals;
+    if (!compute_profit_totals(&filter, &totals)) {
+        printf("Error: Unable to access data files.\n");
+        return;
+    }
+    
+    print_profit_analysis(&filter, &totals);
+}
+
+/*
+ * Best sellers, top customers and cashier performance over a date range.
+ * One pass over the matching sales groups every row by product, customer
+ * and cashier at once into open-addressed tables; each table is then cut
+ * to the top N with a bounded min-heap, so only the winners are sorted and
+ * have their names joined from the catalog. The columnar store is read
+ * month by month; sales.csv is cut into one piece per report thread, each
+ * grouped into its own tables, and the tables are merged.
+ *
+ * The tables live in an arena owned by their TopScan, not in report_arena:
+ * they keep growing while colstore_scan and the CSV scan release their own
+ * scratch from report_arena beneath them, and the worker threads must not
+ * share it. Each scan frees its whole arena at once when it is done.
+ */
+enum { TOP_PRODUCTS, TOP_CUSTOMERS, TOP_CASHIERS, TOP_DIMENSIONS };
+enum { RANK_REVENUE = 1, RANK_UNITS, RANK_PROFIT };
+
+#define TOP_MAX 100
+
+typedef struct {
+    uintptr_t key;             /* product or customer id, or the cashier (see top_add_sale) */
+    char *name;                /* a worker's copy of the cashier name, NULL otherwise */
+    long sales;                /* 0 while the slot is empty */
+    long units;
+    Money revenue;
+    Money cost;
+    Money cost_price;          /* products only, looked up once per group */
+} TopGroup;
+
+typedef struct {
+    TopGroup *slots;
+    size_t capacity;           /* a power of two */
+    size_t count;
+} TopTable;
+
+typedef struct {
+    TopTable tables[TOP_DIMENSIONS];
+    Arena arena;               /* the slots and name copies of the tables */
+    int failed;
+} TopScan;
+
+static void top_scan_init(TopScan *s) {
+    memset(s, 0, sizeof(*s));
+    s->arena.capacity = TOP_SCAN_ARENA_BYTES;
+}
+
+static size_t top_slot(uintptr_t key, size_t capacity) {
+    return (size_t)(((uint64_t)key * 0x9e3779b97f4a7c15ULL) >> 32) & (capacity - 1);
+}
+
+static TopGroup *top_table_find(TopTable *t, uintptr_t key, const char *name) {
+    size_t i = top_slot(key, t->capacity);
+    while (t->slots[i].sales && (t->slots[i].key != key || (name && strcmp(t->slots[i].name, name) != 0))) {
+        i = (i + 1) & (t->capacity - 1);
+    }
+    return &t->slots[i];
+}
+
+// The old slots stay in the arena until the scan is freed, at most as much again as the final table
+static int top_table_grow(TopTable *t, Arena *a) {
+    size_t capacity = t->capacity ? t->capacity * 2 : INDEX_MIN_CAPACITY;
+    TopGroup *grown = arena_calloc(a, capacity, sizeof(*grown));
+    if (!grown) return 0;
+    
+    TopTable old = *t;
+    t->slots = grown;
+    t->capacity = capacity;
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.slots[i].sales) *top_table_find(t, old.slots[i].key, old.slots[i].name) = old.slots[i];
+    }
+    return 1;
+}
+
+/* The group for key, made empty if new, which the caller must then count a sale in; NULL if out of memory. */
+static TopGroup *top_table_get(TopTable *t, Arena *a, uintptr_t key, const char *name) {
+    if ((t->count + 1) * 10 > t->capacity * 7 && !top_table_grow(t, a)) return NULL;
+    TopGroup *g = top_table_find(t, key, name);
+    if (!g->sales) {
+        if (name) {
+            size_t n = strlen(name);
+            if (!(g->name = arena_alloc(a, n + 1))) return NULL;
+            memcpy(g->name, name, n + 1);
+        }
+        g->key = key;
+        t->count++;
+    }
+    return g;
+}
+
+/*
+ * Counts one sale. The cashier is keyed by its interned name, or in a
+ * worker thread, which must not intern, by a hash of name with name kept
+ * to tell collisions apart.
+ */
+static void top_add_sale(TopScan *s, int product_id, int customer_id, uintptr_t cashier, const char *name,
+                         int quantity, Money total) {
+    TopGroup *g[TOP_DIMENSIONS] = {
+        top_table_get(&s->tables[TOP_PRODUCTS], &s->arena, (uint32_t)product_id, NULL),
+        top_table_get(&s->tables[TOP_CUSTOMERS], &s->arena, (uint32_t)customer_id, NULL),
+        top_table_get(&s->tables[TOP_CASHIERS], &s->arena, cashier, name)
+    };
+    if (!g[TOP_PRODUCTS] || !g[TOP_CUSTOMERS] || !g[TOP_CASHIERS]) {
+        s->failed = 1;
+        return;
+    }
+    if (!g[TOP_PRODUCTS]->sales) {
+        const Product *p = product_lookup(product_id);
+        g[TOP_PRODUCTS]->cost_price = p ? p->cost_price : 0;
+    }
+    Money cost = g[TOP_PRODUCTS]->cost_price * quantity;
+    for (int d = 0; d < TOP_DIMENSIONS; d++) {
+        g[d]->sales++;
+        g[d]->units += quantity;
+        g[d]->revenue += total;
+        g[d]->cost += cost;
+    }
+}
+
+/* Adds a worker's groups into the report's, re-keying cashiers by their interned name. */
+static int top_table_merge(TopTable *dst, Arena *a, const TopTable *src) {
+    for (size_t i = 0; i < src->capacity; i++) {
+        const TopGroup *g = &src->slots[i];
+        if (!g->sales) continue;
+        TopGroup *d = top_table_get(dst, a, g->name ? (uintptr_t)intern(g->name) : g->key, NULL);
+        if (!d) return 0;
+        d->sales += g->sales;
+        d->units += g->units;
+        d->revenue += g->revenue;
+        d->cost += g->cost;
+        d->cost_price = g->cost_price;
+    }
+    return 1;
+}
+
+/* Local midnight starting a yyyymmdd day, plus extra days; mktime() carries past the month end. */
+static int64_t day_key_epoch(int day, int extra) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = day / 10000 - 1900;
+    tm.tm_mon = day / 100 % 100 - 1;
+    tm.tm_mday = day % 100 + extra;
+    tm.tm_isdst = -1;
+    return (int64_t)mktime(&tm);
+}
+
+typedef struct {
+    TopScan *scan;
+    int64_t from;              /* epoch range [from, to); 0 = unbounded */
+    int64_t to;
+    int branch;                /* 0 = any */
+} TopPartitionScan;
+
+static void top_partition(const SalesPartition *part, void *arg) {
+    TopPartitionScan *q = arg;
+    for (size_t r = 0; r < part->rows && !q->scan->failed; r++) {
+        if ((q->from && part->date[r] < q->from) || (q->to && part->date[r] >= q->to)) continue;
+        if (q->branch && id_branch(part->id[r]) != q->branch) continue;
+        top_add_sale(q->scan, part->product_id[r], part->customer_id[r], (uintptr_t)partition_cashier(part, r),
+                     NULL, part->quantity[r], part->total_price[r]);
+    }
+}
+
+/* Worker body: groups one piece of sales.csv into its own tables. */
+static void top_scan_chunk(const char *start, const char *end, void *partial, void *ctx) {
+    const SalesFilter *f = ctx;
+    TopScan *s = partial;
+    CsvRecord rec;
+    if (!s->arena.capacity) top_scan_init(s);
+    
+    while (start < end && !s->failed) {
+        start = csv_split(start, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        if (f->day_from || f->day_to) {
+            int day = field_day_key(csv_get(&rec, 5));
+            if ((f->day_from && day < f->day_from) || (f->day_to && day > f->day_to)) continue;
+        }
+        if (f->branch && id_branch(csv_int(&rec, 0)) != f->branch) continue;
+        char cashier[50];
+        csv_string(&rec, 6, cashier, sizeof(cashier));
+        top_add_sale(s, csv_int(&rec, 1), csv_int(&rec, 2), (uintptr_t)hash_bytes(cashier, strlen(cashier)), cashier,
+                     csv_int(&rec, 3), csv_money(&rec, 4));
+    }
+}
+
+/* Folds one worker's tables into the report's and releases them. */
+static int top_scan_merge(TopScan *scan, TopScan *partial) {
+    int ok = !partial->failed;
+    for (int d = 0; ok && d < TOP_DIMENSIONS; d++) {
+        ok = top_table_merge(&scan->tables[d], &scan->arena, &partial->tables[d]);
+    }
+    arena_destroy(&partial->arena);
+    return ok;
+}
+
+static int top_scan_csv(const SalesFilter *f, TopScan *scan) {
+    TopScan archived;
+    top_scan_init(&archived);
+    int ok = archive_scan(f->day_from, f->day_to, top_scan_chunk, &archived, (void *)f);
+    if (!top_scan_merge(scan, &archived) || !ok) return 0;
+    if (!file_exists(SALES_FILE)) return 1;
+    if (!sales_index.ready) sales_index_catch_up();
+    
+    MappedFile map;
+    if (!map_file(SALES_FILE, &map)) return 0;
+    
+    // With the day index in file order, only the rows of the period are read
+    size_t from = 0, to = map.size;
+    if (sales_index.ready && sales_index.ordered) {
+        if (f->day_from) from = day_start_offset(f->day_from);
+        if (f->day_to && day_start_offset(f->day_to + 1) < sales_index.covered) to = day_start_offset(f->day_to + 1);
+        if (from > to) from = to;
+    }
+    
+    size_t mark = arena_mark(&report_arena);
+    int threads = report_thread_count(), chunks = 0;
+    size_t piece = (to - from) / (size_t)threads + 1;
+    TopScan *partials = parallel_scan_chunks(map.data + from, to - from, piece, sizeof(TopScan),
+                                             top_scan_chunk, (void *)f, &chunks);
+    ok = partials != NULL;
+    for (int i = 0; partials && i < chunks; i++) {
+        if (!top_scan_merge(scan, &partials[i])) ok = 0;
+    }
+    arena_release(&report_arena, mark);
+    unmap_file(&map);
+    return ok;
+}
+
+/* Groups the period's sales in one pass; release the tables with top_scan_free(). */
+int compute_top_sellers(const SalesFilter *filter, TopScan *scan) {
+    int64_t start = metric_start();
+    top_scan_init(scan);
+    
+    int ok;
+    if (colstore_enabled()) {
+        TopPartitionScan q = { scan, 0, 0, filter->branch };
+        if (filter->day_from) q.from = day_key_epoch(filter->day_from, 0);
+        if (filter->day_to) q.to = day_key_epoch(filter->day_to, 1);
+        unsigned columns = COLMASK(COL_PRODUCT_ID) | COLMASK(COL_CUSTOMER_ID) | COLMASK(COL_QUANTITY) |
+                           COLMASK(COL_TOTAL_PRICE) | COLMASK(COL_DATE) | COLMASK(COL_CASHIER);
+        if (filter->branch) columns |= COLMASK(COL_ID);
+        ok = colstore_scan(columns, filter->day_from / 100, filter->day_to / 100, top_partition, &q);
+    } else {
+        ok = top_scan_csv(filter, scan);
+    }
+    metric_stop(METRIC_REPORT_TOP, start);
+    return ok && !scan->failed;
+}
+
+void top_scan_free(TopScan *scan) {
+    arena_destroy(&scan->arena);
+    memset(scan->tables, 0, sizeof(scan->tables));
+}
+
+static Money top_value(const TopGroup *g, int rank) {
+    if (rank == RANK_UNITS) return g->units;
+    if (rank == RANK_PROFIT) return g->revenue - g->cost;
+    return g->revenue;
+}
+
+/* Ranks by the chosen figure, then by key so ties come out the same every time. */
+static int top_better(const TopGroup *a, const TopGroup *b, int rank) {
+    Money x = top_value(a, rank), y = top_value(b, rank);
+    if (x != y) return x > y;
+    return a->key < b->key;
+}
+
+static void top_heap_down(const TopGroup **heap, int count, int i, int rank) {
+    for (;;) {
+        int worst = i, l = 2 * i + 1, r = l + 1;
+        if (l < count && top_better(heap[worst], heap[l], rank)) worst = l;
+        if (r < count && top_better(heap[worst], heap[r], rank)) worst = r;
+        if (worst == i) return;
+        const TopGroup *t = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = t;
+        i = worst;
+    }
+}
+
+/*
+ * Fills out with the n best groups, best first, and returns how many there
+ * are. The heap holds the n best seen so far with the weakest at its root.
+ */
+static int top_select(const TopTable *t, int n, int rank, const TopGroup **out) {
+    int count = 0;
+    for (size_t i = 0; i < t->capacity; i++) {
+        const TopGroup *g = &t->slots[i];
+        if (!g->sales) continue;
+        if (count < n) {
+            out[count] = g;
+            for (int c = count++; c > 0 && top_better(out[(c - 1) / 2], out[c], rank); c = (c - 1) / 2) {
+                const TopGroup *tmp = out[c];
+                out[c] = out[(c - 1) / 2];
+                out[(c - 1) / 2] = tmp;
+            }
+        } else if (top_better(g, out[0], rank)) {
+            out[0] = g;
+            top_heap_down(out, count, 0, rank);
+        }
+    }
+    // Popping the weakest into the back leaves the array best first
+    for (int end = count - 1; end > 0; end--) {
+        const TopGroup *weakest = out[0];
+        out[0] = out[end];
+        out[end] = weakest;
+        top_heap_down(out, end, 0, rank);
+    }
+    return count;
+}
+
+static const char *top_group_name(int dimension, const TopGroup *g) {
+    if (dimension == TOP_CASHIERS) return ((const char *)g->key)[0] ? (const char *)g->key : "(none)";
+    if (dimension == TOP_PRODUCTS) {
+        const Product *p = product_lookup((int)g->key);
+        return p ? p->text->name : "(deleted product)";
+    }
+    const Customer *c = customer_lookup((int)g->key);
+    return c ? c->name : "(unknown customer)";
+}
+
+static void print_top_table(int dimension, const TopTable *t, int n, int rank) {
+    static const char *titles[TOP_DIMENSIONS] = { "Top Products", "Top Customers", "Top Cashiers" };
+    const TopGroup *best[TOP_MAX];
+    int count = top_select(t, n, rank, best);
+    
+    printf("\n%s (%zu in period):\n", titles[dimension], t->count);
+    printf("%-4s %-6s %-20s %-7s %-8s %-14s %-14s\n", "Rank", "ID", "Name", "Sales", "Units", "Revenue", "Profit");
+    printf("-----------------------------------------------------------------------------\n");
+    for (int i = 0; i < count; i++) {
+        const TopGroup *g = best[i];
+        char id[16], revenue[MONEY_TEXT], profit[MONEY_TEXT];
+        if (dimension == TOP_CASHIERS) snprintf(id, sizeof(id), "-");
+        else snprintf(id, sizeof(id), "%d", (int)g->key);
+        printf("%-4d %-6s %-20s %-7ld %-8ld %-14s %-14s\n", i + 1, id, top_group_name(dimension, g), g->sales, g->units,
+               format_money(g->revenue, revenue, sizeof(revenue)),
+               format_money(g->revenue - g->cost, profit, sizeof(profit)));
+    }
+}
+
+void report_top_sellers(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_REPORTS)) {
+        printf("Permission denied: You don't have permission to view reports.\n");
+        return;
+    }
+    
+    if (!file_exists(SALES_FILE) && !colstore_enabled()) {
+        printf("No sales recorded.\n");
+        return;
+    }
+    
+    SalesFilter filter;
+    memset(&filter, 0, sizeof(filter));
+    printf("\nPeriod (leave blank for all time):\n");
+    filter.day_from = get_optional_date("From date (YYYY-MM-DD): ");
+    filter.day_to = get_optional_date("To date (YYYY-MM-DD): ");
+    filter.branch = prompt_branch_filter();
+    int n = get_validated_int("Show top (1-100): ", 1, TOP_MAX);
+    printf("Rank by: 1. Revenue  2. Units  3. Profit\n");
+    int rank = get_validated_int("Select option: ", 1, 3);
+    
+    int64_t start = monotonic_ns();
+    TopScan scan;
+    if (!compute_top_sellers(&filter, &scan)) {
+        printf("Error: Unable to read sales.\n");
+    } else {
+        static const char *ranks[] = { "", "revenue", "units", "profit" };
+        printf("\n=== Top %d by %s ===\n", n, ranks[rank]);
+        print_sales_filter(&filter);
+        for (int d = 0; d < TOP_DIMENSIONS; d++) print_top_table(d, &scan.tables[d], n, rank);
+        printf("\nComputed in %.1f ms.\n", (double)(monotonic_ns() - start) / 1e6);
+    }
+    top_scan_free(&scan);
+}
+
+/* -------------------- Authentication -------------------- */
+/*
+ * Seeds the id sequences once at startup. Users, products and customers come
+ * from the resident tables and sales from the sales index when it is
+ * current; only sales.csv without an index is scanned.
+ */
+int load_id_sequences() {
+    int floors[SEQ_COUNT];
+    floors[SEQ_USERS] = user_table.max_id + 1;
+    floors[SEQ_PRODUCTS] = product_table.max_id + 1;
+    floors[SEQ_CUSTOMERS] = customer_table.max_id + 1;
+    floors[SEQ_SALES] = sales_index.ready ? sales_index.last_sale_id + 1 : next_id_from_file(SALES_FILE);
+    if (sales_archive_refresh() && own_id(sales_archive.h.max_id) && sales_archive.h.max_id >= floors[SEQ_SALES]) {
+        floors[SEQ_SALES] = sales_archive.h.max_id + 1;
+    }
+    
+    // On the central node, records shipped from branches are not this shop's to number after
+    if (!own_id(floors[SEQ_PRODUCTS] - 1)) {
+        floors[SEQ_PRODUCTS] = 1;
+        for (int i = 0; i < product_table.count; i++) {
+            int id = product_row(i)->id;
+            if (own_id(id) && id >= floors[SEQ_PRODUCTS]) floors[SEQ_PRODUCTS] = id + 1;
+        }
+    }
+    if (!own_id(floors[SEQ_CUSTOMERS] - 1)) {
+        floors[SEQ_CUSTOMERS] = 1;
+        for (int i = 0; i < customer_table.count; i++) {
+            int id = customer_row(i)->id;
+            if (own_id(id) && id >= floors[SEQ_CUSTOMERS]) floors[SEQ_CUSTOMERS] = id + 1;
+        }
+    }
+    // The mark in id_sequences.csv still covers this shop's own sales
+    if (!own_id(floors[SEQ_SALES] - 1)) floors[SEQ_SALES] = 1;
+    return id_sequences_load(floors);
+}
+
+/*
+ * Checks a username and password against the user table; inactive accounts
+ * never match. Every attempt costs one hash at the current setting whether
+ * or not the account exists, and a hash from an older setting is replaced
+ * once the password has been shown to be right.
+ */
+int authenticate(const char *username, const char *password, User *out) {
+    wal_refresh();
+    
+    User u;
+    if (!find_user(0, username, &u)) {
+        password_dummy_check(password);
+        return 0;
+    }
+    if (!verify_password(password, u.password_hash) || !(u.permissions & USER_ACTIVE)) return 0;
+    
+    if (password_needs_rehash(u.password_hash)) {
+        UserChange change;
+        memset(&change, 0, sizeof(change));
+        change.op = USER_SET_PASSWORD;
+        change.user.id = u.id;
+        if (hash_password(password, change.user.password_hash) &&
+            wal_write_record(WAL_USER, &change, sizeof(change))) {
+            strcpy(u.password_hash, change.user.password_hash);
+        }
+    }
+    *out = u;
+    return 1;
+}
+
+int login(User *current_user) {
+    char username[50];
+    char password[MAX_PASSWORD_LEN];
+    
+    printf("\n=== Shop Manager Login ===\n");
+    
+    get_validated_string("Username: ", username, sizeof(username));
+    
+    printf("Password: ");
+    if (fgets(password, sizeof(password), stdin) == NULL) {
+        return 0;
+    }
+    trim_newline(password);
+    
+    User u;
+    int authenticated = authenticate(username, password, &u);
+    if (authenticated) {
+        *current_user = u;
+        printf("\nWelcome, %s!\n", u.username);
+        printf("Permissions: %s%s%s%s%s\n",
+               (u.permissions & USER_PERM_PRODUCTS) ? "Products " : "",
+               (u.permissions & USER_PERM_CUSTOMERS) ? "Customers " : "",
+               (u.permissions & USER_PERM_SALES) ? "Sales " : "",
+               (u.permissions & USER_PERM_REPORTS) ? "Reports " : "",
+               (u.permissions & USER_PERM_USERS) ? "Users" : "");
+    } else {
+        printf("Invalid username or password, or account is inactive.\n");
+    }
+    
+    return authenticated;
+}
+
+void change_password(User *current_user) {
+    char old_password[MAX_PASSWORD_LEN], new_password[MAX_PASSWORD_LEN];
+    
+    printf("\n=== Change Password ===\n");
+    
+    printf("Current Password: ");
+    if (fgets(old_password, sizeof(old_password), stdin) == NULL) return;
+    trim_newline(old_password);
+    
+    User stored;
+    if (!find_user(current_user->id, NULL, &stored) || !verify_password(old_password, stored.password_hash)) {
+        printf("Error: Current password is incorrect.\n");
+        return;
+    }
+    
+    printf("New Password: ");
+    if (fgets(new_password, sizeof(new_password), stdin) == NULL) return;
+    trim_newline(new_password);
+    
+    if (strlen(new_password) < 4) {
+        printf("Error: Password must be at least 4 characters long.\n");
+        return;
+    }
+    
+    UserChange change;
+    memset(&change, 0, sizeof(change));
+    change.op = USER_SET_PASSWORD;
+    change.user.id = current_user->id;
+    if (!hash_password(new_password, change.user.password_hash)) {
+        printf("Error: Unable to read random data for the password salt.\n");
+        return;
+    }
+    
+    if (!wal_write_record(WAL_USER, &change, sizeof(change))) {
+        printf("Error: Unable to access user database.\n");
+        return;
+    }
+    strcpy(current_user->password_hash, change.user.password_hash);
+    printf("✓ Password changed successfully.\n");
+}
+
+/* -------------------- Backup System -------------------- */
+/*
+ * Backups are snapshots over a content-addressed chunk store:
+ *
+ *   backups/chunks/ab/abcd...    one chunk, named by the SHA-256 of its bytes
+ *   backups/snapshots/NAME.snap  the files of one backup as chunk lists
+ *
+ * Files are cut into chunks of 2-64 KB where a rolling gear hash of the
+ * last 64 bytes hits a fixed pattern, so an edit only moves the
+ * boundaries near it and the other chunks keep their names. A chunk
+ * already in the store is never written again; new ones are compressed
+ * when that saves space.
+ *
+ * Each snapshot also records each file's size, mtime and inode. A file
+ * that has not changed since the latest snapshot reuses its chunk list
+ * without being read. The shop replaces rewritten files by rename, so a
+ * file on the same inode that only grew was appended to. It is chunked
+ * again from its last recorded chunk, once that chunk still hashes the
+ * same. Backup time and space thus follow what changed, not how much
+ * history there is.
+ */
+typedef struct {
+    char hash[SHA256_HEX];
+    uint32_t len;
+} BackupChunk;
+
+typedef struct {
+    char name[64];
+    int64_t size;
+    int64_t mtime_ns;
+    uint64_t dev;
+    uint64_t ino;
+    BackupChunk *chunks;
+    int count;
+    int capacity;
+} BackupFile;
+
+typedef struct {
+    BackupFile files[BACKUP_MAX_FILES];
+    int count;
+} BackupManifest;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t raw_len;
+    uint32_t codec;            /* BACKUP_CODEC_* */
+    uint32_t stored_len;
+} BackupChunkHeader;
+
+enum { BACKUP_CODEC_RAW, BACKUP_CODEC_LZ };
+
+typedef struct {
+    long chunks;
+    long new_chunks;
+    int64_t bytes;
+    int64_t stored_bytes;
+    int reused_files;
+} BackupStats;
+
+static const char *backup_sources[] = {
+    PRODUCTS_FILE, CUSTOMERS_FILE, SALES_FILE, USERS_FILE, SALES_ARCHIVE_FILE, SALES_ARCHIVE_INDEX_FILE,
+    REPLICATION_FILE
+};
+#define BACKUP_SOURCE_COUNT ((int)(sizeof(backup_sources) / sizeof(backup_sources[0])))
+
+static uint64_t backup_gear[256];
+
+static void backup_gear_init() {
+    if (backup_gear[0]) return;
+    // Fixed seed: boundaries must not move between runs
+    uint64_t x = 0x5348504247454152ull;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        backup_gear[i] = (z ^ (z >> 31)) | 1;
+    }
+}
+
+/* Length of the chunk starting at p. */
+static size_t backup_cut(const unsigned char *p, size_t n) {
+    if (n <= BACKUP_MIN_CHUNK) return n;
+    size_t limit = n < BACKUP_MAX_CHUNK ? n : BACKUP_MAX_CHUNK;
+    uint64_t h = 0;
+    // Shifting left forgets a byte after 64 steps, so hashing can start late
+    for (size_t i = BACKUP_MIN_CHUNK - 64; i < limit; i++) {
+        h = (h << 1) + backup_gear[p[i]];
+        if (i + 1 >= BACKUP_MIN_CHUNK && (h >> (64 - BACKUP_CHUNK_BITS)) == 0) return i + 1;
+    }
+    return limit;
+}
+
+static void chunk_path(const char *hash, char *path, size_t size) {
+    snprintf(path, size, "%s/%.2s/%s", BACKUP_CHUNK_DIR, hash, hash);
+}
+
+static void backup_file_free(BackupFile *f) {
+    free(f->chunks);
+    f->chunks = NULL;
+    f->count = f->capacity = 0;
+}
+
+void backup_manifest_free(BackupManifest *m) {
+    for (int i = 0; i < m->count; i++) backup_file_free(&m->files[i]);
+    m->count = 0;
+}
+
+static int backup_file_add_chunk(BackupFile *f, const char *hash, uint32_t len) {
+    if (f->count == f->capacity && !grow_rows((void **)&f->chunks, &f->capacity, sizeof(BackupChunk))) return 0;
+    memcpy(f->chunks[f->count].hash, hash, SHA256_HEX);
+    f->chunks[f->count++].len = len;
+    return 1;
+}
+
+/* Writes a chunk unless the store already has it. */
+static int backup_store_chunk(const unsigned char *data, size_t len, const char *hash, BackupStats *stats) {
+    char path[256], tmp[300];
+    chunk_path(hash, path, sizeof(path));
+    stats->chunks++;
+    stats->bytes += (int64_t)len;
+    if (file_exists(path)) return 1;
+    
+    unsigned char *packed = malloc(lz_bound(len));
+    if (!packed) return 0;
+    BackupChunkHeader h = { BACKUP_CHUNK_MAGIC, (uint32_t)len, BACKUP_CODEC_LZ, 0 };
+    size_t packed_len = lz_compress(data, len, packed);
+    const unsigned char *body = packed;
+    if (packed_len >= len) {
+        h.codec = BACKUP_CODEC_RAW;
+        body = data;
+        packed_len = len;
+    }
+    h.stored_len = (uint32_t)packed_len;
+    
+    snprintf(tmp, sizeof(tmp), "%s/%.2s", BACKUP_CHUNK_DIR, hash);
+    make_dir(tmp);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && full_pwrite(fd, &h, sizeof(h), 0) && full_pwrite(fd, body, packed_len, sizeof(h)) &&
+             fdatasync(fd) == 0;
+    if (fd >= 0 && close(fd) != 0) ok = 0;
+    if (ok && rename(tmp, path) != 0) ok = 0;
+    if (!ok) remove(tmp);
+    free(packed);
+    
+    if (ok) {
+        stats->new_chunks++;
+        stats->stored_bytes += (int64_t)(sizeof(h) + packed_len);
+    }
+    return ok;
+}
+
+/* Reads a chunk into dst (len bytes) and checks it still hashes to its name. */
+static int backup_load_chunk(const BackupChunk *c, unsigned char *dst) {
+    char path[256], hash[SHA256_HEX];
+    chunk_path(c->hash, path, sizeof(path));
+    MappedFile map;
+    if (!map_file(path, &map)) return 0;
+    
+    BackupChunkHeader h;
+    int ok = map.size >= sizeof(h);
+    if (ok) {
+        memcpy(&h, map.data, sizeof(h));
+        const unsigned char *body = (const unsigned char *)map.data + sizeof(h);
+        ok = h.magic == BACKUP_CHUNK_MAGIC && h.raw_len == c->len && h.stored_len == map.size - sizeof(h);
+        if (ok && h.codec == BACKUP_CODEC_RAW) {
+            ok = h.stored_len == c->len;
+            if (ok) memcpy(dst, body, c->len);
+        } else if (ok) {
+            ok = h.codec == BACKUP_CODEC_LZ && lz_decompress(body, h.stored_len, dst, c->len) == (long)c->len;
+        }
+    }
+    unmap_file(&map);
+    if (!ok) return 0;
+    
+    sha256_hex(dst, c->len, hash);
+    return strcmp(hash, c->hash) == 0;
+}
+
+/* Chunks data[from..size) onto f, storing any chunk the store lacks. */
+static int backup_chunk_range(BackupFile *f, const unsigned char *data, size_t from, size_t size, BackupStats *stats) {
+    while (from < size) {
+        size_t len = backup_cut(data + from, size - from);
+        char hash[SHA256_HEX];
+        sha256_hex(data + from, len, hash);
+        if (!backup_file_add_chunk(f, hash, (uint32_t)len) || !backup_store_chunk(data + from, len, hash, stats)) {
+            return 0;
+        }
+        from += len;
+    }
+    return 1;
+}
+
+/* Fills f for path, reusing what prev (the same file in the latest snapshot) still describes. */
+static int backup_file(const char *path, const BackupFile *prev, BackupFile *f, BackupStats *stats) {
+    struct stat st;
+    memset(f, 0, sizeof(*f));
+    snprintf(f->name, sizeof(f->name), "%s", path);
+    if (stat(path, &st) != 0) return errno == ENOENT;
+    f->size = (int64_t)st.st_size;
+    f->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    f->dev = (uint64_t)st.st_dev;
+    f->ino = (uint64_t)st.st_ino;
+    
+    int same_inode = prev && prev->dev == f->dev && prev->ino == f->ino;
+    if (same_inode && prev->size == f->size && prev->mtime_ns == f->mtime_ns) {
+        for (int i = 0; i < prev->count; i++) {
+            if (!backup_file_add_chunk(f, prev->chunks[i].hash, prev->chunks[i].len)) return 0;
+            stats->chunks++;
+            stats->bytes += prev->chunks[i].len;
+        }
+        stats->reused_files++;
+        return 1;
+    }
+    
+    MappedFile map;
+    if (!map_file(path, &map)) return 0;
+    const unsigned char *data = (const unsigned char *)map.data;
+    size_t from = 0;
+    
+    if (same_inode && prev->count > 0 && f->size > prev->size) {
+        const BackupChunk *last = &prev->chunks[prev->count - 1];
+        size_t last_start = (size_t)prev->size - last->len;
+        char hash[SHA256_HEX];
+        sha256_hex(data + last_start, last->len, hash);
+        if (strcmp(hash, last->hash) == 0) {
+            for (int i = 0; i + 1 < prev->count; i++) {
+                if (!backup_file_add_chunk(f, prev->chunks[i].hash, prev->chunks[i].len)) {
+                    unmap_file(&map);
+                    return 0;
+                }
+                stats->chunks++;
+                stats->bytes += prev->chunks[i].len;
+            }
+            from = last_start;
+        }
+    }
+    int ok = backup_chunk_range(f, data, from, map.size, stats);
+    unmap_file(&map);
+    return ok;
+}
+
+static void snapshot_path(const char *name, char *path, size_t size) {
+    snprintf(path, size, "%s/%s.snap", BACKUP_SNAPSHOT_DIR, name);
+}
+
+int write_backup_manifest(const char *name, const BackupManifest *m) {
+    char path[256], tmp[300];
+    snapshot_path(name, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) return 0;
+    
+    fprintf(f, "%s %d\n", BACKUP_MANIFEST_MAGIC, BACKUP_MANIFEST_VERSION);
+    for (int i = 0; i < m->count; i++) {
+        const BackupFile *bf = &m->files[i];
+        fprintf(f, "file,%s,%" PRId64 ",%" PRId64 ",%" PRIu64 ",%" PRIu64 ",%d\n",
+                bf->name, bf->size, bf->mtime_ns, bf->dev, bf->ino, bf->count);
+        for (int c = 0; c < bf->count; c++) fprintf(f, "%s,%u\n", bf->chunks[c].hash, bf->chunks[c].len);
+    }
+    
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        fclose(f);
+        remove(tmp);
+        return 0;
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        remove(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+int read_backup_manifest(const char *name, BackupManifest *m) {
+    char path[256], line[MAX_LINE];
+    snapshot_path(name, path, sizeof(path));
+    memset(m, 0, sizeof(*m));
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    
+    int version = 0, ok = 1;
+    char magic[32];
+    if (!fgets(line, sizeof(line), f) || sscanf(line, "%31s %d", magic, &version) != 2 ||
+        strcmp(magic, BACKUP_MANIFEST_MAGIC) != 0 || version != BACKUP_MANIFEST_VERSION) {
+        ok = 0;
+    }
+    while (ok && fgets(line, sizeof(line), f)) {
+        if (m->count == BACKUP_MAX_FILES) {
+            ok = 0;
+            break;
+        }
+        BackupFile *bf = &m->files[m->count];
+        int chunks;
+        memset(bf, 0, sizeof(*bf));
+        if (sscanf(line, "file,%63[^,],%" SCNd64 ",%" SCNd64 ",%" SCNu64 ",%" SCNu64 ",%d",
+                   bf->name, &bf->size, &bf->mtime_ns, &bf->dev, &bf->ino, &chunks) != 6 || chunks < 0) {
+            ok = 0;
+            break;
+        }
+        m->count++;
+        int64_t total = 0;
+        for (int c = 0; ok && c < chunks; c++) {
+            char hash[SHA256_HEX];
+            unsigned len;
+            ok = fgets(line, sizeof(line), f) && sscanf(line, "%64[0-9a-f],%u", hash, &len) == 2 &&
+                 strlen(hash) == SHA256_HEX - 1 && len > 0 && len <= BACKUP_MAX_CHUNK &&
+                 backup_file_add_chunk(bf, hash, len);
+            total += len;
+        }
+        if (ok && total != bf->size) ok = 0;
+    }
+    fclose(f);
+    if (!ok) backup_manifest_free(m);
+    return ok;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+/* Lists snapshot names oldest first into a malloc'd array of BACKUP_NAME_LEN slots. */
+int list_backups(char **names_out) {
+    *names_out = NULL;
+    int fd = open(BACKUP_SNAPSHOT_DIR, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return 0;
+    
+    int count = 0, capacity = 0;
+    char buf[4096] __attribute__((aligned(8)));
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long off = 0; off < n; off += ((DirEntry64 *)(buf + off))->d_reclen) {
+            const char *name = ((DirEntry64 *)(buf + off))->d_name;
+            size_t len = strlen(name);
+            if (len <= 5 || len - 5 >= BACKUP_NAME_LEN || strcmp(name + len - 5, ".snap") != 0) continue;
+            if (count == capacity && !grow_rows((void **)names_out, &capacity, BACKUP_NAME_LEN)) break;
+            snprintf(*names_out + (size_t)count * BACKUP_NAME_LEN, BACKUP_NAME_LEN, "%.*s", (int)(len - 5), name);
+            count++;
+        }
+    }
+    close(fd);
+    
+    if (count > 1) qsort(*names_out, (size_t)count, BACKUP_NAME_LEN, compare_names);
+    return count;
+}
+
+static const BackupFile *manifest_file(const BackupManifest *m, const char *name) {
+    for (int i = 0; i < m->count; i++) {
+        if (strcmp(m->files[i].name, name) == 0) return &m->files[i];
+    }
+    return NULL;
+}
+
+/* Takes a snapshot of the shop files; writes its name to name_out. */
+int backup_snapshot(char *name_out, size_t size, BackupStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!make_dir(BACKUP_DIR) || !make_dir(BACKUP_CHUNK_DIR) || !make_dir(BACKUP_SNAPSHOT_DIR)) return 0;
+    backup_gear_init();
+    
+    BackupManifest prev, next;
+    memset(&prev, 0, sizeof(prev));
+    memset(&next, 0, sizeof(next));
+    char *names;
+    int count = list_backups(&names);
+    if (count > 0 && !read_backup_manifest(names + (size_t)(count - 1) * BACKUP_NAME_LEN, &prev)) {
+        printf("Warning: Unable to read the latest backup; every file will be chunked again.\n");
+    }
+    
+    time_t t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char stamp[BACKUP_NAME_LEN];
+    strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &tm);
+    snprintf(name_out, size, "%s", stamp);
+    for (int i = 2; i < 100; i++) {
+        int taken = 0;
+        for (int k = 0; k < count; k++) {
+            if (strcmp(names + (size_t)k * BACKUP_NAME_LEN, name_out) == 0) taken = 1;
+        }
+        if (!taken) break;
+        snprintf(name_out, size, "%s_%d", stamp, i);
+    }
+    free(names);
+    
+    int ok = 1;
+    for (int i = 0; ok && i < BACKUP_SOURCE_COUNT; i++) {
+        BackupFile *f = &next.files[next.count];
+        ok = backup_file(backup_sources[i], manifest_file(&prev, backup_sources[i]), f, stats);
+        if (ok && f->ino) next.count++;
+        else backup_file_free(f);
+    }
+    if (ok) ok = write_backup_manifest(name_out, &next);
+    
+    backup_manifest_free(&prev);
+    backup_manifest_free(&next);
+    return ok;
+}
+
+void create_backup() {
+    // The snapshot should hold every sale this till has rung up
+    if (!wal_barrier()) printf("Warning: Unable to flush %s to disk.\n", WAL_FILE);
+    if (!wal_lock()) {
+        printf("Warning: Unable to checkpoint the write-ahead log before backup.\n");
+    } else {
+        if (!checkpoint_catalog(0)) {
+            printf("Warning: Unable to checkpoint the write-ahead log before backup.\n");
+        }
+        // Snapshots hold the CSV files, so a B-tree catalog is written out to them first
+        if (!storage->export_csv()) {
+            printf("Warning: Unable to export the catalog to CSV before backup.\n");
+        }
+        wal_unlock();
+    }
+    save_sales_aggregates();
+    
+    // Held so no till rewrites a file halfway through being chunked
+    if (!shop_lock()) {
+        printf("Backup creation failed.\n");
+        return;
+    }
+    int64_t start = monotonic_ns();
+    char name[BACKUP_NAME_LEN];
+    BackupStats stats;
+    int ok = backup_snapshot(name, sizeof(name), &stats);
+    shop_unlock();
+    
+    if (!ok) {
+        printf("Backup creation failed.\n");
+        return;
+    }
+    printf("Backup created successfully: %s\n", name);
+    printf("  %" PRId64 " bytes in %ld chunks; %ld new (%" PRId64 " bytes stored), %d files unchanged, %.1f ms\n",
+           stats.bytes, stats.chunks, stats.new_chunks, stats.stored_bytes, stats.reused_files,
+           (double)(monotonic_ns() - start) / 1e6);
+}
+
+/* Rebuilds one file from its chunks into a temp file next to it. */
+static int restore_file(const BackupFile *f, const char *tmp) {
+    FILE *out = fopen(tmp, "w");
+    if (!out) return 0;
+    unsigned char *buf = malloc(BACKUP_MAX_CHUNK);
+    int ok = buf != NULL;
+    for (int i = 0; ok && i < f->count; i++) {
+        ok = backup_load_chunk(&f->chunks[i], buf) && fwrite(buf, 1, f->chunks[i].len, out) == f->chunks[i].len;
+    }
+    free(buf);
+    if (ok && (fflush(out) != 0 || fsync(fileno(out)) != 0)) ok = 0;
+    if (fclose(out) != 0) ok = 0;
+    if (!ok) remove(tmp);
+    return ok;
+}
+
+/*
+ * Puts the shop files back as they were in a snapshot. The current files
+ * are backed up first. Every file is rebuilt and verified before any live
+ * file is replaced. The log is then discarded, and the derived sales files
+ * (aggregates, indexes, columnar store) are rebuilt from the restored
+ * archive and sales.csv. With the B-tree backend, shop.db is rebuilt from the restored
+ * CSV files. id_sequences.csv is left alone: its marks only raise the
+ * floor for new ids, and lowering them could hand out ids that another
+ * till already holds.
+ */
+void restore_backup(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_USERS)) {
+        printf("Permission denied: Only administrators can restore backups.\n");
+        return;
+    }
+    
+    char *names;
+    int count = list_backups(&names);
+    if (count == 0) {
+        printf("No backups found.\n");
+        free(names);
+        return;
+    }
+    printf("\nAvailable backups:\n");
+    for (int i = 0; i < count; i++) printf("%3d. %s\n", i + 1, names + (size_t)i * BACKUP_NAME_LEN);
+    int choice = get_validated_int("Restore which backup (0 to cancel): ", 0, count);
+    char name[BACKUP_NAME_LEN];
+    if (choice > 0) snprintf(name, sizeof(name), "%s", names + (size_t)(choice - 1) * BACKUP_NAME_LEN);
+    free(names);
+    if (choice == 0) return;
+    
+    char confirm[10];
+    printf("This replaces all products, customers, sales and users with backup %s. Continue? (yes/no): ", name);
+    if (fgets(confirm, sizeof(confirm), stdin) == NULL) confirm[0] = '\0';
+    trim_newline(confirm);
+    if (strcasecmp(confirm, "yes") != 0 && strcasecmp(confirm, "y") != 0) {
+        printf("Restore cancelled.\n");
+        return;
+    }
+    
+    BackupManifest m;
+    if (!read_backup_manifest(name, &m)) {
+        printf("Error: Backup %s is unreadable.\n", name);
+        return;
+    }
+    printf("Saving the current data first...\n");
+    create_backup();
+    
+    if (!wal_lock()) {
+        printf("Error: Unable to lock the shop data.\n");
+        backup_manifest_free(&m);
+        return;
+    }
+    int64_t start = monotonic_ns();
+    int ok = 1;
+    char tmp[BACKUP_SOURCE_COUNT][128];
+    for (int i = 0; ok && i < BACKUP_SOURCE_COUNT; i++) {
+        const BackupFile *f = manifest_file(&m, backup_sources[i]);
+        snprintf(tmp[i], sizeof(tmp[i]), ".%s.restore", backup_sources[i]);
+        if (f && !restore_file(f, tmp[i])) {
+            printf("Error: %s in backup %s is damaged or incomplete.\n", backup_sources[i], name);
+            ok = 0;
+        }
+    }
+    int replaced = 0;
+    for (int i = 0; i < BACKUP_SOURCE_COUNT; i++) {
+        const BackupFile *f = manifest_file(&m, backup_sources[i]);
+        if (!f) {
+            if (ok && remove(backup_sources[i]) == 0) replaced = 1;
+        } else if (!ok || rename(tmp[i], backup_sources[i]) != 0) {
+            if (ok) printf("Error: Unable to replace %s.\n", backup_sources[i]);
+            ok = 0;
+            remove(tmp[i]);
+        } else {
+            replaced = 1;
+        }
+    }
+    backup_manifest_free(&m);
+    
+    if (ok) {
+        // Other tills see a new log inode and reload the catalog
+        retire_log(WAL_FILE);
+        remove(SALES_AGG_FILE);
+        int use_btree = file_exists(BTREE_FILE);
+        if (use_btree) {
+            btree_close();
+            remove(BTREE_FILE);
+        }
+        ok = wal_reload() && (!use_btree || storage_switch(1));
+        if (ok && colstore_enabled() && colstore_import_csv() < 0) {
+            printf("Warning: Unable to rebuild the sales store.\n");
+        }
+        if (ok && (!rebuild_sales_aggregates() || !save_sales_aggregates() || !rebuild_sales_index())) {
+            printf("Warning: Unable to rebuild sales aggregates; reports will scan sales.csv.\n");
+        }
+    }
+    wal_unlock();
+    
+    if (ok) {
+        printf("✓ Restored backup %s in %.1f ms.\n", name, (double)(monotonic_ns() - start) / 1e6);
+    } else if (replaced) {
+        printf("Error: Restore failed partway; restore the backup saved just before it to undo this.\n");
+    } else {
+        printf("Error: Restore failed; the shop data was left unchanged.\n");
+    }
+}
+
+/* -------------------- System Management -------------------- */
+void storage_menu(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_USERS)) {
+        printf("Permission denied: Only administrators can change the storage engine.\n");
+        return;
+    }
+    
+    int btree_in_use = storage == &btree_storage;
+    printf("\n=== Storage Engine (%s) ===\n", storage->name);
+    printf("1. %s\n", btree_in_use ? "Move catalog back to CSV files" : "Move catalog to B-tree (" BTREE_FILE ")");
+    printf("2. Export catalog to CSV files\n");
+    printf("3. Return\n");
+    
+    int choice = get_validated_int("Select option: ", 1, 3);
+    if (choice == 3) return;
+    
+    if (!wal_lock()) {
+        printf("Error: Unable to lock the shop data.\n");
+        return;
+    }
+    int64_t start = monotonic_ns();
+    int ok = choice == 1 ? storage_switch(!btree_in_use) : storage->export_csv();
+    wal_unlock();
+    
+    if (!ok) {
+        printf("Error: Unable to %s.\n", choice == 1 ? "move the catalog" : "export the catalog");
+    } else if (choice == 1) {
+        printf("✓ Catalog now stored in %s (%.1f ms).\n", btree_in_use ? "CSV files" : BTREE_FILE,
+               (double)(monotonic_ns() - start) / 1e6);
+    } else {
+        printf("✓ products.csv, customers.csv and users.csv are up to date.\n");
+    }
+}
+
+void sales_store_menu(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_SALES)) {
+        printf("Permission denied: You don't have permission to manage sales.\n");
+        return;
+    }
+    
+    printf("\n=== Columnar Sales Store (%s) ===\n", colstore_enabled() ? "enabled" : "disabled");
+    printf("1. Import sales.csv into store\n");
+    printf("2. Export store to sales.csv\n");
+    printf("3. Return\n");
+    
+    int choice = get_validated_int("Select option: ", 1, 3);
+    
+    if (choice == 1) {
+        long rows = colstore_import_csv();
+        if (rows < 0) {
+            printf("Error: Unable to build the sales store.\n");
+        } else {
+            printf("✓ Imported %ld sales into %s/.\n", rows, SALES_STORE_DIR);
+        }
+    } else if (choice == 2) {
+        if (!colstore_enabled()) {
+            printf("Sales store is not enabled.\n");
+        } else if (colstore_export_csv()) {
+            printf("✓ sales.csv regenerated from the store.\n");
+        } else {
+            printf("Error: Unable to export the sales store.\n");
+        }
+    }
+}
+
+/*
+ * Moves the sales dated before cutoff (yyyymmdd) from sales.csv to the
+ * archive and brings the aggregates and sales index in line. Returns the
+ * number of sales moved, or -1. See sales_archive_append for undated_id.
+ */
+long archive_old_sales(int cutoff, int *undated_id) {
+    if (!wal_lock()) return -1;
+    // The aggregates must count every row before the archived ones leave sales.csv
+    sales_aggregates_catch_up();
+    long moved = sales_archive_append(cutoff, undated_id);
+    if (moved > 0) {
+        if (sales_aggregates.ready && (!sales_aggregates_retarget() || !save_sales_aggregates())) {
+            printf("Warning: Unable to save sales aggregates; they will be rebuilt.\n");
+        }
+        if (!rebuild_sales_index()) {
+            printf("Warning: Unable to rebuild the sales index; filtered reports will scan sales.csv.\n");
+        }
+    }
+    wal_unlock();
+    return moved;
+}
+
+int archive_sales(int cutoff) {
+    if (cutoff > epoch_day_key((int64_t)time(NULL))) {
+        printf("Error: The cutoff cannot be later than today.\n");
+        return 0;
+    }
+    int64_t start = monotonic_ns();
+    int undated_id;
+    long moved = archive_old_sales(cutoff, &undated_id);
+    if (moved < 0) {
+        printf("Error: Unable to archive sales; sales.csv was left unchanged.\n");
+        return 0;
+    }
+    if (undated_id) {
+        printf("Warning: Sale #%d has no readable date; it and the sales after it stay in %s.\n", undated_id,
+               SALES_FILE);
+    }
+    if (moved == 0) {
+        printf("No sales in %s are dated before %04d-%02d-%02d.\n", SALES_FILE,
+               cutoff / 10000, cutoff / 100 % 100, cutoff % 100);
+        return 1;
+    }
+    const ArchiveHeader *h = &sales_archive.h;
+    printf("✓ Archived %ld sales in %.1f ms. The archive holds %" PRId64 " sales in %d blocks (%" PRIu64 " bytes).\n",
+           moved, (double)(monotonic_ns() - start) / 1e6, h->rows, h->block_count, h->data_size);
+    return 1;
+}
+
+void archive_menu(User *current_user) {
+    if (!(current_user->permissions & USER_PERM_SALES)) {
+        printf("Permission denied: You don't have permission to manage sales.\n");
+        return;
+    }
+    
+    printf("\n=== Sales Archive ===\n");
+    if (!sales_archive_refresh()) {
+        printf("Error: %s is unreadable.\n", SALES_ARCHIVE_INDEX_FILE);
+        return;
+    }
+    const ArchiveHeader *h = &sales_archive.h;
+    if (h->rows > 0) {
+        printf("%" PRId64 " sales dated before %04d-%02d-%02d in %d blocks (%" PRIu64 " bytes).\n",
+               h->rows, h->cutoff / 10000, h->cutoff / 100 % 100, h->cutoff % 100, h->block_count, h->data_size);
+    } else {
+        printf("No sales archived yet.\n");
+    }
+    
+    int cutoff = get_optional_date("Archive sales dated before (YYYY-MM-DD, blank to cancel): ");
+    if (cutoff) archive_sales(cutoff);
+}
+
+/* Shows this shop's place in the company: a branch's kept segments, or how far each branch has shipped here. */
+void replication_status() {
+    static const char *phases[] = { "", "snapshot", "log" };
+    printf("\n=== Branch Replication ===\n");
+    wal_refresh();
+    
+    int branch = shop_branch();
+    if (branch) {
+        uint32_t live = ship_segment_current(), kept = 0;
+        char path[64];
+        for (uint32_t seg = live; seg > 1; seg--) {
+            ship_segment_path(seg - 1, path, sizeof(path));
+            if (!file_exists(path)) break;
+            kept++;
+        }
+        printf("This shop is branch %d; its records are numbered from %d.\n", branch, branch * BRANCH_ID_SPAN + 1);
+        printf("%u retired log segments are waiting to be shipped; the live log is segment %u.\n", kept, live);
+        return;
+    }
+    if (!shipping_branches()) {
+        printf("This shop is standalone: it is not a branch and no branch has shipped to it.\n");
+        return;
+    }
+    
+    printf("\n%-7s %-9s %-9s %-12s %-21s %-19s\n", "Branch", "Phase", "Segment", "Offset", "Snapshot sales", "Last frame");
+    printf("-------------------------------------------------------------------------------\n");
+    for (int b = 1; b <= MAX_BRANCH; b++) {
+        const ShipPosition *p = &ship_positions[b];
+        if (p->phase == SHIP_NONE) continue;
+        char when[32], sales[32];
+        format_datetime(p->updated, when, sizeof(when));
+        snprintf(sales, sizeof(sales), "%" PRId64 "/%" PRId64, p->sales_done, p->sales_total);
+        printf("%-7d %-9s %-9u %-12" PRIu64 " %-21s %-19s\n", b, phases[p->phase], p->segment, p->offset, sales, when);
+    }
+}
+
+/* Writes the Prometheus text to metrics.prom atomically, for a textfile collector to pick up. */
+int export_metrics() {
+    FILE *tmp = fopen(METRICS_TMP_FILE, "w");
+    if (!tmp) return 0;
+    metrics_write_prometheus(tmp);
+    if (fclose(tmp) != 0 || rename(METRICS_TMP_FILE, METRICS_FILE) != 0) {
+        remove(METRICS_TMP_FILE);
+        return 0;
+    }
+    return 1;
+}
+
+void metrics_menu() {
+    printf("\n=== Metrics (%s) ===\n", metrics_enabled ? "enabled" : "disabled");
+    printf("1. View metrics\n");
+    printf("2. Export to %s (Prometheus text format)\n", METRICS_FILE);
+    printf("3. %s recording\n", metrics_enabled ? "Disable" : "Enable");
+    printf("4. Reset metrics\n");
+    printf("5. Return\n");
+    
+    int choice = get_validated_int("Select option: ", 1, 5);
+    
+    if (choice == 1) {
+        if (!metrics_enabled) printf("\nMetrics are disabled; enable them here or set SHOP_METRICS=1.\n");
+        metrics_print();
+    } else if (choice == 2) {
+        if (export_metrics()) {
+            printf("✓ Metrics written to %s.\n", METRICS_FILE);
+        } else {
+            printf("Error: Unable to write %s.\n", METRICS_FILE);
+        }
+    } else if (choice == 3) {
+        metrics_enabled = !metrics_enabled;
+        printf("✓ Metrics %s.\n", metrics_enabled ? "enabled" : "disabled");
+    } else if (choice == 4) {
+        metrics_reset();
+        printf("✓ Metrics reset.\n");
+    }
+}
+
+void system_maintenance(User *current_user) {
+    printf("\n=== System Maintenance ===\n");
+    printf("1. Create Backup\n");
+    printf("2. Restore Backup\n");
+    printf("3. Change Password\n");
+    printf("4. Columnar Sales Store\n");
+    printf("5. Rebuild Sales Aggregates & Index\n");
+    printf("6. Metrics\n");
+    printf("7. Storage Engine\n");
+    printf("8. Archive Old Sales\n");
+    printf("9. Branch Replication\n");
+    printf("10. Return to Main Menu\n");
+    
+    int choice = get_validated_int("Select option: ", 1, 10);
+    
+    switch (choice) {
+        case 1:
+            create_backup();
+            break;
+        case 2:
+            restore_backup(current_user);
+            break;
+        case 3:
+            change_password(current_user);
+            break;
+        case 4:
+            sales_store_menu(current_user);
+            break;
+        case 5:
+            if (rebuild_sales_aggregates() && save_sales_aggregates() && rebuild_sales_index()) {
+                printf("✓ Sales aggregates and index rebuilt (%ld sales, %d days).\n",
+                       sales_aggregates.all.transactions, sales_aggregates.day_count);
+            } else {
+                printf("Error: Unable to rebuild sales aggregates.\n");
+            }
+            break;
+        case 6:
+            metrics_menu();
+            break;
+        case 7:
+            storage_menu(current_user);
+            break;
+        case 8:
+            archive_menu(current_user);
+            break;
+        case 9:
+            replication_status();
+            break;
+        case 10:
+            return;
+    }
+    
+    pause_and_wait();
+}
+
+/* -------------------- Startup -------------------- */
+/* Loads everything the menus, the daemon and the reports work from. */
+int start_shop() {
+    // Loads the time zone now rather than inside the first report's date parse
+    tzset();
+    metrics_init();
+    if (!load_catalog()) {
+        printf("Error: Unable to load product, customer and user data.\n");
+        return 0;
+    }
+    if (!colstore_upgrade()) {
+        printf("Warning: Unable to rebuild the sales store; reports will scan sales.csv.\n");
+    }
+    if (!load_sales_aggregates()) {
+        printf("Warning: Sales aggregates unavailable; reports will scan sales.csv.\n");
+    }
+    if (!load_sales_index()) {
+        printf("Warning: Sales index unavailable; filtered reports will scan sales.csv.\n");
+    }
+    if (!load_id_sequences()) {
+        printf("Error: Cannot initialize user system.\n");
+        return 0;
+    }
+    return 1;
+}
+
+void stop_shop() {
+    wal_writer_stop();
+    snapshot_catalog();
+    save_sales_aggregates();
+    sales_aggregates_clear();
+    sales_index_close();
+    sales_archive_clear();
+    id_sequences_close();
+    free_catalog();
+    arena_destroy(&report_arena);
+    string_pool_destroy(&interned);
+    snapshot_close();
+}
+
+/* -------------------- RPC Protocol -------------------- */
+/*
+ * Frames between the daemon and its clients are an 8-byte header followed
+ * by a payload:
+ *
+ *   u32 length    payload bytes after the header
+ *   u16 op        request op, echoed in the response
+ *   u16 status    0 in requests; RPC_OK or an RPC_ERR_* code in responses
+ *
+ * All integers are little-endian. Money is an i64 count of minor units
+ * (cents), and strings a u16 length followed by the bytes (no NUL). An
+ * error response carries a single string with the reason. A connection
+ * must log in before any other op except RPC_PING and RPC_METRICS.
+ *
+ *   op                    request                         response
+ *   RPC_PING              -                               -
+ *   RPC_LOGIN             str user, str password          i32 id, u8 permission bits
+ *   RPC_GET_PRODUCT       i32 id                          product
+ *   RPC_GET_CUSTOMER      i32 id                          customer
+ *   RPC_SEARCH_PRODUCTS   str query, u16 limit            u16 n, n x product
+ *   RPC_SEARCH_CUSTOMERS  str query, u16 limit            u16 n, n x customer
+ *   RPC_MAKE_SALE         i32 customer, u16 n,            i32 first sale id, u16 n,
+ *                         n x (i32 product, i32 qty)      money total
+ *   RPC_SALES_SUMMARY     filter                          totals
+ *   RPC_PROFIT            filter                          totals
+ *   RPC_LOW_STOCK         i32 threshold                   u16 n, n x product
+ *   RPC_METRICS           -                               text (Prometheus format)
+ *   RPC_SHIP_STATUS       u16 branch                      position
+ *   RPC_SHIP              u16 branch, position from,      -
+ *                         position to, u32 length,
+ *                         records in the shop.wal layout
+ *   RPC_FIND_SKU          str code                        product
+ *
+ *   product   i32 id, str name, str category, str brand, money cost, money price,
+ *             i32 stock, i32 min_stock, str sku ("" if none)
+ *
+ * RPC_FIND_SKU takes what was scanned or typed at a till's product prompt:
+ * a SKU if one matches, else a product id.
+ *   customer  i32 id, str name, str phone, str email, str address
+ *   filter    i32 day_from, i32 day_to, i32 product_id, str cashier, [u16 branch]
+ *   totals    money revenue, money cost, i64 units, i64 transactions
+ *   position  u16 phase, u32 segment, u64 offset, u32 record, i64 sales_total,
+ *             i64 sales_done (see Branches)
+ *   text      u32 length followed by the bytes
+ */
+enum {
+    RPC_PING = 1,
+    RPC_LOGIN,
+    RPC_GET_PRODUCT,
+    RPC_GET_CUSTOMER,
+    RPC_SEARCH_PRODUCTS,
+    RPC_SEARCH_CUSTOMERS,
+    RPC_MAKE_SALE,
+    RPC_SALES_SUMMARY,
+    RPC_PROFIT,
+    RPC_LOW_STOCK,
+    RPC_METRICS,
+    RPC_SHIP_STATUS,
+    RPC_SHIP,
+    RPC_FIND_SKU
+};
+
+enum {
+    RPC_OK = 0,
+    RPC_ERR_BAD_REQUEST,
+    RPC_ERR_AUTH,
+    RPC_ERR_PERMISSION,
+    RPC_ERR_NOT_FOUND,
+    RPC_ERR_STOCK,
+    RPC_ERR_IO,
+    RPC_ERR_CONFLICT
+};
+
+/* The same bits as USER_PERM_*. */
+enum {
+    RPC_PERM_PRODUCTS = 1,
+    RPC_PERM_CUSTOMERS = 2,
+    RPC_PERM_SALES = 4,
+    RPC_PERM_REPORTS = 8,
+    RPC_PERM_USERS = 16
+};
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int failed;
+} Wire;
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    int failed;
+} WireReader;
+
+static void wire_put(Wire *w, const void *src, size_t n) {
+    if (w->failed) return;
+    if (w->len + n > w->capacity) {
+        size_t capacity = w->capacity ? w->capacity : 256;
+        while (capacity < w->len + n) capacity *= 2;
+        char *data = realloc(w->data, capacity);
+        if (!data) {
+            w->failed = 1;
+            return;
+        }
+        w->data = data;
+        w->capacity = capacity;
+    }
+    memcpy(w->data + w->len, src, n);
+    w->len += n;
+}
+
+static void wire_u64(Wire *w, uint64_t v) {
+    unsigned char b[8];
+    for (int i = 0; i < 8; i++) b[i] = (unsigned char)(v >> (8 * i));
+    wire_put(w, b, 8);
+}
+
+static void wire_u32(Wire *w, uint32_t v) {
+    unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+    wire_put(w, b, 4);
+}
+
+static void wire_u16(Wire *w, uint16_t v) {
+    unsigned char b[2] = { (unsigned char)v, (unsigned char)(v >> 8) };
+    wire_put(w, b, 2);
+}
+
+static void wire_u8(Wire *w, uint8_t v) {
+    wire_put(w, &v, 1);
+}
+
+static void wire_money(Wire *w, Money v) {
+    wire_u64(w, (uint64_t)v);
+}
+
+static void wire_str(Wire *w, const char *s) {
+    size_t n = strlen(s);
+    if (n > 0xFFFF) n = 0xFFFF;
+    wire_u16(w, (uint16_t)n);
+    wire_put(w, s, n);
+}
+
+static const unsigned char *wire_take(WireReader *r, size_t n) {
+    if (r->failed || (size_t)(r->end - r->p) < n) {
+        r->failed = 1;
+        return NULL;
+    }
+    const unsigned char *p = r->p;
+    r->p += n;
+    return p;
+}
+
+static uint64_t wire_get_u64(WireReader *r) {
+    const unsigned char *b = wire_take(r, 8);
+    uint64_t v = 0;
+    for (int i = 0; b && i < 8; i++) v |= (uint64_t)b[i] << (8 * i);
+    return v;
+}
+
+static uint32_t wire_get_u32(WireReader *r) {
+    const unsigned char *b = wire_take(r, 4);
+    return b ? (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24 : 0;
+}
+
+static uint16_t wire_get_u16(WireReader *r) {
+    const unsigned char *b = wire_take(r, 2);
+    return b ? (uint16_t)(b[0] | b[1] << 8) : 0;
+}
+
+static Money wire_get_money(WireReader *r) {
+    return (Money)wire_get_u64(r);
+}
+
+/* Reads a string into out, truncating it to fit. */
+static void wire_get_str(WireReader *r, char *out, size_t size) {
+    size_t n = wire_get_u16(r);
+    const unsigned char *b = wire_take(r, n);
+    if (!b) n = 0;
+    if (n >= size) n = size - 1;
+    memcpy(out, b ? (const char *)b : "", n);
+    out[n] = '\0';
+}
+
+/* Appends a frame header; rpc_finish_frame() fills in the length. */
+static size_t rpc_begin_frame(Wire *w, int op, int status) {
+    size_t start = w->len;
+    wire_u32(w, 0);
+    wire_u16(w, (uint16_t)op);
+    wire_u16(w, (uint16_t)status);
+    return start;
+}
+
+static void rpc_finish_frame(Wire *w, size_t start) {
+    if (w->failed) return;
+    uint32_t len = (uint32_t)(w->len - start - RPC_HEADER_SIZE);
+    for (int i = 0; i < 4; i++) w->data[start + i] = (char)(len >> (8 * i));
+}
+
+static void wire_product(Wire *w, const Product *p) {
+    wire_u32(w, (uint32_t)p->id);
+    wire_str(w, p->text->name);
+    wire_str(w, p->text->category);
+    wire_str(w, p->text->brand);
+    wire_money(w, p->cost_price);
+    wire_money(w, p->sell_price);
+    wire_u32(w, (uint32_t)p->stock);
+    wire_u32(w, (uint32_t)p->min_stock_level);
+    wire_str(w, p->text->sku);
+}
+
+static void wire_get_product(WireReader *r, ProductRecord *p) {
+    p->id = (int32_t)wire_get_u32(r);
+    wire_get_str(r, p->name, sizeof(p->name));
+    wire_get_str(r, p->category, sizeof(p->category));
+    wire_get_str(r, p->brand, sizeof(p->brand));
+    p->cost_price = wire_get_money(r);
+    p->sell_price = wire_get_money(r);
+    p->stock = (int32_t)wire_get_u32(r);
+    p->min_stock_level = (int32_t)wire_get_u32(r);
+    wire_get_str(r, p->sku, sizeof(p->sku));
+}
+
+static void wire_customer(Wire *w, const Customer *c) {
+    wire_u32(w, (uint32_t)c->id);
+    wire_str(w, c->name);
+    wire_str(w, c->phone);
+    wire_str(w, c->email);
+    wire_str(w, c->address);
+}
+
+static void wire_get_customer(WireReader *r, CustomerRecord *c) {
+    c->id = (int32_t)wire_get_u32(r);
+    wire_get_str(r, c->name, sizeof(c->name));
+    wire_get_str(r, c->phone, sizeof(c->phone));
+    wire_get_str(r, c->email, sizeof(c->email));
+    wire_get_str(r, c->address, sizeof(c->address));
+}
+
+static void wire_filter(Wire *w, const SalesFilter *f) {
+    wire_u32(w, (uint32_t)f->day_from);
+    wire_u32(w, (uint32_t)f->day_to);
+    wire_u32(w, (uint32_t)f->product_id);
+    wire_str(w, f->cashier);
+    wire_u16(w, (uint16_t)f->branch);
+}
+
+static void wire_get_filter(WireReader *r, SalesFilter *f) {
+    memset(f, 0, sizeof(*f));
+    f->day_from = (int32_t)wire_get_u32(r);
+    f->day_to = (int32_t)wire_get_u32(r);
+    f->product_id = (int32_t)wire_get_u32(r);
+    wire_get_str(r, f->cashier, sizeof(f->cashier));
+    // Clients from before branches end the filter here
+    if (r->p < r->end) f->branch = wire_get_u16(r);
+}
+
+static void wire_totals(Wire *w, const SalesTotals *t) {
+    wire_money(w, t->revenue);
+    wire_money(w, t->cost);
+    wire_u64(w, (uint64_t)t->units);
+    wire_u64(w, (uint64_t)t->transactions);
+}
+
+static void wire_get_totals(WireReader *r, SalesTotals *t) {
+    t->revenue = wire_get_money(r);
+    t->cost = wire_get_money(r);
+    t->units = (long)wire_get_u64(r);
+    t->transactions = (long)wire_get_u64(r);
+}
+
+static void wire_ship_position(Wire *w, const ShipPosition *p) {
+    wire_u16(w, (uint16_t)p->phase);
+    wire_u32(w, p->segment);
+    wire_u64(w, p->offset);
+    wire_u32(w, p->record);
+    wire_u64(w, (uint64_t)p->sales_total);
+    wire_u64(w, (uint64_t)p->sales_done);
+}
+
+static void wire_get_ship_position(WireReader *r, ShipPosition *p) {
+    memset(p, 0, sizeof(*p));
+    p->phase = wire_get_u16(r);
+    p->segment = wire_get_u32(r);
+    p->offset = wire_get_u64(r);
+    p->record = wire_get_u32(r);
+    p->sales_total = (int64_t)wire_get_u64(r);
+    p->sales_done = (int64_t)wire_get_u64(r);
+}
+
+/*
+ * Addresses are "unix:PATH", a path containing '/' or ending in ".sock",
+ * "HOST:PORT", or a bare port on 127.0.0.1.
+ */
+static const char *rpc_unix_path(const char *address) {
+    if (strncmp(address, "unix:", 5) == 0) return address + 5;
+    size_t n = strlen(address);
+    if (strchr(address, '/') || (n > 5 && strcmp(address + n - 5, ".sock") == 0)) return address;
+    return NULL;
+}
+
+static int rpc_socket(const char *address, int listening) {
+    const char *path = rpc_unix_path(address);
+    if (path) {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(sa.sun_path)) return -1;
+        strcpy(sa.sun_path, path);
+        
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (listening) {
+            unlink(path);
+            if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 128) != 0) {
+                close(fd);
+                return -1;
+            }
+        } else if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
     }
     
-    int user_id = get_validated_int("Enter user ID to delete: ", 1, 10000);
+    char host[256] = "127.0.0.1";
+    const char *port = address;
+    const char *colon = strrchr(address, ':');
+    if (colon) {
+        size_t n = (size_t)(colon - address);
+        if (n >= sizeof(host)) return -1;
+        if (n > 0) {
+            memcpy(host, address, n);
+            host[n] = '\0';
+        }
+        port = colon + 1;
+    }
     
-    // Prevent self-deletion
-    if (user_id == current_user->id) {
-        printf("Error: You cannot delete your own account.\n");
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        int ok;
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 128) == 0;
+        } else {
+            ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        }
+        if (!ok) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/* -------------------- Shop Daemon -------------------- */
+/*
+ * --daemon keeps the catalog, customers, search and sales indexes resident
+ * and serves clients over the RPC protocol from a single-threaded epoll
+ * loop. Requests that arrive together are handled back to back, and the
+ * sales among them share one write-ahead log sync: responses are held until
+ * that sync, then flushed. Other tills may still work on the same directory;
+ * the daemon refreshes from the log before each batch.
+ *
+ * One connection cannot hold the loop or its memory: a wakeup reads and
+ * handles a bounded amount from it, the input buffer never grows past one
+ * frame, and a client that stops reading its responses is not read from
+ * until they drain. Logins are checked on the loop too, and a PBKDF2 check
+ * at the default PASSWORD_ITERATIONS holds every other client for about
+ * 0.1 s, so after a failed login the connection must wait
+ * RPC_LOGIN_DELAY_NS before it may try again.
+ */
+typedef struct {
+    int fd;
+    int closing;
+    int logged_in;
+    int64_t login_after;       /* monotonic ns before which a login is refused */
+    User user;
+    char *in;
+    size_t in_len;
+    size_t in_capacity;
+    Wire out;
+    size_t out_sent;
+} RpcConn;
+
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static void rpc_error(Wire *w, int op, int status, const char *message) {
+    size_t frame = rpc_begin_frame(w, op, status);
+    wire_str(w, message);
+    rpc_finish_frame(w, frame);
+}
+
+static int user_permissions(const User *u) {
+    return (int)(u->permissions & USER_ALL_PERMISSIONS);
+}
+
+static void rpc_search(RpcConn *c, int op, WireReader *r) {
+    char query[100];
+    wire_get_str(r, query, sizeof(query));
+    int limit = wire_get_u16(r);
+    if (r->failed) {
+        rpc_error(&c->out, op, RPC_ERR_BAD_REQUEST, "Malformed request");
         return;
     }
-    
-    FILE *f = fopen(USERS_FILE, "r");
-    FILE *tmp = fopen(".users_tmp", "w");
-    if (!f || !tmp) {
-        if (f) fclose(f);
-        if (tmp) fclose(tmp);
-        printf("Error: Unable to access users file.\n");
+    
+    int hit_count;
+    SearchHit *hits = op == RPC_SEARCH_PRODUCTS ? search_products_index(query, &hit_count)
+                                                : search_customers_index(query, &hit_count);
+    if (limit == 0 || limit > hit_count) limit = hit_count;
+    
+    size_t frame = rpc_begin_frame(&c->out, op, RPC_OK);
+    wire_u16(&c->out, (uint16_t)limit);
+    for (int i = 0; i < limit; i++) {
+        if (op == RPC_SEARCH_PRODUCTS) wire_product(&c->out, product_row(hits[i].row));
+        else wire_customer(&c->out, customer_row(hits[i].row));
+    }
+    rpc_finish_frame(&c->out, frame);
+}
+
+/* Records a sale from the request; returns 1 if a log sync is now owed. */
+static int rpc_make_sale(RpcConn *c, WireReader *r) {
+    Sale lines[MAX_BASKET_ITEMS];
+    memset(lines, 0, sizeof(lines));
+    
+    int customer_id = (int32_t)wire_get_u32(r);
+    int count = wire_get_u16(r);
+    if (count > MAX_BASKET_ITEMS) r->failed = 1;
+    for (int i = 0; i < count && !r->failed; i++) {
+        lines[i].product_id = (int32_t)wire_get_u32(r);
+        lines[i].quantity = (int32_t)wire_get_u32(r);
+        if (lines[i].quantity <= 0) r->failed = 1;
+    }
+    if (r->failed || count == 0) {
+        rpc_error(&c->out, RPC_MAKE_SALE, RPC_ERR_BAD_REQUEST, "Malformed request");
+        return 0;
+    }
+    if (!customer_lookup(customer_id)) {
+        rpc_error(&c->out, RPC_MAKE_SALE, RPC_ERR_NOT_FOUND, "Customer not found");
+        return 0;
+    }
+    
+    int64_t date = (int64_t)time(NULL);
+    Money total = 0;
+    for (int i = 0; i < count; i++) {
+        const Product *p = product_lookup(lines[i].product_id);
+        if (!p) {
+            rpc_error(&c->out, RPC_MAKE_SALE, RPC_ERR_NOT_FOUND, "Product not found");
+            return 0;
+        }
+        lines[i].customer_id = customer_id;
+        lines[i].total_price = p->sell_price * lines[i].quantity;
+        lines[i].cashier_id = c->user.id;
+        lines[i].date = date;
+        total += lines[i].total_price;
+    }
+    
+    int first_id = id_sequence_take(SEQ_SALES, count);
+    for (int i = 0; i < count; i++) lines[i].id = first_id + i;
+    
+    if (!commit_sales_unsynced(lines, count)) {
+        // Stock is checked under the lock, so a shortfall shows up here
+        int short_stock = 0;
+        for (int i = 0; i < count; i++) {
+            const Product *p = product_lookup(lines[i].product_id);
+            if (p && p->stock < basket_reserved(lines, count, lines[i].product_id)) short_stock = 1;
+        }
+        rpc_error(&c->out, RPC_MAKE_SALE, short_stock ? RPC_ERR_STOCK : RPC_ERR_IO,
+                  short_stock ? "Not enough stock" : "Sale was not recorded");
+        return 0;
+    }
+    
+    size_t frame = rpc_begin_frame(&c->out, RPC_MAKE_SALE, RPC_OK);
+    wire_u32(&c->out, (uint32_t)first_id);
+    wire_u16(&c->out, (uint16_t)count);
+    wire_money(&c->out, total);
+    rpc_finish_frame(&c->out, frame);
+    return 1;
+}
+
+/*
+ * Checks one record a branch shipped and adds it to the frame's group as
+ * this node applies it; 0 if it is malformed or not the branch's to send.
+ * The snapshot may be sent again after an interruption: customers already
+ * here are skipped, and a product already here gets a stock change that
+ * brings it to the snapshot's count.
+ */
+static int ship_accept_record(WalGroup *g, int branch, int snapshot, int type, const char *payload, uint32_t len) {
+    if (type == WAL_SALE && len == sizeof(BranchSale)) {
+        BranchSale sale;
+        memcpy(&sale, payload, sizeof(sale));
+        sale.cashier[sizeof(sale.cashier) - 1] = '\0';
+        if (id_branch(sale.sale.id) != branch || id_branch(sale.sale.product_id) != branch) return 0;
+        return wal_add(g, WAL_SALE, &sale, sizeof(sale));
+    }
+    if (type == WAL_STOCK && len == sizeof(StockJournalRecord)) {
+        StockJournalRecord r;
+        memcpy(&r, payload, sizeof(r));
+        return id_branch(r.product_id) == branch && wal_add(g, WAL_STOCK, &r, sizeof(r));
+    }
+    ProductRecord prod;
+    if (type == WAL_PRODUCT && wal_decode_product(payload, len, &prod)) {
+        prod.name[sizeof(prod.name) - 1] = prod.category[sizeof(prod.category) - 1] = '\0';
+        prod.brand[sizeof(prod.brand) - 1] = prod.sku[sizeof(prod.sku) - 1] = '\0';
+        if (id_branch(prod.id) != branch) return 0;
+        
+        const Product *have = product_lookup(prod.id);
+        if (!have) return wal_add(g, WAL_PRODUCT, &prod, sizeof(prod));
+        if (!snapshot || have->stock == prod.stock) return 1;
+        StockJournalRecord r;
+        memset(&r, 0, sizeof(r));
+        r.product_id = prod.id;
+        r.delta = prod.stock - have->stock;
+        r.timestamp = (int64_t)time(NULL);
+        return wal_add(g, WAL_STOCK, &r, sizeof(r));
+    }
+    if (type == WAL_CUSTOMER && len == sizeof(CustomerRecord)) {
+        CustomerRecord cust;
+        memcpy(&cust, payload, sizeof(cust));
+        cust.name[sizeof(cust.name) - 1] = cust.phone[sizeof(cust.phone) - 1] = '\0';
+        cust.email[sizeof(cust.email) - 1] = cust.address[sizeof(cust.address) - 1] = '\0';
+        if (id_branch(cust.id) != branch) return 0;
+        return customer_lookup(cust.id) || wal_add(g, WAL_CUSTOMER, &cust, sizeof(cust));
+    }
+    return 0;
+}
+
+/* colstore_append() for a frame's sales, which name their cashier. */
+static int colstore_append_shipped(const WalGroup *g) {
+    if (!colstore_enabled()) return 1;
+    
+    ColstoreWriter w;
+    memset(&w, 0, sizeof(w));
+    size_t mark = arena_mark(&report_arena);
+    const char *end = g->data + g->len;
+    WalRecordHeader rh;
+    const char *payload;
+    int ok = 1;
+    for (const char *p = g->data; ok && (payload = wal_next_record(p, end, &rh)); p = payload + rh.length) {
+        if (rh.type != WAL_SALE || rh.length != sizeof(BranchSale)) continue;
+        BranchSale sale;
+        memcpy(&sale, payload, sizeof(sale));
+        ok = colstore_writer_add(&w, &sale.sale, sale.cashier);
+    }
+    ok = ok && colstore_writer_flush(&w);
+    colstore_writer_close(&w);
+    arena_release(&report_arena, mark);
+    return ok;
+}
+
+/* Applies a frame of a branch's stream; returns 1 if a log sync is now owed. */
+static int rpc_ship(RpcConn *c, WireReader *r) {
+    int branch = wire_get_u16(r);
+    ShipPosition from, to;
+    wire_get_ship_position(r, &from);
+    wire_get_ship_position(r, &to);
+    uint32_t len = wire_get_u32(r);
+    const char *records = (const char *)wire_take(r, len);
+    if (r->failed || branch < 1 || branch > MAX_BRANCH || branch == shop_branch() ||
+        to.phase < SHIP_SNAPSHOT || to.phase > SHIP_LOG) {
+        rpc_error(&c->out, RPC_SHIP, RPC_ERR_BAD_REQUEST, "Malformed request");
+        return 0;
+    }
+    if (!wal_lock()) {
+        rpc_error(&c->out, RPC_SHIP, RPC_ERR_IO, "Unable to lock the shop");
+        return 0;
+    }
+    if (!ship_position_equal(&ship_positions[branch], &from)) {
+        wal_unlock();
+        rpc_error(&c->out, RPC_SHIP, RPC_ERR_CONFLICT, "Frame does not start where the branch left off");
+        return 0;
+    }
+    
+    WalGroup g = { NULL, 0, 0, 0 };
+    const char *end = records + len;
+    WalRecordHeader rh;
+    int ok = 1;
+    for (const char *p = records; ok && p < end; ) {
+        const char *payload = wal_next_record(p, end, &rh);
+        ok = payload && ship_accept_record(&g, branch, to.phase == SHIP_SNAPSHOT, rh.type, payload, rh.length);
+        if (ok) p = payload + rh.length;
+    }
+    if (!ok) {
+        wal_unlock();
+        wal_group_free(&g);
+        rpc_error(&c->out, RPC_SHIP, RPC_ERR_BAD_REQUEST, "Frame holds a malformed record or another branch's ids");
+        return 0;
+    }
+    
+    to.branch = branch;
+    to.updated = (int64_t)time(NULL);
+    ok = wal_add(&g, WAL_SHIP, &to, sizeof(to)) && wal_commit(&g);
+    // The branch raises its own reorder alerts
+    reorder_clear_alerts();
+    if (ok) {
+        if (!colstore_append_shipped(&g)) printf("Warning: Unable to append branch sales to the columnar store.\n");
+        if (!sales_aggregates_catch_up()) printf("Warning: Unable to update sales aggregates.\n");
+        if (!sales_index_catch_up()) printf("Warning: Unable to update sales index.\n");
+    }
+    wal_unlock();
+    wal_group_free(&g);
+    if (!ok) {
+        rpc_error(&c->out, RPC_SHIP, RPC_ERR_IO, "Frame was not recorded");
+        return 0;
+    }
+    rpc_finish_frame(&c->out, rpc_begin_frame(&c->out, RPC_SHIP, RPC_OK));
+    return 1;
+}
+
+/* Handles one request frame; returns 1 if a log sync is owed before replying. */
+static int rpc_handle(RpcConn *c, int op, const unsigned char *payload, size_t len) {
+    WireReader r = { payload, payload + len, 0 };
+    Wire *w = &c->out;
+    
+    // Nothing in the arena outlives a request
+    arena_release(&report_arena, 0);
+    
+    if (op == RPC_PING) {
+        rpc_finish_frame(w, rpc_begin_frame(w, op, RPC_OK));
+        return 0;
+    }
+    if (op == RPC_METRICS) {
+        char *text = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&text, &len);
+        if (!f) {
+            rpc_error(w, op, RPC_ERR_IO, "Out of memory");
+            return 0;
+        }
+        metrics_write_prometheus(f);
+        fclose(f);
+        size_t frame = rpc_begin_frame(w, op, RPC_OK);
+        wire_u32(w, (uint32_t)len);
+        wire_put(w, text, len);
+        rpc_finish_frame(w, frame);
+        free(text);
+        return 0;
+    }
+    if (op == RPC_LOGIN) {
+        char username[50], password[MAX_PASSWORD_LEN];
+        wire_get_str(&r, username, sizeof(username));
+        wire_get_str(&r, password, sizeof(password));
+        if (monotonic_ns() < c->login_after) {
+            rpc_error(w, op, RPC_ERR_AUTH, "Too many login attempts; try again in a moment");
+            return 0;
+        }
+        if (r.failed || !authenticate(username, password, &c->user)) {
+            c->logged_in = 0;
+            c->login_after = monotonic_ns() + RPC_LOGIN_DELAY_NS;
+            rpc_error(w, op, RPC_ERR_AUTH, "Invalid username or password, or account is inactive");
+            return 0;
+        }
+        c->logged_in = 1;
+        size_t frame = rpc_begin_frame(w, op, RPC_OK);
+        wire_u32(w, (uint32_t)c->user.id);
+        wire_u8(w, (uint8_t)user_permissions(&c->user));
+        rpc_finish_frame(w, frame);
+        return 0;
+    }
+    if (!c->logged_in) {
+        rpc_error(w, op, RPC_ERR_AUTH, "Not logged in");
+        return 0;
+    }
+    
+    switch (op) {
+        case RPC_GET_PRODUCT:
+        case RPC_GET_CUSTOMER: {
+            int id = (int32_t)wire_get_u32(&r);
+            const Product *p = op == RPC_GET_PRODUCT ? product_lookup(id) : NULL;
+            const Customer *cust = op == RPC_GET_CUSTOMER ? customer_lookup(id) : NULL;
+            if (r.failed) {
+                rpc_error(w, op, RPC_ERR_BAD_REQUEST, "Malformed request");
+            } else if (!p && !cust) {
+                rpc_error(w, op, RPC_ERR_NOT_FOUND, op == RPC_GET_PRODUCT ? "Product not found" : "Customer not found");
+            } else {
+                size_t frame = rpc_begin_frame(w, op, RPC_OK);
+                if (p) wire_product(w, p);
+                else wire_customer(w, cust);
+                rpc_finish_frame(w, frame);
+            }
+            return 0;
+        }
+        case RPC_FIND_SKU: {
+            char code[100];
+            wire_get_str(&r, code, sizeof(code));
+            const Product *p = r.failed ? NULL : find_product_by_code(code);
+            if (r.failed) {
+                rpc_error(w, op, RPC_ERR_BAD_REQUEST, "Malformed request");
+            } else if (!p) {
+                rpc_error(w, op, RPC_ERR_NOT_FOUND, "Product not found");
+            } else {
+                size_t frame = rpc_begin_frame(w, op, RPC_OK);
+                wire_product(w, p);
+                rpc_finish_frame(w, frame);
+            }
+            return 0;
+        }
+        case RPC_SEARCH_PRODUCTS:
+        case RPC_SEARCH_CUSTOMERS:
+            rpc_search(c, op, &r);
+            return 0;
+        case RPC_MAKE_SALE:
+            if (!(c->user.permissions & USER_PERM_SALES)) {
+                rpc_error(w, op, RPC_ERR_PERMISSION, "You don't have permission to manage sales");
+                return 0;
+            }
+            return rpc_make_sale(c, &r);
+        case RPC_SHIP_STATUS:
+        case RPC_SHIP: {
+            uint32_t needed = USER_PERM_PRODUCTS | USER_PERM_CUSTOMERS | USER_PERM_SALES;
+            if ((c->user.permissions & needed) != needed) {
+                rpc_error(w, op, RPC_ERR_PERMISSION, "You don't have permission to receive branch data");
+                return 0;
+            }
+            if (op == RPC_SHIP) return rpc_ship(c, &r);
+            int branch = wire_get_u16(&r);
+            if (r.failed || branch < 1 || branch > MAX_BRANCH) {
+                rpc_error(w, op, RPC_ERR_BAD_REQUEST, "Malformed request");
+                return 0;
+            }
+            size_t frame = rpc_begin_frame(w, op, RPC_OK);
+            wire_ship_position(w, &ship_positions[branch]);
+            rpc_finish_frame(w, frame);
+            return 0;
+        }
+        case RPC_SALES_SUMMARY:
+        case RPC_PROFIT:
+        case RPC_LOW_STOCK:
+            break;
+        default:
+            rpc_error(w, op, RPC_ERR_BAD_REQUEST, "Unknown request");
+            return 0;
+    }
+    
+    if (!(c->user.permissions & USER_PERM_REPORTS)) {
+        rpc_error(w, op, RPC_ERR_PERMISSION, "You don't have permission to view reports");
+        return 0;
+    }
+    if (op == RPC_LOW_STOCK) {
+        int64_t start = metric_start();
+        int threshold = (int32_t)wire_get_u32(&r);
+        if (r.failed) {
+            rpc_error(w, op, RPC_ERR_BAD_REQUEST, "Malformed request");
+            return 0;
+        }
+        int n = 0;
+        for (int i = 0; i < product_table.count; i++) {
+            if (product_row(i)->stock <= threshold) n++;
+        }
+        if (n > 0xFFFF) n = 0xFFFF;
+        size_t frame = rpc_begin_frame(w, op, RPC_OK);
+        wire_u16(w, (uint16_t)n);
+        for (int i = 0; i < product_table.count && n > 0; i++) {
+            if (product_row(i)->stock <= threshold) {
+                wire_product(w, product_row(i));
+                n--;
+            }
+        }
+        rpc_finish_frame(w, frame);
+        metric_stop(METRIC_REPORT_LOW_STOCK, start);
+        return 0;
+    }
+    
+    SalesFilter filter;
+    wire_get_filter(&r, &filter);
+    SalesTotals totals;
+    int ok = op == RPC_PROFIT ? compute_profit_totals(&filter, &totals) : compute_sales_summary(&filter, &totals);
+    if (r.failed) {
+        rpc_error(w, op, RPC_ERR_BAD_REQUEST, "Malformed request");
+    } else if (!ok) {
+        rpc_error(w, op, RPC_ERR_IO, "Unable to read sales data");
+    } else {
+        size_t frame = rpc_begin_frame(w, op, RPC_OK);
+        wire_totals(w, &totals);
+        rpc_finish_frame(w, frame);
+    }
+    return 0;
+}
+
+static size_t rpc_backlog(const RpcConn *c) {
+    return c->out.len - c->out_sent;
+}
+
+/* Whether the input holds a complete frame, or a header no frame can match. */
+static int rpc_frame_queued(const RpcConn *c) {
+    if (c->in_len < RPC_HEADER_SIZE) return 0;
+    WireReader r = { (const unsigned char *)c->in, (const unsigned char *)c->in + c->in_len, 0 };
+    uint32_t len = wire_get_u32(&r);
+    return len > RPC_MAX_FRAME || c->in_len - RPC_HEADER_SIZE >= len;
+}
+
+/*
+ * Reads what the socket has, up to RPC_MAX_READS reads and one frame of
+ * input, and handles up to RPC_MAX_REQUESTS complete frames; returns 1 if a
+ * sync is owed. Nothing is read while the response backlog is over
+ * RPC_MAX_BACKLOG.
+ */
+static int rpc_read(RpcConn *c) {
+    int owe_sync = 0;
+    if (rpc_backlog(c) > RPC_MAX_BACKLOG) return 0;
+    for (int reads = 0; reads < RPC_MAX_READS; reads++) {
+        if (c->in_capacity - c->in_len < 4096 && c->in_capacity < RPC_MAX_FRAME + RPC_HEADER_SIZE) {
+            size_t capacity = c->in_capacity ? c->in_capacity * 2 : 8192;
+            if (capacity > RPC_MAX_FRAME + RPC_HEADER_SIZE) capacity = RPC_MAX_FRAME + RPC_HEADER_SIZE;
+            char *in = realloc(c->in, capacity);
+            if (!in) {
+                c->closing = 1;
+                break;
+            }
+            c->in = in;
+            c->in_capacity = capacity;
+        }
+        // A full buffer holds at least one whole frame; it is read again once that is handled
+        if (c->in_len == c->in_capacity) break;
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_capacity - c->in_len);
+        if (n > 0) {
+            c->in_len += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) c->closing = 1;
+        break;
+    }
+    
+    size_t pos = 0;
+    for (int handled = 0; handled < RPC_MAX_REQUESTS && c->in_len - pos >= RPC_HEADER_SIZE; handled++) {
+        if (rpc_backlog(c) > RPC_MAX_BACKLOG) break;
+        WireReader r = { (const unsigned char *)c->in + pos, (const unsigned char *)c->in + c->in_len, 0 };
+        uint32_t len = wire_get_u32(&r);
+        int op = wire_get_u16(&r);
+        wire_get_u16(&r);
+        if (len > RPC_MAX_FRAME) {
+            c->closing = 1;
+            pos = c->in_len;
+            break;
+        }
+        if (c->in_len - pos - RPC_HEADER_SIZE < len) break;
+        
+        int64_t start = metric_start();
+        owe_sync |= rpc_handle(c, op, (const unsigned char *)c->in + pos + RPC_HEADER_SIZE, len);
+        metric_stop(METRIC_RPC_REQUEST, start);
+        pos += RPC_HEADER_SIZE + len;
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    if (c->out.failed) c->closing = 1;
+    return owe_sync;
+}
+
+/* Sends as much pending output as the socket takes; returns 1 if output remains. */
+static int rpc_flush(RpcConn *c) {
+    while (c->out_sent < c->out.len) {
+        ssize_t n = write(c->fd, c->out.data + c->out_sent, c->out.len - c->out_sent);
+        if (n > 0) {
+            c->out_sent += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+        c->closing = 1;
+        return 0;
+    }
+    c->out.len = 0;
+    c->out_sent = 0;
+    return 0;
+}
+
+static void rpc_close(RpcConn *c) {
+    close(c->fd);
+    free(c->in);
+    free(c->out.data);
+    free(c);
+}
+
+int run_daemon(const char *address) {
+    int listen_fd = rpc_socket(address, 1);
+    if (listen_fd < 0 || !set_nonblocking(listen_fd)) {
+        printf("Error: Unable to listen on %s.\n", address);
+        return 1;
+    }
+    
+    int ep = epoll_create1(0);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+        printf("Error: Unable to start the event loop.\n");
+        close(listen_fd);
+        return 1;
+    }
+    
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    printf("Shop daemon listening on %s\n", address);
+    fflush(stdout);
+    
+    struct epoll_event events[RPC_MAX_EVENTS];
+    while (!daemon_stop) {
+        int n = epoll_wait(ep, events, RPC_MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        wal_refresh();
+        
+        int owe_sync = 0;
+        for (int i = 0; i < n; i++) {
+            RpcConn *c = events[i].data.ptr;
+            if (!c) {
+                int fd;
+                while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                    RpcConn *conn = calloc(1, sizeof(RpcConn));
+                    if (!conn || !set_nonblocking(fd)) {
+                        free(conn);
+                        close(fd);
+                        continue;
+                    }
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    conn->fd = fd;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = conn;
+                    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0) rpc_close(conn);
+                }
+                continue;
+            }
+            // EPOLLOUT also stands for frames left queued by the limits in rpc_read
+            if (events[i].events & (EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR)) owe_sync |= rpc_read(c);
+        }
+        
+        // Responses to sales wait until the log is on disk
+        if (owe_sync && !wal_sync()) printf("Warning: Unable to flush %s to disk.\n", WAL_FILE);
+        
+        for (int i = 0; i < n; i++) {
+            RpcConn *c = events[i].data.ptr;
+            if (!c) continue;
+            int pending = rpc_flush(c);
+            int queued = !c->out.failed && rpc_frame_queued(c);
+            if (c->closing && !pending && !queued) {
+                epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+                rpc_close(c);
+                continue;
+            }
+            // A client that is not reading its responses is not read from either; a writable
+            // socket wakes the loop again for frames that are already buffered
+            ev.events = (rpc_backlog(c) > RPC_MAX_BACKLOG ? 0 : EPOLLIN) | (pending || queued ? EPOLLOUT : 0);
+            ev.data.ptr = c;
+            epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+    }
+    
+    printf("Shop daemon stopping.\n");
+    close(ep);
+    close(listen_fd);
+    if (rpc_unix_path(address)) unlink(rpc_unix_path(address));
+    return 0;
+}
+
+/* -------------------- Shop Client -------------------- */
+/* --client is a thin till: every lookup, sale and report is a request to the daemon. */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t capacity;
+} RpcClient;
+
+static int write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int read_all(int fd, char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+/*
+ * Sends one request frame (op plus the payload in req) and waits for the
+ * response. Returns its status, or -1 if the connection failed; the
+ * response payload is left in *resp.
+ */
+static int rpc_call(RpcClient *cl, int op, const Wire *req, WireReader *resp) {
+    Wire frame = { NULL, 0, 0, 0 };
+    size_t start = rpc_begin_frame(&frame, op, 0);
+    if (req) wire_put(&frame, req->data, req->len);
+    rpc_finish_frame(&frame, start);
+    int ok = !frame.failed && write_all(cl->fd, frame.data, frame.len);
+    free(frame.data);
+    
+    char header[RPC_HEADER_SIZE];
+    if (!ok || !read_all(cl->fd, header, sizeof(header))) return -1;
+    WireReader h = { (const unsigned char *)header, (const unsigned char *)header + sizeof(header), 0 };
+    uint32_t len = wire_get_u32(&h);
+    wire_get_u16(&h);
+    int status = wire_get_u16(&h);
+    if (len > RPC_MAX_FRAME) return -1;
+    
+    if (len > cl->capacity) {
+        char *buf = realloc(cl->buf, len);
+        if (!buf) return -1;
+        cl->buf = buf;
+        cl->capacity = len;
+    }
+    if (!read_all(cl->fd, cl->buf, len)) return -1;
+    resp->p = (const unsigned char *)cl->buf;
+    resp->end = (const unsigned char *)cl->buf + len;
+    resp->failed = 0;
+    return status;
+}
+
+/* Prints the reason carried by an error response. */
+static void print_rpc_error(int status, WireReader *resp) {
+    if (status < 0) {
+        printf("Error: Lost connection to the shop daemon.\n");
         return;
     }
+    char message[256];
+    wire_get_str(resp, message, sizeof(message));
+    printf("Error: %s.\n", message);
+}
+
+static void print_product_header() {
+    printf("\n%-4s %-20s %-15s %-15s %-8s %-8s %-6s %-6s\n", 
+           "ID", "Name", "Category", "Brand", "Cost", "Price", "Stock", "Min");
+    printf("-------------------------------------------------------------------------------\n");
+}
+
+static void print_product_line(const ProductRecord *p) {
+    char cost[MONEY_TEXT], price[MONEY_TEXT];
+    printf("%-4d %-20s %-15s %-15s %-8s %-8s %-6d %-6d\n", 
+           p->id, p->name, p->category, p->brand, format_money(p->cost_price, cost, sizeof(cost)),
+           format_money(p->sell_price, price, sizeof(price)), p->stock, p->min_stock_level);
+}
+
+/* Each client_* action returns its rpc_call status, so the menu can tell a dropped connection. */
+static int client_products(RpcClient *cl, int op, Wire *req) {
+    WireReader resp;
+    int status = rpc_call(cl, op, req, &resp);
+    if (status != RPC_OK) {
+        print_rpc_error(status, &resp);
+        return status;
+    }
+    int n = wire_get_u16(&resp);
+    if (n > 0) print_product_header();
+    for (int i = 0; i < n; i++) {
+        ProductRecord p;
+        wire_get_product(&resp, &p);
+        print_product_line(&p);
+    }
+    if (n == 0) printf("No products found.\n");
+    return RPC_OK;
+}
+
+static int client_customers(RpcClient *cl, Wire *req) {
+    WireReader resp;
+    int status = rpc_call(cl, RPC_SEARCH_CUSTOMERS, req, &resp);
+    if (status != RPC_OK) {
+        print_rpc_error(status, &resp);
+        return status;
+    }
+    int n = wire_get_u16(&resp);
+    if (n > 0) {
+        printf("\n%-4s %-20s %-15s %-25s\n", "ID", "Name", "Phone", "Email");
+        printf("----------------------------------------------------\n");
+    }
+    for (int i = 0; i < n; i++) {
+        CustomerRecord c;
+        wire_get_customer(&resp, &c);
+        printf("%-4d %-20s %-15s %-25s\n", c.id, c.name, c.phone, c.email);
+    }
+    if (n == 0) printf("No customers found.\n");
+    return RPC_OK;
+}
+
+static int client_sale(RpcClient *cl) {
+    Wire req = { NULL, 0, 0, 0 };
+    wire_u32(&req, (uint32_t)get_validated_int("Enter customer ID: ", 1, MAX_RECORD_ID));
+    
+    int32_t items[MAX_BASKET_ITEMS][2];
+    int count = 0;
+    while (count < MAX_BASKET_ITEMS) {
+        int pid = get_validated_int("Enter product ID (0 to finish): ", 0, MAX_RECORD_ID);
+        if (pid == 0) break;
+        items[count][0] = pid;
+        items[count][1] = get_validated_int("Quantity: ", 1, 10000);
+        count++;
+    }
+    if (count == 0) {
+        printf("Basket is empty; nothing recorded.\n");
+        free(req.data);
+        return RPC_OK;
+    }
+    wire_u16(&req, (uint16_t)count);
+    for (int i = 0; i < count; i++) {
+        wire_u32(&req, (uint32_t)items[i][0]);
+        wire_u32(&req, (uint32_t)items[i][1]);
+    }
     
-    char line[MAX_LINE];
-    int found = 0;
-    
-    while (fgets(line, sizeof(line), f)) {
-        User u;
-        u.id = atoi(parse_csv_field(line, 0));
+    WireReader resp;
+    int status = rpc_call(cl, RPC_MAKE_SALE, &req, &resp);
+    free(req.data);
+    if (status != RPC_OK) {
+        print_rpc_error(status, &resp);
+        return status;
+    }
+    int first_id = (int32_t)wire_get_u32(&resp);
+    int lines = wire_get_u16(&resp);
+    char total[MONEY_TEXT];
+    format_money(wire_get_money(&resp), total, sizeof(total));
+    printf("\n✓ Sale recorded successfully!\n");
+    printf("Sale ID%s: %d", lines > 1 ? "s" : "", first_id);
+    if (lines > 1) printf("-%d", first_id + lines - 1);
+    printf("\nTotal Amount: %s\n", total);
+    return RPC_OK;
+}
+
+/*
+ * The quick sale over the daemon: each scanned SKU (or typed product id) is
+ * looked up with RPC_FIND_SKU and sold on its own, so nothing is searched.
+ */
+static int client_quick_sale(RpcClient *cl) {
+    Wire req = { NULL, 0, 0, 0 };
+    WireReader resp;
+    int cid = get_validated_int("Enter customer ID: ", 1, MAX_RECORD_ID);
+    wire_u32(&req, (uint32_t)cid);
+    int status = rpc_call(cl, RPC_GET_CUSTOMER, &req, &resp);
+    if (status != RPC_OK) {
+        print_rpc_error(status, &resp);
+        free(req.data);
+        return status;
+    }
+    CustomerRecord cust;
+    wire_get_customer(&resp, &cust);
+    
+    int items = 0;
+    Money sale_total = 0;
+    char amount[MONEY_TEXT], running_total[MONEY_TEXT];
+    while (status >= 0) {
+        char code[100];
+        get_optional_string("Scan SKU or enter product ID (blank to finish): ", code, sizeof(code));
+        if (code[0] == '\0') break;
         
-        if (u.id == user_id) {
-            found = 1;
-            strcpy(u.username, parse_csv_field(line, 1));
-            printf("Found user: %s (ID: %d)\n", u.username, u.id);
-            
-            char confirm[10];
-            printf("Are you sure you want to delete this user? (yes/no): ");
-            fgets(confirm, sizeof(confirm), stdin);
-            trim_newline(confirm);
-            
-            if (strcasecmp(confirm, "yes") != 0 && strcasecmp(confirm, "y") != 0) {
-                // Write the user back to file (keep them)
-                fprintf(tmp, "%s", line);
-                printf("Deletion cancelled.\n");
-            } else {
-                printf("User deleted successfully.\n");
-            }
-        } else {
-            // Write other users to temp file
-            fprintf(tmp, "%s", line);
+        req.len = 0;
+        wire_str(&req, code);
+        status = rpc_call(cl, RPC_FIND_SKU, &req, &resp);
+        if (status != RPC_OK) {
+            print_rpc_error(status, &resp);
+            continue;
+        }
+        ProductRecord p;
+        wire_get_product(&resp, &p);
+        if (p.stock <= 0) {
+            printf("Error: No stock left for %s.\n", p.name);
+            continue;
+        }
+        printf("%s (Stock: %d, Price: %s)\n", p.name, p.stock, format_money(p.sell_price, amount, sizeof(amount)));
+        int qty = get_quantity("Quantity [1]: ", p.stock);
+        
+        req.len = 0;
+        wire_u32(&req, (uint32_t)cid);
+        wire_u16(&req, 1);
+        wire_u32(&req, (uint32_t)p.id);
+        wire_u32(&req, (uint32_t)qty);
+        status = rpc_call(cl, RPC_MAKE_SALE, &req, &resp);
+        if (status != RPC_OK) {
+            print_rpc_error(status, &resp);
+            continue;
         }
+        int sale_id = (int32_t)wire_get_u32(&resp);
+        wire_get_u16(&resp);
+        Money total = wire_get_money(&resp);
+        items++;
+        sale_total += total;
+        printf("✓ Sale %d: %d x %s = %s (total %s)\n", sale_id, qty, p.name,
+               format_money(total, amount, sizeof(amount)),
+               format_money(sale_total, running_total, sizeof(running_total)));
     }
+    free(req.data);
+    if (status < 0) return status;
     
-    fclose(f);
-    fclose(tmp);
-    
-    if (!found) {
-        remove(".users_tmp");
-        printf("Error: User ID %d not found.\n", user_id);
-        return;
+    if (items == 0) {
+        printf("Nothing was sold.\n");
+        return RPC_OK;
     }
-    
-    remove(USERS_FILE);
-    rename(".users_tmp", USERS_FILE);
+    printf("\n✓ %d item(s) sold to %s, total %s\n", items, cust.name,
+           format_money(sale_total, amount, sizeof(amount)));
+    return RPC_OK;
 }
 
-void edit_user_permissions(User *current_user) {
-    if (!current_user->can_manage_users) {
-        printf("Permission denied: You don't have permission to manage users.\n");
-        return;
+static int client_report(RpcClient *cl, int op) {
+    SalesFilter filter;
+    prompt_sales_filter(&filter);
+    Wire req = { NULL, 0, 0, 0 };
+    wire_filter(&req, &filter);
+    
+    WireReader resp;
+    int status = rpc_call(cl, op, &req, &resp);
+    free(req.data);
+    if (status != RPC_OK) {
+        print_rpc_error(status, &resp);
+        return status;
     }
+    SalesTotals t;
+    wire_get_totals(&resp, &t);
     
-    int user_id = get_validated_int("Enter user ID to edit: ", 1, 10000);
+    if (op == RPC_SALES_SUMMARY) print_sales_summary(&filter, &t);
+    else print_profit_analysis(&filter, &t);
+    return RPC_OK;
+}
+
+/* Fetches the daemon's metrics and writes the Prometheus text to out. */
+static int client_metrics(RpcClient *cl, FILE *out) {
+    WireReader resp;
+    int status = rpc_call(cl, RPC_METRICS, NULL, &resp);
+    if (status != RPC_OK) {
+        print_rpc_error(status, &resp);
+        return status;
+    }
+    uint32_t len = wire_get_u32(&resp);
+    const unsigned char *text = wire_take(&resp, len);
+    if (resp.failed) {
+        printf("Error: Malformed response from the shop daemon.\n");
+        return RPC_ERR_BAD_REQUEST;
+    }
+    fwrite(text, 1, len, out);
+    return RPC_OK;
+}
+
+/* --metrics prints a running daemon's metrics, e.g. for a scrape job or textfile collector. */
+int run_metrics(const char *address) {
+    RpcClient cl = { rpc_socket(address, 0), NULL, 0 };
+    if (cl.fd < 0) {
+        printf("Error: Unable to connect to the shop daemon at %s.\n", address);
+        return 1;
+    }
+    int status = client_metrics(&cl, stdout);
+    free(cl.buf);
+    close(cl.fd);
+    return status == RPC_OK ? 0 : 1;
+}
+
+/* Asks for a username and password and logs the connection in with them. */
+static int client_login(RpcClient *cl) {
+    char username[50], password[MAX_PASSWORD_LEN];
+    printf("\n=== Shop Manager Login ===\n");
+    get_validated_string("Username: ", username, sizeof(username));
+    printf("Password: ");
+    if (fgets(password, sizeof(password), stdin) == NULL) password[0] = '\0';
+    trim_newline(password);
     
-    FILE *f = fopen(USERS_FILE, "r");
-    FILE *tmp = fopen(".users_tmp", "w");
-    if (!f || !tmp) {
-        if (f) fclose(f);
-        if (tmp) fclose(tmp);
-        printf("Error: Unable to access users file.\n");
-        return;
+    Wire req = { NULL, 0, 0, 0 };
+    wire_str(&req, username);
+    wire_str(&req, password);
+    WireReader resp;
+    int status = rpc_call(cl, RPC_LOGIN, &req, &resp);
+    free(req.data);
+    if (status != RPC_OK) {
+        print_rpc_error(status, &resp);
+        return 0;
+    }
+    printf("\nWelcome, %s!\n", username);
+    return 1;
+}
+
+int run_client(const char *address) {
+    RpcClient cl = { rpc_socket(address, 0), NULL, 0 };
+    if (cl.fd < 0) {
+        printf("Error: Unable to connect to the shop daemon at %s.\n", address);
+        return 1;
+    }
+    if (!client_login(&cl)) {
+        close(cl.fd);
+        free(cl.buf);
+        return 1;
     }
     
-    char line[MAX_LINE];
-    int found = 0;
+    Wire req = { NULL, 0, 0, 0 };
+    WireReader resp;
+    int status = RPC_OK;
     
-    while (fgets(line, sizeof(line), f)) {
-        User u;
-        u.id = atoi(parse_csv_field(line, 0));
-        strcpy(u.username, parse_csv_field(line, 1));
-        strcpy(u.password_hash, parse_csv_field(line, 2));
-        u.can_manage_products = atoi(parse_csv_field(line, 3));
-        u.can_manage_customers = atoi(parse_csv_field(line, 4));
-        u.can_manage_sales = atoi(parse_csv_field(line, 5));
-        u.can_view_reports = atoi(parse_csv_field(line, 6));
-        u.can_manage_users = atoi(parse_csv_field(line, 7));
-        u.is_active = atoi(parse_csv_field(line, 8));
-        
-        if (u.id == user_id) {
-            found = 1;
-            printf("\nEditing user: %s (ID: %d)\n", u.username, u.id);
-            printf("Current permissions:\n");
-            printf("  Manage Products: %s\n", u.can_manage_products ? "Yes" : "No");
-            printf("  Manage Customers: %s\n", u.can_manage_customers ? "Yes" : "No");
-            printf("  Manage Sales: %s\n", u.can_manage_sales ? "Yes" : "No");
-            printf("  View Reports: %s\n", u.can_view_reports ? "Yes" : "No");
-            printf("  Manage Users: %s\n", u.can_manage_users ? "Yes" : "No");
-            printf("  Active: %s\n", u.is_active ? "Yes" : "No");
-            
-            printf("\nSet new permissions (1 for Yes, 0 for No):\n");
-            u.can_manage_products = get_validated_int("Can manage products? ", 0, 1);
-            u.can_manage_customers = get_validated_int("Can manage customers? ", 0, 1);
-            u.can_manage_sales = get_validated_int("Can manage sales? ", 0, 1);
-            u.can_view_reports = get_validated_int("Can view reports? ", 0, 1);
-            u.can_manage_users = get_validated_int("Can manage users? ", 0, 1);
-            u.is_active = get_validated_int("Is active? ", 0, 1);
-        }
+    int running = 1;
+    while (running) {
+        printf("\n========= Shop Manager (client) =========\n");
+        printf("1. Look Up Product\n");
+        printf("2. Search Products\n");
+        printf("3. Search Customers\n");
+        printf("4. Make Sale\n");
+        printf("5. Quick Sale\n");
+        printf("6. Low Stock Report\n");
+        printf("7. Sales Summary\n");
+        printf("8. Profit Analysis\n");
+        printf("9. Daemon Metrics\n");
+        printf("10. Exit\n");
         
-        fprintf(tmp, "%d,%s,%s,%d,%d,%d,%d,%d,%d\n",
-                u.id, u.username, u.password_hash,
-                u.can_manage_products, u.can_manage_customers,
-                u.can_manage_sales, u.can_view_reports,
-                u.can_manage_users, u.is_active);
+        int choice = get_validated_int("Select option: ", 1, 10);
+        req.len = 0;
+        switch (choice) {
+            case 1: {
+                char code[100];
+                get_validated_string("Enter product ID or SKU: ", code, sizeof(code));
+                wire_str(&req, code);
+                status = rpc_call(&cl, RPC_FIND_SKU, &req, &resp);
+                if (status != RPC_OK) {
+                    print_rpc_error(status, &resp);
+                    break;
+                }
+                ProductRecord p;
+                wire_get_product(&resp, &p);
+                print_product_header();
+                print_product_line(&p);
+                break;
+            }
+            case 2:
+            case 3: {
+                char query[100];
+                get_validated_string("Enter search term: ", query, sizeof(query));
+                wire_str(&req, query);
+                wire_u16(&req, 50);
+                if (choice == 2) status = client_products(&cl, RPC_SEARCH_PRODUCTS, &req);
+                else status = client_customers(&cl, &req);
+                break;
+            }
+            case 4: status = client_sale(&cl); break;
+            case 5: status = client_quick_sale(&cl); break;
+            case 6:
+                wire_u32(&req, (uint32_t)get_validated_int("Low stock threshold: ", 0, 10000));
+                status = client_products(&cl, RPC_LOW_STOCK, &req);
+                break;
+            case 7: status = client_report(&cl, RPC_SALES_SUMMARY); break;
+            case 8: status = client_report(&cl, RPC_PROFIT); break;
+            case 9: status = client_metrics(&cl, stdout); break;
+            case 10: running = 0; break;
+        }
+        if (status < 0) running = 0;
+        if (running) pause_and_wait();
     }
     
-    fclose(f);
-    fclose(tmp);
-    
-    if (!found) {
-        remove(".users_tmp");
-        printf("Error: User ID %d not found.\n", user_id);
-        return;
+    free(req.data);
+    free(cl.buf);
+    close(cl.fd);
+    printf("\nThank you for using Shop Manager. Goodbye!\n");
+    return 0;
+}
+
+/* -------------------- Log Shipping -------------------- */
+/*
+ * --ship ADDR sends a branch's changes to the central node's daemon, which
+ * applies them to its own files and indexes, so company-wide and
+ * per-branch reports run there. The stream starts with a snapshot of the
+ * catalog, customers and every recorded sale, taken under the lock
+ * together with the log position it is consistent with; from that
+ * position on it carries the sale, stock, product and customer records of
+ * the branch's logs in order, retired segments first. User changes stay
+ * with the branch. Each frame names the position it starts from and the
+ * one it ends at, and the central node commits its records and the new
+ * position in one log group, so an interrupted run picks up where the
+ * last frame left off. The live log is synced before any of it is sent.
+ */
+typedef struct {
+    RpcClient *cl;
+    int branch;
+    ShipPosition at;           /* where the central node is */
+    ShipPosition next;         /* where it will be once the batch is applied */
+    WalGroup batch;
+    long records;
+    long frames;
+} Shipper;
+
+static int ship_flush(Shipper *s) {
+    if (s->batch.count == 0 && ship_position_equal(&s->at, &s->next)) return 1;
+    
+    Wire req = { NULL, 0, 0, 0 };
+    wire_u16(&req, (uint16_t)s->branch);
+    wire_ship_position(&req, &s->at);
+    wire_ship_position(&req, &s->next);
+    wire_u32(&req, (uint32_t)s->batch.len);
+    wire_put(&req, s->batch.data, s->batch.len);
+    if (req.failed) {
+        free(req.data);
+        printf("Error: Out of memory.\n");
+        return 0;
     }
-    
-    remove(USERS_FILE);
-    rename(".users_tmp", USERS_FILE);
-    printf("✓ User permissions updated successfully.\n");
+    WireReader resp;
+    int status = rpc_call(s->cl, RPC_SHIP, &req, &resp);
+    free(req.data);
+    if (status != RPC_OK) {
+        print_rpc_error(status, &resp);
+        return 0;
+    }
+    s->at = s->next;
+    s->records += s->batch.count;
+    s->frames++;
+    s->batch.len = 0;
+    s->batch.count = 0;
+    return 1;
 }
 
-void user_management_menu(User *current_user) {
-    if (!current_user->can_manage_users) {
-        printf("Permission denied: You don't have permission to manage users.\n");
-        return;
+/* Adds a record to the batch, sending the batch first if the record would not fit in its frame. */
+static int ship_add(Shipper *s, int type, const void *payload, size_t len, const ShipPosition *after) {
+    if (s->batch.len + sizeof(WalRecordHeader) + len > SHIP_FRAME_BYTES && !ship_flush(s)) return 0;
+    if (!wal_add(&s->batch, type, payload, len)) {
+        printf("Error: Out of memory.\n");
+        return 0;
+    }
+    s->next = *after;
+    return 1;
+}
+
+/* A sale in the central node's terms: ids in the branch's range and the cashier named as user@branch. */
+static void ship_sale_record(int branch, const Sale *sale, const char *cashier, BranchSale *out) {
+    memset(out, 0, sizeof(*out));
+    out->sale = *sale;
+    out->sale.id = branch_global_id(branch, sale->id);
+    out->sale.product_id = branch_global_id(branch, sale->product_id);
+    out->sale.customer_id = branch_global_id(branch, sale->customer_id);
+    out->sale.cashier_id = 0;
+    snprintf(out->cashier, sizeof(out->cashier), "%.40s@%d", cashier, branch);
+}
+
+/* Ships one log record; records the central node has no use for only move the position on. */
+static int ship_record(Shipper *s, int type, const char *payload, uint32_t len, const ShipPosition *after) {
+    int b = s->branch;
+    Sale sale;
+    const char *cashier;
+    ProductRecord prod;
+    if (type == WAL_SALE && wal_decode_sale(payload, len, &sale, &cashier)) {
+        char name[50];
+        if (cashier) snprintf(name, sizeof(name), "%s", cashier);
+        else cashier_name(sale.cashier_id, name, sizeof(name));
+        BranchSale out;
+        ship_sale_record(b, &sale, name, &out);
+        return ship_add(s, WAL_SALE, &out, sizeof(out), after);
+    }
+    if (type == WAL_STOCK && len == sizeof(StockJournalRecord)) {
+        StockJournalRecord r;
+        memcpy(&r, payload, sizeof(r));
+        r.product_id = branch_global_id(b, r.product_id);
+        r.sale_id = branch_global_id(b, r.sale_id);
+        return ship_add(s, WAL_STOCK, &r, sizeof(r), after);
+    }
+    if (type == WAL_PRODUCT && wal_decode_product(payload, len, &prod)) {
+        prod.id = branch_global_id(b, prod.id);
+        return ship_add(s, WAL_PRODUCT, &prod, sizeof(prod), after);
+    }
+    if (type == WAL_CUSTOMER && len == sizeof(CustomerRecord)) {
+        CustomerRecord cust;
+        memcpy(&cust, payload, sizeof(cust));
+        cust.id = branch_global_id(b, cust.id);
+        return ship_add(s, WAL_CUSTOMER, &cust, sizeof(cust), after);
+    }
+    s->next = *after;
+    return 1;
+}
+
+/* The snapshot's sales, copied under the lock; rows the central node already has are only counted. */
+typedef struct {
+    int branch;
+    int64_t skip;
+    int64_t rows;
+    BranchSale *sales;
+    size_t count;
+    size_t capacity;
+    int failed;
+} ShipSnapshot;
+
+static void ship_snapshot_chunk(const char *start, const char *end, void *partial, void *ctx) {
+    (void)ctx;
+    ShipSnapshot *snap = partial;
+    CsvRecord rec;
+    while (start < end && !snap->failed) {
+        start = csv_split(start, end, &rec);
+        if (rec.count == 0 || rec.fields[0].len == 0) continue;
+        if (snap->rows++ < snap->skip) continue;
+        
+        if (snap->count == snap->capacity) {
+            size_t capacity = snap->capacity ? snap->capacity * 2 : 1024;
+            BranchSale *grown = realloc(snap->sales, capacity * sizeof(*grown));
+            if (!grown) {
+                snap->failed = 1;
+                return;
+            }
+            snap->sales = grown;
+            snap->capacity = capacity;
+        }
+        Sale sale;
+        char cashier[50];
+        parse_sale_record(&rec, &sale, cashier, sizeof(cashier));
+        ship_sale_record(snap->branch, &sale, cashier, &snap->sales[snap->count++]);
+    }
+}
+
+/*
+ * Sends the catalog, the customers and every sale as of one log
+ * position, then moves the central node to that position in the log
+ * phase. A snapshot the central node only got part of is sent again,
+ * less the sales it already has.
+ */
+static int ship_snapshot(Shipper *s) {
+    ShipSnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    snap.branch = s->branch;
+    snap.skip = s->at.phase == SHIP_SNAPSHOT ? s->at.sales_done : 0;
+    
+    if (!wal_lock()) {
+        printf("Error: Unable to lock the shop.\n");
+        return 0;
+    }
+    int products = product_table.count, customers = customer_table.count;
+    ProductRecord *prods = malloc((size_t)(products ? products : 1) * sizeof(*prods));
+    CustomerRecord *custs = malloc((size_t)(customers ? customers : 1) * sizeof(*custs));
+    for (int i = 0; prods && i < products; i++) {
+        product_record(product_row(i), &prods[i]);
+        prods[i].id = branch_global_id(s->branch, prods[i].id);
+    }
+    for (int i = 0; custs && i < customers; i++) {
+        customer_record(customer_row(i), &custs[i]);
+        custs[i].id = branch_global_id(s->branch, custs[i].id);
+    }
+    ShipPosition base;
+    memset(&base, 0, sizeof(base));
+    base.phase = SHIP_SNAPSHOT;
+    base.segment = ship_segment_current();
+    base.offset = (uint64_t)wal.offset;
+    
+    int ok = prods && custs && archive_scan(0, 0, ship_snapshot_chunk, &snap, NULL);
+    MappedFile map = { NULL, 0 };
+    if (ok && file_exists(SALES_FILE)) {
+        ok = map_file(SALES_FILE, &map);
+        if (ok) ship_snapshot_chunk(map.data, map.data + map.size, &snap, NULL);
+        unmap_file(&map);
+    }
+    wal_unlock();
+    
+    if (!ok || snap.failed) {
+        printf("Error: Unable to read this branch's records.\n");
+        ok = 0;
+    } else if (snap.rows < snap.skip) {
+        printf("Error: The central node has more of this branch's sales than the branch has.\n");
+        ok = 0;
     }
     
-    int running = 1;
-    while (running) {
-        printf("\n=== User Management ===\n");
-        printf("1. Add New User\n");
-        printf("2. List All Users\n");
-        printf("3. Edit User Permissions\n");
-        printf("4. Delete User\n");
-        printf("5. Return to Main Menu\n");
+    base.sales_total = snap.rows;
+    base.sales_done = snap.skip;
+    for (int i = 0; ok && i < products; i++) ok = ship_add(s, WAL_PRODUCT, &prods[i], sizeof(prods[i]), &base);
+    for (int i = 0; ok && i < customers; i++) ok = ship_add(s, WAL_CUSTOMER, &custs[i], sizeof(custs[i]), &base);
+    ShipPosition after = base;
+    for (size_t i = 0; ok && i < snap.count; i++) {
+        after.sales_done++;
+        ok = ship_add(s, WAL_SALE, &snap.sales[i], sizeof(snap.sales[i]), &after);
+    }
+    if (ok) {
+        after.phase = SHIP_LOG;
+        after.record = 0;
+        s->next = after;
+        ok = ship_flush(s);
+    }
+    if (ok) printf("Snapshot: %d products, %d customers, %zu sales.\n", products, customers, snap.count);
+    free(prods);
+    free(custs);
+    free(snap.sales);
+    return ok;
+}
+
+/*
+ * Sends every complete group after the central node's position, segment
+ * by segment, up to what the live log has synced. A position part-way
+ * through a group skips the records of it already applied.
+ */
+static int ship_log(Shipper *s) {
+    for (;;) {
+        if (!wal_lock()) {
+            printf("Error: Unable to lock the shop.\n");
+            return 0;
+        }
+        uint32_t live = ship_segment_current();
+        uint32_t segment = s->next.segment;
+        char path[64];
+        ship_segment_path(segment, path, sizeof(path));
+        MappedFile map = { NULL, 0 };
+        uint64_t end = 0;
+        int ok = segment <= live && (segment == live || file_exists(path));
+        // The central node must never hold a change the branch could still lose
+        if (ok && segment == live && !wal_sync_log(wal.fd, wal.offset)) ok = 0;
+        if (ok) ok = map_file(segment == live ? WAL_FILE : path, &map);
+        if (ok) {
+            end = map.size;
+            if (segment == live && end > (uint64_t)wal.offset) end = (uint64_t)wal.offset;
+        }
+        wal_unlock();
+        if (!ok) {
+            if (segment > live) printf("Error: The central node is ahead of this branch's log.\n");
+            else if (segment == live) printf("Error: Unable to read %s.\n", WAL_FILE);
+            else printf("Error: Log segment %u is missing; it was shipped from elsewhere or removed.\n", segment);
+            return 0;
+        }
         
-        int choice = get_validated_int("Select option: ", 1, 5);
+        uint64_t offset = s->next.offset;
+        uint32_t skip = s->next.record;
+        while (ok && offset + sizeof(WalGroupHeader) <= end) {
+            WalGroupHeader gh;
+            memcpy(&gh, map.data + offset, sizeof(gh));
+            const char *data = map.data + offset + sizeof(gh);
+            if (gh.magic != WAL_GROUP_MAGIC || gh.bytes > end - offset - sizeof(gh) ||
+                hash_bytes(data, gh.bytes) != gh.checksum) {
+                break;
+            }
+            uint64_t group_end = offset + sizeof(gh) + gh.bytes;
+            const char *data_end = data + gh.bytes;
+            WalRecordHeader rh;
+            const char *payload;
+            uint32_t index = 0;
+            for (const char *p = data; ok && (payload = wal_next_record(p, data_end, &rh)); p = payload + rh.length) {
+                ShipPosition after = s->next;
+                int last = payload + rh.length >= data_end;
+                after.offset = last ? group_end : offset;
+                after.record = last ? 0 : index + 1;
+                if (index++ < skip) continue;
+                ok = ship_record(s, rh.type, payload, rh.length, &after);
+            }
+            skip = 0;
+            offset = group_end;
+        }
+        unmap_file(&map);
+        if (!ok) return 0;
+        if (segment == live) return ship_flush(s);
         
-        switch (choice) {
-            case 1: add_user(current_user); break;
-            case 2: list_users(current_user); break;
-            case 3: edit_user_permissions(current_user); break;
-            case 4: delete_user(current_user); break;
-            case 5: running = 0; break;
+        // A retired segment is complete, so the stream goes on at the start of the next
+        s->next.segment = segment + 1;
+        s->next.offset = sizeof(WalFileHeader);
+        s->next.record = 0;
+    }
+}
+
+/* Removes the segments the central node has applied all of. */
+static void ship_prune(uint32_t segment) {
+    char path[64];
+    while (segment > 1) {
+        ship_segment_path(--segment, path, sizeof(path));
+        if (!file_exists(path) || remove(path) != 0) break;
+    }
+}
+
+int run_ship(const char *address) {
+    int branch = shop_branch();
+    if (!branch) {
+        printf("Error: This shop is not a branch; set its number with --branch N first.\n");
+        return 1;
+    }
+    RpcClient cl = { rpc_socket(address, 0), NULL, 0 };
+    if (cl.fd < 0) {
+        printf("Error: Unable to connect to the central node at %s.\n", address);
+        return 1;
+    }
+    if (!client_login(&cl) || !start_shop()) {
+        close(cl.fd);
+        free(cl.buf);
+        return 1;
+    }
+    
+    Shipper s;
+    memset(&s, 0, sizeof(s));
+    s.cl = &cl;
+    s.branch = branch;
+    Wire req = { NULL, 0, 0, 0 };
+    wire_u16(&req, (uint16_t)branch);
+    WireReader resp;
+    int status = rpc_call(&cl, RPC_SHIP_STATUS, &req, &resp);
+    free(req.data);
+    int ok = status == RPC_OK;
+    if (ok) {
+        wire_get_ship_position(&resp, &s.at);
+        ok = !resp.failed;
+    }
+    if (!ok) {
+        print_rpc_error(status, &resp);
+    } else {
+        int64_t start = monotonic_ns();
+        s.next = s.at;
+        if (s.at.phase != SHIP_LOG) ok = ship_snapshot(&s);
+        s.next = s.at;
+        ok = ok && ship_log(&s);
+        if (s.at.phase == SHIP_LOG) ship_prune(s.at.segment);
+        printf("%s Shipped %ld records in %ld frames as branch %d in %.1f ms; the central node is at segment %u, offset %" PRIu64 ".\n",
+               ok ? "✓" : "Stopped:", s.records, s.frames, branch, (monotonic_ns() - start) / 1e6, s.at.segment, s.at.offset);
+    }
+    wal_group_free(&s.batch);
+    stop_shop();
+    close(cl.fd);
+    free(cl.buf);
+    return ok ? 0 : 1;
+}
+
+/*
+ * --branch N numbers this shop's records as branch N's from the next one
+ * on. Tills already open on the directory keep the old numbering until they
+ * restart, so it is best run with none open.
+ */
+int run_branch(int argc, char **argv) {
+    int branch = argc == 1 ? atoi(argv[0]) : 0;
+    if (branch < 1 || branch > MAX_BRANCH) {
+        printf("Usage: SHOP-MGT --branch N   (1-%d)\n", MAX_BRANCH);
+        return 1;
+    }
+    int current = shop_branch();
+    if (current == branch) {
+        printf("This shop is already branch %d.\n", branch);
+        return 0;
+    }
+    if (current) {
+        printf("Error: This shop is branch %d; its records are already numbered for it.\n", current);
+        return 1;
+    }
+    if (!start_shop()) return 1;
+    int ok = wal_lock();
+    if (ok) {
+        if (shipping_branches()) {
+            printf("Error: Branches ship to this shop, so it is the central node.\n");
+            ok = 0;
+        } else if (!set_shop_branch(branch)) {
+            printf("Error: Unable to write %s.\n", BRANCH_FILE);
+            ok = 0;
+        }
+        wal_unlock();
+    }
+    if (ok) {
+        printf("✓ This shop is now branch %d; new records are numbered from %d, and retired logs are kept in %s/ for --ship.\n",
+               branch, branch * BRANCH_ID_SPAN + 1, SHIP_DIR);
+    }
+    stop_shop();
+    return ok ? 0 : 1;
+}
+
+/* -------------------- Batch Import -------------------- */
+/*
+ * --import KIND [FILE] loads products, customers or sales from a CSV or
+ * JSONL stream (FILE, or stdin when absent or "-") without any prompts.
+ * CSV rows use the column order of the shop's own files unless the first
+ * line is a header naming the columns; JSONL lines are flat objects keyed
+ * by the same names. Unknown columns are ignored, and an empty CSV field
+ * or a JSON null counts as not given. Each rejected row is reported with
+ * its line number and skipped.
+ *
+ * Products and customers with an id update that record (only the given
+ * columns change); rows without one are added under new ids. All rows are
+ * parsed before the lock is taken, then applied to the resident tables,
+ * and the files are written once as a checkpoint, which also makes other
+ * tills reload. The search indexes are rebuilt once at the end.
+ *
+ * Sales always get fresh ids. They are checked against stock as a whole,
+ * committed through the log in groups of IMPORT_BATCH_ROWS and synced
+ * once at the end.
+ */
+enum { IMPORT_PRODUCTS, IMPORT_CUSTOMERS, IMPORT_SALES, IMPORT_KINDS };
+
+static const char *import_kinds[IMPORT_KINDS] = { "products", "customers", "sales" };
+static const char *import_columns[IMPORT_KINDS][IMPORT_MAX_COLUMNS] = {
+    { "id", "name", "category", "brand", "cost_price", "sell_price", "stock", "min_stock_level", "sku" },
+    { "id", "name", "phone", "email", "address" },
+    { "id", "product_id", "customer_id", "quantity", "total_price", "date", "cashier" }
+};
+static const int import_column_counts[IMPORT_KINDS] = { 9, 5, 7 };
+
+#define GIVEN(c) (1u << (c))
+
+/* One input row as text by schema column; NULL where the column was not given. */
+typedef struct {
+    const char *value[IMPORT_MAX_COLUMNS];
+    char buf[2 * IMPORT_MAX_LINE];
+    size_t used;
+} ImportRow;
+
+typedef struct {
+    int kind;
+    int started;
+    int json;
+    int map[CSV_MAX_FIELDS];   /* CSV column -> schema column, -1 = ignored */
+    long line;
+    long rejected;
+} ImportReader;
+
+typedef struct {
+    ProductRecord rec;         /* id 0 = new product */
+    unsigned given;
+    long line;
+} ProductPatch;
+
+typedef struct {
+    CustomerRecord rec;        /* id 0 = new customer */
+    unsigned given;
+    long line;
+} CustomerPatch;
+
+static void import_reject(ImportReader *r, long line, const char *reason) {
+    fprintf(stderr, "Error: line %ld: %s.\n", line, reason);
+    r->rejected++;
+}
+
+static int import_column(int kind, const char *name, size_t len) {
+    for (int c = 0; c < import_column_counts[kind]; c++) {
+        if (strlen(import_columns[kind][c]) == len && strncasecmp(import_columns[kind][c], name, len) == 0) return c;
+    }
+    return -1;
+}
+
+static int import_int(const char *text, long min, long max, int *out) {
+    char *end;
+    errno = 0;
+    long v = strtol(text, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == text || *end || errno || v < min || v > max) return 0;
+    *out = (int)v;
+    return 1;
+}
+
+static int import_money(const char *text, Money *out) {
+    return parse_money(text, strlen(text), out) && *out >= 0;
+}
+
+static int import_text(const char *text, char *dst, size_t size) {
+    size_t n = strlen(text);
+    if (n >= size) return 0;
+    memcpy(dst, text, n + 1);
+    return 1;
+}
+
+static const char *import_store(ImportRow *row, const char *s, size_t n) {
+    if (row->used + n + 1 > sizeof(row->buf)) return NULL;
+    char *dst = row->buf + row->used;
+    memcpy(dst, s, n);
+    dst[n] = '\0';
+    row->used += n + 1;
+    return dst;
+}
+
+static const char *json_skip(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    return p;
+}
+
+static int hex_value(const char *p) {
+    int v = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = p[i];
+        if (c >= '0' && c <= '9') v = v * 16 + c - '0';
+        else if (c >= 'a' && c <= 'f') v = v * 16 + c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v = v * 16 + c - 'A' + 10;
+        else return -1;
+    }
+    return v;
+}
+
+/* Decodes the JSON string starting after its opening quote; returns the position past the closing one. */
+static const char *json_string(const char *p, ImportRow *row, const char **out) {
+    char *dst = row->buf + row->used;
+    size_t room = sizeof(row->buf) - row->used;
+    size_t n = 0;
+    
+    while (*p && *p != '"') {
+        unsigned char bytes[4];
+        int len = 1;
+        bytes[0] = (unsigned char)*p++;
+        if (bytes[0] == '\\') {
+            char e = *p++;
+            if (e == '"' || e == '\\' || e == '/') bytes[0] = (unsigned char)e;
+            else if (e == 'b') bytes[0] = '\b';
+            else if (e == 'f') bytes[0] = '\f';
+            else if (e == 'n') bytes[0] = '\n';
+            else if (e == 'r') bytes[0] = '\r';
+            else if (e == 't') bytes[0] = '\t';
+            else if (e == 'u') {
+                long cp = hex_value(p);
+                if (cp < 0) return NULL;
+                p += 4;
+                if (cp >= 0xD800 && cp < 0xDC00 && p[0] == '\\' && p[1] == 'u') {
+                    int low = hex_value(p + 2);
+                    if (low < 0xDC00 || low > 0xDFFF) return NULL;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                if (cp < 0x80) {
+                    bytes[0] = (unsigned char)cp;
+                } else if (cp < 0x800) {
+                    bytes[0] = (unsigned char)(0xC0 | cp >> 6);
+                    bytes[1] = (unsigned char)(0x80 | (cp & 0x3F));
+                    len = 2;
+                } else if (cp < 0x10000) {
+                    bytes[0] = (unsigned char)(0xE0 | cp >> 12);
+                    bytes[1] = (unsigned char)(0x80 | (cp >> 6 & 0x3F));
+                    bytes[2] = (unsigned char)(0x80 | (cp & 0x3F));
+                    len = 3;
+                } else {
+                    bytes[0] = (unsigned char)(0xF0 | cp >> 18);
+                    bytes[1] = (unsigned char)(0x80 | (cp >> 12 & 0x3F));
+                    bytes[2] = (unsigned char)(0x80 | (cp >> 6 & 0x3F));
+                    bytes[3] = (unsigned char)(0x80 | (cp & 0x3F));
+                    len = 4;
+                }
+            } else {
+                return NULL;
+            }
+        }
+        if (n + (size_t)len >= room) return NULL;
+        memcpy(dst + n, bytes, (size_t)len);
+        n += (size_t)len;
+    }
+    if (*p != '"') return NULL;
+    dst[n] = '\0';
+    row->used += n + 1;
+    *out = dst;
+    return p + 1;
+}
+
+/* Parses one flat JSON object: string, number, true/false or null values. */
+static int import_parse_json(const ImportReader *r, const char *line, ImportRow *row) {
+    const char *p = json_skip(line);
+    if (*p != '{') return 0;
+    p = json_skip(p + 1);
+    if (*p == '}') return *json_skip(p + 1) == '\0';
+    
+    for (;;) {
+        const char *key, *value = NULL;
+        if (*p != '"' || !(p = json_string(p + 1, row, &key))) return 0;
+        p = json_skip(p);
+        if (*p++ != ':') return 0;
+        p = json_skip(p);
+        if (*p == '"') {
+            if (!(p = json_string(p + 1, row, &value))) return 0;
+        } else {
+            const char *start = p;
+            while (*p && *p != ',' && *p != '}' && !isspace((unsigned char)*p)) p++;
+            size_t n = (size_t)(p - start);
+            if (n == 0) return 0;
+            if (!(n == 4 && memcmp(start, "null", 4) == 0) && !(value = import_store(row, start, n))) return 0;
         }
         
-        if (running) pause_and_wait();
+        int c = import_column(r->kind, key, strlen(key));
+        if (c >= 0) row->value[c] = value;
+        p = json_skip(p);
+        if (*p == '}') return *json_skip(p + 1) == '\0';
+        if (*p++ != ',') return 0;
+        p = json_skip(p);
     }
 }
 
-/* -------------------- Product Functions -------------------- */
-void add_product(User *current_user) {
-    if (!current_user->can_manage_products) {
-        printf("Permission denied: You don't have permission to manage products.\n");
-        return;
+/*
+ * Sets up the column map from the first CSV line. Returns 1 if the line was
+ * a header, 0 if it is data, and -1 for a header naming no known column.
+ */
+static int import_read_header(ImportReader *r, const CsvRecord *rec) {
+    for (int i = 0; i < CSV_MAX_FIELDS; i++) {
+        r->map[i] = i < import_column_counts[r->kind] ? i : -1;
     }
     
-    Product p;
-    p.id = next_id_from_file(PRODUCTS_FILE);
-    
-    printf("\n=== Add New Product (ID: %d) ===\n", p.id);
-    
-    get_validated_string("Product Name: ", p.name, sizeof(p.name));
-    get_validated_string("Category: ", p.category, sizeof(p.category));
-    get_validated_string("Brand: ", p.brand, sizeof(p.brand));
-    p.cost_price = get_validated_float("Cost Price: ", 0);
-    p.sell_price = get_validated_float("Sell Price: ", p.cost_price);
-    p.stock = get_validated_int("Stock Quantity: ", 0, 10000);
-    p.min_stock_level = get_validated_int("Minimum Stock Level: ", 0, 10000);
-
-    FILE *f = fopen(PRODUCTS_FILE, "a");
-    if (!f) { 
-        printf("Error: Unable to open products file.\n"); 
-        return; 
+    char first[64];
+    int id;
+    csv_field_copy(csv_get(rec, 0), first, sizeof(first));
+    if (!first[0] || import_int(first, INT_MIN, INT_MAX, &id)) return 0;
+    
+    int known = 0;
+    for (int i = 0; i < CSV_MAX_FIELDS; i++) {
+        const CsvField *f = csv_get(rec, i);
+        r->map[i] = i < rec->count ? import_column(r->kind, f->ptr, f->len) : -1;
+        if (r->map[i] >= 0) known++;
     }
-    
-    fprintf(f, "%d,\"%s\",\"%s\",\"%s\",%.2f,%.2f,%d,%d\n", 
-            p.id, p.name, p.category, p.brand, p.cost_price, p.sell_price, p.stock, p.min_stock_level);
-    fclose(f);
-    
-    printf("✓ Product added successfully.\n");
+    return known ? 1 : -1;
 }
 
-void list_products(User *current_user) {
-    if (!file_exists(PRODUCTS_FILE)) { 
-        printf("No products found.\n"); 
-        return; 
+/* Reads the next data row; returns 1 with a row, 0 at end of input and -1 on a bad header. */
+static int import_next(ImportReader *r, FILE *in, char **line, size_t *capacity, ImportRow *row) {
+    ssize_t len;
+    while ((len = getline(line, capacity, in)) >= 0) {
+        char *text = *line;
+        r->line++;
+        while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) text[--len] = '\0';
+        if (*json_skip(text) == '\0') continue;
+        if (len >= IMPORT_MAX_LINE) {
+            import_reject(r, r->line, "line too long");
+            continue;
+        }
+        
+        memset(row->value, 0, sizeof(row->value));
+        row->used = 0;
+        if (!r->started) {
+            r->started = 1;
+            r->json = *json_skip(text) == '{';
+            if (!r->json) {
+                CsvRecord rec;
+                csv_split(text, text + len, &rec);
+                int header = import_read_header(r, &rec);
+                if (header < 0) return -1;
+                if (header) continue;
+            }
+        }
+        
+        if (r->json) {
+            if (!import_parse_json(r, text, row)) {
+                import_reject(r, r->line, "malformed JSON object");
+                continue;
+            }
+        } else {
+            CsvRecord rec;
+            csv_split(text, text + len, &rec);
+            for (int i = 0; i < rec.count && i < CSV_MAX_FIELDS; i++) {
+                int c = r->map[i];
+                if (c < 0) continue;
+                char *dst = row->buf + row->used;
+                size_t n = csv_field_copy(&rec.fields[i], dst, sizeof(row->buf) - row->used);
+                row->used += n + 1;
+                row->value[c] = n ? dst : NULL;
+            }
+        }
+        return 1;
     }
-    
-    FILE *f = fopen(PRODUCTS_FILE, "r");
-    if (!f) {
-        printf("Error: Unable to read products file.\n");
-        return;
+    return 0;
+}
+
+static const char *parse_product_patch(const ImportRow *row, ProductPatch *p) {
+    const char *const *v = row->value;
+    memset(p, 0, sizeof(*p));
+    for (int c = 0; c < import_column_counts[IMPORT_PRODUCTS]; c++) {
+        if (v[c]) p->given |= GIVEN(c);
     }
-    
-    char line[MAX_LINE];
-    printf("\n%-4s %-20s %-15s %-15s %-8s %-8s %-6s %-6s\n", 
-           "ID", "Name", "Category", "Brand", "Cost", "Price", "Stock", "Min");
-    printf("-------------------------------------------------------------------------------\n");
-    
-    while (fgets(line, sizeof(line), f)) {
-        Product p;
-        p.id = atoi(parse_csv_field(line, 0));
-        strcpy(p.name, parse_csv_field(line, 1));
-        strcpy(p.category, parse_csv_field(line, 2));
-        strcpy(p.brand, parse_csv_field(line, 3));
-        p.cost_price = atof(parse_csv_field(line, 4));
-        p.sell_price = atof(parse_csv_field(line, 5));
-        p.stock = atoi(parse_csv_field(line, 6));
-        p.min_stock_level = atoi(parse_csv_field(line, 7));
-        
-        printf("%-4d %-20s %-15s %-15s %-8.2f %-8.2f %-6d %-6d\n", 
-               p.id, p.name, p.category, p.brand, p.cost_price, p.sell_price, p.stock, p.min_stock_level);
+    if (v[0] && !import_int(v[0], 1, INT_MAX, &p->rec.id)) return "invalid id";
+    if (v[1] && !import_text(v[1], p->rec.name, sizeof(p->rec.name))) return "name too long";
+    if (v[2] && !import_text(v[2], p->rec.category, sizeof(p->rec.category))) return "category too long";
+    if (v[3] && !import_text(v[3], p->rec.brand, sizeof(p->rec.brand))) return "brand too long";
+    if (v[4] && !import_money(v[4], &p->rec.cost_price)) return "invalid cost_price";
+    if (v[5] && !import_money(v[5], &p->rec.sell_price)) return "invalid sell_price";
+    if (v[6] && !import_int(v[6], 0, INT_MAX, &p->rec.stock)) return "invalid stock";
+    if (v[7] && !import_int(v[7], 0, INT_MAX, &p->rec.min_stock_level)) return "invalid min_stock_level";
+    if (v[8] && !import_text(v[8], p->rec.sku, sizeof(p->rec.sku))) return "sku too long";
+    
+    unsigned required = GIVEN(1) | GIVEN(2) | GIVEN(3) | GIVEN(4) | GIVEN(5);
+    if (!p->rec.id && ((p->given & required) != required || !p->rec.name[0])) {
+        return "new products need name, category, brand, cost_price and sell_price";
     }
-    fclose(f);
+    return NULL;
 }
 
-void search_products(User *current_user) {
-    if (!file_exists(PRODUCTS_FILE)) { 
-        printf("No products found.\n"); 
-        return; 
-    }
-    
-    char search_term[100];
-    get_validated_string("Enter search term (name, category, or brand): ", search_term, sizeof(search_term));
-    
-    FILE *f = fopen(PRODUCTS_FILE, "r");
-    if (!f) {
-        printf("Error: Unable to read products file.\n");
-        return;
+/* Applies a patch to the resident table. Must hold the lock. */
+static const char *apply_product_patch(const ProductPatch *patch, long *added, long *updated) {
+    ProductRecord r = patch->rec;
+    int row = INDEX_EMPTY;
+    
+    if (r.id) {
+        row = id_index_find(&product_table.index, r.id);
+        if (row == INDEX_EMPTY) return "unknown product id";
+        product_record(product_row(row), &r);
+        const ProductRecord *x = &patch->rec;
+        if (patch->given & GIVEN(1)) memcpy(r.name, x->name, sizeof(r.name));
+        if (patch->given & GIVEN(2)) memcpy(r.category, x->category, sizeof(r.category));
+        if (patch->given & GIVEN(3)) memcpy(r.brand, x->brand, sizeof(r.brand));
+        if (patch->given & GIVEN(4)) r.cost_price = x->cost_price;
+        if (patch->given & GIVEN(5)) r.sell_price = x->sell_price;
+        if (patch->given & GIVEN(6)) r.stock = x->stock;
+        if (patch->given & GIVEN(7)) r.min_stock_level = x->min_stock_level;
+        if (patch->given & GIVEN(8)) memcpy(r.sku, x->sku, sizeof(r.sku));
     }
-    
-    char line[MAX_LINE];
-    int found = 0;
-    
-    printf("\nSearch Results:\n");
-    printf("%-4s %-20s %-15s %-15s %-8s %-8s %-6s\n", 
-           "ID", "Name", "Category", "Brand", "Cost", "Price", "Stock");
-    printf("----------------------------------------------------------------\n");
-    
-    while (fgets(line, sizeof(line), f)) {
-        Product p;
-        p.id = atoi(parse_csv_field(line, 0));
-        strcpy(p.name, parse_csv_field(line, 1));
-        strcpy(p.category, parse_csv_field(line, 2));
-        strcpy(p.brand, parse_csv_field(line, 3));
-        p.cost_price = atof(parse_csv_field(line, 4));
-        p.sell_price = atof(parse_csv_field(line, 5));
-        p.stock = atoi(parse_csv_field(line, 6));
-        
-        if (strstr(p.name, search_term) || strstr(p.category, search_term) || strstr(p.brand, search_term)) {
-            printf("%-4d %-20s %-15s %-15s %-8.2f %-8.2f %-6d\n", 
-                   p.id, p.name, p.category, p.brand, p.cost_price, p.sell_price, p.stock);
-            found = 1;
-        }
+    if (r.sell_price < r.cost_price) return "sell_price below cost_price";
+    int owner = sku_index_find(&product_table.sku_index, r.sku);
+    if (owner != INDEX_EMPTY && owner != row) return "sku belongs to another product";
+    
+    if (row == INDEX_EMPTY) {
+        r.id = id_sequence_take(SEQ_PRODUCTS, 1);
+        if (!product_table_add(&r)) return "out of memory";
+        (*added)++;
+        return NULL;
     }
-    fclose(f);
     
-    if (!found) {
-        printf("No products found matching '%s'\n", search_term);
+    Product *p = product_row(row);
+    ProductText *text = slab_at(&product_table.text, row);
+    text->name = intern(r.name);
+    text->category = intern(r.category);
+    text->brand = intern(r.brand);
+    text->sku = intern(r.sku);
+    if (!sku_index_put(&product_table.sku_index, text->sku, row)) return "out of memory";
+    p->cost_price = r.cost_price;
+    p->sell_price = r.sell_price;
+    p->stock = r.stock;
+    p->min_stock_level = r.min_stock_level;
+    reorder_update(p);
+    (*updated)++;
+    return NULL;
+}
+
+static const char *parse_customer_patch(const ImportRow *row, CustomerPatch *p) {
+    const char *const *v = row->value;
+    memset(p, 0, sizeof(*p));
+    for (int c = 0; c < import_column_counts[IMPORT_CUSTOMERS]; c++) {
+        if (v[c]) p->given |= GIVEN(c);
     }
+    if (v[0] && !import_int(v[0], 1, INT_MAX, &p->rec.id)) return "invalid id";
+    if (v[1] && !import_text(v[1], p->rec.name, sizeof(p->rec.name))) return "name too long";
+    if (v[2] && !import_text(v[2], p->rec.phone, sizeof(p->rec.phone))) return "phone too long";
+    if (v[3] && !import_text(v[3], p->rec.email, sizeof(p->rec.email))) return "email too long";
+    if (v[4] && !import_text(v[4], p->rec.address, sizeof(p->rec.address))) return "address too long";
+    if (!p->rec.id && !p->rec.name[0]) return "new customers need a name";
+    return NULL;
 }
 
-int find_product_by_id(Product *out, int id) {
-    if (!file_exists(PRODUCTS_FILE)) return 0;
-    
-    FILE *f = fopen(PRODUCTS_FILE, "r");
-    if (!f) return 0;
-    
-    char line[MAX_LINE];
-    int found = 0;
+static const char *apply_customer_patch(const CustomerPatch *patch, long *added, long *updated) {
+    if (!patch->rec.id) {
+        CustomerRecord r = patch->rec;
+        r.id = id_sequence_take(SEQ_CUSTOMERS, 1);
+        if (!customer_table_add(&r)) return "out of memory";
+        (*added)++;
+        return NULL;
+    }
     
-    while (fgets(line, sizeof(line), f)) {
-        Product p;
-        p.id = atoi(parse_csv_field(line, 0));
-        
-        if (p.id == id) {
-            strcpy(p.name, parse_csv_field(line, 1));
-            strcpy(p.category, parse_csv_field(line, 2));
-            strcpy(p.brand, parse_csv_field(line, 3));
-            p.cost_price = atof(parse_csv_field(line, 4));
-            p.sell_price = atof(parse_csv_field(line, 5));
-            p.stock = atoi(parse_csv_field(line, 6));
-            p.min_stock_level = atoi(parse_csv_field(line, 7));
-            
-            if (out) *out = p;
-            found = 1;
+    Customer *c = customer_lookup(patch->rec.id);
+    if (!c) return "unknown customer id";
+    if (patch->given & GIVEN(1)) c->name = intern(patch->rec.name);
+    if (patch->given & GIVEN(2)) c->phone = intern(patch->rec.phone);
+    if (patch->given & GIVEN(3)) c->email = intern(patch->rec.email);
+    if (patch->given & GIVEN(4)) c->address = intern(patch->rec.address);
+    (*updated)++;
+    return NULL;
+}
+
+/* Parses every row into patches, then applies them and writes the files once. */
+static int import_catalog(ImportReader *r, FILE *in) {
+    int products = r->kind == IMPORT_PRODUCTS;
+    size_t patch_size = products ? sizeof(ProductPatch) : sizeof(CustomerPatch);
+    void *patches = NULL;
+    int count = 0, capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ImportRow *row = malloc(sizeof(ImportRow));
+    int out_of_memory = !row;
+    int status = out_of_memory ? -1 : 1;
+    
+    while (status > 0 && (status = import_next(r, in, &line, &line_capacity, row)) > 0) {
+        if (count == capacity && !grow_rows(&patches, &capacity, patch_size)) {
+            out_of_memory = 1;
+            status = -1;
             break;
         }
+        char *patch = (char *)patches + (size_t)count * patch_size;
+        const char *error = products ? parse_product_patch(row, (ProductPatch *)patch)
+                                     : parse_customer_patch(row, (CustomerPatch *)patch);
+        if (error) {
+            import_reject(r, r->line, error);
+            continue;
+        }
+        if (products) ((ProductPatch *)patch)->line = r->line;
+        else ((CustomerPatch *)patch)->line = r->line;
+        count++;
     }
-    fclose(f);
-    return found;
-}
-
-void update_product_stock(int product_id, int delta) {
-    if (!file_exists(PRODUCTS_FILE)) return;
-    
-    FILE *f = fopen(PRODUCTS_FILE, "r");
-    FILE *tmp = fopen(".products_tmp", "w");
-    if (!f || !tmp) {
-        if (f) fclose(f);
-        if (tmp) fclose(tmp);
-        return;
+    free(line);
+    free(row);
+    if (status < 0) {
+        printf("Error: %s.\n", out_of_memory ? "Out of memory" : "The CSV header names no known column");
+        free(patches);
+        return 0;
     }
     
-    char line[MAX_LINE];
-    int updated = 0;
-    
-    while (fgets(line, sizeof(line), f)) {
-        Product p;
-        p.id = atoi(parse_csv_field(line, 0));
-        
-        if (p.id == product_id) {
-            strcpy(p.name, parse_csv_field(line, 1));
-            strcpy(p.category, parse_csv_field(line, 2));
-            strcpy(p.brand, parse_csv_field(line, 3));
-            p.cost_price = atof(parse_csv_field(line, 4));
-            p.sell_price = atof(parse_csv_field(line, 5));
-            p.stock = atoi(parse_csv_field(line, 6));
-            p.min_stock_level = atoi(parse_csv_field(line, 7));
-            
-            p.stock += delta;
-            if (p.stock < 0) p.stock = 0;
-            updated = 1;
+    if (!wal_lock()) {
+        printf("Error: Unable to lock the shop data.\n");
+        free(patches);
+        return 0;
+    }
+    long added = 0, updated = 0;
+    for (int i = 0; i < count; i++) {
+        const char *error;
+        long line_no;
+        if (products) {
+            const ProductPatch *p = (const ProductPatch *)patches + i;
+            error = apply_product_patch(p, &added, &updated);
+            line_no = p->line;
         } else {
-            strcpy(p.name, parse_csv_field(line, 1));
-            strcpy(p.category, parse_csv_field(line, 2));
-            strcpy(p.brand, parse_csv_field(line, 3));
-            p.cost_price = atof(parse_csv_field(line, 4));
-            p.sell_price = atof(parse_csv_field(line, 5));
-            p.stock = atoi(parse_csv_field(line, 6));
-            p.min_stock_level = atoi(parse_csv_field(line, 7));
+            const CustomerPatch *p = (const CustomerPatch *)patches + i;
+            error = apply_customer_patch(p, &added, &updated);
+            line_no = p->line;
         }
-        
-        fprintf(tmp, "%d,\"%s\",\"%s\",\"%s\",%.2f,%.2f,%d,%d\n", 
-                p.id, p.name, p.category, p.brand, p.cost_price, p.sell_price, p.stock, p.min_stock_level);
+        if (error) import_reject(r, line_no, error);
     }
+    free(patches);
     
-    fclose(f);
-    fclose(tmp);
+    int ok = 1;
+    if (added || updated) {
+        ok = build_search_indexes() && checkpoint_catalog(!products);
+        if (!ok) wal_reload();
+    }
+    wal_unlock();
     
-    if (updated) {
-        remove(PRODUCTS_FILE);
-        rename(".products_tmp", PRODUCTS_FILE);
-    } else {
-        remove(".products_tmp");
+    if (!ok) {
+        printf("Error: Unable to save the imported %s.\n", import_kinds[r->kind]);
+        return 0;
     }
+    printf("✓ Imported %s: %ld added, %ld updated, %ld rejected.\n",
+           import_kinds[r->kind], added, updated, r->rejected);
+    return 1;
 }
 
-/* -------------------- Customer Functions -------------------- */
-void add_customer(User *current_user) {
-    if (!current_user->can_manage_customers) {
-        printf("Permission denied: You don't have permission to manage customers.\n");
-        return;
-    }
-    
-    Customer c;
-    c.id = next_id_from_file(CUSTOMERS_FILE);
-    
-    printf("\n=== Add New Customer (ID: %d) ===\n", c.id);
-    
-    get_validated_string("Full Name: ", c.name, sizeof(c.name));
-    get_validated_string("Phone: ", c.phone, sizeof(c.phone));
-    get_validated_string("Email: ", c.email, sizeof(c.email));
-    get_validated_string("Address: ", c.address, sizeof(c.address));
+typedef struct {
+    char name[50];
+    int id;
+} ImportCashier;
 
-    FILE *f = fopen(CUSTOMERS_FILE, "a");
-    if (!f) { 
-        printf("Error: Unable to open customers file.\n"); 
-        return; 
+/* Resolves a cashier's username to a user id through a small cache; 0 if unknown. */
+static int import_cashier_id(const char *name, ImportCashier *cache, int *count) {
+    for (int i = 0; i < *count; i++) {
+        if (strcmp(cache[i].name, name) == 0) return cache[i].id;
     }
-    
-    fprintf(f, "%d,\"%s\",\"%s\",\"%s\",\"%s\"\n", 
-            c.id, c.name, c.phone, c.email, c.address);
-    fclose(f);
-    
-    printf("✓ Customer added successfully.\n");
+    User u;
+    int id = find_user(0, name, &u) ? u.id : 0;
+    if (*count < IMPORT_MAX_CASHIERS && strlen(name) < sizeof(cache[0].name)) {
+        snprintf(cache[*count].name, sizeof(cache[*count].name), "%s", name);
+        cache[(*count)++].id = id;
+    }
+    return id;
 }
 
-void list_customers(User *current_user) {
-    if (!file_exists(CUSTOMERS_FILE)) { 
-        printf("No customers found.\n"); 
-        return; 
+static const char *parse_import_sale(const ImportRow *row, Sale *s, int *reserved,
+                                     ImportCashier *cashiers, int *cashier_count) {
+    const char *const *v = row->value;
+    memset(s, 0, sizeof(*s));
+    if (!v[1] || !import_int(v[1], 1, INT_MAX, &s->product_id)) return "invalid product_id";
+    if (!v[2] || !import_int(v[2], 1, INT_MAX, &s->customer_id)) return "invalid customer_id";
+    if (!v[3] || !import_int(v[3], 1, INT_MAX, &s->quantity)) return "invalid quantity";
+    
+    int product_row_index = id_index_find(&product_table.index, s->product_id);
+    if (product_row_index == INDEX_EMPTY) return "unknown product_id";
+    if (!customer_lookup(s->customer_id)) return "unknown customer_id";
+    const Product *p = product_row(product_row_index);
+    if (p->stock - reserved[product_row_index] < s->quantity) return "not enough stock";
+    
+    if (v[4]) {
+        if (!import_money(v[4], &s->total_price)) return "invalid total_price";
+    } else {
+        s->total_price = p->sell_price * s->quantity;
     }
-    
-    FILE *f = fopen(CUSTOMERS_FILE, "r");
-    if (!f) {
-        printf("Error: Unable to read customers file.\n");
-        return;
+    if (v[5]) {
+        if ((s->date = parse_datetime(v[5])) < 0) return "invalid date";
+    } else {
+        s->date = (int64_t)time(NULL);
     }
+    s->cashier_id = import_cashier_id(v[6] ? v[6] : "admin", cashiers, cashier_count);
+    if (!s->cashier_id) return "unknown cashier";
     
-    char line[MAX_LINE];
-    printf("\n%-4s %-20s %-15s %-25s %-30s\n", 
-           "ID", "Name", "Phone", "Email", "Address");
-    printf("----------------------------------------------------------------------------------------\n");
-    
-    while (fgets(line, sizeof(line), f)) {
-        Customer c;
-        c.id = atoi(parse_csv_field(line, 0));
-        strcpy(c.name, parse_csv_field(line, 1));
-        strcpy(c.phone, parse_csv_field(line, 2));
-        strcpy(c.email, parse_csv_field(line, 3));
-        strcpy(c.address, parse_csv_field(line, 4));
-        
-        printf("%-4d %-20s %-15s %-25s %-30s\n", 
-               c.id, c.name, c.phone, c.email, c.address);
-    }
-    fclose(f);
+    reserved[product_row_index] += s->quantity;
+    return NULL;
 }
 
-void search_customers(User *current_user) {
-    if (!file_exists(CUSTOMERS_FILE)) { 
-        printf("No customers found.\n"); 
-        return; 
+static int import_sales(ImportReader *r, FILE *in) {
+    wal_refresh();
+    Sale *sales = NULL;
+    int count = 0, capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ImportRow *row = malloc(sizeof(ImportRow));
+    int *reserved = calloc((size_t)product_table.count + 1, sizeof(int));
+    ImportCashier cashiers[IMPORT_MAX_CASHIERS];
+    int cashier_count = 0;
+    int out_of_memory = !row || !reserved;
+    int status = out_of_memory ? -1 : 1;
+    
+    while (status > 0 && (status = import_next(r, in, &line, &line_capacity, row)) > 0) {
+        if (count == capacity && !grow_rows((void **)&sales, &capacity, sizeof(Sale))) {
+            out_of_memory = 1;
+            status = -1;
+            break;
+        }
+        const char *error = parse_import_sale(row, &sales[count], reserved, cashiers, &cashier_count);
+        if (error) import_reject(r, r->line, error);
+        else count++;
     }
-    
-    char search_term[100];
-    get_validated_string("Enter search term (name, phone, or email): ", search_term, sizeof(search_term));
-    
-    FILE *f = fopen(CUSTOMERS_FILE, "r");
-    if (!f) {
-        printf("Error: Unable to read customers file.\n");
-        return;
+    free(line);
+    free(reserved);
+    if (status < 0) {
+        printf("Error: %s.\n", out_of_memory ? "Out of memory" : "The CSV header names no known column");
+        free(row);
+        free(sales);
+        return 0;
     }
+    free(row);
     
-    char line[MAX_LINE];
-    int found = 0;
-    
-    printf("\nSearch Results:\n");
-    printf("%-4s %-20s %-15s %-25s\n", "ID", "Name", "Phone", "Email");
-    printf("----------------------------------------------------\n");
-    
-    while (fgets(line, sizeof(line), f)) {
-        Customer c;
-        c.id = atoi(parse_csv_field(line, 0));
-        strcpy(c.name, parse_csv_field(line, 1));
-        strcpy(c.phone, parse_csv_field(line, 2));
-        strcpy(c.email, parse_csv_field(line, 3));
-        
-        if (strstr(c.name, search_term) || strstr(c.phone, search_term) || strstr(c.email, search_term)) {
-            printf("%-4d %-20s %-15s %-25s\n", c.id, c.name, c.phone, c.email);
-            found = 1;
-        }
+    int recorded = 0;
+    if (count > 0) {
+        int first_id = id_sequence_take(SEQ_SALES, count);
+        for (int i = 0; i < count; i++) sales[i].id = first_id + i;
     }
-    fclose(f);
-    
-    if (!found) {
-        printf("No customers found matching '%s'\n", search_term);
+    while (recorded < count) {
+        int n = count - recorded < IMPORT_BATCH_ROWS ? count - recorded : IMPORT_BATCH_ROWS;
+        if (!commit_sales_unsynced(sales + recorded, n)) break;
+        recorded += n;
     }
-}
-
-int find_customer_by_id(Customer *out, int id) {
-    if (!file_exists(CUSTOMERS_FILE)) return 0;
-    
-    FILE *f = fopen(CUSTOMERS_FILE, "r");
-    if (!f) return 0;
+    free(sales);
+    if (recorded > 0 && !wal_sync()) printf("Warning: Unable to flush %s to disk.\n", WAL_FILE);
     
-    char line[MAX_LINE];
-    int found = 0;
-    
-    while (fgets(line, sizeof(line), f)) {
-        Customer c;
-        c.id = atoi(parse_csv_field(line, 0));
-        
-        if (c.id == id) {
-            strcpy(c.name, parse_csv_field(line, 1));
-            strcpy(c.phone, parse_csv_field(line, 2));
-            strcpy(c.email, parse_csv_field(line, 3));
-            strcpy(c.address, parse_csv_field(line, 4));
-            
-            if (out) *out = c;
-            found = 1;
-            break;
-        }
+    if (recorded < count) {
+        printf("Error: Unable to record sales after the first %d; %d were not recorded.\n",
+               recorded, count - recorded);
+        return 0;
     }
-    fclose(f);
-    return found;
+    printf("✓ Imported sales: %d added, %ld rejected.\n", recorded, r->rejected);
+    return 1;
 }
 
-/* -------------------- Sales Functions -------------------- */
-void make_sale(User *current_user) {
-    if (!current_user->can_manage_sales) {
-        printf("Permission denied: You don't have permission to manage sales.\n");
-        return;
-    }
-    
-    if (!file_exists(PRODUCTS_FILE)) { 
-        printf("No products available to sell.\n"); 
-        return; 
+int run_import(int argc, char **argv) {
+    int kind = -1;
+    for (int k = 0; argc > 0 && k < IMPORT_KINDS; k++) {
+        if (strcmp(argv[0], import_kinds[k]) == 0) kind = k;
     }
-    
-    Sale s;
-    s.id = next_id_from_file(SALES_FILE);
-    
-    printf("\n=== Create New Sale (ID: %d) ===\n", s.id);
-    
-    list_products(current_user);
-    
-    int pid = get_validated_int("Enter product ID: ", 1, 10000);
-    Product p;
-    if (!find_product_by_id(&p, pid)) { 
-        printf("Error: Product not found.\n"); 
-        return; 
+    if (kind < 0 || argc > 2) {
+        printf("Usage: SHOP-MGT --import products|customers|sales [FILE|-]\n");
+        return 1;
     }
     
-    printf("Selected: %s (Stock: %d, Price: %.2f)\n", p.name, p.stock, p.sell_price);
-    
-    int cid = get_validated_int("Enter customer ID (0 to add new): ", 0, 10000);
-    if (cid == 0) { 
-        add_customer(current_user); 
-        cid = next_id_from_file(CUSTOMERS_FILE) - 1; 
+    FILE *in = stdin;
+    if (argc > 1 && strcmp(argv[1], "-") != 0 && !(in = fopen(argv[1], "r"))) {
+        printf("Error: Unable to open %s.\n", argv[1]);
+        return 1;
     }
-    
-    Customer cust;
-    if (!find_customer_by_id(&cust, cid)) { 
-        printf("Error: Customer not found.\n"); 
-        return; 
+    if (!start_shop()) {
+        if (in != stdin) fclose(in);
+        return 1;
     }
     
-    int qty = get_validated_int("Quantity: ", 1, p.stock);
-    
-    s.product_id = pid;
-    s.customer_id = cid;
-    s.quantity = qty;
-    s.total_price = p.sell_price * qty;
-    now_str(s.date, sizeof(s.date));
-    
-    get_validated_string("Cashier name: ", s.cashier, sizeof(s.cashier));
+    ImportReader r;
+    memset(&r, 0, sizeof(r));
+    r.kind = kind;
+    int ok = kind == IMPORT_SALES ? import_sales(&r, in) : import_catalog(&r, in);
+    if (in != stdin) fclose(in);
+    stop_shop();
+    return ok && r.rejected == 0 ? 0 : 1;
+}
 
-    FILE *f = fopen(SALES_FILE, "a");
-    if (!f) { 
-        printf("Error: Unable to write sales file.\n"); 
-        return; 
+/* --archive YYYY-MM-DD: archive_sales() without the menus, for a scheduled job. */
+int run_archive(int argc, char **argv) {
+    int y, m, d;
+    char tail;
+    if (argc != 1 || sscanf(argv[0], "%4d-%2d-%2d%c", &y, &m, &d, &tail) != 3 || m < 1 || m > 12 || d < 1 || d > 31) {
+        printf("Usage: SHOP-MGT --archive YYYY-MM-DD\n");
+        return 1;
     }
-    
-    fprintf(f, "%d,%d,%d,%d,%.2f,\"%s\",\"%s\"\n", 
-            s.id, s.product_id, s.customer_id, s.quantity, s.total_price, s.date, s.cashier);
-    fclose(f);
+    if (!start_shop()) return 1;
+    int ok = archive_sales((y * 100 + m) * 100 + d);
+    stop_shop();
+    return ok ? 0 : 1;
+}
+
+/* -------------------- Benchmarks -------------------- */
+/*
+ * --bench builds a synthetic shop in bench_data/ and times the operations
+ * the tills lean on, calling the same functions as the menus but without
+ * the prompts. Results go to stdout as one JSON object per line (the run's
+ * configuration first), so runs can be kept and compared between versions;
+ * progress goes to stderr. The generator is seeded, so a given size always
+ * produces the same files.
+ */
+typedef struct {
+    int64_t *ns;
+    int count;
+    int capacity;
+    int64_t started;
+} BenchTimer;
 
-    update_product_stock(pid, -qty);
+static const char *bench_categories[] = {
+    "laptops", "desktops", "monitors", "phones", "tablets", "printers",
+    "keyboards", "mice", "storage", "networking", "audio", "cables"
+};
+static const char *bench_brands[] = {
+    "hp", "dell", "lenovo", "asus", "acer", "apple", "samsung", "logitech",
+    "tp-link", "hisense", "sandisk", "canon"
+};
+static const char *bench_first_names[] = {
+    "amina", "brian", "grace", "david", "esther", "joseph", "mary", "peter",
+    "ruth", "samuel", "sarah", "moses", "faith", "daniel", "joan", "paul"
+};
+static const char *bench_last_names[] = {
+    "okello", "nakato", "mugisha", "achieng", "ssempijja", "namubiru", "otieno",
+    "kato", "auma", "byaruhanga", "nansubuga", "opio", "kirabo", "wasswa"
+};
+static const char *bench_cashiers[] = { "admin", "cashier1", "cashier2", "cashier3", "cashier4" };
 
-    printf("\n✓ Sale recorded successfully!\n");
-    printf("Product: %s\n", p.name);
-    printf("Customer: %s\n", cust.name);
-    printf("Quantity: %d\n", qty);
-    printf("Total Amount: %.2f\n", s.total_price);
+#define BENCH_COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+static uint64_t bench_rng = BENCH_SEED;
+
+static uint64_t bench_next() {
+    bench_rng ^= bench_rng << 13;
+    bench_rng ^= bench_rng >> 7;
+    bench_rng ^= bench_rng << 17;
+    return bench_rng;
 }
 
-void list_sales(User *current_user) {
-    if (!current_user->can_manage_sales) {
-        printf("Permission denied: You don't have permission to view sales.\n");
-        return;
+static int bench_below(int n) {
+    return (int)(bench_next() % (uint64_t)n);
+}
+
+static int bench_timer_init(BenchTimer *t, int capacity) {
+    t->ns = malloc((size_t)capacity * sizeof(int64_t));
+    t->count = 0;
+    t->capacity = capacity;
+    return t->ns != NULL;
+}
+
+static void bench_start(BenchTimer *t) {
+    t->started = monotonic_ns();
+}
+
+static void bench_stop(BenchTimer *t) {
+    int64_t elapsed = monotonic_ns() - t->started;
+    if (t->count < t->capacity) t->ns[t->count++] = elapsed;
+}
+
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Prints one result line and frees the timer; rows > 0 adds a row rate. */
+static void bench_report(const char *op, BenchTimer *t, long rows) {
+    int64_t total = 0;
+    for (int i = 0; i < t->count; i++) total += t->ns[i];
+    if (t->count > 1) qsort(t->ns, (size_t)t->count, sizeof(int64_t), compare_int64);
+    
+    double seconds = total / 1e9;
+    int n = t->count;
+    double p50 = n ? t->ns[n / 2] / 1e3 : 0;
+    double p99 = n ? t->ns[n * 99 / 100 < n ? n * 99 / 100 : n - 1] / 1e3 : 0;
+    double max = n ? t->ns[n - 1] / 1e3 : 0;
+    
+    printf("{\"op\":\"%s\",\"ops\":%d,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f",
+           op, n, seconds, seconds > 0 ? n / seconds : 0, p50, p99, max);
+    if (rows > 0) printf(",\"rows\":%ld,\"rows_per_sec\":%.1f", rows, seconds > 0 ? rows / seconds : 0);
+    printf("}\n");
+    fflush(stdout);
+    free(t->ns);
+}
+
+/* Products, customers and sales.csv; sales are spread over the last year in id order. */
+static int bench_generate(long sales, int products, int customers) {
+    const char *stale[] = {
+        WAL_FILE, WAL_FOLDED, STOCK_JOURNAL_FILE, ID_SEQUENCE_FILE, SALES_AGG_FILE,
+        SALES_DAY_INDEX_FILE, SALES_PRODUCT_INDEX_FILE, SALES_STORE_FORMAT, SALES_ARCHIVE_FILE,
+        SALES_ARCHIVE_INDEX_FILE, SNAPSHOT_FILE, BTREE_FILE
+    };
+    for (int i = 0; i < BENCH_COUNT(stale); i++) remove(stale[i]);
+    
+    FILE *f = fopen(PRODUCTS_FILE, "w");
+    if (!f) return 0;
+    Money *prices = malloc((size_t)products * sizeof(Money));
+    if (!prices) {
+        fclose(f);
+        return 0;
+    }
+    for (int i = 0; i < products; i++) {
+        ProductRecord p;
+        memset(&p, 0, sizeof(p));
+        p.id = i + 1;
+        const char *category = bench_categories[bench_below(BENCH_COUNT(bench_categories))];
+        const char *brand = bench_brands[bench_below(BENCH_COUNT(bench_brands))];
+        snprintf(p.name, sizeof(p.name), "%s %s %d", brand, category, 100 + bench_below(900));
+        snprintf(p.category, sizeof(p.category), "%s", category);
+        snprintf(p.brand, sizeof(p.brand), "%s", brand);
+        snprintf(p.sku, sizeof(p.sku), "20%011d", p.id);
+        p.cost_price = (Money)(5000 + bench_below(2000000)) * MONEY_SCALE;
+        p.sell_price = p.cost_price + p.cost_price * (10 + bench_below(40)) / 100;
+        p.stock = 1000000;
+        p.min_stock_level = bench_below(20);
+        prices[i] = p.sell_price;
+        write_product_row(f, &p);
     }
-    
-    if (!file_exists(SALES_FILE)) { 
-        printf("No sales recorded.\n"); 
-        return; 
+    if (fclose(f) != 0) {
+        free(prices);
+        return 0;
     }
     
-    FILE *f = fopen(SALES_FILE, "r");
+    f = fopen(CUSTOMERS_FILE, "w");
     if (!f) {
-        printf("Error: Unable to read sales file.\n");
-        return;
+        free(prices);
+        return 0;
+    }
+    for (int i = 0; i < customers; i++) {
+        CustomerRecord c;
+        c.id = i + 1;
+        snprintf(c.name, sizeof(c.name), "%s %s", bench_first_names[bench_below(BENCH_COUNT(bench_first_names))],
+                 bench_last_names[bench_below(BENCH_COUNT(bench_last_names))]);
+        snprintf(c.phone, sizeof(c.phone), "07%08d", bench_below(100000000));
+        snprintf(c.email, sizeof(c.email), "customer%d@example.com", c.id);
+        snprintf(c.address, sizeof(c.address), "plot %d, kampala", 1 + bench_below(500));
+        write_customer_row(f, &c);
+    }
+    if (fclose(f) != 0) {
+        free(prices);
+        return 0;
     }
     
-    char line[MAX_LINE];
-    float total_revenue = 0;
-    int total_sales = 0;
-    
-    printf("\n%-4s %-8s %-8s %-4s %-10s %-20s %-15s\n", 
-           "ID", "ProdID", "CustID", "Qty", "Total", "Date", "Cashier");
-    printf("----------------------------------------------------------------\n");
-    
-    while (fgets(line, sizeof(line), f)) {
+    f = fopen(SALES_FILE, "w");
+    if (!f) {
+        free(prices);
+        return 0;
+    }
+    int64_t end = (int64_t)time(NULL);
+    int64_t start = end - 365 * 86400;
+    int64_t last_date = -1;
+    char date[32];
+    for (long i = 0; i < sales; i++) {
+        // Squaring skews sales towards the low product ids, as best sellers do
+        uint64_t r = bench_next() % 65536;
+        Sale s;
+        s.id = (int)(i + 1);
+        s.product_id = 1 + (int)(r * r * (uint64_t)products / (65536ull * 65536ull));
+        s.customer_id = 1 + bench_below(customers);
+        s.quantity = 1 + bench_below(5);
+        s.total_price = prices[s.product_id - 1] * s.quantity;
+        s.date = start + (end - start) * i / sales;
+        if (s.date != last_date) {
+            format_datetime(s.date, date, sizeof(date));
+            last_date = s.date;
+        }
+        write_sale_fields(f, &s, date, bench_cashiers[bench_below(BENCH_COUNT(bench_cashiers))]);
+        if ((i + 1) % 1000000 == 0) fprintf(stderr, "bench: %ld sales written\n", i + 1);
+    }
+    free(prices);
+    return fclose(f) == 0;
+}
+
+static void bench_sales(int count, const User *cashier) {
+    BenchTimer t;
+    if (!bench_timer_init(&t, count)) return;
+    for (int i = 0; i < count; i++) {
         Sale s;
-        s.id = atoi(parse_csv_field(line, 0));
-        s.product_id = atoi(parse_csv_field(line, 1));
-        s.customer_id = atoi(parse_csv_field(line, 2));
-        s.quantity = atoi(parse_csv_field(line, 3));
-        s.total_price = atof(parse_csv_field(line, 4));
-        strcpy(s.date, parse_csv_field(line, 5));
-        strcpy(s.cashier, parse_csv_field(line, 6));
+        memset(&s, 0, sizeof(s));
+        const Product *p = product_row(bench_below(product_table.count));
+        s.product_id = p->id;
+        s.customer_id = customer_row(bench_below(customer_table.count))->id;
+        s.quantity = 1 + bench_below(3);
+        s.total_price = p->sell_price * s.quantity;
+        s.cashier_id = cashier->id;
+        s.date = (int64_t)time(NULL);
         
-        printf("%-4d %-8d %-8d %-4d %-10.2f %-20s %-15s\n", 
-               s.id, s.product_id, s.customer_id, s.quantity, s.total_price, s.date, s.cashier);
+        bench_start(&t);
+        s.id = id_sequence_take(SEQ_SALES, 1);
+        int ok = commit_sales(&s, 1);
+        bench_stop(&t);
+        if (!ok) {
+            fprintf(stderr, "bench: sale %d failed\n", i);
+            break;
+        }
+    }
+    bench_report("make_sale", &t, 0);
+}
+
+/* A quick-sale item as the till runs it: the scanned SKU looked up, then one sale committed. */
+static void bench_quick_sales(int count, const User *cashier) {
+    BenchTimer t;
+    if (!bench_timer_init(&t, count)) return;
+    for (int i = 0; i < count; i++) {
+        char code[32];
+        snprintf(code, sizeof(code), "%s", product_row(bench_below(product_table.count))->text->sku);
+        int customer_id = customer_row(bench_below(customer_table.count))->id;
+        int quantity = 1 + bench_below(3);
         
-        total_revenue += s.total_price;
-        total_sales++;
+        bench_start(&t);
+        const Product *p = find_product_by_code(code);
+        int ok = p != NULL;
+        if (ok) {
+            Sale s;
+            memset(&s, 0, sizeof(s));
+            s.product_id = p->id;
+            s.customer_id = customer_id;
+            s.quantity = quantity;
+            s.total_price = p->sell_price * quantity;
+            s.cashier_id = cashier->id;
+            s.date = (int64_t)time(NULL);
+            s.id = id_sequence_take(SEQ_SALES, 1);
+            ok = commit_sales(&s, 1);
+        }
+        bench_stop(&t);
+        if (!ok) {
+            fprintf(stderr, "bench: quick sale %d failed\n", i);
+            break;
+        }
     }
-    fclose(f);
-    
-    printf("\nSummary: %d sales, Total Revenue: %.2f\n", total_sales, total_revenue);
+    bench_report("quick_sale", &t, 0);
 }
 
-/* -------------------- Reports -------------------- */
-void report_low_stock(User *current_user) {
-    if (!current_user->can_view_reports) {
-        printf("Permission denied: You don't have permission to view reports.\n");
-        return;
+static void bench_search(const char *op, int count, int products) {
+    BenchTimer t;
+    if (!bench_timer_init(&t, count)) return;
+    for (int i = 0; i < count; i++) {
+        char term[64];
+        if (products) {
+            const Product *p = product_row(bench_below(product_table.count));
+            snprintf(term, sizeof(term), "%s", i % 2 ? p->text->brand : p->text->category);
+        } else {
+            snprintf(term, sizeof(term), "%s", bench_last_names[bench_below(BENCH_COUNT(bench_last_names))]);
+        }
+        
+        int hits;
+        bench_start(&t);
+        if (products) search_products_index(term, &hits);
+        else search_customers_index(term, &hits);
+        bench_stop(&t);
+        arena_release(&report_arena, 0);
     }
-    
-    if (!file_exists(PRODUCTS_FILE)) { 
-        printf("No products found.\n"); 
-        return; 
+    bench_report(op, &t, 0);
+}
+
+static void bench_lookups(int count) {
+    BenchTimer t;
+    if (!bench_timer_init(&t, count)) return;
+    volatile int found = 0;
+    for (int i = 0; i < count; i++) {
+        int id = 1 + bench_below(product_table.max_id);
+        bench_start(&t);
+        found += product_lookup(id) != NULL;
+        bench_stop(&t);
     }
-    
-    int threshold = get_validated_int("Low stock threshold: ", 0, 10000);
-    
-    FILE *f = fopen(PRODUCTS_FILE, "r");
-    if (!f) {
-        printf("Error: Unable to read products file.\n");
-        return;
+    bench_report("product_lookup", &t, 0);
+    
+    if (!bench_timer_init(&t, count)) return;
+    for (int i = 0; i < count; i++) {
+        char sku[32];
+        snprintf(sku, sizeof(sku), "20%011d", 1 + bench_below(product_table.max_id));
+        bench_start(&t);
+        found += product_lookup_sku(sku) != NULL;
+        bench_stop(&t);
     }
-    
-    char line[MAX_LINE];
-    int low_stock_count = 0;
-    
-    printf("\nProducts with stock <= %d:\n", threshold);
-    printf("%-4s %-20s %-15s %-6s %-6s\n", "ID", "Name", "Category", "Stock", "Min");
-    printf("-------------------------------------------------\n");
-    
-    while (fgets(line, sizeof(line), f)) {
-        Product p;
-        p.id = atoi(parse_csv_field(line, 0));
-        strcpy(p.name, parse_csv_field(line, 1));
-        strcpy(p.category, parse_csv_field(line, 2));
-        p.stock = atoi(parse_csv_field(line, 6));
-        p.min_stock_level = atoi(parse_csv_field(line, 7));
-        
-        if (p.stock <= threshold) {
-            printf("%-4d %-20s %-15s %-6d %-6d\n", 
-                   p.id, p.name, p.category, p.stock, p.min_stock_level);
-            low_stock_count++;
+    bench_report("sku_lookup", &t, 0);
+}
+
+/* Times a report function over a filter; profit selects compute_profit_totals. */
+static void bench_report_op(const char *op, int count, const SalesFilter *filter, int profit) {
+    BenchTimer t;
+    if (!bench_timer_init(&t, count)) return;
+    for (int i = 0; i < count; i++) {
+        SalesTotals totals;
+        bench_start(&t);
+        int ok = profit ? compute_profit_totals(filter, &totals) : compute_sales_summary(filter, &totals);
+        bench_stop(&t);
+        arena_release(&report_arena, 0);
+        if (!ok) {
+            fprintf(stderr, "bench: %s failed\n", op);
+            break;
         }
     }
-    fclose(f);
-    
-    printf("\nTotal low stock items: %d\n", low_stock_count);
+    bench_report(op, &t, 0);
 }
 
-void report_sales_summary(User *current_user) {
-    if (!current_user->can_view_reports) {
-        printf("Permission denied: You don't have permission to view reports.\n");
-        return;
-    }
-    
-    if (!file_exists(SALES_FILE)) { 
-        printf("No sales recorded.\n"); 
-        return; 
-    }
-    
-    FILE *f = fopen(SALES_FILE, "r");
-    if (!f) {
-        printf("Error: Unable to read sales file.\n");
-        return;
+/* Times the top-N report: one grouping pass and a top 10 by revenue of each table. */
+static void bench_top_op(const char *op, int count, const SalesFilter *filter) {
+    BenchTimer t;
+    if (!bench_timer_init(&t, count)) return;
+    for (int i = 0; i < count; i++) {
+        TopScan scan;
+        const TopGroup *best[10];
+        bench_start(&t);
+        int ok = compute_top_sellers(filter, &scan);
+        for (int d = 0; ok && d < TOP_DIMENSIONS; d++) top_select(&scan.tables[d], 10, RANK_REVENUE, best);
+        bench_stop(&t);
+        top_scan_free(&scan);
+        if (!ok) {
+            fprintf(stderr, "bench: %s failed\n", op);
+            break;
+        }
     }
-    
-    char line[MAX_LINE];
-    float total_revenue = 0;
-    int total_transactions = 0;
-    int total_units = 0;
-    
-    while (fgets(line, sizeof(line), f)) {
-        total_transactions++;
-        total_units += atoi(parse_csv_field(line, 3));
-        total_revenue += atof(parse_csv_field(line, 4));
+    bench_report(op, &t, 0);
+}
+
+/*
+ * Runs each report shape once from the aggregates and once with them
+ * switched off, so the index and scan paths are timed too.
+ */
+static void bench_reports(const char *suffix, int count) {
+    char op[64];
+    SalesFilter all, month, product, cashier, month_product;
+    memset(&all, 0, sizeof(all));
+    
+    // The last full month, one mid-ranked product and one cashier
+    time_t now = time(NULL) - 31 * 86400;
+    struct tm tm;
+    localtime_r(&now, &tm);
+    month = all;
+    month.day_from = (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + 1;
+    month.day_to = month.day_from + 30;
+    product = all;
+    product.product_id = product_row(product_table.count / 10)->id;
+    cashier = all;
+    snprintf(cashier.cashier, sizeof(cashier.cashier), "%s", bench_cashiers[1]);
+    month_product = month;
+    month_product.product_id = product.product_id;
+    
+    int aggregates = sales_aggregates.ready;
+    for (int pass = 0; pass < 2; pass++) {
+        const char *path = pass ? "_scan" : "";
+        sales_aggregates.ready = pass ? 0 : aggregates;
+        if (pass && count > BENCH_SCAN_OPS) count = BENCH_SCAN_OPS;
+        
+        snprintf(op, sizeof(op), "summary_all%s%s", suffix, path);
+        bench_report_op(op, count, &all, 0);
+        snprintf(op, sizeof(op), "summary_month%s%s", suffix, path);
+        bench_report_op(op, count, &month, 0);
+        snprintf(op, sizeof(op), "profit_all%s%s", suffix, path);
+        bench_report_op(op, count, &all, 1);
+        snprintf(op, sizeof(op), "profit_product%s%s", suffix, path);
+        bench_report_op(op, count, &product, 1);
+        snprintf(op, sizeof(op), "profit_cashier%s%s", suffix, path);
+        bench_report_op(op, count, &cashier, 1);
+        snprintf(op, sizeof(op), "profit_month_product%s%s", suffix, path);
+        bench_report_op(op, count, &month_product, 1);
     }
-    fclose(f);
+    sales_aggregates.ready = aggregates;
     
-    printf("\n=== Sales Summary Report ===\n");
-    printf("Total Transactions: %d\n", total_transactions);
-    printf("Total Units Sold: %d\n", total_units);
-    printf("Total Revenue: %.2f\n", total_revenue);
-    printf("Average Sale Value: %.2f\n", total_transactions > 0 ? total_revenue / total_transactions : 0);
+    // Top-N always groups the rows itself
+    snprintf(op, sizeof(op), "top_all%s", suffix);
+    bench_top_op(op, count, &all);
+    snprintf(op, sizeof(op), "top_month%s", suffix);
+    bench_top_op(op, count, &month);
 }
 
-void report_profit_analysis(User *current_user) {
-    if (!current_user->can_view_reports) {
-        printf("Permission denied: You don't have permission to view reports.\n");
-        return;
+int run_bench(int argc, char **argv) {
+    long sales = argc > 0 ? atol(argv[0]) : BENCH_DEFAULT_SALES;
+    if (sales < 1) {
+        fprintf(stderr, "Error: SALES must be a positive count.\n");
+        return 1;
     }
-    
-    if (!file_exists(SALES_FILE) || !file_exists(PRODUCTS_FILE)) { 
-        printf("Insufficient data for profit analysis.\n"); 
-        return; 
+    long products = argc > 1 ? atol(argv[1]) : sales / 1000;
+    long customers = argc > 2 ? atol(argv[2]) : sales / 100;
+    if (products < 100) products = 100;
+    if (customers < 100) customers = 100;
+    if (products > 1000000) products = 1000000;
+    if (customers > 10000000) customers = 10000000;
+    
+    if (!make_dir(BENCH_DIR) || chdir(BENCH_DIR) != 0) {
+        fprintf(stderr, "Error: Unable to use %s/.\n", BENCH_DIR);
+        return 1;
     }
-    
-    FILE *sales_file = fopen(SALES_FILE, "r");
-    FILE *products_file = fopen(PRODUCTS_FILE, "r");
-    
-    if (!sales_file || !products_file) {
-        if (sales_file) fclose(sales_file);
-        if (products_file) fclose(products_file);
-        printf("Error: Unable to access data files.\n");
-        return;
+    printf("{\"op\":\"config\",\"sales\":%ld,\"products\":%ld,\"customers\":%ld,\"report_threads\":%d}\n",
+           sales, products, customers, report_thread_count());
+    
+    BenchTimer t;
+    fprintf(stderr, "bench: generating %ld sales in %s/\n", sales, BENCH_DIR);
+    if (!bench_timer_init(&t, 1)) return 1;
+    bench_start(&t);
+    int ok = bench_generate(sales, (int)products, (int)customers);
+    bench_stop(&t);
+    if (!ok) {
+        fprintf(stderr, "Error: Unable to write the benchmark data.\n");
+        free(t.ns);
+        return 1;
     }
+    bench_report("generate", &t, sales);
+    
+    // Startup loads the catalog and builds the sales aggregates and index
+    if (!bench_timer_init(&t, 1)) return 1;
+    bench_start(&t);
+    ok = start_shop();
+    bench_stop(&t);
+    if (!ok) {
+        free(t.ns);
+        return 1;
+    }
+    bench_report("startup", &t, sales);
     
-    float product_costs[10000] = {0};
-    char product_line[MAX_LINE];
-    
-    while (fgets(product_line, sizeof(product_line), products_file)) {
-        int id = atoi(parse_csv_field(product_line, 0));
-        float cost = atof(parse_csv_field(product_line, 4));
-        product_costs[id] = cost;
+    User cashier;
+    if (!find_user(0, "admin", &cashier)) {
+        fprintf(stderr, "Error: No admin user to record sales as.\n");
+        stop_shop();
+        return 1;
     }
-    fclose(products_file);
     
-    char sales_line[MAX_LINE];
-    float total_revenue = 0;
-    float total_cost = 0;
-    int transactions = 0;
+    fprintf(stderr, "bench: timing lookups, searches and sales\n");
+    bench_lookups(BENCH_QUERY_OPS * 10);
+    bench_search("search_products", BENCH_QUERY_OPS, 1);
+    bench_search("search_customers", BENCH_QUERY_OPS, 0);
+    bench_sales(BENCH_SALE_OPS, &cashier);
+    
+    // Quick sale as the interactive till runs it, with the write-behind thread
+    wal_writer_start();
+    bench_quick_sales(BENCH_SALE_OPS, &cashier);
+    wal_writer_stop();
+    
+    fprintf(stderr, "bench: timing reports\n");
+    bench_reports("", BENCH_REPORT_OPS);
+    
+    // Everything before this month into the archive, then the reports over it
+    if (bench_timer_init(&t, 1)) {
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        int undated_id;
+        bench_start(&t);
+        long moved = archive_old_sales((tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + 1, &undated_id);
+        bench_stop(&t);
+        if (moved < 0) {
+            fprintf(stderr, "bench: archiving failed\n");
+            free(t.ns);
+        } else {
+            bench_report("archive", &t, moved);
+            bench_reports("_archived", BENCH_REPORT_OPS);
+        }
+    }
     
-    while (fgets(sales_line, sizeof(sales_line), sales_file)) {
-        int product_id = atoi(parse_csv_field(sales_line, 1));
-        int quantity = atoi(parse_csv_field(sales_line, 3));
-        float revenue = atof(parse_csv_field(sales_line, 4));
-        
-        total_revenue += revenue;
-        total_cost += product_costs[product_id] * quantity;
-        transactions++;
+    // The same reports again from the columnar store
+    if (bench_timer_init(&t, 1)) {
+        bench_start(&t);
+        long rows = colstore_import_csv();
+        bench_stop(&t);
+        if (rows < 0) {
+            fprintf(stderr, "bench: columnar import failed\n");
+            free(t.ns);
+        } else {
+            bench_report("colstore_import", &t, rows);
+            bench_reports("_colstore", BENCH_REPORT_OPS);
+        }
     }
-    fclose(sales_file);
     
-    float total_profit = total_revenue - total_cost;
-    float profit_margin = total_revenue > 0 ? (total_profit / total_revenue) * 100 : 0;
+    // A restart loads the catalog back from the snapshot the stop leaves
+    stop_shop();
+    if (!bench_timer_init(&t, 1)) return 1;
+    bench_start(&t);
+    ok = start_shop();
+    bench_stop(&t);
+    if (!ok) {
+        free(t.ns);
+        return 1;
+    }
+    bench_report("restart", &t, sales);
     
-    printf("\n=== Profit Analysis Report ===\n");
-    printf("Total Transactions: %d\n", transactions);
-    printf("Total Revenue: %.2f\n", total_revenue);
-    printf("Total Cost: %.2f\n", total_cost);
-    printf("Total Profit: %.2f\n", total_profit);
-    printf("Profit Margin: %.2f%%\n", profit_margin);
+    stop_shop();
+    return 0;
 }
 
-/* -------------------- Authentication -------------------- */
-int ensure_default_user() {
-    if (!file_exists(USERS_FILE)) {
-        FILE *f = fopen(USERS_FILE, "w");
-        if (!f) return 0;
-        
-        User admin;
-        admin.id = 1;
-        strcpy(admin.username, "admin");
-        simple_hash("admin", admin.password_hash);
-        admin.can_manage_products = 1;
-        admin.can_manage_customers = 1;
-        admin.can_manage_sales = 1;
-        admin.can_view_reports = 1;
-        admin.can_manage_users = 1;
-        admin.is_active = 1;
-        
-        fprintf(f, "%d,%s,%s,%d,%d,%d,%d,%d,%d\n",
-                admin.id, admin.username, admin.password_hash,
-                admin.can_manage_products, admin.can_manage_customers,
-                admin.can_manage_sales, admin.can_view_reports,
-                admin.can_manage_users, admin.is_active);
-        fclose(f);
+/* -------------------- Self Test -------------------- */
+/*
+ * --selftest checks the paths a till rarely takes, against a scratch shop
+ * in selftest_data/: --import rejecting bad rows, the daemon's limits on
+ * what one connection may send, write-ahead log replay after a till dies
+ * mid-commit, and archiving around an unreadable date. It calls the same functions as the real commands and
+ * prints one line per check; the shop's own output is discarded. The exit
+ * status is 0 only if every check passes.
+ */
+static int selftest_failures;
+static int selftest_saved_fds[2] = { -1, -1 };
+
+/* Sends stdout and stderr to /dev/null while the shop under test runs, or brings them back. */
+static void selftest_quiet(int quiet) {
+    fflush(stdout);
+    fflush(stderr);
+    if (quiet && selftest_saved_fds[0] < 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd < 0) return;
+        selftest_saved_fds[0] = dup(STDOUT_FILENO);
+        selftest_saved_fds[1] = dup(STDERR_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    } else if (!quiet && selftest_saved_fds[0] >= 0) {
+        dup2(selftest_saved_fds[0], STDOUT_FILENO);
+        dup2(selftest_saved_fds[1], STDERR_FILENO);
+        close(selftest_saved_fds[0]);
+        close(selftest_saved_fds[1]);
+        selftest_saved_fds[0] = selftest_saved_fds[1] = -1;
     }
-    return 1;
 }
 
-int login(User *current_user) {
-    if (!ensure_default_user()) {
-        printf("Error: Cannot initialize user system.\n");
-        return 0;
-    }
-    
-    char username[50];
-    char password[MAX_PASSWORD_LEN];
-    
-    printf("\n=== Shop Manager Login ===\n");
-    
-    get_validated_string("Username: ", username, sizeof(username));
-    
-    printf("Password: ");
-    if (fgets(password, sizeof(password), stdin) == NULL) {
-        return 0;
-    }
-    trim_newline(password);
-    
-    FILE *f = fopen(USERS_FILE, "r");
+static void selftest_check(const char *what, int ok) {
+    printf("%s %s\n", ok ? "✓" : "✗ FAILED:", what);
+    if (!ok) selftest_failures++;
+}
+
+static void selftest_reset() {
+    const char *stale[] = {
+        PRODUCTS_FILE, CUSTOMERS_FILE, USERS_FILE, SALES_FILE, WAL_FILE, WAL_FOLDED, STOCK_JOURNAL_FILE,
+        ID_SEQUENCE_FILE, SALES_AGG_FILE, SALES_DAY_INDEX_FILE, SALES_PRODUCT_INDEX_FILE, SALES_STORE_FORMAT,
+        SALES_ARCHIVE_FILE, SALES_ARCHIVE_INDEX_FILE, SNAPSHOT_FILE, BTREE_FILE
+    };
+    for (int i = 0; i < BENCH_COUNT(stale); i++) remove(stale[i]);
+}
+
+/* Runs an import of the given text; returns the rows rejected, or -1 if the import itself failed. */
+static long selftest_import(int kind, const char *text) {
+    FILE *in = fmemopen((void *)text, strlen(text), "r");
+    if (!in) return -1;
+    ImportReader r;
+    memset(&r, 0, sizeof(r));
+    r.kind = kind;
+    int ok = kind == IMPORT_SALES ? import_sales(&r, in) : import_catalog(&r, in);
+    fclose(in);
+    return ok ? r.rejected : -1;
+}
+
+static long selftest_count_lines(const char *path) {
+    FILE *f = fopen(path, "r");
     if (!f) return 0;
-    
-    char line[MAX_LINE];
-    int authenticated = 0;
-    
-    while (fgets(line, sizeof(line), f)) {
-        User u;
-        u.id = atoi(parse_csv_field(line, 0));
-        strcpy(u.username, parse_csv_field(line, 1));
-        strcpy(u.password_hash, parse_csv_field(line, 2));
-        u.can_manage_products = atoi(parse_csv_field(line, 3));
-        u.can_manage_customers = atoi(parse_csv_field(line, 4));
-        u.can_manage_sales = atoi(parse_csv_field(line, 5));
-        u.can_view_reports = atoi(parse_csv_field(line, 6));
-        u.can_manage_users = atoi(parse_csv_field(line, 7));
-        u.is_active = atoi(parse_csv_field(line, 8));
-        
-        if (strcmp(u.username, username) == 0 && verify_password(password, u.password_hash) && u.is_active) {
-            *current_user = u;
-            authenticated = 1;
-            printf("\nWelcome, %s!\n", u.username);
-            printf("Permissions: %s%s%s%s%s\n",
-                   u.can_manage_products ? "Products " : "",
-                   u.can_manage_customers ? "Customers " : "",
-                   u.can_manage_sales ? "Sales " : "",
-                   u.can_view_reports ? "Reports " : "",
-                   u.can_manage_users ? "Users" : "");
-            break;
-        }
-    }
+    long lines = 0;
+    int ch;
+    while ((ch = fgetc(f)) != EOF) lines += ch == '\n';
     fclose(f);
-    
-    if (!authenticated) {
-        printf("Invalid username or password, or account is inactive.\n");
+    return lines;
+}
+
+static void selftest_imports() {
+    selftest_quiet(1);
+    long rejected = selftest_import(IMPORT_PRODUCTS,
+                                    "name,category,brand,cost_price,sell_price,stock,min_stock_level,sku\n"
+                                    "usb cable,cables,acme,1.00,2.50,10,2,4006381333931\n"
+                                    "hdmi cable,cables,acme,abc,2.50,10,2,\n"
+                                    "dvi cable,cables,acme,3.00,2.50,10,2,\n"
+                                    "vga cable,cables,acme,1.00,2.50,10,2,4006381333931\n"
+                                    "mouse,mice,acme,5.00\n");
+    selftest_quiet(0);
+    selftest_check("product import rejects bad prices, a taken SKU and missing columns",
+                   rejected == 4 && product_table.count == 1);
+    
+    selftest_quiet(1);
+    rejected = selftest_import(IMPORT_CUSTOMERS,
+                               "{\"name\": \"Ann Lee\", \"phone\": \"0700000000\"}\n"
+                               "{\"name\": \"Bob\"\n"
+                               "{\"phone\": \"0711111111\"}\n");
+    selftest_quiet(0);
+    selftest_check("customer import rejects malformed JSON and a row without a name",
+                   rejected == 2 && customer_table.count == 1);
+    
+    char text[512];
+    int product_id = product_table.count ? product_row(0)->id : 0;
+    int customer_id = customer_table.count ? customer_row(0)->id : 0;
+    snprintf(text, sizeof(text),
+             "product_id,customer_id,quantity,date\n"
+             "%d,%d,2,2026-01-05 10:00:00\n"
+             "%d,%d,50,\n"
+             "%d,%d,1,\n"
+             "%d,%d,1,someday\n"
+             "%d,%d,0,\n",
+             product_id, customer_id, product_id, customer_id, product_id + 1, customer_id,
+             product_id, customer_id, product_id, customer_id);
+    selftest_quiet(1);
+    rejected = selftest_import(IMPORT_SALES, text);
+    selftest_quiet(0);
+    selftest_check("sale import rejects short stock, an unknown product, a bad date and a zero quantity",
+                   rejected == 4 && selftest_count_lines(SALES_FILE) == 1);
+}
+
+/* Sends one frame to a connection's peer socket. */
+static int selftest_send(int fd, int op, const char *username, const char *password) {
+    Wire w = { NULL, 0, 0, 0 };
+    size_t start = rpc_begin_frame(&w, op, 0);
+    if (username) {
+        wire_str(&w, username);
+        wire_str(&w, password);
     }
-    
-    return authenticated;
+    rpc_finish_frame(&w, start);
+    int ok = !w.failed && write_all(fd, w.data, w.len);
+    free(w.data);
+    return ok;
 }
 
-void change_password(User *current_user) {
-    char old_password[MAX_PASSWORD_LEN], new_password[MAX_PASSWORD_LEN];
-    
-    printf("\n=== Change Password ===\n");
-    
-    printf("Current Password: ");
-    if (fgets(old_password, sizeof(old_password), stdin) == NULL) return;
-    trim_newline(old_password);
-    
-    if (!verify_password(old_password, current_user->password_hash)) {
-        printf("Error: Current password is incorrect.\n");
+static void selftest_rpc() {
+    int sv[2];
+    RpcConn *c = calloc(1, sizeof(RpcConn));
+    if (!c || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 || !set_nonblocking(sv[0])) {
+        free(c);
+        selftest_check("RPC connection over a socket pair", 0);
         return;
     }
-    
-    printf("New Password: ");
-    if (fgets(new_password, sizeof(new_password), stdin) == NULL) return;
-    trim_newline(new_password);
-    
-    if (strlen(new_password) < 4) {
-        printf("Error: Password must be at least 4 characters long.\n");
-        return;
+    c->fd = sv[0];
+    
+    int ok = 1;
+    for (int i = 0; ok && i < RPC_MAX_REQUESTS + 8; i++) ok = selftest_send(sv[1], RPC_PING, NULL, NULL);
+    rpc_read(c);
+    int first = (int)(c->out.len / RPC_HEADER_SIZE);
+    int queued = rpc_frame_queued(c);
+    rpc_read(c);
+    selftest_check("pipelined pings are answered RPC_MAX_REQUESTS per wakeup",
+                   ok && first == RPC_MAX_REQUESTS && queued && c->out.len / RPC_HEADER_SIZE == RPC_MAX_REQUESTS + 8 &&
+                   !rpc_frame_queued(c) && !c->closing);
+    
+    // The connection's responses are not real here; only their count matters
+    size_t answered = c->out.len;
+    c->out.len = RPC_MAX_BACKLOG + 1;
+    ok = selftest_send(sv[1], RPC_PING, NULL, NULL);
+    rpc_read(c);
+    int held = c->in_len == 0;
+    c->out.len = answered;
+    rpc_read(c);
+    selftest_check("a connection with a full response backlog is not read",
+                   ok && held && c->out.len == answered + RPC_HEADER_SIZE);
+    
+    c->out.len = 0;
+    selftest_quiet(1);
+    ok = selftest_send(sv[1], RPC_LOGIN, "nobody", "wrong") && selftest_send(sv[1], RPC_LOGIN, "nobody", "wrong");
+    rpc_read(c);
+    selftest_quiet(0);
+    // The second answer comes from the delay, not from another password check
+    char message[80];
+    WireReader r = { (const unsigned char *)c->out.data, (const unsigned char *)c->out.data + c->out.len, 0 };
+    uint32_t first_len = wire_get_u32(&r);
+    wire_take(&r, RPC_HEADER_SIZE - 4 + (size_t)first_len);
+    wire_take(&r, RPC_HEADER_SIZE);
+    wire_get_str(&r, message, sizeof(message));
+    selftest_check("a failed login makes the next one wait",
+                   ok && !r.failed && !c->logged_in && strncmp(message, "Too many login attempts", 23) == 0);
+    
+    unsigned char header[RPC_HEADER_SIZE] = { 0 };
+    uint32_t len = RPC_MAX_FRAME + 1;
+    for (int i = 0; i < 4; i++) header[i] = (unsigned char)(len >> (8 * i));
+    ok = write_all(sv[1], (const char *)header, sizeof(header));
+    rpc_read(c);
+    selftest_check("a frame longer than RPC_MAX_FRAME closes the connection", ok && c->closing && c->in_len == 0);
+    
+    close(sv[1]);
+    rpc_close(c);
+}
+
+/* Offset of the log's last group, or 0 if it has none. */
+static off_t selftest_last_group(int fd) {
+    off_t at = sizeof(WalFileHeader), last = 0;
+    WalGroupHeader g;
+    while (full_pread(fd, &g, sizeof(g), at) && g.magic == WAL_GROUP_MAGIC) {
+        last = at;
+        at += (off_t)sizeof(g) + g.bytes;
     }
-    
-    FILE *f = fopen(USERS_FILE, "r");
-    FILE *tmp = fopen(".users_tmp", "w");
-    if (!f || !tmp) {
-        if (f) fclose(f);
-        if (tmp) fclose(tmp);
-        printf("Error: Unable to access user database.\n");
-        return;
+    return last;
+}
+
+/* Leaves the log as a till that died after appending its last group, then restarts the shop. */
+static int selftest_crash(int tear) {
+    stop_shop();
+    int fd = open(WAL_FILE, O_RDWR);
+    off_t group = fd >= 0 ? selftest_last_group(fd) : 0;
+    uint32_t applied = 0;
+    int ok = group > 0 && full_pwrite(fd, &applied, sizeof(applied), group + offsetof(WalGroupHeader, applied));
+    if (ok && tear) {
+        struct stat st;
+        WalGroupHeader torn = { WAL_GROUP_MAGIC, 1, 64, 0, 0, 0 };
+        ok = fstat(fd, &st) == 0 && full_pwrite(fd, &torn, sizeof(torn), st.st_size);
     }
-    
+    if (fd >= 0) close(fd);
+    // A till that died mid-commit wrote no snapshot, and the sale's row had not reached sales.csv
+    remove(SNAPSHOT_FILE);
+    ok = ok && truncate(SALES_FILE, 0) == 0;
+    selftest_quiet(1);
+    ok = start_shop() && ok;
+    selftest_quiet(0);
+    return ok;
+}
+
+static void selftest_wal() {
+    FILE *f = fopen(SALES_FILE, "r");
     char line[MAX_LINE];
-    char new_hash[65];
-    simple_hash(new_password, new_hash);
-    
-    while (fgets(line, sizeof(line), f)) {
-        User u;
-        u.id = atoi(parse_csv_field(line, 0));
-        strcpy(u.username, parse_csv_field(line, 1));
-        strcpy(u.password_hash, parse_csv_field(line, 2));
-        u.can_manage_products = atoi(parse_csv_field(line, 3));
-        u.can_manage_customers = atoi(parse_csv_field(line, 4));
-        u.can_manage_sales = atoi(parse_csv_field(line, 5));
-        u.can_view_reports = atoi(parse_csv_field(line, 6));
-        u.can_manage_users = atoi(parse_csv_field(line, 7));
-        u.is_active = atoi(parse_csv_field(line, 8));
-        
-        if (u.id == current_user->id) {
-            strcpy(u.password_hash, new_hash);
-            strcpy(current_user->password_hash, new_hash);
-        }
-        
-        fprintf(tmp, "%d,%s,%s,%d,%d,%d,%d,%d,%d\n",
-                u.id, u.username, u.password_hash,
-                u.can_manage_products, u.can_manage_customers,
-                u.can_manage_sales, u.can_view_reports,
-                u.can_manage_users, u.is_active);
-    }
-    
-    fclose(f);
-    fclose(tmp);
-    
-    remove(USERS_FILE);
-    rename(".users_tmp", USERS_FILE);
-    printf("✓ Password changed successfully.\n");
+    CsvRecord rec;
+    int sale_id = f && fgets(line, sizeof(line), f) && csv_split_line(line, &rec) ? csv_int(&rec, 0) : 0;
+    if (f) fclose(f);
+    
+    int ok = sale_id > 0 && selftest_crash(0);
+    selftest_check("a logged sale missing from sales.csv is replayed at the next start",
+                   ok && selftest_count_lines(SALES_FILE) == 1 && file_tail_has_id(SALES_FILE, sale_id));
+    
+    struct stat before, after;
+    ok = stat(WAL_FILE, &before) == 0 && selftest_crash(1);
+    selftest_quiet(1);
+    // The torn group is cut off by the first till to take the lock
+    ok = ok && wal_lock();
+    wal_unlock();
+    selftest_quiet(0);
+    selftest_check("replay behind a torn group writes the row once and cuts the group off",
+                   ok && selftest_count_lines(SALES_FILE) == 1 && file_tail_has_id(SALES_FILE, sale_id) &&
+                   stat(WAL_FILE, &after) == 0 && after.st_size == before.st_size);
 }
 
-/* -------------------- System Management -------------------- */
-void system_maintenance(User *current_user) {
-    printf("\n=== System Maintenance ===\n");
-    printf("1. Create Backup\n");
-    printf("2. Change Password\n");
-    printf("3. Return to Main Menu\n");
+static void selftest_archive() {
+    stop_shop();
+    FILE *f = fopen(SALES_FILE, "w");
+    int ok = f && fputs("901,1,1,1,2.50,\"2000-01-03 10:00:00\",\"admin\"\n"
+                        "902,1,1,1,2.50,\"someday\",\"admin\"\n"
+                        "903,1,1,1,2.50,\"2000-01-04 10:00:00\",\"admin\"\n", f) >= 0;
+    if (f && fclose(f) != 0) ok = 0;
+    remove(SALES_AGG_FILE);
+    remove(SALES_DAY_INDEX_FILE);
+    remove(SALES_PRODUCT_INDEX_FILE);
+    
+    selftest_quiet(1);
+    ok = start_shop() && ok;
+    int undated_id = 0;
+    long moved = ok ? archive_old_sales(20000201, &undated_id) : -1;
+    selftest_quiet(0);
+    selftest_check("archiving stops at a sale whose date does not parse",
+                   moved == 1 && undated_id == 902 && selftest_count_lines(SALES_FILE) == 2);
+}
+
+int run_selftest() {
+    if (!make_dir(SELFTEST_DIR) || chdir(SELFTEST_DIR) != 0) {
+        fprintf(stderr, "Error: Unable to use %s/.\n", SELFTEST_DIR);
+        return 1;
+    }
+    selftest_reset();
+    selftest_quiet(1);
+    int ok = start_shop();
+    selftest_quiet(0);
+    if (!ok) {
+        printf("Error: Unable to start a shop in %s/.\n", SELFTEST_DIR);
+        return 1;
+    }
     
-    int choice = get_validated_int("Select option: ", 1, 3);
+    selftest_imports();
+    selftest_rpc();
+    selftest_wal();
+    selftest_archive();
+    stop_shop();
     
-    switch (choice) {
-        case 1:
-            create_backup();
-            break;
-        case 2:
-            change_password(current_user);
-            break;
-        case 3:
-            return;
+    if (selftest_failures) {
+        printf("%d check%s failed.\n", selftest_failures, selftest_failures == 1 ? "" : "s");
+        return 1;
     }
-    
-    pause_and_wait();
+    printf("✓ All checks passed.\n");
+    return 0;
 }
 
 /* -------------------- Main Menu -------------------- */
@@ -1302,7 +13469,7 @@ void show_main_menu(User *current_user) {
     printf("2. Customers Management\n");
     printf("3. Sales Management\n");
     printf("4. Reports & Analytics\n");
-    if (current_user->can_manage_users) {
+    if (current_user->permissions & USER_PERM_USERS) {
         printf("5. User Management\n");
     }
     printf("6. System Maintenance\n");
@@ -1311,7 +13478,7 @@ void show_main_menu(User *current_user) {
 }
 
 void products_menu(User *current_user) {
-    if (!current_user->can_manage_products) {
+    if (!(current_user->permissions & USER_PERM_PRODUCTS)) {
         printf("Permission denied: You don't have permission to manage products.\n");
         return;
     }
@@ -1338,7 +13505,7 @@ void products_menu(User *current_user) {
 }
 
 void customers_menu(User *current_user) {
-    if (!current_user->can_manage_customers) {
+    if (!(current_user->permissions & USER_PERM_CUSTOMERS)) {
         printf("Permission denied: You don't have permission to manage customers.\n");
         return;
     }
@@ -1365,7 +13532,7 @@ void customers_menu(User *current_user) {
 }
 
 void sales_menu(User *current_user) {
-    if (!current_user->can_manage_sales) {
+    if (!(current_user->permissions & USER_PERM_SALES)) {
         printf("Permission denied: You don't have permission to manage sales.\n");
         return;
     }
@@ -1374,15 +13541,19 @@ void sales_menu(User *current_user) {
     while (running) {
         printf("\n=== Sales Management ===\n");
         printf("1. Make New Sale\n");
-        printf("2. List All Sales\n");
-        printf("3. Return to Main Menu\n");
+        printf("2. Basket Sale (multiple items)\n");
+        printf("3. Quick Sale (scan SKUs)\n");
+        printf("4. List All Sales\n");
+        printf("5. Return to Main Menu\n");
         
-        int choice = get_validated_int("Select option: ", 1, 3);
+        int choice = get_validated_int("Select option: ", 1, 5);
         
         switch (choice) {
             case 1: make_sale(current_user); break;
-            case 2: list_sales(current_user); break;
-            case 3: running = 0; break;
+            case 2: make_basket_sale(current_user); break;
+            case 3: make_quick_sale(current_user); break;
+            case 4: list_sales(current_user); break;
+            case 5: running = 0; break;
         }
         
         if (running) pause_and_wait();
@@ -1390,7 +13561,7 @@ void sales_menu(User *current_user) {
 }
 
 void reports_menu(User *current_user) {
-    if (!current_user->can_view_reports) {
+    if (!(current_user->permissions & USER_PERM_REPORTS)) {
         printf("Permission denied: You don't have permission to view reports.\n");
         return;
     }
@@ -1401,33 +13572,77 @@ void reports_menu(User *current_user) {
         printf("1. Low Stock Report\n");
         printf("2. Sales Summary\n");
         printf("3. Profit Analysis\n");
-        printf("4. Return to Main Menu\n");
+        printf("4. Below Reorder Point\n");
+        printf("5. Top Sellers\n");
+        printf("6. Return to Main Menu\n");
         
-        int choice = get_validated_int("Select option: ", 1, 4);
+        int choice = get_validated_int("Select option: ", 1, 6);
         
         switch (choice) {
             case 1: report_low_stock(current_user); break;
             case 2: report_sales_summary(current_user); break;
             case 3: report_profit_analysis(current_user); break;
-            case 4: running = 0; break;
+            case 4: report_reorder_point(current_user); break;
+            case 5: report_top_sellers(current_user); break;
+            case 6: running = 0; break;
         }
         
         if (running) pause_and_wait();
     }
 }
 
-int main() {
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--client") == 0) {
+        return run_client(argc > 2 ? argv[2] : DEFAULT_SHOP_ADDRESS);
+    }
+    if (argc > 1 && strcmp(argv[1], "--metrics") == 0) {
+        return run_metrics(argc > 2 ? argv[2] : DEFAULT_SHOP_ADDRESS);
+    }
+    if (argc > 1 && strcmp(argv[1], "--import") == 0) {
+        return run_import(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "--archive") == 0) {
+        return run_archive(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        return run_bench(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "--branch") == 0) {
+        return run_branch(argc - 2, argv + 2);
+    }
+    if (argc > 2 && strcmp(argv[1], "--ship") == 0) {
+        return run_ship(argv[2]);
+    }
+    if (argc > 1 && strcmp(argv[1], "--selftest") == 0) {
+        return run_selftest();
+    }
+    if (argc > 1 && strcmp(argv[1], "--daemon") != 0) {
+        printf("Usage: %s [--daemon [ADDR] | --client [ADDR] | --metrics [ADDR] | --import KIND [FILE] | --archive DATE | --bench [SALES [PRODUCTS [CUSTOMERS]]] | --branch N | --ship ADDR | --selftest]\n", argv[0]);
+        return 1;
+    }
+    
     printf("Welcome to Enhanced Shop Manager\n");
     printf("================================\n");
     
+    if (!start_shop()) return 1;
+    if (argc > 1) {
+        int status = run_daemon(argc > 2 ? argv[2] : DEFAULT_SHOP_ADDRESS);
+        stop_shop();
+        return status;
+    }
+    
+    wal_writer_start();
     User current_user;
     if (!login(&current_user)) {
         printf("Login failed. Exiting.\n");
+        stop_shop();
         return 1;
     }
     
     int running = 1;
     while (running) {
+        wal_refresh();
+        arena_release(&report_arena, 0);
         show_main_menu(&current_user);
         int choice = get_validated_int("", 1, 7);
         
@@ -1437,7 +13652,7 @@ int main() {
             case 3: sales_menu(&current_user); break;
             case 4: reports_menu(&current_user); break;
             case 5: 
-                if (current_user.can_manage_users) {
+                if (current_user.permissions & USER_PERM_USERS) {
                     user_management_menu(&current_user); 
                 } else {
                     printf("Invalid choice.\n");
@@ -1449,6 +13664,7 @@ int main() {
         }
     }
     
+    stop_shop();
     printf("\nThank you for using Shop Manager. Goodbye!\n");
     return 0;
 }
\ No newline at end of file